@@ -0,0 +1,995 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  Benchmarks.cpp: micro-benchmarks and equivalence checks for the data
+  path, run from the command line of the headless build.
+*/
+
+#ifdef TOUCHKEYS_NO_GUI
+
+#include "Benchmarks.h"
+#include "TouchKeys/TouchkeyDevice.h"
+#include "TouchKeys/TouchkeyDeviceSimulator.h"
+#include "TouchKeys/TouchkeyFrameDecoder.h"
+#include "TouchKeys/PianoKey.h"
+#include "TouchKeys/PianoKeyboard.h"
+#include "Mappings/Mapping.h"
+#include "Mappings/MappingScheduler.h"
+#include "Utility/IIRFilter.h"
+#include "Utility/Pipeline.h"
+#include "Utility/Trigger.h"
+#include <boost/circular_buffer.hpp>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <string.h>
+#include <vector>
+
+// ***** Helpers *****
+
+namespace {
+    double nowMicroseconds() {
+        return juce::Time::getMillisecondCounterHiRes() * 1000.0;
+    }
+
+    // Shortest time taken by a function over kBenchmarkRepeats runs, in microseconds
+    template<class Function>
+    double bestTime(Function function) {
+        double best = std::numeric_limits<double>::infinity();
+
+        for(int run = 0; run < kBenchmarkRepeats; run++) {
+            double start = nowMicroseconds();
+            function();
+            best = std::min(best, nowMicroseconds() - start);
+        }
+        return best;
+    }
+
+    // Simulator output for a full keyboard with analog sensors, the same on every run
+    void captureSimulatorOutput(std::vector<unsigned char>& output) {
+        TouchkeyDeviceSimulator simulator;
+
+        simulator.setNumberOfOctaves(kBenchmarkSimulatorOctaves);
+        simulator.setHasAnalogSensors(true);
+        simulator.setSyntheticTouchRate(kBenchmarkSimulatorTouchRate);
+        simulator.setRandomSeed(1);
+        simulator.captureScans(kBenchmarkSimulatorScans, output);
+    }
+
+    // The byte-at-a-time state machine TouchkeyDevice used before TouchkeyFrameDecoder.
+    // Counts the frames and adds up their lengths, to check the decoder against.
+    struct ByteDecoder {
+        unsigned char frame[TOUCHKEY_MAX_FRAME_LENGTH];
+        int frameLength = 0;
+        bool controlSeq = false, inFrame = false;
+        uint64_t frames = 0, frameBytes = 0;
+
+        void decode(const unsigned char *data, long count) {
+            for(long i = 0; i < count; i++) {
+                unsigned char ch = data[i];
+
+                if(inFrame) {
+                    if(controlSeq) {
+                        controlSeq = false;
+                        if(ch == kControlCharacterFrameEnd) {
+                            inFrame = false;
+                            frames++;
+                            frameBytes += frameLength;
+                        }
+                        else if(ch == ESCAPE_CHARACTER) {
+                            frame[frameLength++] = ch;
+                            if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH)
+                                inFrame = false;
+                        }
+                    }
+                    else if(ch == ESCAPE_CHARACTER)
+                        controlSeq = true;
+                    else {
+                        frame[frameLength++] = ch;
+                        if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH)
+                            inFrame = false;
+                    }
+                }
+                else {
+                    if(controlSeq) {
+                        controlSeq = false;
+                        if(ch == kControlCharacterFrameBegin) {
+                            inFrame = true;
+                            frameLength = 0;
+                        }
+                    }
+                    else if(ch == ESCAPE_CHARACTER)
+                        controlSeq = true;
+                }
+            }
+        }
+    };
+
+    // The storage Node used before NodeRingBuffer: values and timestamps in two
+    // boost::circular_buffers, indices offset by a count of samples dropped off the front, and
+    // a linear search for timestamps. Insertion locks as Node does but sends no trigger.
+    template<typename DataType>
+    class CircularBufferHistory {
+    public:
+        typedef std::size_t size_type;
+
+        CircularBufferHistory(size_type capacity) : values_(capacity), timestamps_(capacity), firstSampleIndex_(0) {}
+
+        void insert(DataType const& item, timestamp_type timestamp) {
+            bufferAccessMutex_.enter();
+            if(values_.full())
+                firstSampleIndex_++;
+            timestamps_.push_back(timestamp);
+            values_.push_back(item);
+            bufferAccessMutex_.exit();
+        }
+
+        size_type beginIndex() { return firstSampleIndex_; }
+        size_type endIndex() { return firstSampleIndex_ + values_.size(); }
+        timestamp_type earliestTimestamp() { return timestamps_.front(); }
+
+        DataType operator[](size_type index) { return values_[index - firstSampleIndex_]; }
+        timestamp_type timestampAt(size_type index) { return timestamps_.at(index - firstSampleIndex_); }
+
+        size_type indexNearestBefore(timestamp_type t) {
+            typename boost::circular_buffer<timestamp_type>::iterator it =
+                std::find_if(timestamps_.begin(), timestamps_.end(), [t](timestamp_type x) { return t < x; });
+            if(it == timestamps_.end())
+                return timestamps_.size() - 1 + firstSampleIndex_;
+            if(it == timestamps_.begin())
+                return firstSampleIndex_;
+            return (size_type)((--it) - timestamps_.begin()) + firstSampleIndex_;
+        }
+
+        DataType interpolate(double index) {
+            size_type before = floor(index);
+            double frac = index - (double)before;
+            DataType val1 = values_.at(before - firstSampleIndex_);
+            if(before == endIndex() - 1)
+                return val1;
+            DataType val2 = values_.at(before + 1 - firstSampleIndex_);
+            return val1 * (1.0 - frac) + val2 * frac;
+        }
+
+    private:
+        juce::CriticalSection bufferAccessMutex_;
+        boost::circular_buffer<DataType> values_;
+        boost::circular_buffer<timestamp_type> timestamps_;
+        size_type firstSampleIndex_;
+    };
+
+    // Exposes sendTrigger(), which is protected in TriggerSource
+    class BenchmarkTriggerSource : public TriggerSource {
+    public:
+        void send(timestamp_type timestamp) { sendTrigger(timestamp); }
+    };
+
+    // Counts the triggers it receives
+    class BenchmarkTriggerDestination : public TriggerDestination {
+    public:
+        BenchmarkTriggerDestination() : received(0) {}
+        void triggerReceived(TriggerSource* who, timestamp_type timestamp) { received++; }
+        uint64_t received;
+    };
+
+    // How early MappingScheduler may run an action (its kAllowableAdvanceExecutionTime)
+    const timestamp_diff_type kSchedulerEarliness = milliseconds_to_timestamp(1.0);
+
+    // Results shared by the mappings in the scheduler benchmark
+    struct SchedulerRecord {
+        std::atomic<int> active[128];           // Calls in progress for each note
+        std::atomic<unsigned long> calls[128];
+        std::atomic<unsigned long> overlaps, outOfOrder, deleted;
+        std::atomic<double> mappingMicroseconds;
+
+        void reset() {
+            for(int i = 0; i < 128; i++) {
+                active[i] = 0;
+                calls[i] = 0;
+            }
+            overlaps = outOfOrder = deleted = 0;
+            mappingMicroseconds = 0;
+        }
+    };
+
+    // A mapping which does a fixed amount of work every update interval. It checks that calls
+    // for its note never overlap, and that each comes no earlier than the scheduler allows
+    // after the one it asked for.
+    class BenchmarkMapping : public Mapping {
+    public:
+        BenchmarkMapping(PianoKeyboard& keyboard, int noteNumber, SchedulerRecord& record)
+        : Mapping(keyboard, nullptr, noteNumber, nullptr, nullptr, nullptr), record_(record) {}
+
+        ~BenchmarkMapping() { record_.deleted++; }
+
+        void triggerReceived(TriggerSource* who, timestamp_type timestamp) {}
+
+        timestamp_type performMapping() {
+            double start = nowMicroseconds();
+            if(record_.active[noteNumber_]++ != 0)
+                record_.overlaps++;
+
+            timestamp_type currentTimestamp = keyboard_.schedulerCurrentTimestamp();
+            if(record_.calls[noteNumber_] != 0 && currentTimestamp < nextScheduledTimestamp_ - kSchedulerEarliness)
+                record_.outOfOrder++;
+
+            volatile double work = 0;
+            for(int i = 0; i < kBenchmarkMappingWork; i++)
+                work = work + i;
+
+            record_.calls[noteNumber_]++;
+            record_.active[noteNumber_]--;
+            record_.mappingMicroseconds = record_.mappingMicroseconds + (nowMicroseconds() - start);
+            nextScheduledTimestamp_ = currentTimestamp + updateInterval_;
+            return nextScheduledTimestamp_;
+        }
+
+    private:
+        SchedulerRecord& record_;
+    };
+
+    // Vibrato distance filter: the bandpass TouchkeyVibratoMapping designs by default
+    typedef IIRFilterStage<float, 3, 2> VibratoFilterStage;
+
+    void vibratoFilterCoefficients(std::vector<float>& bCoeffs, std::vector<float>& aCoeffs) {
+        std::vector<double> b, a;
+
+        designSecondOrderBandpass(b, a, 9.0, 0.707, 200.0);
+        bCoeffs.assign(b.begin(), b.end());
+        aCoeffs.assign(a.begin(), a.end());
+    }
+
+    // Input that looks like a finger rocking on a key, plus a little noise
+    float vibratoSample(int note, int frame) {
+        return 0.1f * sinf(frame * 0.28f + note) + ((frame * 7919U + note * 104729U) % 101) * 0.001f;
+    }
+
+    // The best case for a keyboard-wide filter bank: one slot per note in structure-of-arrays
+    // form with no locking. Every note's sample for a frame is stored, one branch-free loop
+    // advances all the slots, then each output is inserted into that note's Node, which is
+    // where the mapping reads it from.
+    struct BiquadBank {
+        std::vector<float> b0, b1, b2, a1, a2, x1, x2, y1, y2, input, output;
+
+        BiquadBank(int slots, std::vector<float> const& bCoeffs, std::vector<float> const& aCoeffs)
+        : b0(slots, bCoeffs[0]), b1(slots, bCoeffs[1]), b2(slots, bCoeffs[2]), a1(slots, aCoeffs[0]), a2(slots, aCoeffs[1]),
+          x1(slots), x2(slots), y1(slots), y2(slots), input(slots), output(slots) {}
+
+        void processAll() {
+            int slots = (int)input.size();
+            for(int i = 0; i < slots; i++) {
+                float result = b0[i] * input[i] + x1[i] * b1[i] + x2[i] * b2[i] - y1[i] * a1[i] - y2[i] * a2[i];
+                x2[i] = x1[i];
+                x1[i] = input[i];
+                y2[i] = y1[i];
+                y1[i] = result;
+                output[i] = result;
+            }
+        }
+    };
+
+    // The recursive search PianoKey::touchMatchClosestPoints() replaced. Each level matches
+    // one old point to each available new point (a bitmask) in turn and recurses over the rest.
+    float touchMatchReference(const float* oldPoints, const float *newPoints, int count,
+                              int oldIndex, unsigned int availableNewPoints, float currentTotalDistance, int *order) {
+        if(availableNewPoints == 0)    // Shouldn't happen but prevent an infinite loop
+            return std::numeric_limits<float>::infinity();
+        
+        // End case: only one possible point available
+        if((availableNewPoints & (availableNewPoints - 1)) == 0) {
+            int newIndex = 0;
+            while(!(availableNewPoints & (1U << newIndex)))
+                newIndex++;
+            
+            order[oldIndex] = newIndex;
+            
+            if(oldPoints[oldIndex] < 0.0 || newPoints[newIndex] < 0.0)
+                return currentTotalDistance + 100.0;
+            return currentTotalDistance + (oldPoints[oldIndex] - newPoints[newIndex])*(oldPoints[oldIndex] - newPoints[newIndex]);
+        }
+        
+        float minVal = std::numeric_limits<float>::infinity();
+        int bestOrder[3];
+        int candidateOrder[3];
+        
+        // Go through all available new points
+        for(int newIndex = 0; newIndex < count; newIndex++) {
+            if(!(availableNewPoints & (1U << newIndex)))
+                continue;
+            
+            // Remove (and test) one point and recursively call ourselves
+            float dist;
+            if(newPoints[newIndex] >= 0.0 && oldPoints[oldIndex] >= 0.0)
+                dist = (oldPoints[oldIndex] - newPoints[newIndex])*(oldPoints[oldIndex] - newPoints[newIndex]);
+            else
+                dist = 100.0;
+            
+            float rval = touchMatchReference(oldPoints, newPoints, count, oldIndex + 1, availableNewPoints & ~(1U << newIndex),
+                                             currentTotalDistance + dist, candidateOrder);
+            
+            if(rval < minVal) {
+                minVal = rval;
+                for(int i = oldIndex + 1; i < count; i++)
+                    bestOrder[i] = candidateOrder[i];
+                bestOrder[oldIndex] = newIndex;
+            }
+        }
+        
+        for(int i = oldIndex; i < count; i++)
+            order[i] = bestOrder[i];
+        
+        return minVal;
+    }
+}
+
+// ***** Running *****
+
+bool Benchmarks::run(std::string const& name, std::ostream& out) {
+    if(name == "decoder")
+        return frameDecoder(out);
+    if(name == "analog")
+        return analogFrames(out);
+    if(name == "touch-match")
+        return touchMatch(out);
+    if(name == "node")
+        return nodeStorage(out);
+    if(name == "mapping-scheduler")
+        return mappingScheduler(out);
+    if(name == "trigger")
+        return triggerSend(out);
+    if(name == "filter-pipeline")
+        return filterPipeline(out);
+    if(name == "filter-bank")
+        return filterBank(out);
+
+    out << "Unknown benchmark " << name << '\n';
+    list(out);
+    return false;
+}
+
+void Benchmarks::list(std::ostream& out) {
+    out << "Benchmarks:\n";
+    out << "  decoder:     TouchkeyFrameDecoder throughput over simulator output\n";
+    out << "  analog:      TouchkeyDevice analog frame processing against the per-value loop it replaced\n";
+    out << "  touch-match: PianoKey touch matching against the recursive search it replaced\n";
+    out << "  node:        Node storage against the boost::circular_buffer storage it replaced\n";
+    out << "  mapping-scheduler: 88 mappings every 5.5ms on 1, 2 and 4 workers\n";
+    out << "  trigger:     TriggerSource::sendTrigger() to 1-16 destinations, counted and as a sending thread\n";
+    out << "  filter-pipeline: fused Pipeline filter against the trigger-chained IIRFilterNode\n";
+    out << "  filter-bank: per-note fused vibrato filters against a keyboard-wide filter bank\n";
+}
+
+// ***** Frame decoder *****
+
+bool Benchmarks::frameDecoder(std::ostream& out) {
+    const int kReadSizes[] = {64, 1024, 16384};
+    const int kPasses = 20;
+    std::vector<unsigned char> stream;
+    bool passed = true;
+
+    captureSimulatorOutput(stream);
+    out << "Frame decoder: " << stream.size() << " bytes of simulator output (" << kBenchmarkSimulatorOctaves
+        << " octaves, analog, " << kBenchmarkSimulatorScans << " scans), " << kPasses << " passes\n";
+
+    for(int readSize : kReadSizes) {
+        TouchkeyFrameDecoder decoder;
+        ByteDecoder reference;
+        uint64_t frames = 0, frameBytes = 0;
+
+        // The stream is handed over one read at a time, as it is from the device
+        double start = nowMicroseconds();
+        for(int pass = 0; pass < kPasses; pass++) {
+            for(size_t offset = 0; offset < stream.size(); offset += readSize) {
+                long length = (long)std::min<size_t>(readSize, stream.size() - offset);
+                decoder.setInput(&stream[offset], length);
+                int event;
+                while((event = decoder.decodeNext()) != TouchkeyFrameDecoder::kEventNone) {
+                    if(event == TouchkeyFrameDecoder::kEventFrame) {
+                        frames++;
+                        frameBytes += decoder.frameLength();
+                    }
+                }
+            }
+        }
+        double decoderTime = nowMicroseconds() - start;
+
+        start = nowMicroseconds();
+        for(int pass = 0; pass < kPasses; pass++) {
+            for(size_t offset = 0; offset < stream.size(); offset += readSize)
+                reference.decode(&stream[offset], (long)std::min<size_t>(readSize, stream.size() - offset));
+        }
+        double referenceTime = nowMicroseconds() - start;
+
+        double megabytes = (double)stream.size() * kPasses / 1.0e6;
+        out << "  reads of " << std::setw(5) << readSize << " bytes: decoder " << std::fixed << std::setprecision(1)
+            << std::setw(7) << megabytes / (decoderTime * 1.0e-6) << " MB/s, byte loop "
+            << std::setw(7) << megabytes / (referenceTime * 1.0e-6) << " MB/s, "
+            << frames / kPasses << " frames per pass\n";
+        out.unsetf(std::ios::floatfield);
+
+        if(frames != reference.frames || frameBytes != reference.frameBytes) {
+            out << "  MISMATCH: decoder found " << frames << " frames of " << frameBytes << " bytes, byte loop "
+                << reference.frames << " frames of " << reference.frameBytes << " bytes\n";
+            passed = false;
+        }
+    }
+
+    return passed;
+}
+
+// ***** Analog frames *****
+
+// Run the analog frames of the simulator capture through two devices: one with
+// processAnalogFrame(), the other with the per-value loop it replaced. Both are calibrated
+// from the same frames first, and their keys should end up with the same position histories.
+bool Benchmarks::analogFrames(std::ostream& out) {
+    const int kLowestNote = 24;
+    std::vector<unsigned char> stream;
+    std::vector<std::vector<unsigned char> > frames;   // Analog frames without the type byte
+    bool passed = true;
+
+    captureSimulatorOutput(stream);
+    TouchkeyFrameDecoder decoder;
+    decoder.setInput(&stream[0], (long)stream.size());
+    int event;
+    while((event = decoder.decodeNext()) != TouchkeyFrameDecoder::kEventNone) {
+        if(event == TouchkeyFrameDecoder::kEventFrame && decoder.frameLength() > 1 &&
+           decoder.frame()[0] == kFrameTypeAnalog)
+            frames.push_back(std::vector<unsigned char>(decoder.frame() + 1, decoder.frame() + decoder.frameLength()));
+    }
+
+    // The loop processAnalogFrame() replaced: each value looks up its key and calibrator
+    // and synchronizes the frame timestamp again
+    auto referenceAnalogFrame = [](TouchkeyDevice& device, unsigned char * const buffer, const int bufferLength) {
+        int octave = buffer[0];
+        int board = octave / 2;
+        int frame, midiNote, value;
+        int bufferIndex = 1;
+
+        while(bufferIndex < bufferLength) {
+            if(bufferLength - bufferIndex < kAnalogFrameLength)
+                break;
+
+            frame = buffer[bufferIndex] + ((int)buffer[bufferIndex+1] << 8) +
+                    ((int)buffer[bufferIndex+2] << 16) + ((int)buffer[bufferIndex+3] << 24);
+            if(frame != device.analogLastFrame_[board] + 1 && device.verbose_ >= 1)
+                std::cout << "WARNING: dropped or repeat frame(s) on board " << board << '\n';
+            device.analogLastFrame_[board] = frame;
+
+            for(int key = 0; key < 25; key++) {
+                if(key == 24 && octave != device.numberOfOctaves() - 2)
+                    continue;
+
+                midiNote = device.octaveKeyToMidi(octave, key);
+                if(device.keyboard_.key(midiNote) == 0 || (octave*12 + key) >= device.keyCalibratorsLength_ || midiNote < 21)
+                    continue;
+
+                value = (((signed char)buffer[bufferIndex + key*2 + 5])*256 + buffer[bufferIndex + key*2 + 4]);
+
+                key_position calibratedPosition = device.keyCalibrators_[octave*12 + key]->evaluate(value);
+                if(!missing_value<key_position>::isMissing(calibratedPosition)) {
+                    timestamp_type timestamp = device.timestampSynchronizer_.synchronizedTimestamp(frame);
+                    device.keyboard_.key(midiNote)->insertSample(calibratedPosition, timestamp);
+                }
+            }
+
+            bufferIndex += kAnalogFrameLength;
+        }
+    };
+
+    // PianoKey reports its state changes on std::cout; keep them out of the timing
+    std::streambuf *coutBuffer = std::cout.rdbuf(nullptr);
+
+    // A device and keyboard laid out as four boards, calibrated by a pass over the frames.
+    // Calibrators take the quiescent value from their last few samples and many keys are
+    // down at any time, so finish on the first frames again, when every key was at rest.
+    PianoKeyboard keyboard, referenceKeyboard;
+    TouchkeyDevice device(keyboard), referenceDevice(referenceKeyboard);
+    size_t restingFrames = std::min(frames.size(), kPianoKeyCalibrationBufferSize * kAnalogMaxBoards);
+    int keysCalibrated = 0;
+    for(TouchkeyDevice* d : {&device, &referenceDevice}) {
+        d->numOctaves_ = kBenchmarkSimulatorOctaves;
+        d->setLowestMidiNote(kLowestNote);
+        d->calibrationInit(12*kBenchmarkSimulatorOctaves + 1);
+        d->calibrationStart(nullptr);
+        for(auto& frame : frames)
+            d->processAnalogFrame(&frame[0], (int)frame.size());
+        for(size_t i = 0; i < restingFrames; i++)
+            d->processAnalogFrame(&frames[i][0], (int)frames[i].size());
+        d->calibrationFinish();
+    }
+    for(int i = 0; i < device.keyCalibratorsLength_; i++) {
+        if(device.keyCalibrators_[i]->calibrationStatus() == kPianoKeyCalibrated)
+            keysCalibrated++;
+    }
+
+    double time = bestTime([&]() {
+        for(auto& frame : frames)
+            device.processAnalogFrame(&frame[0], (int)frame.size());
+    });
+    double referenceTime = bestTime([&]() {
+        for(auto& frame : frames)
+            referenceAnalogFrame(referenceDevice, &frame[0], (int)frame.size());
+    });
+    std::cout.rdbuf(coutBuffer);
+
+    out << "Analog frames: " << frames.size() << " board frames of simulator output (" << kBenchmarkSimulatorOctaves
+        << " octaves, " << kBenchmarkSimulatorScans << " scans), " << keysCalibrated << " keys calibrated\n";
+
+    // Four boards each send a frame every millisecond
+    const double kFramesPerSecond = kAnalogMaxBoards * 1000.0;
+    double nanoseconds = time * 1000.0 / frames.size(), referenceNanoseconds = referenceTime * 1000.0 / frames.size();
+    out << std::fixed << std::setprecision(1)
+        << "  processAnalogFrame: " << std::setw(7) << nanoseconds << "ns per frame, "
+        << std::setprecision(2) << nanoseconds * kFramesPerSecond * 1.0e-7 << "% of a core at full rate\n"
+        << std::setprecision(1)
+        << "  per-value loop:     " << std::setw(7) << referenceNanoseconds << "ns per frame, "
+        << std::setprecision(2) << referenceNanoseconds * kFramesPerSecond * 1.0e-7 << "% of a core at full rate\n";
+    out.unsetf(std::ios::floatfield);
+
+    // Every frame went through each device the same number of times
+    uint64_t samples = 0, mismatches = 0;
+    for(int note = 0; note < 128; note++) {
+        Node<key_position>& buffer = keyboard.key(note)->buffer();
+        Node<key_position>& referenceBuffer = referenceKeyboard.key(note)->buffer();
+
+        if(buffer.endIndex() != referenceBuffer.endIndex() || buffer.beginIndex() != referenceBuffer.beginIndex()) {
+            mismatches++;
+            continue;
+        }
+        for(auto index = buffer.beginIndex(); index < buffer.endIndex(); index++) {
+            samples++;
+            if(buffer[index] != referenceBuffer[index])
+                mismatches++;
+        }
+    }
+    out << "  " << samples << " stored positions compared, " << mismatches << " mismatches\n";
+    if(mismatches != 0 || keysCalibrated == 0) {
+        out << "  MISMATCH: the two paths delivered different positions\n";
+        passed = false;
+    }
+
+    return passed;
+}
+
+// ***** Touch matching *****
+
+// Compare the two matchers on every assignment of a grid of locations to three old and three
+// new points, for 1-3 touches. The grid includes missing (-1) locations, duplicates and ties.
+// NaN is left out: the recursion treated it differently at different depths, and touch
+// frames never contain it. Results must agree in distance (bit for bit) and ordering.
+bool Benchmarks::touchMatch(std::ostream& out) {
+    const int iterations = kBenchmarkTouchMatchIterations;
+    const float values[] = {-1.0f, 0.0f, 0.05f, 0.1f, 0.2f, 0.25f, 0.3f, 0.5f, 0.5f, 0.7f, 0.9f, 0.95f, 1.0f};
+    const int numValues = sizeof(values) / sizeof(values[0]);
+    const int numCombinations = numValues * numValues * numValues;
+    unsigned long cases = 0, mismatches = 0;
+    
+    for(int oldCombination = 0; oldCombination < numCombinations; oldCombination++) {
+        float oldPoints[3] = {values[oldCombination % numValues], values[(oldCombination / numValues) % numValues],
+                              values[oldCombination / (numValues * numValues)]};
+        
+        for(int newCombination = 0; newCombination < numCombinations; newCombination++) {
+            float newPoints[3] = {values[newCombination % numValues], values[(newCombination / numValues) % numValues],
+                                  values[newCombination / (numValues * numValues)]};
+            
+            for(int count = 1; count <= 3; count++) {
+                int referenceOrder[3] = {-1, -1, -1}, order[3] = {-1, -1, -1};
+                float referenceDistance = touchMatchReference(oldPoints, newPoints, 3, 0, (1U << count) - 1, 0.0, referenceOrder);
+                float distance = PianoKey::touchMatchClosestPoints(oldPoints, newPoints, count, order);
+                
+                bool same = (memcmp(&referenceDistance, &distance, sizeof(float)) == 0);
+                for(int i = 0; i < count; i++)
+                    same = same && (referenceOrder[i] == order[i]);
+                
+                if(!same) {
+                    if(mismatches < 8) {
+                        out << "Mismatch, " << count << " touches: old " << oldPoints[0] << ' ' << oldPoints[1] << ' ' << oldPoints[2]
+                            << " new " << newPoints[0] << ' ' << newPoints[1] << ' ' << newPoints[2]
+                            << ": " << referenceDistance << " vs " << distance << '\n';
+                    }
+                    mismatches++;
+                }
+                cases++;
+            }
+        }
+    }
+    
+    out << "Touch matching: " << cases << " cases, " << mismatches << " mismatches\n";
+    
+    // Time both on a frame which moves slightly each call
+    float oldPoints[3] = {0.2f, 0.5f, -1.0f}, newPoints[3] = {0.21f, 0.48f, 0.8f};
+    int order[3];
+    volatile float sink = 0;
+    
+    for(int count = 2; count <= 3; count++) {
+        double startTime = nowMicroseconds();
+        for(int i = 0; i < iterations; i++) {
+            oldPoints[0] = (i & 255) * 0.004f;
+            sink = sink + touchMatchReference(oldPoints, newPoints, 3, 0, (1U << count) - 1, 0.0, order);
+        }
+        double referenceTime = nowMicroseconds() - startTime;
+        
+        startTime = nowMicroseconds();
+        for(int i = 0; i < iterations; i++) {
+            oldPoints[0] = (i & 255) * 0.004f;
+            sink = sink + PianoKey::touchMatchClosestPoints(oldPoints, newPoints, count, order);
+        }
+        double time = nowMicroseconds() - startTime;
+        
+        out << "  " << count << " touches: recursive " << referenceTime * 1e3 / iterations << " ns, table "
+            << time * 1e3 / iterations << " ns per match\n";
+    }
+    
+    return mismatches == 0;
+}
+
+// ***** Node storage *****
+
+bool Benchmarks::nodeStorage(std::ostream& out) {
+    const int kInserts = 2000000;
+    const int kSearches = 200000;
+    const int kCapacity = kBenchmarkNodeCapacity;
+    const int kReadPasses = kInserts / kCapacity;
+    const int kInterpolatePasses = kInserts / (kCapacity * 4);
+    const int kInterpolatedSamples = kInterpolatePasses * (kCapacity - 1) * 4;
+    const double kInterval = 0.001;
+    Node<float> node(kCapacity);
+    CircularBufferHistory<float> reference(kCapacity);
+    int nodeInserted = 0, referenceInserted = 0;
+    uint64_t nodeIndexTotal = 0, referenceIndexTotal = 0;
+    float nodeTotal = 0, referenceTotal = 0;
+    float nodeInterpolateTotal = 0, referenceInterpolateTotal = 0;
+
+    out << "Node storage: capacity " << kCapacity << ", best of " << kBenchmarkRepeats << " runs\n";
+
+    // Insertion, carrying on from the previous run each time
+    double nodeInsertTime = bestTime([&]() {
+        for(int i = 0; i < kInserts; i++, nodeInserted++)
+            node.insert((float)nodeInserted, (timestamp_type)nodeInserted * kInterval);
+    });
+    double referenceInsertTime = bestTime([&]() {
+        for(int i = 0; i < kInserts; i++, referenceInserted++)
+            reference.insert((float)referenceInserted, (timestamp_type)referenceInserted * kInterval);
+    });
+
+    // Reading every sample by index
+    double nodeReadTime = bestTime([&]() {
+        nodeTotal = 0;
+        for(int pass = 0; pass < kReadPasses; pass++) {
+            for(Node<float>::size_type i = node.beginIndex(); i < node.endIndex(); i++)
+                nodeTotal += node[i];
+        }
+    });
+    double referenceReadTime = bestTime([&]() {
+        referenceTotal = 0;
+        for(int pass = 0; pass < kReadPasses; pass++) {
+            for(std::size_t i = reference.beginIndex(); i < reference.endIndex(); i++)
+                referenceTotal += reference[i];
+        }
+    });
+
+    // Searching for timestamps spread across the buffer, half way between samples
+    timestamp_type earliest = node.earliestTimestamp();
+    double nodeSearchTime = bestTime([&]() {
+        nodeIndexTotal = 0;
+        for(int i = 0; i < kSearches; i++)
+            nodeIndexTotal += node.indexNearestBefore(earliest + ((i % kCapacity) + 0.5) * kInterval);
+    });
+    double referenceSearchTime = bestTime([&]() {
+        referenceIndexTotal = 0;
+        for(int i = 0; i < kSearches; i++)
+            referenceIndexTotal += reference.indexNearestBefore(earliest + ((i % kCapacity) + 0.5) * kInterval);
+    });
+
+    // Interpolated iteration at a quarter of the sample spacing
+    double nodeInterpolateTime = bestTime([&]() {
+        nodeInterpolateTotal = 0;
+        for(int pass = 0; pass < kInterpolatePasses; pass++) {
+            Node<float>::interpolated_iterator it = node.interpolatedBegin(0.25);
+            Node<float>::interpolated_iterator end = node.interpolatedIteratorAtIndex(node.endIndex() - 1, 0.25);
+            for(; it < end; ++it)
+                nodeInterpolateTotal += *it;
+        }
+    });
+    double referenceInterpolateTime = bestTime([&]() {
+        referenceInterpolateTotal = 0;
+        for(int pass = 0; pass < kInterpolatePasses; pass++) {
+            for(double index = reference.beginIndex(); index < reference.endIndex() - 1; index += 0.25)
+                referenceInterpolateTotal += reference.interpolate(index);
+        }
+    });
+
+    out << std::fixed << std::setprecision(2);
+    out << "  insert:             Node " << std::setw(6) << nodeInsertTime * 1.0e3 / kInserts
+        << " ns, circular_buffer " << std::setw(6) << referenceInsertTime * 1.0e3 / kInserts << " ns\n";
+    out << "  operator[]:         Node " << std::setw(6) << nodeReadTime * 1.0e3 / ((double)kReadPasses * kCapacity)
+        << " ns, circular_buffer " << std::setw(6) << referenceReadTime * 1.0e3 / ((double)kReadPasses * kCapacity) << " ns\n";
+    out << "  indexNearestBefore: Node " << std::setw(6) << nodeSearchTime * 1.0e3 / kSearches
+        << " ns, circular_buffer " << std::setw(6) << referenceSearchTime * 1.0e3 / kSearches << " ns\n";
+    out << "  interpolated:       Node " << std::setw(6) << nodeInterpolateTime * 1.0e3 / kInterpolatedSamples
+        << " ns, circular_buffer " << std::setw(6) << referenceInterpolateTime * 1.0e3 / kInterpolatedSamples << " ns\n";
+    out.unsetf(std::ios::floatfield);
+
+    // Both hold the same samples, so every result should agree
+    int mismatches = 0;
+    if(nodeTotal != referenceTotal || nodeIndexTotal != referenceIndexTotal || nodeInterpolateTotal != referenceInterpolateTotal)
+        mismatches++;
+    for(Node<float>::size_type i = node.beginIndex(); i < node.endIndex(); i++) {
+        if(node[i] != reference[i] || node.timestampAt(i) != reference.timestampAt(i))
+            mismatches++;
+    }
+
+    if(mismatches != 0)
+        out << "  MISMATCH: the two storages disagree\n";
+    return mismatches == 0;
+}
+
+// ***** Mapping scheduler *****
+
+bool Benchmarks::mappingScheduler(std::ostream& out) {
+    const int kWorkerCounts[] = {1, 2, 4};
+    const int kLowestNote = 21, kNotes = 88;
+    const double kIntervalMilliseconds = 5.5;
+    static SchedulerRecord record;
+    bool passed = true;
+
+    out << "Mapping scheduler: " << kNotes << " mappings every " << kIntervalMilliseconds << "ms for "
+        << kBenchmarkSchedulerMilliseconds << "ms\n";
+
+    for(int workers : kWorkerCounts) {
+        PianoKeyboard keyboard;
+        std::vector<BenchmarkMapping*> mappings;
+
+        record.reset();
+        keyboard.mappingScheduler().setNumberOfWorkers(workers);
+        double start = juce::Time::getMillisecondCounterHiRes();
+
+        for(int note = kLowestNote; note < kLowestNote + kNotes; note++) {
+            mappings.push_back(new BenchmarkMapping(keyboard, note, record));
+            mappings.back()->engage();
+        }
+
+        juce::Thread::sleep(kBenchmarkSchedulerMilliseconds);
+
+        // Time the scheduler spent that wasn't in performMapping(), per 5.5ms tick
+        double elapsed = juce::Time::getMillisecondCounterHiRes() - start;
+        double busyMilliseconds = 0;
+        unsigned long actions = 0, stolen = 0;
+        for(int i = 0; i < workers; i++) {
+            busyMilliseconds += keyboard.mappingScheduler().workerUtilization(i) * elapsed;
+            actions += keyboard.mappingScheduler().workerActionsPerformed(i);
+            stolen += keyboard.mappingScheduler().workerShardsStolen(i);
+        }
+        double mappingMilliseconds = record.mappingMicroseconds / 1000.0;
+        double ticks = elapsed / kIntervalMilliseconds;
+
+        // Each mapping schedules its next call from when it ran, so lateness adds up, but
+        // every note should have kept up with the others
+        unsigned long fewestCalls = record.calls[kLowestNote], mostCalls = fewestCalls;
+        for(int note = kLowestNote; note < kLowestNote + kNotes; note++) {
+            fewestCalls = std::min<unsigned long>(fewestCalls, record.calls[note]);
+            mostCalls = std::max<unsigned long>(mostCalls, record.calls[note]);
+        }
+
+        // Unregistering and deleting goes through the same queues; none should be left behind
+        for(auto it = mappings.begin(); it != mappings.end(); ++it)
+            (*it)->disengage(true);
+        for(int wait = 0; wait < 100 && record.deleted < (unsigned long)kNotes; wait++)
+            juce::Thread::sleep(10);
+
+        out << "  " << workers << (workers == 1 ? " worker:  " : " workers: ") << std::fixed << std::setprecision(1)
+            << (busyMilliseconds - mappingMilliseconds) * 1000.0 / ticks << "us overhead per tick ("
+            << (busyMilliseconds - mappingMilliseconds) * 1.0e6 / std::max<unsigned long>(actions, 1) << "ns per action), "
+            << mappingMilliseconds * 1000.0 / ticks << "us in mappings; " << actions << " actions, "
+            << stolen << " shards stolen\n";
+        out.unsetf(std::ios::floatfield);
+        out << "    calls per note " << fewestCalls << "-" << mostCalls << " of " << (int)ticks << " ticks, "
+            << record.overlaps << " overlapping, " << record.outOfOrder << " early, "
+            << record.deleted << "/" << kNotes << " deleted\n";
+
+        // A note whose actions were stranded in a shard would fall behind the rest
+        if(record.overlaps != 0 || record.outOfOrder != 0 || record.deleted != (unsigned long)kNotes ||
+           fewestCalls < mostCalls * 9 / 10) {
+            out << "  FAILED: actions overlapped, ran early or were stranded\n";
+            passed = false;
+        }
+    }
+
+    return passed;
+}
+
+// ***** Triggers *****
+
+bool Benchmarks::triggerSend(std::ostream& out) {
+    const int kDestinationCounts[] = {1, 2, 4, 8, 16};
+    const int kSends = 2000000;
+    bool passed = true;
+
+    out << "Trigger send: " << kSends << " sends, best of " << kBenchmarkRepeats << " runs\n";
+
+    for(int destinationCount : kDestinationCounts) {
+        BenchmarkTriggerSource source;
+        std::vector<BenchmarkTriggerDestination> destinations(destinationCount);
+
+        for(int i = 0; i < destinationCount; i++)
+            destinations[i].registerForTrigger(&source);
+
+        // This thread isn't registered, so each send counts itself in and out
+        double countedTime = bestTime([&]() {
+            for(int i = 0; i < kSends; i++)
+                source.send(i);
+        });
+
+        TriggerSource::registerSendingThread();
+        double registeredTime = bestTime([&]() {
+            for(int i = 0; i < kSends; i++)
+                source.send(i);
+            TriggerSource::threadQuiescent();
+        });
+        TriggerSource::unregisterSendingThread();
+
+        out << "  " << std::setw(2) << destinationCount << " destinations: counted " << std::fixed << std::setprecision(1)
+            << std::setw(6) << countedTime * 1.0e3 / kSends << " ns, sending thread "
+            << std::setw(6) << registeredTime * 1.0e3 / kSends << " ns per send\n";
+        out.unsetf(std::ios::floatfield);
+
+        for(int i = 0; i < destinationCount; i++) {
+            if(destinations[i].received != (uint64_t)kSends * kBenchmarkRepeats * 2) {
+                out << "  MISMATCH: destination " << i << " received " << destinations[i].received << " triggers\n";
+                passed = false;
+            }
+            destinations[i].unregisterForTrigger(&source);
+        }
+    }
+
+    return passed;
+}
+
+// ***** Filter pipeline *****
+
+bool Benchmarks::filterPipeline(std::ostream& out) {
+    const int kSamples = 2000000;
+    const int kPasses = 3;
+    std::vector<float> bCoeffs, aCoeffs;
+    Node<float> raw(kBenchmarkFilterBufferLength);
+    IIRFilterNode<float> chained(kBenchmarkFilterBufferLength, raw);
+    PipelineNode<VibratoFilterStage> fused(kBenchmarkFilterBufferLength);
+    std::vector<float> input(kSamples);
+    int mismatches = 0;
+
+    for(int i = 0; i < kSamples; i++)
+        input[i] = vibratoSample(0, i);
+    vibratoFilterCoefficients(bCoeffs, aCoeffs);
+    chained.setCoefficients(bCoeffs, aCoeffs);
+    chained.setAutoCalculate(true);
+    fused.stage<0>().setCoefficients(bCoeffs, aCoeffs);
+    out << "Filter pipeline: " << kSamples << " samples per pass\n";
+
+    // Check sample by sample, then time whole passes
+    for(int i = 0; i < kSamples; i++) {
+        raw.insert(input[i], i);
+        fused.process(input[i], i);
+        if(chained.latest() != fused.latest())
+            mismatches++;
+    }
+
+    // The chained filter runs from the trigger when the raw sample is inserted
+    for(int pass = 0; pass < kPasses; pass++) {
+        timestamp_type base = (timestamp_type)(pass + 1) * kSamples;
+
+        double start = nowMicroseconds();
+        for(int i = 0; i < kSamples; i++)
+            raw.insert(input[i], base + i);
+        double chainedTime = nowMicroseconds() - start;
+
+        start = nowMicroseconds();
+        for(int i = 0; i < kSamples; i++)
+            fused.process(input[i], base + i);
+        double fusedTime = nowMicroseconds() - start;
+
+        if(chained.latest() != fused.latest())
+            mismatches++;
+
+        out << "  pass " << pass << ": chained " << std::fixed << std::setprecision(1)
+            << chainedTime * 1.0e3 / kSamples << " ns, fused " << fusedTime * 1.0e3 / kSamples << " ns per sample\n";
+        out.unsetf(std::ios::floatfield);
+    }
+
+    if(mismatches != 0)
+        out << "  MISMATCH: " << mismatches << " samples differ\n";
+    return mismatches == 0;
+}
+
+// ***** Filter bank *****
+
+bool Benchmarks::filterBank(std::ostream& out) {
+    const int kNoteCounts[] = {1, 10, 128};
+    const int kFrames = 200000;
+    const int kInputFrames = 256;
+    std::vector<float> bCoeffs, aCoeffs;
+    bool passed = true;
+
+    vibratoFilterCoefficients(bCoeffs, aCoeffs);
+    out << "Filter bank: " << kFrames << " frames, one sample per note per frame\n";
+
+    for(int notes : kNoteCounts) {
+        std::vector<PipelineNode<VibratoFilterStage>*> fused;
+        std::vector<Node<float>*> banked;
+        BiquadBank bank(notes, bCoeffs, aCoeffs);
+        std::vector<float> input(kInputFrames * notes);
+
+        // A repeating block of input, so that generating it isn't timed
+        for(int frame = 0; frame < kInputFrames; frame++) {
+            for(int note = 0; note < notes; note++)
+                input[frame * notes + note] = vibratoSample(note, frame);
+        }
+
+        for(int note = 0; note < notes; note++) {
+            fused.push_back(new PipelineNode<VibratoFilterStage>(kBenchmarkFilterBufferLength));
+            fused.back()->stage<0>().setCoefficients(bCoeffs, aCoeffs);
+            banked.push_back(new Node<float>(kBenchmarkFilterBufferLength));
+        }
+
+        double start = nowMicroseconds();
+        for(int frame = 0; frame < kFrames; frame++) {
+            for(int note = 0; note < notes; note++)
+                fused[note]->process(input[(frame % kInputFrames) * notes + note], frame);
+        }
+        double fusedTime = nowMicroseconds() - start;
+
+        start = nowMicroseconds();
+        for(int frame = 0; frame < kFrames; frame++) {
+            for(int note = 0; note < notes; note++)
+                bank.input[note] = input[(frame % kInputFrames) * notes + note];
+            bank.processAll();
+            for(int note = 0; note < notes; note++)
+                banked[note]->insert(bank.output[note], frame);
+        }
+        double bankTime = nowMicroseconds() - start;
+
+        // Both compute each output in the same order, so they should agree exactly
+        int mismatches = 0;
+        for(int note = 0; note < notes; note++) {
+            if(fused[note]->latest() != banked[note]->latest())
+                mismatches++;
+        }
+
+        out << "  " << std::setw(3) << notes << " notes: fused " << std::fixed << std::setprecision(1)
+            << std::setw(7) << fusedTime * 1.0e3 / kFrames << " ns, bank " << std::setw(7) << bankTime * 1.0e3 / kFrames
+            << " ns per frame\n";
+        out.unsetf(std::ios::floatfield);
+
+        if(mismatches != 0) {
+            out << "  MISMATCH: " << mismatches << " notes have different outputs\n";
+            passed = false;
+        }
+
+        for(int note = 0; note < notes; note++) {
+            delete fused[note];
+            delete banked[note];
+        }
+    }
+
+    return passed;
+}
+
+#endif // TOUCHKEYS_NO_GUI
@@ -0,0 +1,95 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  Benchmarks.h: micro-benchmarks and equivalence checks for the data
+  path, run from the command line of the headless build.
+*/
+
+#pragma once
+
+#ifdef TOUCHKEYS_NO_GUI
+
+#include <ostream>
+#include <string>
+
+const int kBenchmarkSimulatorOctaves = 8;           // Four boards, as on a full-size keyboard
+const int kBenchmarkSimulatorScans = 10000;         // Ten seconds of device output at 1ms scans
+const float kBenchmarkSimulatorTouchRate = 40.0;    // New touches per second across the keyboard
+const int kBenchmarkRepeats = 5;                    // Runs of each measurement, keeping the fastest
+const int kBenchmarkTouchMatchIterations = 10000000;  // Calls timed for each touch count
+const int kBenchmarkSchedulerMilliseconds = 3000;   // How long each scheduler configuration runs
+const int kBenchmarkMappingWork = 2000;             // Loop iterations in each benchmark mapping call
+const int kBenchmarkNodeCapacity = 100;             // A typical history length, not a power of two
+const int kBenchmarkFilterBufferLength = 30;        // As TouchkeyVibratoMapping's filtered distance
+
+/*
+ * Benchmarks
+ *
+ * Each benchmark builds its own input, usually from TouchkeyDeviceSimulator::captureScans()
+ * so that runs are repeatable, times the current code against the simplest equivalent
+ * (normally the implementation it replaced), checks the two agree where that makes sense,
+ * and prints the results. Run with the -B option of the headless build.
+ */
+
+class Benchmarks {
+public:
+    // Run the benchmark with the given name, printing its results. Returns false if there
+    // is no such benchmark or one of its checks failed.
+    static bool run(std::string const& name, std::ostream& out);
+
+    // Print the names accepted by run()
+    static void list(std::ostream& out);
+
+    // ***** Benchmarks *****
+
+    // Throughput of TouchkeyFrameDecoder over simulator output, in MB/s, for several
+    // read sizes, against a byte-at-a-time decoder
+    static bool frameDecoder(std::ostream& out);
+
+    // TouchkeyDevice::processAnalogFrame() against the per-value loop it replaced, in time per
+    // board frame and share of a core at four boards' full rate, over simulator output
+    static bool analogFrames(std::ostream& out);
+
+    // PianoKey::touchMatchClosestPoints() against the recursive search it replaced, over
+    // every combination of a grid of touch locations, then the time per match of each
+    static bool touchMatch(std::ostream& out);
+
+    // Node against the boost::circular_buffer storage it used before NodeRingBuffer, for
+    // insertion, indexed reads, timestamp search and interpolated iteration
+    static bool nodeStorage(std::ostream& out);
+
+    // 88 mappings at the default 5.5ms update interval on 1, 2 and 4 MappingScheduler
+    // workers: the time spent per tick outside performMapping(), and checks that actions
+    // for each note never overlap or run early and that none are stranded
+    static bool mappingScheduler(std::ostream& out);
+
+    // Cost of TriggerSource::sendTrigger() with 1 to 16 destinations, from a thread using the
+    // shared counter and from a registered sending thread
+    static bool triggerSend(std::ostream& out);
+
+    // Per-sample cost of the vibrato distance filter as a fused PipelineNode, against the
+    // Node -> IIRFilterNode chain driven by triggers that it replaced
+    static bool filterPipeline(std::ostream& out);
+
+    // Per-frame cost of filtering the vibrato distance for 1, 10 and 128 notes, with a fused
+    // IIRFilterStage per note against an ideal structure-of-arrays bank of the same filters
+    static bool filterBank(std::ostream& out);
+};
+
+#endif // TOUCHKEYS_NO_GUI
@@ -75,7 +75,7 @@ PreferencesComponent::PreferencesComponent ()
     defaultsButton->setButtonText (TRANS("Reset to Defaults..."));
     defaultsButton->addListener (this);
 
-    defaultsButton->setBounds (16, 168, 144, 24);
+    defaultsButton->setBounds (16, 192, 144, 24);
 
     suppressStrayTouchSlider.reset (new juce::Slider ("suppress stray touch slider"));
     addAndMakeVisible (suppressStrayTouchSlider.get());
@@ -104,11 +104,18 @@ PreferencesComponent::PreferencesComponent ()
 
     strayTouchThresholdLabel->setBounds (32, 136, 80, 24);
 
+    realTimeButton.reset (new juce::ToggleButton ("real-time button"));
+    addAndMakeVisible (realTimeButton.get());
+    realTimeButton->setButtonText (TRANS("Real-time thread priority"));
+    realTimeButton->addListener (this);
+
+    realTimeButton->setBounds (16, 160, 208, 24);
+
 
     //[UserPreSize]
     //[/UserPreSize]
 
-    setSize (296, 200);
+    setSize (296, 224);
 
 
     //[Constructor] You can add your own custom stuff here..
@@ -135,6 +142,7 @@ PreferencesComponent::~PreferencesComponent()
     suppressStrayTouchSlider = nullptr;
     suppressStrayTouchButton = nullptr;
     strayTouchThresholdLabel = nullptr;
+    realTimeButton = nullptr;
 
 
     //[Destructor]. You can add your own custom destruction code here..
@@ -234,6 +242,12 @@ void PreferencesComponent::buttonClicked (juce::Button* buttonThatWasClicked)
             controller_->setPrefsSuppressStrayTouches(0);
         //[/UserButtonCode_suppressStrayTouchButton]
     }
+    else if (buttonThatWasClicked == realTimeButton.get())
+    {
+        //[UserButtonCode_realTimeButton] -- add your button handler code here..
+        controller_->setPrefsRealTimeProfile(realTimeButton->getToggleState());
+        //[/UserButtonCode_realTimeButton]
+    }
 
     //[UserbuttonClicked_Post]
     //[/UserbuttonClicked_Post]
@@ -271,6 +285,7 @@ void PreferencesComponent::synchronize(bool forceUpdates) {
 
     startTouchKeysButton->setToggleState(controller_->getPrefsAutoStartTouchKeys(), juce::NotificationType::dontSendNotification);
     autodetectButton->setToggleState(controller_->getPrefsAutodetectOctave(), juce::NotificationType::dontSendNotification);
+    realTimeButton->setToggleState(controller_->getPrefsRealTimeProfile(), juce::NotificationType::dontSendNotification);
     
     if(controller_->getPrefsSuppressStrayTouches() > 0) {
         suppressStrayTouchButton->setToggleState(true, juce::NotificationType::dontSendNotification);
@@ -310,7 +325,7 @@ BEGIN_JUCER_METADATA
 <JUCER_COMPONENT documentType="Component" className="PreferencesComponent" componentName=""
                  parentClasses="public Component" constructorParams="" variableInitialisers="controller_(0)"
                  snapPixels="8" snapActive="1" snapShown="1" overlayOpacity="0.330"
-                 fixedSize="1" initialWidth="296" initialHeight="200">
+                 fixedSize="1" initialWidth="296" initialHeight="224">
   <BACKGROUND backgroundColour="ffd2d2d2"/>
   <COMBOBOX name="Startup preset combo box" id="244410f02f6c1c72" memberName="startupPresetComboBox"
             virtualName="" explicitFocusOrder="0" pos="16 32 264 24" editable="0"
@@ -327,7 +342,7 @@ BEGIN_JUCER_METADATA
                 virtualName="" explicitFocusOrder="0" pos="16 88 272 24" buttonText="Autodetect TouchKeys octave on each start"
                 connectedEdges="0" needsCallback="1" radioGroupId="0" state="0"/>
   <TEXTBUTTON name="new button" id="89690e14d6bf00c0" memberName="defaultsButton"
-              virtualName="" explicitFocusOrder="0" pos="16 168 144 24" buttonText="Reset to Defaults..."
+              virtualName="" explicitFocusOrder="0" pos="16 192 144 24" buttonText="Reset to Defaults..."
               connectedEdges="0" needsCallback="1" radioGroupId="0"/>
   <SLIDER name="suppress stray touch slider" id="c31cda5155c929b3" memberName="suppressStrayTouchSlider"
           virtualName="" explicitFocusOrder="0" pos="104 136 120 24" min="1.0"
@@ -342,6 +357,9 @@ BEGIN_JUCER_METADATA
          edBkgCol="0" labelText="Strength:" editableSingleClick="0" editableDoubleClick="0"
          focusDiscardsChanges="0" fontname="Default font" fontsize="15.0"
          kerning="0.0" bold="0" italic="0" justification="33"/>
+  <TOGGLEBUTTON name="real-time button" id="3d5e8a1c7b2f4690" memberName="realTimeButton"
+                virtualName="" explicitFocusOrder="0" pos="16 160 208 24" buttonText="Real-time thread priority"
+                connectedEdges="0" needsCallback="1" radioGroupId="0" state="0"/>
 </JUCER_COMPONENT>
 
 END_JUCER_METADATA
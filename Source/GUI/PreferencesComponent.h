@@ -89,6 +89,7 @@ private:
     std::unique_ptr<juce::Slider> suppressStrayTouchSlider;
     std::unique_ptr<juce::ToggleButton> suppressStrayTouchButton;
     std::unique_ptr<juce::Label> strayTouchThresholdLabel;
+    std::unique_ptr<juce::ToggleButton> realTimeButton;
 
 
     //==============================================================================
@@ -92,6 +92,9 @@ START_JUCE_APPLICATION (TouchKeysApplication)
 
 #else // TOUCHKEYS_NO_GUI
 
+#include "Benchmarks.h"
+#include "TouchKeys/TouchkeyDeviceSimulator.h"
+#include "Utility/RealTimeProfile.h"
 #include <getopt.h>
 #include <libgen.h>
 #include <signal.h>
@@ -108,6 +111,20 @@ static struct option long_options[] = {
     {"midi-output", required_argument, NULL, 'o'},
     {"virtual-midi-output", no_argument, NULL, 'V'},
     {"osc-input-port", required_argument, NULL, 'P'},
+    {"event-driven-input", no_argument, NULL, 'e'},
+    {"frame-pipeline", no_argument, NULL, 'p'},
+    {"simulate", no_argument, NULL, 's'},
+    {"simulate-log", required_argument, NULL, 'r'},
+    {"replay", required_argument, NULL, 'R'},
+    {"replay-midi", required_argument, NULL, 'M'},
+    {"replay-analog", required_argument, NULL, 'N'},
+    {"replay-calibration", required_argument, NULL, 'C'},
+    {"replay-output", required_argument, NULL, 'O'},
+    {"mapping-workers", required_argument, NULL, 'w'},
+    {"real-time", no_argument, NULL, 'T'},
+    {"real-time-cores", required_argument, NULL, 'A'},
+    {"jitter-benchmark", required_argument, NULL, 'J'},
+    {"benchmark", required_argument, NULL, 'B'},
 	{0,0,0,0}
 };
 
@@ -117,7 +134,10 @@ void sigint_handler(int s){
 
 void usage(const char * processName)	// Print usage information and exit
 {
-	cerr << "Usage: " << processName << " [-h] [-l] [-t touchkeys] [-i MIDI-in] [-o MIDI-out]\n";
+	cerr << "Usage: " << processName << " [-h] [-l] [-e] [-p] [-s] [-r log] [-w workers] [-T] [-A cores] [-t touchkeys] [-i MIDI-in] [-o MIDI-out]\n";
+    cerr << "       " << processName << " [-R touch-log] [-M MIDI-log] [-N analog-log -C calibration] [-O output]\n";
+    cerr << "       " << processName << " [-A cores] [-J wakeups]\n";
+    cerr << "       " << processName << " [-B benchmark]\n";
 	cerr << "  -h:   Print this menu\n";
 	cerr << "  -l:   List available TouchKeys and MIDI devices\n";
 	cerr << "  -t:   Specify TouchKeys device path and autostart\n";
@@ -125,6 +145,48 @@ void usage(const char * processName)	// Print usage information and exit
     cerr << "  -o:   Specify MIDI output device\n";
     cerr << "  -V:   Open virtual MIDI output\n";
     cerr << "  -P:   Specify OSC input port (default: " << kDefaultOscReceivePort << ")\n";
+    cerr << "  -e:   Wait for TouchKeys data with poll() instead of polling every 0.5ms\n";
+    cerr << "  -p:   Process TouchKeys frames on a separate thread from device input\n";
+    cerr << "  -s:   Simulate a TouchKeys device generating random touches, and autostart\n";
+    cerr << "  -r:   Simulate a TouchKeys device replaying the given key touch log, and autostart\n";
+    cerr << "  -w:   Perform mappings on this many threads, sharded by note (default: 1)\n";
+    cerr << "  -R:   Replay a key touch log in virtual time as fast as possible, then exit\n";
+    cerr << "  -M:   Replay a MIDI log in virtual time as fast as possible, then exit\n";
+    cerr << "  -N:   Replay a key position (analog) log in virtual time as fast as possible, then exit\n";
+    cerr << "  -C:   Key calibration file for replaying an analog log\n";
+    cerr << "  -O:   File for the MIDI and OSC output of a replay (default: replay.txt)\n";
+    cerr << "  -T:   Run the device, scheduler, mapping and OSC threads with real-time priority\n";
+    cerr << "  -A:   Pin the real-time threads to cores, as a comma-separated list in the order\n";
+    cerr << "        device I/O, frame processing, mapping, scheduler, LED, OSC (-1 for any core)\n";
+    cerr << "  -J:   Measure this many scheduler wakeups with the real-time profile off and on, then exit\n";
+    cerr << "  -B:   Run the named benchmark (\"list\" to show them all), then exit\n";
+}
+
+// Time from the simulator sending a new touch to the note it starts leaving as MIDI
+void simulator_midi_monitor(TouchkeyDeviceSimulator *simulator, LatencyHistogram *latency,
+                            int port, const juce::MidiMessage& message)
+{
+    if(!message.isNoteOn())
+        return;
+    double onsetTime = simulator->takeTouchOnsetTime(message.getNoteNumber());
+    if(onsetTime >= 0)
+        latency->addSample((juce::Time::getMillisecondCounterHiRes() - onsetTime) * 1000.0);
+}
+
+// Print the wakeup lateness of a scheduler-role thread with the real-time profile off, then on
+void jitter_benchmark(int wakeups)
+{
+    bool wasEnabled = RealTimeProfile::isEnabled();
+    
+    for(int pass = 0; pass < 2; pass++) {
+        LatencyHistogram histogram;
+        
+        RealTimeProfile::setEnabled(pass == 1);
+        RealTimeProfile::measureWakeupJitter(kRealTimeRoleScheduler, histogram, wakeups);
+        histogram.print(std::cout, pass == 1 ? "Wakeup lateness, real-time profile on" : "Wakeup lateness, real-time profile off");
+    }
+    
+    RealTimeProfile::setEnabled(wasEnabled);
 }
 
 void list_devices(MainApplicationController& controller)
@@ -168,6 +230,8 @@ void list_devices(MainApplicationController& controller)
 int main (int argc, char* argv[])
 {
     MainApplicationController controller;
+    TouchkeyDeviceSimulator simulator;
+    LatencyHistogram simulatorMidiLatency;
     
     int ch, option_index;
     int midiInputNum = 0, midiOutputNum = 0;
@@ -176,9 +240,19 @@ int main (int argc, char* argv[])
     bool autostartTouchkeys = false;
     bool autoopenMidiOut = false, autoopenMidiIn = false;
     int oscInputPort = kDefaultOscReceivePort;
+    int ingestMode = kIngestModePolling;
+    bool framePipeline = false;
+    bool simulateDevice = false;
+    std::string simulatorLogPath;
     std::string touchkeysDevicePath;
+    std::string replayTouchPath, replayMidiPath, replayAnalogPath, replayCalibrationPath;
+    std::string replayOutputPath = "replay.txt";
+    int mappingWorkers = 1;
+    bool realTimeProfile = false;
+    int jitterWakeups = 0;
+    std::string benchmarkName;
     
-	while((ch = getopt_long(argc, argv, "hli:o:t:VP:", long_options, &option_index)) != -1)
+	while((ch = getopt_long(argc, argv, "hli:o:t:VP:epsr:R:M:N:C:O:w:TA:J:B:", long_options, &option_index)) != -1)
 	{
         if(ch == 'l') { // List devices
             list_devices(controller);
@@ -204,6 +278,55 @@ int main (int argc, char* argv[])
         else if(ch == 'P') { // OSC port
             oscInputPort = atoi(optarg);
         }
+        else if(ch == 'e') { // Event-driven TouchKeys input
+            ingestMode = kIngestModeEventDriven;
+        }
+        else if(ch == 'p') { // Separate TouchKeys frame processing thread
+            framePipeline = true;
+        }
+        else if(ch == 's') { // Simulated TouchKeys device
+            simulateDevice = true;
+        }
+        else if(ch == 'r') { // Simulated TouchKeys device replaying a log
+            simulateDevice = true;
+            simulatorLogPath = optarg;
+        }
+        else if(ch == 'R') { // Replay a key touch log in virtual time
+            replayTouchPath = optarg;
+        }
+        else if(ch == 'M') { // Replay a MIDI log in virtual time
+            replayMidiPath = optarg;
+        }
+        else if(ch == 'N') { // Replay a key position log in virtual time
+            replayAnalogPath = optarg;
+        }
+        else if(ch == 'C') { // Calibration for the key position log
+            replayCalibrationPath = optarg;
+        }
+        else if(ch == 'O') { // Output of the replay
+            replayOutputPath = optarg;
+        }
+        else if(ch == 'w') { // Mapping scheduler threads
+            mappingWorkers = atoi(optarg);
+        }
+        else if(ch == 'T') { // Real-time thread profile
+            realTimeProfile = true;
+        }
+        else if(ch == 'A') { // Cores for the real-time threads
+            if(!RealTimeProfile::setCoresFromString(optarg)) {
+                std::cout << "Invalid core list " << optarg << '\n';
+                shouldStart = false;
+                break;
+            }
+        }
+        else if(ch == 'J') { // Wakeup jitter benchmark
+            jitterWakeups = atoi(optarg);
+            if(jitterWakeups <= 0)
+                jitterWakeups = kRealTimeJitterDefaultWakeups;
+        }
+        else if(ch == 'B') { // Named benchmark
+            benchmarkName = optarg;
+        }
         else {
             usage(basename(argv[0]));
             shouldStart = false;
@@ -211,10 +334,43 @@ int main (int argc, char* argv[])
 		}
 	}
     
+    // The command line overrides the preferences for this run only
+    if(realTimeProfile)
+        RealTimeProfile::setEnabled(true);
+    
+    if(shouldStart && jitterWakeups > 0) {
+        jitter_benchmark(jitterWakeups);
+        shouldStart = false;
+    }
+    
+    if(shouldStart && !benchmarkName.empty()) {
+        if(benchmarkName == "list")
+            Benchmarks::list(std::cout);
+        else if(!Benchmarks::run(benchmarkName, std::cout))
+            std::cout << "Benchmark " << benchmarkName << " FAILED\n";
+        shouldStart = false;
+    }
+    
+    if(shouldStart && (!replayTouchPath.empty() || !replayMidiPath.empty() || !replayAnalogPath.empty())) {
+        // Headless replay: load the startup preset, run the logs through it and exit
+        controller.initialise();
+        controller.mappingSchedulerSetWorkers(mappingWorkers);
+        
+        if(autoopenMidiOut && !useVirtualMidiOutput) {
+            std::cout << "Opening MIDI output device " << midiOutputNum << '\n';
+            controller.enableMIDIOutputPort(0, midiOutputNum);
+        }
+        
+        if(!controller.replayLogFiles(replayTouchPath, replayMidiPath, replayAnalogPath,
+                                      replayCalibrationPath, replayOutputPath))
+            std::cout << "Unable to replay logs to " << replayOutputPath << '\n';
+        shouldStart = false;
+    }
     
     if(shouldStart) {
         // Main initialization: open TouchKeys and MIDI devices
         controller.initialise();
+        controller.mappingSchedulerSetWorkers(mappingWorkers);
         
         // Always enable OSC input without GUI, since it is how we control
         // the system
@@ -243,6 +399,29 @@ int main (int argc, char* argv[])
             }
             
             // Start the TouchKeys
+            controller.touchkeyDeviceSetIngestMode(ingestMode);
+            controller.touchkeyDeviceSetFramePipelineEnabled(framePipeline);
+            if(simulateDevice) {
+                simulator.setVerboseLevel(1);
+                if(!simulatorLogPath.empty() && !simulator.loadKeyTouchLog(simulatorLogPath)) {
+                    std::cout << "Unable to load key touch log " << simulatorLogPath << '\n';
+                    throw new exception;
+                }
+                if(!simulator.start()) {
+                    std::cout << "Unable to start TouchKeys simulator\n";
+                    throw new exception;
+                }
+                touchkeysDevicePath = simulator.devicePath();
+                autostartTouchkeys = true;
+                
+                // Without a MIDI keyboard, the simulated touches play the notes themselves
+                if(!autoopenMidiIn) {
+                    for(int i = 0; i < controller.midiSegmentsCount(); i++)
+                        controller.midiSegment(i)->enableTouchkeyStandaloneMode();
+                }
+                controller.midiOutputSetMessageMonitor(boost::bind(&simulator_midi_monitor, &simulator,
+                                                                   &simulatorMidiLatency, _1, _2));
+            }
             if(autostartTouchkeys) {
                 std::cout << "Starting the TouchKeys on " << touchkeysDevicePath << " ... ";
                 if(!controller.touchkeyDeviceStartupSequence(touchkeysDevicePath.c_str())) {
@@ -273,6 +452,14 @@ int main (int argc, char* argv[])
         // Stop TouchKeys if still running
         if(controller.touchkeyDeviceIsRunning())
             controller.stopTouchkeyDevice();
+        simulator.stop();
+        if(simulateDevice) {
+            controller.midiOutputSetMessageMonitor(MidiOutputController::MessageMonitor());
+            simulatorMidiLatency.print(std::cout, "Simulated touch to MIDI note latency");
+        }
+        
+        if(mappingWorkers > 1)
+            controller.mappingSchedulerPrintStatistics();
     }
     
     // Clean up any MessageManager instance that JUCE creates
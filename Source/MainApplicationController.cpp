@@ -25,6 +25,8 @@
 */
 
 #include "MainApplicationController.h"
+#include "Mappings/MappingScheduler.h"
+#include "Utility/RealTimeProfile.h"
 #ifndef TOUCHKEYS_NO_GUI
 #include "Display/KeyboardTesterDisplay.h"
 #endif
@@ -191,6 +193,10 @@ bool MainApplicationController::touchkeyDeviceStartupSequence(const char * path)
     
     // Step 4: suppress stray touches if enabled
     touchkeyController_.setSuppressStrayTouches(getPrefsSuppressStrayTouches());
+    
+    // Step 4a: send any key parameters from the preset
+    if(!applyTouchkeyKeySettings())
+        std::cout << "Warning: not all key settings were acknowledged by the device\n";
         
     // Step 5: start data collection from the device
     if(!startTouchkeyDevice()) {
@@ -393,6 +399,31 @@ void MainApplicationController::touchkeyDeviceSetLowestMidiNote(int note) {
     applicationProperties_.getUserSettings()->setValue("TouchKeysLowestMIDINote", note);
 }
 
+// Set how the TouchKeys I/O thread waits for data. Takes effect when the device next starts.
+void MainApplicationController::touchkeyDeviceSetIngestMode(int mode) {
+    touchkeyController_.setIngestMode(mode);
+}
+
+void MainApplicationController::touchkeyDeviceSetFramePipelineEnabled(bool enable) {
+    touchkeyController_.setFramePipelineEnabled(enable);
+}
+
+// Set how many threads perform mappings
+void MainApplicationController::mappingSchedulerSetWorkers(int workers) {
+    keyboardController_.mappingScheduler().setNumberOfWorkers(workers);
+}
+
+// Print the fraction of time each mapping thread has spent busy
+void MainApplicationController::mappingSchedulerPrintStatistics() {
+    MappingScheduler& scheduler = keyboardController_.mappingScheduler();
+    
+    for(int i = 0; i < scheduler.numberOfWorkers(); i++) {
+        std::cout << "Mapping worker " << i << ": " << 100.0 * scheduler.workerUtilization(i) << "% busy, "
+                  << scheduler.workerActionsPerformed(i) << " actions, "
+                  << scheduler.workerShardsStolen(i) << " shards stolen\n";
+    }
+}
+
 // Start an autodetection routine to match touch data to MIDI
 void MainApplicationController::touchkeyDeviceAutodetectLowestMidiNote() {
     if(touchkeyAutodetecting_)
@@ -431,8 +462,8 @@ void MainApplicationController::startLogging() {
     std::string analogLogFileName = "keyAngleLog_" + fileId + ".bin";
     
     // Create log files with these names
-    midiInputController_.createLogFile(midiLogFileName, loggingDirectory_);
-    touchkeyController_.createLogFiles(keyTouchLogFileName, analogLogFileName, loggingDirectory_);
+    midiInputController_.createLogFile(logRecorder_, midiLogFileName, loggingDirectory_);
+    touchkeyController_.createLogFiles(logRecorder_, keyTouchLogFileName, analogLogFileName, loggingDirectory_);
     
     // Enable logging from each controller
     midiInputController_.startLogging();
@@ -453,6 +484,7 @@ void MainApplicationController::stopLogging() {
     // close the log files
     midiInputController_.closeLogFile();
     touchkeyController_.closeLogFile();
+    logRecorder_.closeAllStreams();
     
     loggingActive_ = false;
 }
@@ -516,6 +548,41 @@ void MainApplicationController::stopPlayingLog() {
     isPlayingLog_ = false;
 }
 
+// Replay logs in virtual time, writing the output to a file. Returns true on success.
+bool MainApplicationController::replayLogFiles(std::string const& touchPath, std::string const& midiPath,
+                                               std::string const& analogPath, std::string const& calibrationPath,
+                                               std::string const& outputPath) {
+    if(isPlayingLog_)
+        return false;
+    
+    LogReplay replay(keyboardController_, touchkeyController_, midiInputController_, midiOutputController_, oscTransmitter_);
+    if(!replay.openLogFiles(touchPath, midiPath, analogPath))
+        return false;
+    
+    // Key positions mean nothing without the calibration they were recorded with
+    if(analogPath != "" && !replay.loadAnalogCalibration(calibrationPath)) {
+        std::cout << "Unable to load calibration \"" << calibrationPath << "\" for the analog log\n";
+        return false;
+    }
+    
+    // Output is recorded rather than sent while replaying
+    bool oscWasEnabled = oscTransmitter_.enabled();
+    oscTransmitter_.setEnabled(false);
+    bool result = replay.run(outputPath);
+    oscTransmitter_.setEnabled(oscWasEnabled);
+    midiInputController_.allNotesOff();
+    
+    if(result) {
+        std::cout << "Replayed " << replay.touchFramesReplayed() << " touch frames, "
+                  << replay.analogFramesReplayed() << " analog frames and "
+                  << replay.midiEventsReplayed() << " MIDI events (" << replay.virtualDurationMilliseconds() / 1000.0
+                  << " s) in " << replay.wallDurationMilliseconds() / 1000.0 << " s: "
+                  << replay.midiMessagesOutput() << " MIDI and " << replay.oscMessagesOutput() << " OSC messages out\n";
+    }
+    
+    return result;
+}
+
 // Add a new MIDI keyboard segment. This method also handles numbering of the segments
 MidiKeyboardSegment* MainApplicationController::midiSegmentAdd() {
     // For now, the segment counter increments with each new segment. Eventually, we could
@@ -912,6 +979,12 @@ bool MainApplicationController::loadPresetHelper( juce::File const& inputFile) {
     // Load the preset from this element
     bool result = midiInputController_.loadSegmentPreset(segmentsElement);
     
+    // Key parameters are optional; send them now if the device is already running,
+    // otherwise they are sent when it next starts
+    loadTouchkeyKeySettings(mainElement->getChildByName("TouchkeyKeySettings"));
+    if(touchkeyController_.isOpen() && !applyTouchkeyKeySettings())
+        result = false;
+    
     // Enable any necessary MIDI outputs
     for(int i = 0; i < midiInputController_.numSegments(); i++)
         loadMIDIOutputFromApplicationPreferences(i);
@@ -931,6 +1004,8 @@ bool MainApplicationController::savePresetHelper( juce::File& outputFile) {
     
     juce::XmlElement* segmentsElement = midiInputController_.getSegmentPreset();
     mainElement.addChildElement(segmentsElement);
+    if(!touchkeyKeySettings_.empty())
+        mainElement.addChildElement(getTouchkeyKeySettingsPreset());
     
     bool result = mainElement.writeTo(outputFile);
     
@@ -946,11 +1021,67 @@ void MainApplicationController::clearPreset() {
     midiInputController_.removeAllSegments();
     //midiOutputController_.disableAllPorts();
     segmentCounter_ = 0;
+    touchkeyKeySettings_.clear();
     
     // Re-add a new segment, starting at 0
     midiSegmentAdd();
 }
 
+// Read the per-key device parameters from a preset. Each Key element applies to one key,
+// or to a group of keys when octave or key is missing; missing values are left unchanged.
+void MainApplicationController::loadTouchkeyKeySettings(juce::XmlElement const* settingsElement) {
+    touchkeyKeySettings_.clear();
+    if(settingsElement == nullptr)
+        return;
+    
+    juce::XmlElement *element = settingsElement->getChildByName("Key");
+    while(element != nullptr) {
+        TouchkeyDevice::KeySettings settings;
+        
+        settings.octave = element->getIntAttribute("octave", -1);
+        settings.key = element->getIntAttribute("key", -1);
+        settings.sensitivity = element->getIntAttribute("sensitivity", -1);
+        settings.centroidScaler = element->getIntAttribute("centroidScaler", -1);
+        settings.minimumCentroidSize = element->getIntAttribute("minimumCentroidSize", -1);
+        settings.noiseThreshold = element->getIntAttribute("noiseThreshold", -1);
+        touchkeyKeySettings_.push_back(settings);
+        
+        element = element->getNextElementWithTagName("Key");
+    }
+}
+
+// Write the per-key device parameters back out in the same form
+juce::XmlElement* MainApplicationController::getTouchkeyKeySettingsPreset() {
+    juce::XmlElement* settingsElement = new juce::XmlElement("TouchkeyKeySettings");
+    
+    for(auto it = touchkeyKeySettings_.begin(); it != touchkeyKeySettings_.end(); ++it) {
+        juce::XmlElement* element = new juce::XmlElement("Key");
+        
+        if(it->octave >= 0)
+            element->setAttribute("octave", it->octave);
+        if(it->key >= 0)
+            element->setAttribute("key", it->key);
+        if(it->sensitivity >= 0)
+            element->setAttribute("sensitivity", it->sensitivity);
+        if(it->centroidScaler >= 0)
+            element->setAttribute("centroidScaler", it->centroidScaler);
+        if(it->minimumCentroidSize >= 0)
+            element->setAttribute("minimumCentroidSize", it->minimumCentroidSize);
+        if(it->noiseThreshold >= 0)
+            element->setAttribute("noiseThreshold", it->noiseThreshold);
+        settingsElement->addChildElement(element);
+    }
+    
+    return settingsElement;
+}
+
+// Send the key parameters to the device as one batch. Returns true if they were all acknowledged.
+bool MainApplicationController::applyTouchkeyKeySettings() {
+    if(touchkeyKeySettings_.empty())
+        return true;
+    return touchkeyController_.configureKeys(touchkeyKeySettings_);
+}
+
 // Whether to automatically start the TouchKeys on startup
 bool MainApplicationController::getPrefsAutoStartTouchKeys() {
     if(!applicationProperties_.getUserSettings()->containsKey("StartupStartTouchKeys"))
@@ -1030,6 +1161,39 @@ void MainApplicationController::setPrefsSuppressStrayTouches(int level) {
     touchkeyController_.setSuppressStrayTouches(level);
 }
 
+bool MainApplicationController::getPrefsRealTimeProfile() {
+    if(!applicationProperties_.getUserSettings()->containsKey("RealTimeProfileEnabled"))
+        return false;
+    return applicationProperties_.getUserSettings()->getBoolValue("RealTimeProfileEnabled");
+}
+void MainApplicationController::setPrefsRealTimeProfile(bool enable) {
+    applicationProperties_.getUserSettings()->setValue("RealTimeProfileEnabled", enable);
+    
+    // Running threads pick up the change on their next pass, or next start
+    RealTimeProfile::setEnabled(enable);
+}
+
+juce::String MainApplicationController::getPrefsRealTimeCores() {
+    if(!applicationProperties_.getUserSettings()->containsKey("RealTimeProfileCores"))
+        return "";
+    return applicationProperties_.getUserSettings()->getValue("RealTimeProfileCores");
+}
+void MainApplicationController::setPrefsRealTimeCores(juce::String const& cores) {
+    if(!RealTimeProfile::setCoresFromString(cores))
+        return;
+    applicationProperties_.getUserSettings()->setValue("RealTimeProfileCores", cores);
+}
+
+bool MainApplicationController::getPrefsRealTimeLockMemory() {
+    if(!applicationProperties_.getUserSettings()->containsKey("RealTimeProfileLockMemory"))
+        return true;
+    return applicationProperties_.getUserSettings()->getBoolValue("RealTimeProfileLockMemory");
+}
+void MainApplicationController::setPrefsRealTimeLockMemory(bool lock) {
+    applicationProperties_.getUserSettings()->setValue("RealTimeProfileLockMemory", lock);
+    RealTimeProfile::setLockMemory(lock);
+}
+
 // Reset application preferences to defaults
 void MainApplicationController::resetPreferences() {
     // TODO: reset settings now, not after restart
@@ -1038,6 +1202,7 @@ void MainApplicationController::resetPreferences() {
     setPrefsStartupPresetVibratoPitchBend();
     setPrefsAutodetectOctave(true);
     setPrefsSuppressStrayTouches(0);
+    setPrefsRealTimeProfile(false);
 }
 
 // Load the current devices from a global preferences file
@@ -1062,6 +1227,12 @@ void MainApplicationController::loadApplicationPreferences(){
             touchkeyDeviceSetLowestMidiNote(note);
     }
     
+    // Real-time profile: cores and memory locking first, so enabling uses them
+    RealTimeProfile::setCoresFromString(getPrefsRealTimeCores());
+    RealTimeProfile::setLockMemory(getPrefsRealTimeLockMemory());
+    if(getPrefsRealTimeProfile())
+        RealTimeProfile::setEnabled(true);
+    
     // Load MIDI input settings
     if(props->containsKey("MIDIInputPrimary")) {
         juce::String deviceName = props->getValue("MIDIInputPrimary");
@@ -33,6 +33,7 @@
 #include "TouchKeys/TouchkeyDevice.h"
 #include "TouchKeys/TouchkeyOscEmulator.h"
 #include "TouchKeys/LogPlayback.h"
+#include "TouchKeys/LogReplay.h"
 #include "Mappings/Vibrato/TouchkeyVibratoMappingFactory.h"
 #include "Mappings/PitchBend/TouchkeyPitchBendMappingFactory.h"
 #include "Mappings/Control/TouchkeyControlMappingFactory.h"
@@ -125,6 +126,19 @@ public:
     // Set the lowest MIDI note for the TouchKeys
     void touchkeyDeviceSetLowestMidiNote(int note);
     
+    // Set how the TouchKeys I/O thread waits for data (polling or event-driven)
+    void touchkeyDeviceSetIngestMode(int mode);
+    
+    // Set whether TouchKeys frames are processed on a separate thread from device input
+    void touchkeyDeviceSetFramePipelineEnabled(bool enable);
+    
+    // Set how many threads perform mappings (1 by default). Mappings are sharded
+    // among them by note; change this before input starts arriving.
+    void mappingSchedulerSetWorkers(int workers);
+    
+    // Print the fraction of time each mapping thread has spent busy
+    void mappingSchedulerPrintStatistics();
+    
     // Attempt to autodetect the correct TouchKey octave from MIDI data
     void touchkeyDeviceAutodetectLowestMidiNote();
     void touchkeyDeviceStopAutodetecting();
@@ -184,6 +198,11 @@ public:
         return midiOutputController_.enabledPort(identifier);
     }
     
+    // Observe outgoing MIDI messages; pass an empty function to stop
+    void midiOutputSetMessageMonitor(MidiOutputController::MessageMonitor const& monitor) {
+        midiOutputController_.setMessageMonitor(monitor);
+    }
+    
     void midiTouchkeysStandaloneModeEnable();
     void midiTouchkeysStandaloneModeDisable();
     bool midiTouchkeysStandaloneModeIsEnabled() { return touchkeyStandaloneModeEnabled_; }
@@ -262,6 +281,13 @@ public:
     void stopPlayingLog();
     bool isPlayingLog() { return isPlayingLog_; }
     
+    // Replay logs in virtual time as fast as possible, writing the resulting
+    // MIDI and OSC output to a file. Any log path may be blank; an analog log
+    // needs the calibration it was recorded with.
+    bool replayLogFiles(std::string const& touchPath, std::string const& midiPath,
+                        std::string const& analogPath, std::string const& calibrationPath,
+                        std::string const& outputPath);
+    
     // *** OSC handler method (different from OSC device selection) ***
     
 	bool oscHandlerMethod(const char *path, const char *types, int numValues, lo_arg **values, void *data);
@@ -313,6 +339,18 @@ public:
     int getPrefsSuppressStrayTouches();
     void setPrefsSuppressStrayTouches(int level);
     
+    // Real-time scheduling of the device, scheduler, mapping and OSC threads (see RealTimeProfile)
+    bool getPrefsRealTimeProfile();
+    void setPrefsRealTimeProfile(bool enable);
+    
+    // Cores to pin each thread role to, comma-separated in RealTimeThreadRole order
+    juce::String getPrefsRealTimeCores();
+    void setPrefsRealTimeCores(juce::String const& cores);
+    
+    // Whether the real-time profile also locks the application into memory
+    bool getPrefsRealTimeLockMemory();
+    void setPrefsRealTimeLockMemory(bool lock);
+    
     // Reset all preferences
     void resetPreferences();
     
@@ -352,10 +390,16 @@ public:
 private:
     bool savePresetHelper( juce::File& outputFile);
     bool loadPresetHelper( juce::File const& inputFile);
+    void loadTouchkeyKeySettings(juce::XmlElement const* settingsElement);
+    juce::XmlElement* getTouchkeyKeySettingsPreset();
+    bool applyTouchkeyKeySettings();
     
     // Application properties: for managing preferences
     juce::ApplicationProperties applicationProperties_;
     
+    // Writes the log files; declared before the objects which log so it is destroyed after them
+    LogRecorder logRecorder_;
+    
     // TouchKeys objects
     MainApplicationOSCController *mainOscController_;
     PianoKeyboard keyboardController_;
@@ -364,6 +408,8 @@ private:
     OscTransmitter oscTransmitter_;
     OscReceiver oscReceiver_;
     TouchkeyDevice touchkeyController_;
+    std::vector<TouchkeyDevice::KeySettings> touchkeyKeySettings_;  // Key parameters from the preset, sent
+                                                                    // to the device when it starts
     TouchkeyOscEmulator touchkeyEmulator_;
     LogPlayback *logPlayback_;
 #ifdef TOUCHKEY_ENTROPY_GENERATOR_ENABLE
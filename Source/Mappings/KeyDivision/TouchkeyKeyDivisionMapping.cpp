@@ -73,9 +73,8 @@ void TouchkeyKeyDivisionMapping::triggerReceived(TriggerSource* who, timestamp_t
         // yet. We should come up with a candidate segment. If the MIDI note is on, activate this
         // segment right away. Otherwise, save it for later so when the MIDI note begins, we have
         // it ready to go.
-        if(!touchBuffer_->empty()) {
-            const KeyTouchFrame& frame = touchBuffer_->latest();
-            
+        KeyTouchFrame frame;
+        if(touchBuffer_->snapshotLatest(frame)) {
             if(detectedSegment_ < 0) {
                 int candidateBasedOnYPosition = -1, candidateBasedOnNumberOfTouches = -1;
                 
@@ -122,17 +122,17 @@ timestamp_type MIDIKeyPositionMapping::performMapping() {
     timestamp_type currentTimestamp = keyboard_.schedulerCurrentTimestamp();
 
     // Calculate the output features as a function of input sensor data
+    key_position latestPosition;
     if(positionBuffer_ == nullptr) {
         // No buffer -> all 0
     }
-    else if(positionBuffer_->empty()) {
+    else if(!positionBuffer_->snapshotLatest(latestPosition)) {
         // No samples -> all 0
     }
     else if(noteIsOn_) {
         // Generate aftertouch messages based on key position, if the note is on and
         // if the position exceeds the aftertouch threshold. Note on and note off are
         // handled directly by the trigger thread.
-        key_position latestPosition = positionBuffer_->latest();
         int aftertouchValue;
         
         if(latestPosition < kMinimumAftertouchPosition)
@@ -149,15 +149,15 @@ timestamp_type MRPMapping::performMapping() {
     float harmonic = 0;
 
     // Calculate the output features as a function of input sensor data
+    key_position latestPosition;
     if(positionBuffer_ == nullptr) {
         // No buffer -> all 0
     }
-    else if(positionBuffer_->empty()) {
+    else if(!positionBuffer_->snapshotLatest(latestPosition)) {
         // No samples -> all 0
     }
     else {
         // TODO: IIR filter on the position data before mapping it
-        key_position latestPosition = positionBuffer_->latest();
         int trackerState = kPositionTrackerStateUnknown;
         if(positionTracker_ != nullptr)
             trackerState = positionTracker_->currentState();
@@ -336,12 +336,12 @@ timestamp_type MRPMapping::performMapping() {
                         }
                         
                         // This is the case where the other note is controlling our pitch
-                        if(bend.positionBuffer->empty()) {
+                        key_position latestBenderPosition;
+                        if(!bend.positionBuffer->snapshotLatest(latestBenderPosition)) {
                             continue;
                         }
                         
                         float noteDifference = (float)(bend.note - noteNumber_);
-                        key_position latestBenderPosition = bend.positionBuffer->latest();
                         
                         // Key position at 0 = 0 pitch bend; key position at max = most pitch bend
                         float bendAmount = key_position_to_float(latestBenderPosition - kPianoKeyDefaultIdlePositionThreshold*2) /
@@ -488,39 +488,49 @@ timestamp_type MRPMapping::performMapping() {
 // efficient to run that many triggers all the time. Instead, it's brought up to
 // date on an as-needed basis during performMapping().
 key_velocity MRPMapping::updateVelocityMeasurements() {
-    positionBuffer_->lock_mutex();
+    key_position positions[kMRPMappingVelocitySnapshotLength];
+    timestamp_type timestamps[kMRPMappingVelocitySnapshotLength];
     
     // Need at least 2 samples to calculate velocity (first difference)
-    if(positionBuffer_->size() < 2) {
-        positionBuffer_->unlock_mutex();
+    if(positionBuffer_->snapshotLatest(2, nullptr, nullptr) < 2)
         return missing_value<key_velocity>::missing();
-    }
-    
-    if(lastCalculatedVelocityIndex_ < positionBuffer_->beginIndex() + 1) {
-        // Fell off the beginning of the position buffer. Reset calculations.
-        filteredVelocity_.clear();
-        rawVelocity_.clear();
-        lastCalculatedVelocityIndex_ = positionBuffer_->beginIndex() + 1;
-    }
     
-    while(lastCalculatedVelocityIndex_ < positionBuffer_->endIndex()) {
-        // Calculate the velocity and add to buffer
-        key_position diffPosition = (*positionBuffer_)[lastCalculatedVelocityIndex_] - (*positionBuffer_)[lastCalculatedVelocityIndex_ - 1];
-        timestamp_diff_type diffTimestamp = positionBuffer_->timestampAt(lastCalculatedVelocityIndex_) - positionBuffer_->timestampAt(lastCalculatedVelocityIndex_ - 1);
-        key_velocity vel;
+    // Copy out the new samples in batches, along with the one before them for the first
+    // difference. The position buffer is written from another thread and isn't locked.
+    while(true) {
+        Node<key_position>::size_type first = (lastCalculatedVelocityIndex_ > 0 ? lastCalculatedVelocityIndex_ - 1 : 0);
+        Node<key_position>::size_type count = positionBuffer_->snapshot(first, kMRPMappingVelocitySnapshotLength,
+                                                                          positions, timestamps);
+        if(count < 2)
+            break;
+        
+        if(first + 1 != lastCalculatedVelocityIndex_) {
+            // Fell off the beginning of the position buffer. Reset calculations.
+            filteredVelocity_.clear();
+            rawVelocity_.clear();
+            lastCalculatedVelocityIndex_ = first + 1;
+        }
         
-        if(diffTimestamp != 0)
-            vel = calculate_key_velocity(diffPosition, diffTimestamp);
-        else
-            vel = 0; // Bad measurement: replace with 0 so as not to mess up IIR calculations
+        for(Node<key_position>::size_type i = 1; i < count; i++) {
+            // Calculate the velocity and add to buffer
+            key_position diffPosition = positions[i] - positions[i - 1];
+            timestamp_diff_type diffTimestamp = timestamps[i] - timestamps[i - 1];
+            key_velocity vel;
+            
+            if(diffTimestamp != 0)
+                vel = calculate_key_velocity(diffPosition, diffTimestamp);
+            else
+                vel = 0; // Bad measurement: replace with 0 so as not to mess up IIR calculations
+            
+            // Add the raw velocity to the buffer
+            rawVelocity_.insert(vel, timestamps[i]);
+            lastCalculatedVelocityIndex_++;
+        }
         
-        // Add the raw velocity to the buffer
-        rawVelocity_.insert(vel, positionBuffer_->timestampAt(lastCalculatedVelocityIndex_));
-        lastCalculatedVelocityIndex_++;
+        if(count < kMRPMappingVelocitySnapshotLength)
+            break;
     }
     
-    positionBuffer_->unlock_mutex();
-    
     // Bring the filtered velocity up to date
     key_velocity filteredVel = filteredVelocity_.calculate();
     //std::cout << "Key " << noteNumber_ << " velocity " << filteredVel << std::endl;
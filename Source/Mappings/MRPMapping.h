@@ -29,6 +29,7 @@
 // How many velocity samples to save in the buffer. Make sure this is
 // enough to cover the frequency of updates.
 const int kMRPMappingVelocityBufferLength = 30;
+const int kMRPMappingVelocitySnapshotLength = 32;    // Position samples copied at a time for velocity
 
 // This class handles the mapping from key position and, optionally,
 // touch information to OSC messages which control the magnetic resonator
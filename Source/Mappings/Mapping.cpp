@@ -38,7 +38,8 @@ Mapping::Mapping(PianoKeyboard &keyboard, MappingFactory *factory, int noteNumbe
 : keyboard_(keyboard), factory_(factory), noteNumber_(noteNumber), touchBuffer_(touchBuffer),
 positionBuffer_(positionBuffer), positionTracker_(positionTracker), engaged_(false),
 suspended_(false), updateInterval_(kDefaultUpdateInterval),
-nextScheduledTimestamp_(0)
+nextScheduledTimestamp_(0), schedulerCounter_(0), schedulerRegistered_(false),
+schedulerStatistics_(factory != nullptr ? factory->schedulerStatistics() : nullptr)
 {
     // Create a statically bound call to the performMapping() method that
     // we use each time we schedule a new mapping
@@ -49,7 +50,8 @@ nextScheduledTimestamp_(0)
 Mapping::Mapping(Mapping const& obj) : keyboard_(obj.keyboard_), factory_(obj.factory_), noteNumber_(obj.noteNumber_),
 touchBuffer_(obj.touchBuffer_), positionBuffer_(obj.positionBuffer_), positionTracker_(obj.positionTracker_),
 engaged_(obj.engaged_), updateInterval_(obj.updateInterval_),
-nextScheduledTimestamp_(obj.nextScheduledTimestamp_)
+nextScheduledTimestamp_(obj.nextScheduledTimestamp_), schedulerCounter_(0), schedulerRegistered_(false),
+schedulerStatistics_(obj.schedulerStatistics_)
 {
     // Create a statically bound call to the performMapping() method that
     // we use each time we schedule a new mapping
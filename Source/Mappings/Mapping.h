@@ -35,6 +35,7 @@
 #define NEW_MAPPING_SCHEDULER
 
 class MappingFactory;
+struct MappingTypeStatistics;
 
 // This virtual base class defines a mapping from keyboard data to OSC or
 // other output information. Specific behavior is implemented by subclasses.
@@ -122,4 +123,13 @@ protected:
     timestamp_diff_type updateInterval_;        // How long between mapping calls
     timestamp_type nextScheduledTimestamp_;     // When we've asked for the next callback
     Scheduler::action mappingAction_;           // Action function which calls performMapping()
+    
+private:
+    // Bookkeeping owned by the MappingScheduler thread. Keeping it in the mapping
+    // saves a map lookup on every action.
+    friend class MappingScheduler;
+    
+    unsigned long schedulerCounter_;            // Counter of the last action performed on this mapping
+    bool schedulerRegistered_;                  // Whether the scheduler will perform actions for it
+    MappingTypeStatistics *schedulerStatistics_; // Where to record timing for this type of mapping
 };
@@ -46,7 +46,7 @@ public:
     // ***** Constructor *****
     
 	// Default constructor, containing a reference to the PianoKeyboard class.
-    MappingFactory(PianoKeyboard &keyboard) : keyboard_(keyboard) {}
+    MappingFactory(PianoKeyboard &keyboard) : keyboard_(keyboard), schedulerStatistics_(nullptr) {}
 	
     // ***** Destructor *****
     
@@ -62,6 +62,11 @@ public:
     virtual std::string const getShortName() { return ""; }
     virtual void setName(const std::string& name) {}
     
+    // Where the scheduler records timing for this type of mapping. Looked up when the
+    // factory is added to a segment, so the scheduler threads never search for it.
+    MappingTypeStatistics *schedulerStatistics() { return schedulerStatistics_; }
+    void setSchedulerStatistics(MappingTypeStatistics *statistics) { schedulerStatistics_ = statistics; }
+    
     virtual Mapping* mapping(int noteNumber) = 0;      // Look up a mapping with the given note number
     virtual std::vector<int> activeMappings() = 0;     // Return a list of all active notes
     
@@ -156,5 +161,7 @@ protected:
     PianoKeyboard& keyboard_;                   // Reference to the main keyboard controller
     
 private:
+    MappingTypeStatistics *schedulerStatistics_; // Shared by every mapping this factory creates
+    
     //JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MappingFactory)
 };
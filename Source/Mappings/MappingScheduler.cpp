@@ -28,125 +28,180 @@
 */
 
 #include "MappingScheduler.h"
+#include "MappingFactory.h"
+#include <algorithm>
 
 #undef DEBUG_MAPPING_SCHEDULER
 
 
 // Constructor
 MappingScheduler::MappingScheduler(PianoKeyboard& keyboard, juce::String threadName)
-: juce::Thread(threadName), keyboard_(keyboard),
-  waitableEvent_(true), isRunning_(false), counter_(0)
-#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
-  ,lastDebugStatisticsTimestamp_(0)
-#endif
+: keyboard_(keyboard), threadName_(threadName), isRunning_(false), virtualTimeEnabled_(false), counter_(0)
 {
+    createWorkers(1);
+    
+    statisticsEvent_ = keyboard_.scheduleEvent(this, boost::bind(&MappingScheduler::publishStatistics, this),
+                                               keyboard_.schedulerCurrentTimestamp() +
+                                               milliseconds_to_timestamp(kMappingStatisticsIntervalMilliseconds));
 }
 
 // Destructor
 MappingScheduler::~MappingScheduler() {
-    // Stop the thread
+    // Stop the threads and the statistics
+    keyboard_.unscheduleEvent(statisticsEvent_);
     stop();
     
     // Now go through and delete any mappings awaiting deletion
-    // so these objects don't leak
+    // so these objects don't leak. The later actions only ever
+    // perform mappings, so nothing there needs deleting.
     MappingAction nextAction;
     
-    //while(actionsNow_.Consume(nextAction)) {
-    while(actionsNow_.pop(nextAction)) {
-        if(nextAction.who != nullptr && nextAction.action == kActionUnregisterAndDelete) {
+    for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+        while((*it)->actionsNow.pop(nextAction)) {
+            if(nextAction.who != nullptr && nextAction.action == kActionUnregisterAndDelete) {
 #ifdef DEBUG_MAPPING_SCHEDULER
-            std::cout << "~MappingScheduler(): Deleting mapping " << who << " (actionsNow)\n";
+                std::cout << "~MappingScheduler(): Deleting mapping " << nextAction.who << " (actionsNow)\n";
 #endif
-            delete nextAction.who;
+                delete nextAction.who;
+            }
         }
     }
     
-    while(!actionsLater_.empty()) {
-        nextAction = actionsLater_.begin()->second;
-        
-        if(nextAction.who != nullptr && nextAction.action == kActionUnregisterAndDelete) {
-#ifdef DEBUG_MAPPING_SCHEDULER
-            std::cout << "~MappingScheduler(): Deleting mapping " << who << " (actionsLater)\n";
-#endif
-            delete nextAction.who;
-        }
-        actionsLater_.erase(actionsLater_.begin());
-    }
+    deleteWorkers();
 }
 
-// Start the thread handling the scheduling.
+// Start the threads handling the scheduling.
 void MappingScheduler::start() {
 	if(isRunning_)
 		return;
-    startThread();
+    
+    double now = juce::Time::getMillisecondCounterHiRes();
+    for(std::vector<Worker*>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+        (*it)->startMilliseconds = now;
+        (*it)->busyMilliseconds = 0;
+        (*it)->actionsPerformed = 0;
+        (*it)->shardsStolen = 0;
+        (*it)->startThread();
+    }
+    isRunning_ = true;
 }
 
-// Stop the scheduler thread if it is currently running.
+// Stop the scheduler threads if they are currently running.
 void MappingScheduler::stop() {
 	if(!isRunning_)
 		return;
     
-    // Tell the thread to quit and signal the event it waits on
-    signalThreadShouldExit();
-    waitableEvent_.signal();
-    stopThread(-1);
+    // Tell the threads to quit and signal the events they wait on
+    for(std::vector<Worker*>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+        (*it)->signalThreadShouldExit();
+        (*it)->waitableEvent.signal();
+    }
+    for(std::vector<Worker*>::iterator it = workers_.begin(); it != workers_.end(); ++it)
+        (*it)->stopThread(-1);
     
 	isRunning_ = false;
 }
 
-// Register a mapping to be called by the scheduler
-void MappingScheduler::registerMapping(Mapping *who) {
-    // Lock the mutex for insertions to ensure that only a single
-    // thread can act as producer at any given time.
-    juce::ScopedLock sl(actionsInsertionMutex_);
+// Change the number of worker threads, moving any pending actions to the new shards
+void MappingScheduler::setNumberOfWorkers(int workers) {
+    if(workers < 1)
+        workers = 1;
+    if(workers > kMappingSchedulerMaxWorkers)
+        workers = kMappingSchedulerMaxWorkers;
+    if(workers == (int)workers_.size())
+        return;
     
-    actionsNow_.push(MappingAction(who, counter_, kActionRegister));
+    bool wasRunning = isRunning_;
+    stop();
     
-    // Increment the counter so each insertion gets a unique label
-    counter_++;
+    // Collect what is pending. All the actions for one mapping are in the same
+    // shard, so their order is kept.
+    std::vector<MappingAction> actionsNow, actionsLater;
+    MappingAction nextAction;
     
-    // Wake up the consumer thread
-    waitableEvent_.signal();
-}
-
-// Schedule a mapping action to happen as soon as possible
-void MappingScheduler::scheduleNow(Mapping *who) {
-    // Lock the mutex for insertions to ensure that only a single
-    // thread can act as producer at any given time.
-    juce::ScopedLock sl(actionsInsertionMutex_);
+    for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+        while((*it)->actionsNow.pop(nextAction))
+            actionsNow.push_back(nextAction);
+        actionsLater.insert(actionsLater.end(), (*it)->actionsLater.begin(), (*it)->actionsLater.end());
+    }
     
-    actionsNow_.push(MappingAction(who, counter_, kActionPerformMapping));
+    deleteWorkers();
+    createWorkers(workers);
     
-    // Increment the counter so each insertion gets a unique label
-    counter_++;
+    for(std::vector<MappingAction>::iterator it = actionsNow.begin(); it != actionsNow.end(); ++it)
+        shardFor(it->who).actionsNow.push(*it);
+    for(std::vector<MappingAction>::iterator it = actionsLater.begin(); it != actionsLater.end(); ++it)
+        insertLaterAction(shardFor(it->who), *it);
     
-    // Wake up the consumer thread
-    waitableEvent_.signal();
+    if(wasRunning && !virtualTimeEnabled_)
+        start();
+}
+
+// Fraction of the time since starting that a worker spent performing actions
+double MappingScheduler::workerUtilization(int worker) {
+    if(worker < 0 || worker >= (int)workers_.size())
+        return 0;
+    double elapsed = juce::Time::getMillisecondCounterHiRes() - workers_[worker]->startMilliseconds;
+    if(!isRunning_ || elapsed <= 0)
+        return 0;
+    return workers_[worker]->busyMilliseconds / elapsed;
+}
+
+unsigned long MappingScheduler::workerActionsPerformed(int worker) {
+    if(worker < 0 || worker >= (int)workers_.size())
+        return 0;
+    return workers_[worker]->actionsPerformed;
+}
+
+unsigned long MappingScheduler::workerShardsStolen(int worker) {
+    if(worker < 0 || worker >= (int)workers_.size())
+        return 0;
+    return workers_[worker]->shardsStolen;
+}
+
+// Create the worker threads and their shards. A single worker has a single
+// shard, so every action happens in the order it was scheduled.
+void MappingScheduler::createWorkers(int workers) {
+    for(int i = 0; i < workers; i++) {
+        juce::String name = (workers == 1 ? threadName_ : threadName_ + " " + juce::String(i));
+        workers_.push_back(new Worker(*this, i, name));
+    }
+    
+    int shards = (workers == 1 ? 1 : workers * kMappingSchedulerShardsPerWorker);
+    for(int i = 0; i < shards; i++)
+        shards_.push_back(new Shard(i % workers));
+}
+
+void MappingScheduler::deleteWorkers() {
+    for(std::vector<Worker*>::iterator it = workers_.begin(); it != workers_.end(); ++it)
+        delete *it;
+    for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it)
+        delete *it;
+    workers_.clear();
+    shards_.clear();
+}
+
+// Register a mapping to be called by the scheduler
+void MappingScheduler::registerMapping(Mapping *who) {
+    enqueueAction(who, kActionRegister);
+}
+
+// Schedule a mapping action to happen as soon as possible. The time is
+// recorded so the lateness can be measured.
+void MappingScheduler::scheduleNow(Mapping *who) {
+    enqueueAction(who, kActionPerformMapping, keyboard_.schedulerCurrentTimestamp());
 }
 
 // Schedule a mapping action to happen in the future at a specified timestamp
 void MappingScheduler::scheduleLater(Mapping *who, timestamp_type timestamp) {
-    juce::ScopedLock sl(actionsLaterMutex_);
-    juce::ScopedLock sl2(actionsInsertionMutex_);
-    
-    bool newActionWillComeFirst = false;
-    if(actionsLater_.empty())
-        newActionWillComeFirst = true;
-    else if(timestamp < actionsLater_.begin()->first)
-        newActionWillComeFirst = true;
-    
-    actionsLater_.insert(std::pair<timestamp_type, MappingAction>(timestamp,
-                                                                  MappingAction(who,
-                                                                                counter_,
-                                                                                kActionPerformMapping)));
-    
-    // Increment the counter so each insertion gets a unique label
-    counter_++;
+    // In virtual time, the caller is the thread which performs the actions
+    if(virtualTimeEnabled_) {
+        insertLaterAction(shardFor(who), MappingAction(who, counter_++, kActionPerformMapping, timestamp));
+        return;
+    }
     
-    // Wake up the consumer thread if what we inserted is the next
-    // upcoming event
-    if(newActionWillComeFirst)
-        waitableEvent_.signal();
+    // Otherwise pass the request through the "now" queue
+    enqueueAction(who, kActionScheduleLater, timestamp);
 }
 
 // Unschedule any further mappings from this object. Immediate mappings
@@ -154,127 +209,116 @@ void MappingScheduler::scheduleLater(Mapping *who, timestamp_type timestamp) {
 void MappingScheduler::unschedule(Mapping *who) {
     // Unscheduling works by inserting an action in the "now" queue
     // which preempts any further actions by this object.
-    juce::ScopedLock sl(actionsInsertionMutex_);
-    
-    actionsNow_.push(MappingAction(who, counter_, kActionUnschedule));
-    
-    // Increment the counter to indicate we're at another cycle
-    counter_++;
-    
-    // Wake up the consumer thread
-    waitableEvent_.signal();
+    enqueueAction(who, kActionUnschedule);
 }
 
 // Unregister a mapping which prevents it from being called by future events
 void MappingScheduler::unregisterMapping(Mapping *who) {
-    // Lock the mutex for insertions to ensure that only a single
-    // thread can act as producer at any given time.
-    juce::ScopedLock sl(actionsInsertionMutex_);
-    
-    actionsNow_.push(MappingAction(who, counter_, kActionUnregister));
-    
-    // Increment the counter so each insertion gets a unique label
-    counter_++;
-    
-    // Wake up the consumer thread
-    waitableEvent_.signal();
+    enqueueAction(who, kActionUnregister);
 }
 
-
 // Unschedule any further mappings from this object. Once any currently
 // scheduled "now" mappings have been executed, delete the object in question.
 void MappingScheduler::unregisterAndDelete(Mapping *who) {
     // Unscheduling works by inserting an action in the "now" queue
     // which preempts any further actions by this object. Deletion
     // will be handled by the consumer thread.
-    juce::ScopedLock sl(actionsInsertionMutex_);
+    enqueueAction(who, kActionUnregisterAndDelete);
+}
+
+// Add an action to the "now" queue of the mapping's shard
+void MappingScheduler::enqueueAction(Mapping *who, int action, timestamp_type timestamp) {
+    Shard& shard = shardFor(who);
     
-    actionsNow_.push(MappingAction(who, counter_, kActionUnregisterAndDelete));
+    // Lock the mutex for insertions to ensure that only a single
+    // thread can act as producer at any given time.
+    juce::ScopedLock sl(shard.insertionMutex);
     
-    // Increment the counter to indicate we're at another cycle
-    counter_++;
+    // Increment the counter so each insertion gets a unique label
+    shard.actionsNow.push(MappingAction(who, counter_++, action, timestamp));
     
     // Wake up the consumer thread
-    waitableEvent_.signal();
+    Worker& owner = *workers_[shard.owner];
+    owner.waitableEvent.signal();
+    
+    // If the owner is busy with another shard, wake an idle worker to steal this one
+    if(workers_.size() > 1 && !owner.idle.load()) {
+        for(size_t i = 0; i < workers_.size(); i++) {
+            if(workers_[i] != &owner && workers_[i]->idle.exchange(false)) {
+                workers_[i]->waitableEvent.signal();
+                break;
+            }
+        }
+    }
 }
 
-// This function runs in its own thread (from the Juce::Thread parent class). Every time
-// it is signaled, it executes all the Mapping actions in the actionsNow_ category and then
-// looks for the next delayed action.
+// This function runs in each worker thread. Every time it is signaled, it executes all the
+// Mapping actions in its own shards, then looks for overdue actions in other workers' shards,
+// then waits for the next delayed action.
 
-void MappingScheduler::run() {
-	isRunning_ = true;
-	
+void MappingScheduler::runWorker(Worker& worker) {
+    int profileGeneration = -1;
+    
+    // Mapping actions send triggers; go offline while waiting, which may be indefinitely
+    TriggerSource::registerSendingThread();
+    
     // This will run until the thread is interrupted (in the stop() method)
-    while(!threadShouldExit()) {
-        MappingAction nextAction;
+    while(!worker.threadShouldExit()) {
+        RealTimeProfile::applyIfChanged(kRealTimeRoleMappingScheduler, profileGeneration);
+        TriggerSource::threadQuiescent();
+        double passStartTime = juce::Time::getMillisecondCounterHiRes();
         
-        // Go through the accumulated actions in the "now" queue
-        while(actionsNow_.pop(nextAction)) {
-            if(nextAction.who != nullptr) {
-#ifdef DEBUG_MAPPING_SCHEDULER
-                std::cout << "Performing immediate mapping\n";
-#endif
-                performAction(nextAction);
-            }
-            
-#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
-            printDebugStatistics();
-#endif
-        }
+        // Perform the actions of our own shards. If another worker holds one,
+        // it is performing the actions for us.
+        for(size_t i = worker.index; i < shards_.size(); i += workers_.size())
+            performShardIfFree(*shards_[i], worker);
+        
+        if(workers_.size() > 1)
+            stealActions(worker);
+        
+        worker.busyMilliseconds = worker.busyMilliseconds + (juce::Time::getMillisecondCounterHiRes() - passStartTime);
         
-        // Next, grab the first upcoming action in the later category
-        bool foundAction = true;
+        if(worker.threadShouldExit())
+            break;
+        
+        // Wake for the next action in one of our own shards, or for one in another
+        // worker's shard once it is late enough to steal
+        bool foundAction = false;
         timestamp_diff_type timeToNextAction = 0;
+        timestamp_type currentTimestamp = keyboard_.schedulerCurrentTimestamp();
         
-        while(foundAction && !threadShouldExit()) {
-            // Lock the future actions mutex to examine the contents
-            // of the future actions collection
-            actionsLaterMutex_.enter();
-            foundAction = false;
-            
-            if(!actionsLater_.empty()) {
-                auto it = actionsLater_.begin();
-                timestamp_type t = it->first;
-                
-                timeToNextAction = t - keyboard_.schedulerCurrentTimestamp();
-                if(timeToNextAction <= 0) {
-                    // If we get here, we have a non-empty collection fo future actions, the first
-                    // of which should happen by now. Copy the action, erase it from the collection
-                    // and unlock the mutex before proceeding.
-                    nextAction = it->second;
-                    actionsLater_.erase(it);
-                    foundAction = true;
-                }
+        for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+            // Immediate actions still waiting belong to a worker which is busy; come
+            // back to them if it hasn't got to them by then
+            if(workers_.size() > 1 && !(*it)->actionsNow.empty()) {
+                if(!foundAction || kStealDelay < timeToNextAction)
+                    timeToNextAction = kStealDelay;
+                foundAction = true;
             }
-            else
-                timeToNextAction = 0;
             
-            actionsLaterMutex_.exit();
-        
-            if(foundAction) {
-                // If this is set, we found a future action which is supposed to happen by now.
-                // Execute it and check the next one.
-#ifdef DEBUG_MAPPING_SCHEDULER
-                std::cout << "Performing delayed mapping\n";
-#endif
-                performAction(nextAction);
-            }
-            else {
-#ifdef DEBUG_MAPPING_SCHEDULER
-                std::cout << "Found no further actions\n";
-#endif
+            timestamp_type t = (*it)->nextActionTimestamp;
+            if(t == Shard::kNoAction)
+                continue;
+            
+            timestamp_diff_type timeToAction = t - currentTimestamp;
+            if((*it)->owner != worker.index) {
+                // Don't spin on a late shard which another worker is still performing
+                timeToAction += kStealDelay;
+                if(timeToAction < kStealDelay)
+                    timeToAction = kStealDelay;
             }
-#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
-            printDebugStatistics();
-#endif
+            else if(timeToAction < 0)
+                timeToAction = 0;
+            
+            if(!foundAction || timeToAction < timeToNextAction)
+                timeToNextAction = timeToAction;
+            foundAction = true;
         }
         
-        if(timeToNextAction > 0) {
-            // If we complete the above loop with timeToNextAction set greater than 0, it means
-            // we found an action that's supposed to happen in the future, but isn't ready yet.
-            // The alternative is that there were no further actions, in which case the loop will
-            // terminate with timeToNextAction set to 0.
+        if(foundAction) {
+            // If we get here, we found an action that's supposed to happen in the future,
+            // or one that has come due since we looked, in which case timeToNextAction is 0.
+            // The alternative is that there were no further actions.
             
 #ifdef DEBUG_MAPPING_SCHEDULER
             std::cout << "Waiting for next action in " << timestamp_to_milliseconds(timeToNextAction) << "ms\n";
@@ -284,7 +328,13 @@ void MappingScheduler::run() {
 #endif
             
             // Wait for the next action to arrive (unless signaled)
-            waitableEvent_.wait(timestamp_to_milliseconds(timeToNextAction));
+            if(timeToNextAction > 0) {
+                worker.idle = true;
+                TriggerSource::threadOffline();
+                worker.waitableEvent.wait(timestamp_to_milliseconds(timeToNextAction));
+                TriggerSource::threadOnline();
+                worker.idle = false;
+            }
         }
         else {
             // No future actions found; wait for a signal
@@ -292,28 +342,205 @@ void MappingScheduler::run() {
 #if defined(DEBUG_MAPPING_SCHEDULER) || defined(DEBUG_MAPPING_SCHEDULER_STATISTICS)
             std::cout << "Waiting for next action\n";
 #endif
-            waitableEvent_.wait();
+            worker.idle = true;
+            TriggerSource::threadOffline();
+            worker.waitableEvent.wait();
+            TriggerSource::threadOnline();
+            worker.idle = false;
+        }
+        
+        worker.waitableEvent.reset();       // Clear the signal
+    }
+    
+    TriggerSource::unregisterSendingThread();
+}
+
+// Perform the actions of any other worker's shard which has immediate actions waiting,
+// or later actions which its owner hasn't reached in time.
+void MappingScheduler::stealActions(Worker& worker) {
+    timestamp_type currentTimestamp = keyboard_.schedulerCurrentTimestamp();
+    
+    for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+        Shard& shard = **it;
+        if(shard.owner == worker.index)
+            continue;
+        
+        timestamp_type t = shard.nextActionTimestamp;
+        bool ready = !shard.actionsNow.empty() ||
+                     (t != Shard::kNoAction && t + kStealDelay <= currentTimestamp);
+        if(!ready)
+            continue;
+        
+        if(performShardIfFree(shard, worker)) {
+            worker.shardsStolen++;
+            
+            // The owner may be waiting for a later time than the shard now needs
+            workers_[shard.owner]->waitableEvent.signal();
         }
+    }
+}
+
+// Perform a shard's actions unless another worker holds it. An action queued while we
+// hold the shard wakes its owner, which finds it busy and moves on, so look at the queue
+// again after letting go; whoever holds the shard next does the same.
+bool MappingScheduler::performShardIfFree(Shard& shard, Worker& worker) {
+    bool performed = false;
+    
+    while(shard.performMutex.tryEnter()) {
+        if(performShardActions(shard, worker))
+            performed = true;
+        shard.performMutex.exit();
         
-        waitableEvent_.reset();             // Clear the signal
+        if(shard.actionsNow.empty())
+            break;
+    }
+    
+    return performed;
+}
+
+// Stop the threads so the owner can perform actions in virtual time, or restart them
+void MappingScheduler::setVirtualTimeEnabled(bool enable) {
+    if(enable == virtualTimeEnabled_)
+        return;
+    virtualTimeEnabled_ = enable;
+    
+    if(enable)
+        stop();
+    else
+        start();
+}
+
+// Execute all the Mapping actions in the "now" queues, then any delayed actions whose
+// time has come. Returns the time until the next delayed action, or 0 if there are none.
+// With the threads stopped, the first worker's statistics are used for the accounting.
+timestamp_diff_type MappingScheduler::performPendingActions() {
+    Worker& worker = *workers_[0];
+    bool performed = true;
+    
+    // An action in one shard may schedule another in a shard already visited
+    while(performed) {
+        performed = false;
+        for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+            juce::ScopedLock sl((*it)->performMutex);
+            if(performShardActions(**it, worker))
+                performed = true;
+        }
     }
+    
+    timestamp_type nextTimestamp;
+    if(!nextActionTimestamp(nextTimestamp))
+        return 0;
+    return nextTimestamp - keyboard_.schedulerCurrentTimestamp();
+}
+
+// Find the time of the next later action; returns false if there are none.
+// Only call from the thread which performs the actions.
+bool MappingScheduler::nextActionTimestamp(timestamp_type& timestamp) {
+    bool found = false;
+    
+    for(std::vector<Shard*>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+        if((*it)->actionsLater.empty())
+            continue;
+        if(!found || (*it)->actionsLater.front().timestamp < timestamp)
+            timestamp = (*it)->actionsLater.front().timestamp;
+        found = true;
+    }
+    return found;
+}
+
+// Execute all the Mapping actions in the shard's "now" queue, then any of its delayed
+// actions whose time has come. The caller must hold the shard's performMutex.
+bool MappingScheduler::performShardActions(Shard& shard, Worker& worker) {
+    MappingAction nextAction;
+    bool performed = false;
+#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
+    double passStartTime = juce::Time::getMillisecondCounterHiRes();
+#endif
+    
+    // Go through the accumulated actions in the "now" queue
+    while(shard.actionsNow.pop(nextAction)) {
+        if(nextAction.who != nullptr) {
+#ifdef DEBUG_MAPPING_SCHEDULER
+            std::cout << "Performing immediate mapping\n";
+#endif
+            performAction(shard, worker, nextAction);
+            performed = true;
+        }
+    }
+    
+    // Next, perform the upcoming actions in the later category until
+    // we reach one which isn't due yet. The heap belongs to whoever
+    // holds performMutex so no further locking is needed.
+    while(!shard.actionsLater.empty()) {
+        if(shard.actionsLater.front().timestamp > keyboard_.schedulerCurrentTimestamp())
+            break;
+        
+        std::pop_heap(shard.actionsLater.begin(), shard.actionsLater.end(), LaterActionComparator());
+        nextAction = shard.actionsLater.back();
+        shard.actionsLater.pop_back();
+        
+#ifdef DEBUG_MAPPING_SCHEDULER
+        std::cout << "Performing delayed mapping\n";
+#endif
+        performAction(shard, worker, nextAction);
+        performed = true;
+    }
+    
+    // Publish the next due time for the other workers
+    shard.nextActionTimestamp = (shard.actionsLater.empty() ? Shard::kNoAction
+                                                            : shard.actionsLater.front().timestamp);
+    
+#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
+    worker.statisticsPasses++;
+    worker.statisticsTotalMilliseconds += juce::Time::getMillisecondCounterHiRes() - passStartTime;
+    printDebugStatistics(worker);
+#endif
+    
+    return performed;
+}
+
+// Add an action to the heap of later actions
+void MappingScheduler::insertLaterAction(Shard& shard, MappingAction const& mappingAction) {
+    shard.actionsLater.push_back(mappingAction);
+    std::push_heap(shard.actionsLater.begin(), shard.actionsLater.end(), LaterActionComparator());
+    shard.nextActionTimestamp = shard.actionsLater.front().timestamp;
+}
+
+// Drop any later actions for a mapping which is being unregistered, so the heap
+// never holds a pointer to a mapping which might be deleted
+void MappingScheduler::removeLaterActions(Shard& shard, Mapping *who) {
+    std::vector<MappingAction>::iterator newEnd =
+        std::remove_if(shard.actionsLater.begin(), shard.actionsLater.end(),
+                       [who](MappingAction const& a) { return a.who == who; });
+    if(newEnd == shard.actionsLater.end())
+        return;
+    shard.actionsLater.erase(newEnd, shard.actionsLater.end());
+    std::make_heap(shard.actionsLater.begin(), shard.actionsLater.end(), LaterActionComparator());
 }
 
 // Perform a mapping action: either execute the mapping or unschedule it,
 // depending on the contents of the MappingAction object.
-void MappingScheduler::performAction(MappingAction const& mappingAction) {
+void MappingScheduler::performAction(Shard& shard, Worker& worker, MappingAction const& mappingAction) {
     Mapping* who = mappingAction.who;
     bool skip = true;
     
+    if(mappingAction.action == kActionScheduleLater) {
+        // A later action requested from another thread: move it onto the heap,
+        // where it will be checked against the counter when it comes due
+        if(who->schedulerRegistered_)
+            insertLaterAction(shard, MappingAction(who, mappingAction.counter, kActionPerformMapping,
+                                                   mappingAction.timestamp));
+        return;
+    }
     
     // Check if this mapping action has been superseded by another
     // one already executed which was scheduled at the same time or later.
     // For example, if multiple actions have the same counter and the same
     // object, only the first one will run.
-    if(countersForMappings_.count(who) != 0) {
-        if(countersForMappings_[who] < mappingAction.counter) {
+    if(who->schedulerRegistered_) {
+        if(who->schedulerCounter_ < mappingAction.counter) {
 #ifdef DEBUG_MAPPING_SCHEDULER
-            std::cout << "Found counter " << countersForMappings_[who] << " for mapping " << who << std::endl;
+            std::cout << "Found counter " << who->schedulerCounter_ << " for mapping " << who << std::endl;
 #endif
             skip = false;
         }
@@ -329,9 +556,10 @@ void MappingScheduler::performAction(MappingAction const& mappingAction) {
     
     if(!skip) {
         // Update the last counter for this object
-        countersForMappings_[who] = mappingAction.counter;
+        who->schedulerCounter_ = mappingAction.counter;
         
         if(mappingAction.action == kActionRegister) {
+            who->schedulerRegistered_ = true;
 #ifdef DEBUG_MAPPING_SCHEDULER
             std::cout << "Registering object " << mappingAction.who << " with counter " << mappingAction.counter << std::endl;
 #endif
@@ -340,14 +568,28 @@ void MappingScheduler::performAction(MappingAction const& mappingAction) {
 #ifdef DEBUG_MAPPING_SCHEDULER
             std::cout << "Performing mapping for object " << mappingAction.who << " with counter " << mappingAction.counter << std::endl;
 #endif
+            timestamp_type currentTimestamp = keyboard_.schedulerCurrentTimestamp();
+            double mappingStartTime = juce::Time::getMillisecondCounterHiRes();
             timestamp_type nextTimestamp = who->performMapping();
+            double mappingMilliseconds = juce::Time::getMillisecondCounterHiRes() - mappingStartTime;
+            
+            worker.actionsPerformed++;
+            if(who->schedulerStatistics_ != nullptr) {
+                who->schedulerStatistics_->executionTime.addSample(mappingMilliseconds * 1000.0);
+                who->schedulerStatistics_->lateness.addSample(timestamp_to_milliseconds(currentTimestamp - mappingAction.timestamp) * 1000.0);
+                who->schedulerStatistics_->queueDepth.addSample((double)shard.actionsLater.size());
+            }
+#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
+            worker.statisticsMappingMilliseconds += mappingMilliseconds;
+            worker.statisticsActionsPerformed++;
+#endif
             
             // Reschedule for later if next timestamp isn't 0
             if(nextTimestamp != 0) {
 #ifdef DEBUG_MAPPING_SCHEDULER
                 std::cout << "Rescheduling object " << mappingAction.who << " for timestamp " << nextTimestamp << std::endl;
 #endif
-                scheduleLater(who, nextTimestamp);
+                insertLaterAction(shard, MappingAction(who, counter_++, kActionPerformMapping, nextTimestamp));
             }
         }
         else if(mappingAction.action == kActionUnschedule) {
@@ -361,15 +603,16 @@ void MappingScheduler::performAction(MappingAction const& mappingAction) {
 #ifdef DEBUG_MAPPING_SCHEDULER
             std::cout << "Unregistering and deleting object " << who << " with counter " << mappingAction.counter << std::endl;
 #endif
-            // Remove the object from the counter registry
-            countersForMappings_.erase(who);
+            // Stop accepting actions for the object and drop any pending ones
+            who->schedulerRegistered_ = false;
+            removeLaterActions(shard, who);
         }
         else if(mappingAction.action == kActionUnregisterAndDelete) {
 #ifdef DEBUG_MAPPING_SCHEDULER
             std::cout << "Unregistering and deleting object " << who << " with counter " << mappingAction.counter << std::endl;
 #endif
-            // Remove the object from the counter registry
-            countersForMappings_.erase(who);
+            // Stop accepting actions for the object and drop any pending ones
+            removeLaterActions(shard, who);
             
             // Delete this object
             delete mappingAction.who;
@@ -382,23 +625,61 @@ void MappingScheduler::performAction(MappingAction const& mappingAction) {
         }
     }
     else {
+#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
+        worker.statisticsActionsSkipped++;
+#endif
 #ifdef DEBUG_MAPPING_SCHEDULER
         std::cout << "Skipping action " << mappingAction.action << " for object " << who << " with counter " << mappingAction.counter << std::endl;
 #endif
     }
 }
 
+// Send one message per mapping type to /touchkeys/stats/mappings, then reset the
+// histograms so each message covers one interval. All times are in microseconds:
+//   name, actions, execution mean, p99, max, lateness mean, p99, max, queue depth mean, max
+// Nothing is sent in virtual time, where the wall-clock figures would make replays differ.
+timestamp_type MappingScheduler::publishStatistics() {
+    int numberOfTypes = statistics_.numberOfTypes();
+    
+    for(int i = 0; i < numberOfTypes && !virtualTimeEnabled_; i++) {
+        MappingTypeStatistics *stats = statistics_.statistics(i);
+        
+        keyboard_.sendMessage("/touchkeys/stats/mappings", "siffffffff",
+                              stats->name.c_str(), (int)stats->executionTime.count(),
+                              (float)stats->executionTime.mean(), (float)stats->executionTime.percentile(99),
+                              (float)stats->executionTime.maximum(),
+                              (float)stats->lateness.mean(), (float)stats->lateness.percentile(99),
+                              (float)stats->lateness.maximum(),
+                              (float)stats->queueDepth.mean(), (float)stats->queueDepth.maximum(),
+                              LO_ARGS_END);
+        stats->clear();
+    }
+    
+    return keyboard_.schedulerCurrentTimestamp() + milliseconds_to_timestamp(kMappingStatisticsIntervalMilliseconds);
+}
+
 #ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
-void MappingScheduler::printDebugStatistics() {
+void MappingScheduler::printDebugStatistics(Worker& worker) {
     timestamp_type currentTimestamp = keyboard_.schedulerCurrentTimestamp();
-    if(currentTimestamp - lastDebugStatisticsTimestamp_ < milliseconds_to_timestamp(500))
+    if(currentTimestamp - worker.lastDebugStatisticsTimestamp < milliseconds_to_timestamp(500))
         return;
-    lastDebugStatisticsTimestamp_ = currentTimestamp;
-    std::cout << "MappingScheduler: " << actionsNow_.size() << " now, " << actionsLater_.size() << " later";
-    if(!actionsLater_.empty()) {
-        std::cout << ", time lag = " << timestamp_to_milliseconds(currentTimestamp - actionsLater_.begin()->first) << std::endl;
+    worker.lastDebugStatisticsTimestamp = currentTimestamp;
+    
+    size_t actionsLater = 0;
+    for(size_t i = worker.index; i < shards_.size(); i += workers_.size())
+        actionsLater += shards_[i]->actionsLater.size();
+    std::cout << "MappingScheduler " << worker.index << ": " << actionsLater << " later";
+    
+    // Overhead is the time per pass not spent inside performMapping()
+    if(worker.statisticsPasses > 0) {
+        std::cout << ", " << worker.statisticsPasses << " passes, " << worker.statisticsActionsPerformed << " performed, "
+                  << worker.statisticsActionsSkipped << " skipped, overhead = "
+                  << 1000.0 * (worker.statisticsTotalMilliseconds - worker.statisticsMappingMilliseconds) / worker.statisticsPasses
+                  << "us/pass";
     }
-    else
-        std::cout << std::endl;
+    std::cout << std::endl;
+    
+    worker.statisticsPasses = worker.statisticsActionsPerformed = worker.statisticsActionsSkipped = 0;
+    worker.statisticsTotalMilliseconds = worker.statisticsMappingMilliseconds = 0;
 }
-#endif
\ No newline at end of file
+#endif
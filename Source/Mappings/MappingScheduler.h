@@ -32,11 +32,19 @@
 #undef DEBUG_MAPPING_SCHEDULER_STATISTICS
 
 #include "Mapping.h"
+#include "MappingStatistics.h"
+#include "../Utility/RealTimeProfile.h"
 #include <JuceHeader.h>
 #include <iostream>
 #include <list>
+#include <vector>
+#include <atomic>
+#include <limits>
 #include <boost/lockfree/queue.hpp>
 
+const int kMappingSchedulerInitialCapacity = 256;   // Later actions that can be pending before any allocation
+const int kMappingSchedulerMaxWorkers = 8;          // Most threads which can perform mappings
+const int kMappingSchedulerShardsPerWorker = 4;     // Groups of notes per thread, when there is more than one
 
 /*
  * MappingScheduler
@@ -46,11 +54,29 @@
  * of objects inheriting from Mapping. It maintains facilities to run mappings either now
  * or in the future, including the ability to preempt future mapping calls with more immediate
  * ones.
+ *
+ * Other threads only ever touch the lock-free "now" queues. Future actions live in min-heaps
+ * owned by whichever thread is performing actions; a future action requested from elsewhere
+ * travels through the "now" queue and is moved onto the heap when it arrives. A mapping must
+ * not be scheduled again once it has been unregistered.
+ *
+ * By default a single thread performs every mapping. With more workers, mappings are sharded
+ * by note number: each shard has its own queue and heap, and only one worker at a time
+ * performs a shard's actions, so the actions for any one note still happen in order. Each
+ * worker owns several shards. A worker with nothing due steals shards whose actions its
+ * owner hasn't reached within kStealDelay. An idle worker is woken when an action is queued
+ * for a shard whose owner is busy, and checks back every kStealDelay while any shard has
+ * immediate actions waiting.
+ *
+ * Execution time, lateness and queue depth are recorded for each type of mapping in
+ * lock-free histograms, and published every kMappingStatisticsIntervalMilliseconds on
+ * the OSC path /touchkeys/stats/mappings, one message per type (see publishStatistics()).
  */
 
-class MappingScheduler : public juce::Thread {
+class MappingScheduler {
 private:
 	static constexpr timestamp_diff_type kAllowableAdvanceExecutionTime = milliseconds_to_timestamp( 1.0 );
+	static constexpr timestamp_diff_type kStealDelay = milliseconds_to_timestamp( 1.0 );
 
 	enum {
 		kActionUnknown = 0,
@@ -58,18 +84,76 @@ private:
 		kActionPerformMapping,
 		kActionUnschedule,
 		kActionUnregister,
-		kActionUnregisterAndDelete
+		kActionUnregisterAndDelete,
+		kActionScheduleLater
 	};
 	
 	struct MappingAction {
 
 		MappingAction() = default;
-		MappingAction(Mapping *x, unsigned long y, int z) :
-		  who(x), counter(y), action(z) {}
+		MappingAction(Mapping *x, unsigned long y, int z, timestamp_type t = 0) :
+		  who(x), counter(y), action(z), timestamp(t) {}
 		
 		Mapping* who { nullptr };
 		unsigned long counter { 0 };
 		int action { kActionUnknown };
+		timestamp_type timestamp { 0 };     // When to perform a later action
+	};
+	
+	// Orders the heap of later actions by timestamp, then by order of insertion
+	struct LaterActionComparator {
+		bool operator()(MappingAction const& a, MappingAction const& b) const {
+			if(a.timestamp != b.timestamp)
+				return a.timestamp > b.timestamp;
+			return a.counter > b.counter;
+		}
+	};
+	
+	// The actions for one group of notes
+	struct Shard {
+		Shard(int ownerIndex) : owner(ownerIndex), nextActionTimestamp(kNoAction) {
+			actionsLater.reserve(kMappingSchedulerInitialCapacity);
+		}
+		
+		static constexpr timestamp_type kNoAction = std::numeric_limits<timestamp_type>::max();
+		
+		int owner;                                          // Worker which normally performs these actions
+		juce::CriticalSection insertionMutex;               // Keeps counters in order in the queue
+		juce::CriticalSection performMutex;                 // Held by the thread performing these actions
+		boost::lockfree::queue<MappingAction> actionsNow { 1024 };
+		std::vector<MappingAction> actionsLater;            // Heap; only touched with performMutex held
+		std::atomic<timestamp_type> nextActionTimestamp;    // Top of the heap, for other workers to check
+	};
+	
+	// A thread which performs the actions of its own shards, and steals others'
+	class Worker : public juce::Thread {
+	public:
+		Worker(MappingScheduler& owner, int workerIndex, juce::String const& name)
+		: juce::Thread(name), scheduler(owner), index(workerIndex), waitableEvent(true), idle(false),
+		  startMilliseconds(0), busyMilliseconds(0), actionsPerformed(0), shardsStolen(0) {}
+		
+		void run() { scheduler.runWorker(*this); }
+		
+		MappingScheduler& scheduler;
+		int index;
+		juce::WaitableEvent waitableEvent;
+		std::atomic<bool> idle;             // Waiting with nothing of its own to do
+		
+		// Statistics, updated by the worker and read from other threads
+		std::atomic<double> startMilliseconds;
+		std::atomic<double> busyMilliseconds;
+		std::atomic<unsigned long> actionsPerformed;
+		std::atomic<unsigned long> shardsStolen;
+		
+#ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
+		// Time spent in the scheduler itself, as opposed to in performMapping()
+		timestamp_type lastDebugStatisticsTimestamp { 0 };
+		unsigned long statisticsPasses { 0 };
+		unsigned long statisticsActionsSkipped { 0 };
+		double statisticsTotalMilliseconds { 0 };
+		double statisticsMappingMilliseconds { 0 };
+		unsigned long statisticsActionsPerformed { 0 };
+#endif
 	};
 	
 public:
@@ -84,15 +168,44 @@ public:
 	
 	// ***** Thread Methods *****
 	//
-	// These start and stop the thread that handles the scheduling of events.
+	// These start and stop the threads that handle the scheduling of events.
 	
 	void start();
 	void stop();
 	
 	bool isRunning() { return isRunning_; }
 	
-	// The main Juce::Thread run loop
-	void run();
+	// ***** Worker Methods *****
+	//
+	// Change the number of threads performing mappings. Pending actions are carried
+	// over, but this should be done while no input is arriving, e.g. at startup.
+	
+	void setNumberOfWorkers(int workers);
+	int numberOfWorkers() { return (int)workers_.size(); }
+	
+	// Fraction of the time since starting that a worker spent performing actions
+	double workerUtilization(int worker);
+	unsigned long workerActionsPerformed(int worker);
+	unsigned long workerShardsStolen(int worker);
+	
+	// ***** Statistics Methods *****
+	
+	MappingStatistics& statistics() { return statistics_; }
+	
+	// ***** Virtual Time Methods *****
+	//
+	// With the threads stopped, the owner performs actions itself by calling
+	// performPendingActions() each time the keyboard's (virtual) clock moves.
+	
+	void setVirtualTimeEnabled(bool enable);
+	bool virtualTimeEnabled() { return virtualTimeEnabled_; }
+	
+	// Perform every immediate action, and every later action due by the current time.
+	// Returns the time until the next later action, or 0 if there are none.
+	timestamp_diff_type performPendingActions();
+	
+	// Find the time of the next later action; returns false if there are none
+	bool nextActionTimestamp(timestamp_type& timestamp);
 	
 	// ***** Event Management Methods *****
 	//
@@ -111,35 +224,65 @@ public:
 	
 private:
 	// ***** Private Methods *****
-	void performAction(MappingAction const& mappingAction);
+	
+	// Create and destroy the workers and their shards
+	void createWorkers(int workers);
+	void deleteWorkers();
+	
+	// Find the shard which handles a given mapping
+	Shard& shardFor(Mapping *who) {
+		return *shards_[(unsigned int)who->noteNumber_ % shards_.size()];
+	}
+	
+	// Add an action to a shard's "now" queue and wake its worker
+	void enqueueAction(Mapping *who, int action, timestamp_type timestamp = 0);
+	
+	// The main loop of each worker thread
+	void runWorker(Worker& worker);
+	
+	// Perform the actions of other workers' shards which are overdue
+	void stealActions(Worker& worker);
+	
+	// Perform a shard's actions if no other worker is, looking again after letting go of
+	// it in case actions arrived while it was held. Returns whether anything was performed.
+	bool performShardIfFree(Shard& shard, Worker& worker);
+	
+	// Perform a shard's immediate actions and its due later actions; the caller holds
+	// its performMutex. Returns whether anything was performed.
+	bool performShardActions(Shard& shard, Worker& worker);
+	void performAction(Shard& shard, Worker& worker, MappingAction const& mappingAction);
+	
+	// Manage the heap of later actions (performing thread only)
+	void insertLaterAction(Shard& shard, MappingAction const& mappingAction);
+	void removeLaterActions(Shard& shard, Mapping *who);
+	
+	// Send the statistics gathered since the last call over OSC and reset them
+	timestamp_type publishStatistics();
 	
 	// Reference to the main PianoKeyboard object which holds the master timestamp
 	PianoKeyboard& keyboard_;
+	juce::String threadName_;
 	
-	// These variables keep track of the status of the separate thread running the events
-	juce::CriticalSection actionsInsertionMutex_;
-	juce::CriticalSection actionsLaterMutex_;
-	
-	juce::WaitableEvent waitableEvent_;
+	// These variables keep track of the status of the separate threads running the events
+	std::vector<Worker*> workers_;
+	std::vector<Shard*> shards_;
 	bool isRunning_;
+	bool virtualTimeEnabled_;
 	
 	// This counter keeps track of the sequence of insertions and executions
 	// of mappings. It is incremented whenever the scheduler finishes the "now"
 	// set of actions, and can be used to figure out whether an event has been
-	// duplicated or preempted.
-	unsigned long counter_;
-	std::map<Mapping*, unsigned long> countersForMappings_;
+	// duplicated or preempted. The last counter performed for each mapping is
+	// kept in the Mapping itself.
+	std::atomic<unsigned long> counter_;
 	
-	// These variables hold a ring buffer of actions to happen as soon as possible and a
-	// lock-synchronized collection of events that happen at later timestamps
-	boost::lockfree::queue<MappingAction> actionsNow_ { 1024 };
-	std::multimap<timestamp_type, MappingAction> actionsLater_;
+	// Statistics for each type of mapping, and the event which publishes them
+	MappingStatistics statistics_;
+	Scheduler::Handle statisticsEvent_;
 	
 #ifdef DEBUG_MAPPING_SCHEDULER_STATISTICS
-	timestamp_type lastDebugStatisticsTimestamp_;
-	
 	// Debugging method to indicate what is in the queue
-	void printDebugStatistics();
+	void printDebugStatistics(Worker& worker);
 #endif
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR( MappingScheduler )
 };
@@ -0,0 +1,59 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  MappingStatistics.cpp: always-on execution time, lateness and queue
+  depth statistics for each type of mapping, gathered by MappingScheduler.
+*/
+
+#include "MappingStatistics.h"
+#include <algorithm>
+
+MappingStatistics::~MappingStatistics() {
+    for(int i = 0; i < numTypes_; i++)
+        delete types_[i];
+}
+
+// Return the entry for a type, adding it if needed. Factory type names may
+// contain line breaks for display, which are replaced with spaces.
+MappingTypeStatistics* MappingStatistics::statisticsForType(std::string const& typeName) {
+    std::string name(typeName);
+    std::replace(name.begin(), name.end(), '\n', ' ');
+    
+    juce::ScopedLock sl(typesMutex_);
+    
+    int count = numTypes_.load(std::memory_order_relaxed);
+    for(int i = 0; i < count; i++) {
+        if(types_[i]->name == name)
+            return types_[i];
+    }
+    
+    if(count >= kMappingStatisticsMaxTypes)
+        return nullptr;
+    
+    types_[count] = new MappingTypeStatistics(name);
+    numTypes_.store(count + 1, std::memory_order_release);
+    return types_[count];
+}
+
+// Reset every histogram. Samples added at the same time may or may not be kept.
+void MappingStatistics::clear() {
+    int count = numberOfTypes();
+    for(int i = 0; i < count; i++)
+        types_[i]->clear();
+}
@@ -0,0 +1,92 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  MappingStatistics.h: always-on execution time, lateness and queue
+  depth statistics for each type of mapping, gathered by MappingScheduler.
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "../Utility/LatencyHistogram.h"
+#include <atomic>
+#include <string>
+
+const int kMappingStatisticsMaxTypes = 32;                  // Mapping types which can be tracked
+const double kMappingStatisticsIntervalMilliseconds = 1000.0; // How often statistics are published
+
+/*
+ * MappingTypeStatistics
+ *
+ * Histograms for one type of mapping, which every mapping of that type shares. Execution
+ * time is how long performMapping() took; lateness is how long after its requested time
+ * the action was performed; queue depth is how many later actions were waiting in the
+ * same scheduler shard at the time. The depth uses the same log-linear buckets as the
+ * durations, counting actions rather than microseconds.
+ */
+
+struct MappingTypeStatistics {
+    MappingTypeStatistics(std::string const& typeName) : name(typeName) {}
+    
+    void clear() {
+        executionTime.clear();
+        lateness.clear();
+        queueDepth.clear();
+    }
+    
+    std::string name;
+    LatencyHistogram executionTime;
+    LatencyHistogram lateness;
+    LatencyHistogram queueDepth;
+};
+
+/*
+ * MappingStatistics
+ *
+ * The table of MappingTypeStatistics, one per type name. Entries are only ever added, and
+ * only when a mapping factory is added to a keyboard segment. Each factory keeps a pointer
+ * to its entry and hands it to its mappings, so the scheduler threads add samples without
+ * any locking or lookup. Readers may walk the table from any thread.
+ */
+
+class MappingStatistics {
+public:
+    // ***** Constructor and Destructor *****
+    
+    MappingStatistics() : numTypes_(0) {}
+    ~MappingStatistics();
+    
+    // ***** Types *****
+    
+    // Return the entry for a type, adding it if needed. Returns nullptr if the table is full.
+    MappingTypeStatistics* statisticsForType(std::string const& typeName);
+    
+    int numberOfTypes() { return numTypes_.load(std::memory_order_acquire); }
+    MappingTypeStatistics* statistics(int index) { return types_[index]; }
+    
+    // Reset every histogram
+    void clear();
+    
+private:
+    juce::CriticalSection typesMutex_;              // Serialises adding new types
+    MappingTypeStatistics* types_[kMappingStatisticsMaxTypes];
+    std::atomic<int> numTypes_;                     // Entries in use, published after each is filled in
+    
+    JUCE_DECLARE_NON_COPYABLE( MappingStatistics )
+};
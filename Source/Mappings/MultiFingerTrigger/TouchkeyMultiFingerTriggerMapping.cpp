@@ -134,9 +134,9 @@ void TouchkeyMultiFingerTriggerMapping::triggerReceived(TriggerSource* who, time
     }
     
     if(who == touchBuffer_) {
-        if(!touchBuffer_->empty()) {
+        KeyTouchFrame frame;
+        if(touchBuffer_->snapshotLatest(frame)) {
             // Find the current number of touches
-            KeyTouchFrame frame  = touchBuffer_->latest();
             int count = frame.count;
             
             if(count < numTouchesForTrigger_) {
@@ -60,8 +60,10 @@ void TouchkeyOnsetAngleMapping::triggerReceived(TriggerSource* who, timestamp_ty
         
         // Save the latest frame, even if it is an empty touch (we need to know what happened even
         // after the touch ends since the MIDI off may come later)
-        if(!touchBuffer_->empty())
-            pastSamples_.insert(touchBuffer_->latest(), touchBuffer_->latestTimestamp());
+        KeyTouchFrame frame;
+        timestamp_type frameTimestamp;
+        if(touchBuffer_->snapshotLatest(frame, frameTimestamp))
+            pastSamples_.insert(frame, frameTimestamp);
     }
 }
 
@@ -112,9 +112,9 @@ void TouchkeyPitchBendMapping::triggerReceived(TriggerSource* who, timestamp_typ
         return;
     
     if(who == touchBuffer_) {
-        if(!touchBuffer_->empty()) {
+        KeyTouchFrame frame;
+        if(touchBuffer_->snapshotLatest(frame)) {
             // New touch data is available. Find the distance from the onset location.
-            KeyTouchFrame frame = touchBuffer_->latest();
             lastTimestamp_ = timestamp;
             
             if(frame.count == 0) {
@@ -62,15 +62,13 @@ lastExtremumTimestamp_(missing_value<timestamp_diff_type>::missing()),
 vibratoPrescaler_(kDefaultVibratoPrescaler),
 vibratoRangeSemitones_(kDefaultVibratoRangeSemitones),
 lastPitchBendSemitones_(0),
-rawDistance_(kDefaultFilterBufferLength),
-filteredDistance_(kDefaultFilterBufferLength, rawDistance_)
+filteredDistance_(kDefaultFilterBufferLength)
 {
     // Initialize the filter coefficients for filtered key velocity (used for vibrato detection)
     std::vector<double> bCoeffs, aCoeffs;
     designSecondOrderBandpass(bCoeffs, aCoeffs, 9.0, 0.707, 200.0);
     std::vector<float> bCf(bCoeffs.begin(), bCoeffs.end()), aCf(aCoeffs.begin(), aCoeffs.end());
-    filteredDistance_.setCoefficients(bCf, aCf);
-    filteredDistance_.setAutoCalculate(true);
+    filteredDistance_.stage<0>().setCoefficients(bCf, aCf);
     
     //setOscController(&keyboard_);
     resetDetectionState();
@@ -129,9 +127,9 @@ void TouchkeyVibratoMapping::triggerReceived(TriggerSource* who, timestamp_type
         return;
     
     if(who == touchBuffer_) {
-        if(!touchBuffer_->empty()) {
+        KeyTouchFrame frame;
+        if(touchBuffer_->snapshotLatest(frame)) {
             // New touch data is available. Find the distance from the onset location.
-            KeyTouchFrame frame = touchBuffer_->latest();
             lastTimestamp_ = timestamp;
             
             if(frame.count == 0) {
@@ -240,10 +238,10 @@ void TouchkeyVibratoMapping::triggerReceived(TriggerSource* who, timestamp_type
                             distance = lastX_ - onsetLocationX_;
                         }
                         
-                        // Insert raw distance into the buffer. Bandpass filter calculates the next
-                        // sample automatically. The rest of the processing takes place in the dedicated
-                        // thread so as not to slow down commmunication with the hardware.
-                        rawDistance_.insert(distance, timestamp);
+                        // Filter the raw distance into the buffer; the raw value itself isn't kept.
+                        // The rest of the processing takes place in the dedicated thread so as not
+                        // to slow down commmunication with the hardware.
+                        filteredDistance_.process(distance, timestamp);
                            
                         // Move the current scheduled event up to the present time.
                         // FIXME: this may be more inefficient than just doing everything in the current thread!
@@ -550,9 +548,8 @@ void TouchkeyVibratoMapping::resetDetectionState() {
 
 // Clear the buffers that hold distance measurements
 void TouchkeyVibratoMapping::clearBuffers() {
-    rawDistance_.clear();
     filteredDistance_.clear();
-    rawDistance_.insert(0.0, lastTimestamp_);
+    filteredDistance_.process(0.0, lastTimestamp_);
     lastProcessedIndex_ = 0;
 }
 
@@ -29,6 +29,7 @@
 #include "../../TouchKeys/PianoKeyboard.h"
 #include "../TouchkeyBaseMapping.h"
 #include "../../Utility/IIRFilter.h"
+#include "../../Utility/Pipeline.h"
 #include <boost/bind.hpp>
 #include <map>
 #include <vector>
@@ -160,8 +161,7 @@ private:
     
     float lastPitchBendSemitones_;              // The last pitch bend value we sent out
     
-    Node<float> rawDistance_;                   // Distance from onset location
-    IIRFilterNode<float> filteredDistance_;     // Bandpass filtered finger motion
+    PipelineNode<IIRFilterStage<float, 3, 2> > filteredDistance_;  // Bandpass filtered distance from onset location
     juce::CriticalSection distanceAccessMutex_;       // Mutex that protects the access buffer from changes
 };
 
@@ -27,17 +27,15 @@
 // Default constructor
 KeyIdleDetector::KeyIdleDetector(capacity_type capacity, Node<key_position>& keyBuffer, key_position positionThreshold, 
 								 key_position activityThreshold, int counterThreshold)
-: Node<int>(capacity), keyBuffer_(keyBuffer), accumulator_(kKeyIdleNumSamples+1, keyBuffer),
+: Node<int>(capacity), keyBuffer_(keyBuffer), statistics_(kKeyIdleNumSamples), range_(kKeyIdleNumSamples),
   keyIdleThreshold_(kDefaultKeyIdleThreshold), activityThreshold_(activityThreshold), positionThreshold_(positionThreshold),
   numberOfFramesWithoutActivity_(0), noActivityCounterThreshold_(counterThreshold),
-  idleState_(kIdleDetectorUnknown)
+  idleState_(kIdleDetectorUnknown), sleepAllowed_(false), sleeping_(false)
 {
-	// Register to receive messages from the accumulator each time it gets a new sample
+	// Register to receive messages from the key buffer each time it gets a new sample
 	  //std::cout << "Registering IdleDetector\n";
 	  
-	  registerForTrigger(&accumulator_);
-	  
-	//  std::cout << "IdleDetector: this_source = " << (TriggerSource*)this << " this_dest = " << (TriggerDestination*)this << " accumulator = " << &accumulator_ << std::endl;
+	  registerForTrigger(&keyBuffer_);
 }
 
 // Copy constructor
@@ -52,8 +50,40 @@ KeyIdleDetector::KeyIdleDetector(capacity_type capacity, Node<key_position>& key
 // Clear current state and reset to unknown idle state.
 void KeyIdleDetector::clear() {
 	Node<int>::clear();
+	statistics_.clear();
+	range_.clear();
 	idleState_ = kIdleDetectorUnknown;
 	numberOfFramesWithoutActivity_ = 0;
+	updateSleep();
+}
+
+// Let the detector stop listening to the key buffer while the key is idle
+void KeyIdleDetector::setSleepAllowed(bool allowed) {
+	sleepAllowed_ = allowed;
+	updateSleep();
+}
+
+// Sleep when idle, if allowed, and listen to the key buffer otherwise
+void KeyIdleDetector::updateSleep() {
+	bool shouldSleep = (sleepAllowed_ && idleState_ == kIdleDetectorIdle);
+	
+	if(shouldSleep && !sleeping_) {
+		unregisterForTrigger(&keyBuffer_);
+		sleeping_ = true;
+	}
+	else if(!shouldSleep && sleeping_) {
+		registerForTrigger(&keyBuffer_);
+		sleeping_ = false;
+	}
+}
+
+// Change state and notify listeners. Waking comes first, so that anything the listeners
+// register on the key buffer in response comes after this detector, as it would have if
+// the detector had never slept.
+void KeyIdleDetector::changeState(int newState, timestamp_type timestamp) {
+	idleState_ = newState;
+	updateSleep();
+	insert(newState, timestamp);
 }
 
 // Evaluator function.  Find the maximum deviation from average of the key motion.
@@ -61,16 +91,23 @@ void KeyIdleDetector::clear() {
 void KeyIdleDetector::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
 	//std::cout << "KeyIdleDetector::triggerReceived\n";
 
-	if(who != &accumulator_)
+	if(who != &keyBuffer_)
 		return;
+	
+	evaluate(timestamp);
+}
 
-    key_position currentKeyPosition = keyBuffer_.latest();
-    std::pair<int, key_position> currentAccumulator = accumulator_.latest();
+// Examine the latest sample in the key buffer, catching up with any samples missed while asleep
+void KeyIdleDetector::evaluate(timestamp_type timestamp) {
+    statistics_.update(keyBuffer_);
+    range_.update(keyBuffer_);
     
     // Check that we have enough samples
-    if(currentAccumulator.first < kKeyIdleNumSamples)
+    if(keyBuffer_.empty() || statistics_.count() < kKeyIdleNumSamples)
         return;
     
+    key_position currentKeyPosition = keyBuffer_.latest();
+    
     // Behavior depends on whether we were idle or not before (or in unknown state)
     if(idleState_ == kIdleDetectorIdle) {
         // If idle right now, don't do anything if the key position is below a threshold
@@ -78,17 +115,16 @@ void KeyIdleDetector::triggerReceived(TriggerSource* who, timestamp_type timesta
             return;
 
         // If average is below a second, slightly higher threshold, stay idle
-        key_position averageValue = currentAccumulator.second / (key_position)currentAccumulator.first;
+        key_position averageValue = (key_position)statistics_.mean();
         if(averageValue < keyIdleThreshold_ * 2)
             return;
         
         // Go active, notifying any listeners
-        idleState_ = kIdleDetectorActive;
-        insert(kIdleDetectorActive, timestamp);
+        changeState(kIdleDetectorActive, timestamp);
     }
     else { // Active or unknown
         // Rule out any cases that would immediately take the key active
-        key_position averageValue = currentAccumulator.second / (key_position)currentAccumulator.first;
+        key_position averageValue = (key_position)statistics_.mean();
         if(averageValue >= keyIdleThreshold_ * 2) {
             numberOfFramesWithoutActivity_ = 0;
             return;
@@ -104,24 +140,29 @@ void KeyIdleDetector::triggerReceived(TriggerSource* who, timestamp_type timesta
                 maxDeviation = diff;
         }
 #endif
-        key_position averageDeviation = 0;
-        size_type endIndex = keyBuffer_.endIndex();
-        // Find and return the average deviation from mean
-        for(int i = endIndex - kKeyIdleNumSamples; i < endIndex; i++) {
-            averageDeviation += key_abs(keyBuffer_[i] - averageValue);
-        }
-        averageDeviation /= kKeyIdleNumSamples;
+        // Compare the average deviation from mean to the threshold, using the bounds on it
+        // where they decide the comparison
+        double threshold = (double)activityThreshold_;
+        double standardDeviation = statistics_.standardDeviation();
+        bool flat;
+        
+        if(standardDeviation < threshold * (1.0 - kKeyIdleBoundMargin))
+            flat = true;
+        else if((double)range_.range() / kKeyIdleNumSamples >= threshold * (1.0 + kKeyIdleBoundMargin) ||
+                standardDeviation / sqrt((double)kKeyIdleNumSamples) >= threshold * (1.0 + kKeyIdleBoundMargin))
+            flat = false;
+        else
+            flat = (statistics_.averageDeviation() < threshold);
         
-        //std::cout << "averageDeviation = " << averageDeviation << " counter = " << numberOfFramesWithoutActivity_ << std::endl;
+        //std::cout << "standardDeviation = " << standardDeviation << " counter = " << numberOfFramesWithoutActivity_ << std::endl;
         
-        if(averageDeviation < activityThreshold_) {
+        if(flat) {
             // Key registers as "flat".  Check if it has stayed that way for long enough, and with a position close enough
             // to resting position, to change the state back to Idle.
             
             numberOfFramesWithoutActivity_++;
             if(numberOfFramesWithoutActivity_ >= noActivityCounterThreshold_) {
-                idleState_ = kIdleDetectorIdle;
-                insert(kIdleDetectorIdle, timestamp);
+                changeState(kIdleDetectorIdle, timestamp);
             }
         }
         else
@@ -25,13 +25,14 @@
 #pragma once
 
 #include "../Utility/Node.h"
-#include "../Utility/Accumulator.h"
+#include "../Utility/SlidingWindow.h"
 //#include "Trigger.h"
 //#include "PianoKeyboard.h"
 #include "PianoTypes.h"
 
 #define kKeyIdleNumSamples 10
 #define kDefaultKeyIdleThreshold (scale_key_position(0.05))
+#define kKeyIdleBoundMargin 1e-4        // Relative margin for deciding activity from the deviation bounds
 
 // Three states of idle detector
 enum {
@@ -46,9 +47,15 @@ enum {
  * A Filter that looks for whether the key position has been flat over time, or is changing.
  * Uses this information to detect when a key has begun to move.
  *
- * This class contains a second Filter object, operating on the same data source, which is used
- * to maintain a running sum of the last N values.  The running sum is converted to an average
- * value, and the maximum deviation from the average is calculated.
+ * Running statistics of the last N key positions (mean, variance, minimum and maximum) are
+ * updated on each sample.  The key is flat when the average deviation from the mean is below
+ * the activity threshold.  That deviation is bounded below by the range divided by N and by
+ * the standard deviation divided by sqrt(N), and above by the standard deviation, so only when
+ * the threshold falls between the bounds are the N samples visited to calculate it exactly.
+ *
+ * When sleep is allowed, the detector stops listening to the key buffer once the key is idle.
+ * A KeyboardStateEngine then screens the samples for every key at once and calls evaluate()
+ * only for a sample which might make the key active; the statistics catch up from the buffer.
  *
  */
 
@@ -78,6 +85,12 @@ public:
 	
 	void clear();
 	
+	// ***** Sleeping *****
+	
+	void setSleepAllowed(bool allowed);
+	bool sleepAllowed() { return sleepAllowed_; }
+	bool sleeping() { return sleeping_; }
+	
 	// ***** Evaluator *****
 	
 	// This method actually handles the quantification of key activity.  When it
@@ -85,10 +98,22 @@ public:
 	
 	void triggerReceived(TriggerSource* who, timestamp_type timestamp);
 	
+	// Evaluate the latest sample in the key buffer, as if it had just triggered us
+	void evaluate(timestamp_type timestamp);
+	
+private:
+	// Listen to the key buffer or not, depending on the state
+	void updateSleep();
+	
+	// Change the idle state and notify listeners
+	void changeState(int newState, timestamp_type timestamp);
+	
+public:
 	// ***** Member Variables *****
 	
 	Node<key_position>& keyBuffer_;								// Raw key position data	
-	Accumulator<key_position, kKeyIdleNumSamples> accumulator_;	// This class accumulates the last N key samples (to find an average)
+	SlidingWindowStatistics<key_position> statistics_;			// Mean and variance of the last N key samples
+	SlidingWindowMinMax<key_position> range_;					// Minimum and maximum of the same samples
 	
     key_position keyIdleThreshold_;                             // Position below which we assume key is staying idle
     
@@ -97,6 +122,8 @@ public:
 	int numberOfFramesWithoutActivity_;                         // For how many samples have we been below the idle threshold?
     int noActivityCounterThreshold_;
 	int idleState_;												// Currently idle?
+	bool sleepAllowed_;											// Whether we may stop listening when idle
+	bool sleeping_;												// Whether we have stopped listening
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(KeyIdleDetector)
 };
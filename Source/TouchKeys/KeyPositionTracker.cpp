@@ -23,9 +23,16 @@
 
 #include "KeyPositionTracker.h"
 
+#undef DEBUG_KEY_POSITION_TRACKER
+
 // Default constructor
 KeyPositionTracker::KeyPositionTracker(capacity_type capacity, Node<key_position>& keyBuffer)
-: Node<KeyPositionTrackerNotification>(capacity), keyBuffer_(keyBuffer), engaged_(false) {
+: Node<KeyPositionTrackerNotification>(capacity), keyBuffer_(keyBuffer), engaged_(false),
+  pressEscapementCrossing_(kPositionTrackerDefaultPositionForPressVelocityCalculation,
+                           ThresholdCrossingTracker<key_position>::kComparisonAtOrBelow),
+  releaseEscapementCrossing_(kPositionTrackerDefaultPositionForReleaseVelocityCalculation,
+                             ThresholdCrossingTracker<key_position>::kComparisonAtOrAbove),
+  historyBeginIndex_(0), historyEndIndex_(0) {
     reset();
 }
 
@@ -38,10 +45,20 @@ KeyPositionTracker::KeyPositionTracker(capacity_type capacity, Node<key_position
 
 // Calculate (MIDI-style) key press velocity from continuous key position
 std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity() {
-    return pressVelocity(pressVelocityEscapementPosition_);
+    // The search from the start of the press has already run as far as the data allows
+    if(missing_value<timestamp_type>::isMissing(startTimestamp_) || pressVelocitySearch_.foundIndex == 0 ||
+       (pressIndex_ != 0 && pressVelocitySearch_.foundIndex >= pressIndex_)) {
+        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+                                                       missing_value<key_velocity>::missing());
+    }
+    
+    return std::pair<timestamp_type, key_velocity>(pressVelocitySearch_.timestamp, pressVelocitySearch_.velocity);
 }
 
 std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity(key_position escapementPosition) {
+    if(escapementPosition == pressVelocityEscapementPosition_)
+        return pressVelocity();
+    
     // Check that we have a valid start point from which to calculate
     if(missing_value<timestamp_type>::isMissing(startTimestamp_)) {
         return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
@@ -80,10 +97,19 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity(key_po
 
 // Calculate (MIDI-style) key release velocity from continuous key position
 std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity() {
-    return releaseVelocity(releaseVelocityEscapementPosition_);
+    if(missing_value<timestamp_type>::isMissing(releaseBeginTimestamp_) || releaseVelocitySearch_.foundIndex == 0 ||
+       (releaseEndIndex_ != 0 && releaseVelocitySearch_.foundIndex >= releaseEndIndex_)) {
+        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+                                                       missing_value<key_velocity>::missing());
+    }
+    
+    return std::pair<timestamp_type, key_velocity>(releaseVelocitySearch_.timestamp, releaseVelocitySearch_.velocity);
 }
 
 std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity(key_position returnPosition) {
+    if(returnPosition == releaseVelocityEscapementPosition_)
+        return releaseVelocity();
+    
     // Check that we have a valid start point from which to calculate
     if(missing_value<timestamp_type>::isMissing(releaseBeginTimestamp_)) {
         return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
@@ -111,7 +137,9 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity(key_
             timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
             key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
             
+#ifdef DEBUG_KEY_POSITION_TRACKER
             std::cout << "found release velocity " << velocity << "(diffp " << diffPosition << ", diffT " << diffTimestamp << ")" << std::endl;
+#endif
             
             return std::pair<timestamp_type, key_velocity>(exactPressTimestamp, velocity);
         }
@@ -123,91 +151,44 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity(key_
                                                    missing_value<key_velocity>::missing());
 }
 
-// Calculate and return features about the percussiveness of the key press
+// Return features about the percussiveness of the key press, as calculated so far
 KeyPositionTracker::PercussivenessFeatures KeyPositionTracker::pressPercussiveness() {
     PercussivenessFeatures features;
-    key_buffer_index index;
-    key_velocity maximumVelocity, largestVelocityDifference;
-    key_buffer_index maximumVelocityIndex, largestVelocityDifferenceIndex;
+    PercussivenessSearch const& search = percussivenessSearch_;
     
     // Check that we have a valid start point from which to calculate
-    if(missing_value<timestamp_type>::isMissing(startTimestamp_) || keyBuffer_.beginIndex() > startIndex_ - 1) {
+    if(missing_value<timestamp_type>::isMissing(startTimestamp_) || !search.active || keyBuffer_.beginIndex() > startIndex_ - 1) {
         std::cout << "*** no start time\n";
         features.percussiveness = missing_value<float>::missing();
         return features;
     }
     
-    // From the start of the key press, look for an initial maximum in velocity
-    index = startIndex_;
-    
-    maximumVelocity = scale_key_velocity(0);
-    maximumVelocityIndex = startIndex_;
-    largestVelocityDifference = scale_key_velocity(0);
-    largestVelocityDifferenceIndex = startIndex_;
-    
-    std::cout << "*** start index " << index << std::endl;
-    
-    while(index < keyBuffer_.endIndex()) {
-        if(pressIndex_ != 0 && index >= pressIndex_)
-            break;
-        
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        // Look for maximum of velocity
-        if(velocity > maximumVelocity) {
-            maximumVelocity = velocity;
-            maximumVelocityIndex = index;
-            std::cout << "*** found new max velocity " << maximumVelocity << " at index " << index << std::endl;
-        }
-        
-        // And given the difference between the max and the current sample,
-        // look for the largest rebound (velocity hitting a peak and falling)
-        if(maximumVelocity - velocity > largestVelocityDifference) {
-            largestVelocityDifference = maximumVelocity - velocity;
-            largestVelocityDifferenceIndex = index;
-            std::cout << "*** found new diff velocity " << largestVelocityDifference << " at index " << index << std::endl;
-        }
-        
-        // Only look at the early part of the key press: if the key position
-        // makes it more than a certain amount down, assume the initial spike
-        // has passed and finish up. But always allow at least 5 points for the
-        // fastest key presses to be considered.
-        if(index - startIndex_ >= 4 && keyBuffer_[index] > kPositionTrackerPositionThresholdForPercussivenessCalculation) {
-            break;
-        }
-        
-        index++;
-    }
+    std::cout << "*** start index " << startIndex_ << ", max velocity " << search.maximumVelocity << " at index "
+              << search.maximumVelocityIndex << ", diff velocity " << search.largestVelocityDifference << " at index "
+              << search.largestVelocityDifferenceIndex << std::endl;
     
     // Now transfer what we've found to the data structure
-    features.velocitySpikeMaximum = Event(maximumVelocityIndex, maximumVelocity, keyBuffer_.timestampAt(maximumVelocityIndex));
-    features.velocitySpikeMinimum = Event(largestVelocityDifferenceIndex, maximumVelocity - largestVelocityDifference,
-                                          keyBuffer_.timestampAt(largestVelocityDifferenceIndex));
-    features.timeFromStartToSpike = keyBuffer_.timestampAt(maximumVelocityIndex) - keyBuffer_.timestampAt(startIndex_);
+    features.velocitySpikeMaximum = Event(search.maximumVelocityIndex, search.maximumVelocity,
+                                          keyBuffer_.timestampAt(search.maximumVelocityIndex));
+    features.velocitySpikeMinimum = Event(search.largestVelocityDifferenceIndex, search.maximumVelocity - search.largestVelocityDifference,
+                                          keyBuffer_.timestampAt(search.largestVelocityDifferenceIndex));
+    features.timeFromStartToSpike = keyBuffer_.timestampAt(search.maximumVelocityIndex) - keyBuffer_.timestampAt(startIndex_);
     
     // Check if we found a meaningful difference. If not, percussiveness is set to 0
-    if(largestVelocityDifference == scale_key_velocity(0)) {
+    if(search.largestVelocityDifference == scale_key_velocity(0)) {
         features.percussiveness = 0.0;
         features.areaPrecedingSpike = scale_key_velocity(0);
         features.areaFollowingSpike = scale_key_velocity(0);
         return features;
     }
     
-    // Calculate the area under the velocity curve before and after the maximum
-    features.areaPrecedingSpike = scale_key_velocity(0);
-    for(index = startIndex_; index < maximumVelocityIndex; index++) {
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        features.areaPrecedingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
-    }
-    features.areaFollowingSpike = scale_key_velocity(0);
-    for(index = maximumVelocityIndex; index < largestVelocityDifferenceIndex; index++) {
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        features.areaFollowingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
-    }
+    // Area under the velocity curve before and after the maximum. If the maximum moved on
+    // after the largest difference was found, there is nothing between them.
+    features.areaPrecedingSpike = search.areaPrecedingSpike;
+    if(search.largestVelocityDifferenceIndex > search.maximumVelocityIndex)
+        features.areaFollowingSpike = search.areaFollowingSpike;
+    else
+        features.areaFollowingSpike = scale_key_velocity(0);
     
     std::cout << "area before = " << features.areaPrecedingSpike << " after = " << features.areaFollowingSpike << std::endl;
     
@@ -216,11 +197,13 @@ KeyPositionTracker::PercussivenessFeatures KeyPositionTracker::pressPercussivene
     return features;
 }
 
-// Register to receive messages from the key buffer on each new sample
+// Register to receive messages from the key buffer on each new sample, first bringing
+// the history up to date with the samples that arrived while we weren't listening
 void KeyPositionTracker::engage() {
     if(engaged_)
         return;
 
+    updateHistory();
     registerForTrigger(&keyBuffer_);
     engaged_ = true;
 }
@@ -234,6 +217,13 @@ void KeyPositionTracker::disengage() {
     engaged_ = false;
 }
 
+// Forget the history, for when the key buffer has been cleared
+void KeyPositionTracker::clearHistory() {
+    historyBeginIndex_ = historyEndIndex_ = 0;
+    pressEscapementCrossing_.clear();
+    releaseEscapementCrossing_.clear();
+}
+
 // Clear current state and reset to unknown state
 void KeyPositionTracker::reset() {
 	Node<KeyPositionTrackerNotification>::clear();
@@ -252,6 +242,17 @@ void KeyPositionTracker::reset() {
     releaseVelocityEscapementPosition_ = kPositionTrackerDefaultPositionForReleaseVelocityCalculation;
     pressVelocityAvailableIndex_ = releaseVelocityAvailableIndex_ = percussivenessAvailableIndex_ = 0;
     releaseVelocityWaitingForThresholdCross_ = false;
+    
+    pressEscapementCrossing_.setThreshold(pressVelocityEscapementPosition_);
+    releaseEscapementCrossing_.setThreshold(releaseVelocityEscapementPosition_);
+    
+    pressVelocitySearch_.active = releaseVelocitySearch_.active = false;
+    pressVelocitySearch_.nextIndex = releaseVelocitySearch_.nextIndex = 0;
+    pressVelocitySearch_.foundIndex = releaseVelocitySearch_.foundIndex = 0;
+    percussivenessSearch_.active = false;
+    
+    // The velocity history and escapement crossings describe the key buffer rather than
+    // the press, so they are kept until clearHistory()
 }
 
 // Evaluator function. Update the current state
@@ -260,6 +261,9 @@ void KeyPositionTracker::triggerReceived(TriggerSource* who, timestamp_type time
 	if(who != &keyBuffer_)
 		return;
     
+    updateHistory();
+    advanceSearches();
+    
     // Always start in the partial press state after a reset, retroactively locating
     // the start position for this key press
     if(empty()) {
@@ -329,6 +333,8 @@ void KeyPositionTracker::triggerReceived(TriggerSource* who, timestamp_type time
             pressIndex_ = 0;
             pressPosition_ = missing_value<key_position>::missing();
             pressTimestamp_ = missing_value<timestamp_type>::missing();
+            restartEscapementSearch(pressVelocitySearch_, startIndex_, startTimestamp_);
+            restartPercussivenessSearch();
             
             changeState(kPositionTrackerStatePressInProgress, timestamp);
         }
@@ -391,6 +397,10 @@ void KeyPositionTracker::triggerReceived(TriggerSource* who, timestamp_type time
                     pressPosition_ = currentMaxPosition_;
                     pressTimestamp_ = currentMaxTimestamp_;
                     
+                    // Percussiveness stops at the end of the press; start over if it went past
+                    if(percussivenessSearch_.nextIndex > pressIndex_)
+                        restartPercussivenessSearch();
+                    
                     // Insert the state change into the buffer timestamped according to
                     // when the maximum arrived, unless that would put it earlier than what's already there
                     timestamp_type stateChangeTimestamp = latestTimestamp() > currentMaxTimestamp_ ? latestTimestamp() : currentMaxTimestamp_;
@@ -472,7 +482,7 @@ void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
             // Start looking for the data needed for MIDI onset velocity.
             // Where did the key cross the escapement position? How many more samples do
             // we need to calculate velocity?
-            index = findMostRecentKeyPositionCrossing(pressVelocityEscapementPosition_, false, 1000);
+            index = findMostRecentKeyPositionCrossing(pressEscapementCrossing_, 1000);
             if(index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement <= mostRecentIndex) {
                 // Here, we already have the velocity information
                 currentlyAvailableFeatures_ |= KeyPositionTrackerNotification::kFeaturePressVelocity;
@@ -540,21 +550,20 @@ void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
         return;
     
     key_buffer_index index = keyBuffer_.endIndex() - 1;
-    int searchBackCounter = 0;
+    key_buffer_index firstVelocityIndex = keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity;
     
-    while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchForStartLocation) {
-        // Take the N-sample velocity average and compare to a minimum threshold
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        if(velocity < kPositionTrackerStartVelocityThreshold) {
-            break;
-        }
-        
-        searchBackCounter++;
-        index--;
-    }
+    // Search period: the samples with a full velocity window, going back no further than the limit
+    key_buffer_index searchStart = firstVelocityIndex;
+    if(index - searchStart > (key_buffer_index)kPositionTrackerSamplesToSearchForStartLocation)
+        searchStart = index - kPositionTrackerSamplesToSearchForStartLocation;
+    
+    // Find the latest N-sample velocity average below the minimum threshold, or if there isn't
+    // one in the search period, the sample just before the period
+    HistoryEntry const* entry = historyAt(index);
+    if(entry != nullptr && entry->lastStartIndex != 0 && entry->lastStartIndex >= searchStart)
+        index = entry->lastStartIndex;
+    else
+        index = searchStart - 1;
     
     // Having either found the minimum velocity or reached the beginning of the search period,
     // store the key start information. Since the velocity is calculated over a window, choose
@@ -566,42 +575,37 @@ void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
     
     // After saving that information, look further back for a specified number of samples to see if there
     // is another mini-spike at the beginning of the key press. This can happen with highly percussive presses.
-    // If so, the start is actually the earlier time.
-    
-    // Leave index where it was...
-    searchBackCounter = 0;
-    bool haveFoundVelocitySpike = false, haveFoundNewMinimum = false;
-    
-    while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchBeyondStartLocation) {
-        // Take the N-sample velocity average and compare to a minimum threshold
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+    // If so, the start is actually the earlier time: the last velocity below the threshold before the
+    // last spike, provided both fall within the look-back period.
+    if(index >= firstVelocityIndex) {
+        key_buffer_index searchBackLimit = firstVelocityIndex;
+        if(index - searchBackLimit > (key_buffer_index)kPositionTrackerSamplesToSearchBeyondStartLocation)
+            searchBackLimit = index - kPositionTrackerSamplesToSearchBeyondStartLocation;
         
-        if(velocity > kPositionTrackerStartVelocitySpikeThreshold) {
-            std::cout << "At index " << index << ", velocity is " << velocity << std::endl;
-            haveFoundVelocitySpike = true;
-        }
+        key_buffer_index spikeIndex = 0, previousStartIndex = 0;
+        if((entry = historyAt(index)) != nullptr)
+            spikeIndex = entry->lastSpikeIndex;
+        if(spikeIndex > searchBackLimit && (entry = historyAt(spikeIndex - 1)) != nullptr)
+            previousStartIndex = entry->lastStartIndex;
         
-        if(velocity < kPositionTrackerStartVelocityThreshold && haveFoundVelocitySpike) {
-            std::cout << "At index " << index << ", velocity is " << velocity << std::endl;
-            haveFoundNewMinimum = true;
-            break;
+        if(previousStartIndex != 0 && previousStartIndex >= searchBackLimit) {
+            std::cout << "At index " << spikeIndex << ", velocity is " << velocityAt(spikeIndex) << std::endl;
+            std::cout << "At index " << previousStartIndex << ", velocity is " << velocityAt(previousStartIndex) << std::endl;
+            
+            // Here we looked back beyond a small spike and found an earlier start time
+            index = previousStartIndex;
+            startIndex_ = index - kPositionTrackerSamplesToAverageForStartVelocity/2;
+            startPosition_ = keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity/2];
+            startTimestamp_ = keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity/2);
+            lastMinMaxPosition_ = startPosition_;
+            
+            std::cout << "Found previous location\n";
         }
-        
-        searchBackCounter++;
-        index--;
     }
     
-    if(haveFoundNewMinimum) {
-        // Here we looked back beyond a small spike and found an earlier start time
-        startIndex_ = index - kPositionTrackerSamplesToAverageForStartVelocity/2;
-        startPosition_ = keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity/2];
-        startTimestamp_ = keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity/2);
-        lastMinMaxPosition_ = startPosition_;
-        
-        std::cout << "Found previous location\n";
-    }
+    // Feature searches run from the new start
+    restartEscapementSearch(pressVelocitySearch_, startIndex_, startTimestamp_);
+    restartPercussivenessSearch();
 }
 
 // When a key is released, retroactively locate where the release started
@@ -610,22 +614,21 @@ void KeyPositionTracker::findKeyReleaseStart(timestamp_type timestamp) {
         return;
     
     key_buffer_index index = keyBuffer_.endIndex() - 1;
-    int searchBackCounter = 0;
     
-    while(index >= keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity && searchBackCounter <= kPositionTrackerSamplesToSearchForReleaseLocation) {
-        // Take the N-sample velocity average and compare to a minimum threshold
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        if(velocity > kPositionTrackerReleaseVelocityThreshold) {
-            std::cout << "Found release at index " << index << " (vel = " << velocity << ")\n";
-            break;
-        }
-        
-        searchBackCounter++;
-        index--;
+    // Search period: the samples with a full velocity window, going back no further than the limit
+    key_buffer_index searchStart = keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity;
+    if(index - searchStart > (key_buffer_index)kPositionTrackerSamplesToSearchForReleaseLocation)
+        searchStart = index - kPositionTrackerSamplesToSearchForReleaseLocation;
+    
+    // Find the latest N-sample velocity average above the release threshold, or if there isn't
+    // one in the search period, the sample just before the period
+    HistoryEntry const* entry = historyAt(index);
+    if(entry != nullptr && entry->lastReleaseIndex != 0 && entry->lastReleaseIndex >= searchStart) {
+        index = entry->lastReleaseIndex;
+        std::cout << "Found release at index " << index << " (vel = " << velocityAt(index) << ")\n";
     }
+    else
+        index = searchStart - 1;
     
     // Having either found the minimum velocity or reached the beginning of the search period,
     // store the key release information.
@@ -638,34 +641,36 @@ void KeyPositionTracker::findKeyReleaseStart(timestamp_type timestamp) {
     releaseEndIndex_ = 0;
     releaseEndPosition_ = missing_value<key_position>::missing();
     releaseEndTimestamp_ = missing_value<timestamp_type>::missing();
+    
+    restartEscapementSearch(releaseVelocitySearch_, releaseBeginIndex_, releaseBeginTimestamp_);
 }
 
-// Find the index at which the key position crosses the given threshold. Returns 0 if not found.
-KeyPositionTracker::key_buffer_index KeyPositionTracker::findMostRecentKeyPositionCrossing(key_position threshold, bool greaterThan, int maxDistance) {
+// Find the index at which the key position crosses the tracker's threshold, no more than
+// maxDistance samples ago. Returns 0 if not found. The crossings are kept current by
+// updateHistory(), so this doesn't need to look at the buffer.
+KeyPositionTracker::key_buffer_index KeyPositionTracker::findMostRecentKeyPositionCrossing(ThresholdCrossingTracker<key_position>& crossing, int maxDistance) {
     if(keyBuffer_.empty())
         return 0;
     
-    key_buffer_index index = keyBuffer_.endIndex() - 1;
-    int searchBackCounter = 0;
+    // Catches up after a change of threshold
+    updateHistory();
     
     // Check if the most recent sample already meets the criterion. If so,
     // there's no crossing yet.
-    if(keyBuffer_[index] >= threshold && greaterThan)
-        return 0;
-    if(keyBuffer_[index] <= threshold && !greaterThan)
+    if(crossing.latestMeets() || !crossing.found())
         return 0;
     
-    while(index >= keyBuffer_.beginIndex() && searchBackCounter <= maxDistance) {
-        if(keyBuffer_[index] >= threshold && greaterThan)
-            return index;
-        else if(keyBuffer_[index] <= threshold && !greaterThan)
-            return index;
-        
-        searchBackCounter++;
-        index--;
-    }
-    
-    return 0;
+    key_buffer_index index = crossing.mostRecentIndex();
+    if(index < keyBuffer_.beginIndex() || keyBuffer_.endIndex() - 1 - index > (key_buffer_index)maxDistance)
+        return 0;
+    return index;
+}
+
+// Velocity averaged over kPositionTrackerSamplesToAverageForStartVelocity samples up to the given index
+key_velocity KeyPositionTracker::velocityAt(key_buffer_index index) {
+    key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - kPositionTrackerSamplesToAverageForStartVelocity];
+    timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity);
+    return calculate_key_velocity(diffPosition, diffTimestamp);
 }
 
 void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, timestamp_type timestamp) {
@@ -675,7 +680,7 @@ void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_b
     // will be the last sample which is above the threshold. What we need is the first sample
     // below the threshold plus at least one more (SamplesNeededForReleaseVelocity...) to
     // perform a local velocity calculation.
-    index = findMostRecentKeyPositionCrossing(releaseVelocityEscapementPosition_, true, 1000);
+    index = findMostRecentKeyPositionCrossing(releaseEscapementCrossing_, 1000);
 
     if(index == 0) {
         // Haven't crossed the threshold yet
@@ -694,4 +699,178 @@ void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_b
         releaseVelocityAvailableIndex_ = index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement + 1;
         releaseVelocityWaitingForThresholdCross_ = false;
     }
-}
\ No newline at end of file
+}
+
+// Add the samples which have arrived since the last update to the velocity history,
+// and bring the escapement crossings up to date
+void KeyPositionTracker::updateHistory() {
+    key_buffer_index endIndex = keyBuffer_.endIndex();
+    
+    // Start over if the buffer was cleared, and skip anything too old to keep
+    if(endIndex < historyEndIndex_)
+        historyBeginIndex_ = historyEndIndex_ = 0;
+    if(endIndex - historyEndIndex_ > (key_buffer_index)kPositionTrackerHistoryLength)
+        historyBeginIndex_ = historyEndIndex_ = endIndex - kPositionTrackerHistoryLength;
+    if(historyBeginIndex_ < keyBuffer_.beginIndex())
+        historyBeginIndex_ = keyBuffer_.beginIndex();
+    if(historyEndIndex_ < historyBeginIndex_)
+        historyEndIndex_ = historyBeginIndex_;
+    
+    key_buffer_index firstVelocityIndex = keyBuffer_.beginIndex() + kPositionTrackerSamplesToAverageForStartVelocity;
+    
+    for(key_buffer_index index = historyEndIndex_; index < endIndex; index++) {
+        HistoryEntry& entry = history_[index % kPositionTrackerHistoryLength];
+        HistoryEntry const* previous = historyAt(index - 1);
+        
+        if(previous != nullptr && index > historyBeginIndex_)
+            entry = *previous;
+        else
+            entry.lastStartIndex = entry.lastReleaseIndex = entry.lastSpikeIndex = 0;
+        
+        // Only samples with a full velocity window count
+        if(index >= firstVelocityIndex) {
+            key_velocity velocity = velocityAt(index);
+            
+            if(velocity < kPositionTrackerStartVelocityThreshold)
+                entry.lastStartIndex = index;
+            if(velocity > kPositionTrackerReleaseVelocityThreshold)
+                entry.lastReleaseIndex = index;
+            if(velocity > kPositionTrackerStartVelocitySpikeThreshold)
+                entry.lastSpikeIndex = index;
+        }
+        historyEndIndex_ = index + 1;
+    }
+    
+    // The crossings only need to reach back as far as anyone will ask
+    key_buffer_index firstCrossingIndex = keyBuffer_.beginIndex();
+    if(endIndex > firstCrossingIndex + kPositionTrackerMaxEscapementCrossingDistance + 1)
+        firstCrossingIndex = endIndex - kPositionTrackerMaxEscapementCrossingDistance - 1;
+    auto positionAt = [this](key_buffer_index i) { return keyBuffer_[i]; };
+    pressEscapementCrossing_.update(firstCrossingIndex, endIndex, positionAt);
+    releaseEscapementCrossing_.update(firstCrossingIndex, endIndex, positionAt);
+}
+
+// History entry for the given index, if it is still kept
+KeyPositionTracker::HistoryEntry const* KeyPositionTracker::historyAt(key_buffer_index index) {
+    if(index < historyBeginIndex_ || index >= historyEndIndex_ ||
+       historyEndIndex_ - index > (key_buffer_index)kPositionTrackerHistoryLength)
+        return nullptr;
+    return &history_[index % kPositionTrackerHistoryLength];
+}
+
+// Search for the escapement crossing from the start of a new press or release
+void KeyPositionTracker::restartEscapementSearch(EscapementSearch& search, key_buffer_index startIndex,
+                                                 timestamp_type startTimestamp) {
+    search.active = !missing_value<timestamp_type>::isMissing(startTimestamp);
+    search.foundIndex = 0;
+    search.nextIndex = startIndex;
+    
+    // Velocity needs two samples before the crossing
+    if(search.nextIndex < keyBuffer_.beginIndex() + 2)
+        search.nextIndex = keyBuffer_.beginIndex() + 2;
+    
+    advanceSearches();
+}
+
+// Calculate percussiveness from the start of a new press
+void KeyPositionTracker::restartPercussivenessSearch() {
+    PercussivenessSearch& search = percussivenessSearch_;
+    
+    // Velocity needs the sample before the start
+    search.active = !missing_value<timestamp_type>::isMissing(startTimestamp_) && startIndex_ > keyBuffer_.beginIndex();
+    search.finished = false;
+    search.nextIndex = startIndex_;
+    search.maximumVelocity = search.largestVelocityDifference = scale_key_velocity(0);
+    search.maximumVelocityIndex = search.largestVelocityDifferenceIndex = startIndex_;
+    search.area = search.areaSinceMaximum = scale_key_velocity(0);
+    search.areaPrecedingSpike = search.areaFollowingSpike = scale_key_velocity(0);
+    
+    advanceSearches();
+}
+
+// Look for the escapement crossing in the samples which have arrived, stopping at the first
+// sample past the escapement position with enough samples after it to calculate velocity.
+// Going down (a release), the crossing is below the position; otherwise above it.
+void KeyPositionTracker::advanceEscapementSearch(EscapementSearch& search, key_position escapementPosition,
+                                                 bool downwards, key_buffer_index limitIndex) {
+    if(!search.active || search.foundIndex != 0 || keyBuffer_.empty())
+        return;
+    
+    int samplesAfter = downwards ? kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement
+                                 : kPositionTrackerSamplesNeededForPressVelocityAfterEscapement;
+    if(keyBuffer_.endIndex() < (key_buffer_index)samplesAfter)
+        return;
+    key_buffer_index endIndex = keyBuffer_.endIndex() - samplesAfter;
+    if(limitIndex != 0 && limitIndex < endIndex)
+        endIndex = limitIndex;
+    
+    for(; search.nextIndex < endIndex; search.nextIndex++) {
+        key_buffer_index index = search.nextIndex;
+        
+        if(downwards ? keyBuffer_[index] < escapementPosition : keyBuffer_[index] > escapementPosition) {
+            // Velocity is calculated by an average of 2 samples before and the ones after
+            key_position diffPosition = keyBuffer_[index + samplesAfter] - keyBuffer_[index - 2];
+            timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + samplesAfter) - keyBuffer_.timestampAt(index - 2);
+            
+            search.foundIndex = index;
+            search.timestamp = keyBuffer_.timestampAt(index); // TODO: interpolate
+            search.velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+            return;
+        }
+    }
+}
+
+// Follow the early part of the press looking for an initial maximum in velocity and the largest
+// rebound after it, with the areas under the velocity curve either side of the maximum
+void KeyPositionTracker::advancePercussivenessSearch() {
+    PercussivenessSearch& search = percussivenessSearch_;
+    if(!search.active || search.finished)
+        return;
+    
+    // If the key press has a defined end, make sure we don't go past it
+    key_buffer_index endIndex = keyBuffer_.endIndex();
+    if(pressIndex_ != 0 && pressIndex_ < endIndex)
+        endIndex = pressIndex_;
+    
+    while(search.nextIndex < endIndex) {
+        key_buffer_index index = search.nextIndex++;
+        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
+        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
+        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+        
+        // Look for maximum of velocity
+        if(velocity > search.maximumVelocity) {
+            search.maximumVelocity = velocity;
+            search.maximumVelocityIndex = index;
+            search.areaPrecedingSpike = search.area;
+            search.areaSinceMaximum = scale_key_velocity(0);
+        }
+        
+        // And given the difference between the max and the current sample,
+        // look for the largest rebound (velocity hitting a peak and falling)
+        if(search.maximumVelocity - velocity > search.largestVelocityDifference) {
+            search.largestVelocityDifference = search.maximumVelocity - velocity;
+            search.largestVelocityDifferenceIndex = index;
+            search.areaFollowingSpike = search.areaSinceMaximum;
+        }
+        
+        search.area += velocity;
+        search.areaSinceMaximum += velocity;
+        
+        // Only look at the early part of the key press: if the key position
+        // makes it more than a certain amount down, assume the initial spike
+        // has passed and finish up. But always allow at least 5 points for the
+        // fastest key presses to be considered.
+        if(index - startIndex_ >= 4 && keyBuffer_[index] > kPositionTrackerPositionThresholdForPercussivenessCalculation) {
+            search.finished = true;
+            break;
+        }
+    }
+}
+
+// Bring all the feature searches up to date
+void KeyPositionTracker::advanceSearches() {
+    advanceEscapementSearch(pressVelocitySearch_, pressVelocityEscapementPosition_, false, pressIndex_);
+    advanceEscapementSearch(releaseVelocitySearch_, releaseVelocityEscapementPosition_, true, releaseEndIndex_);
+    advancePercussivenessSearch();
+}
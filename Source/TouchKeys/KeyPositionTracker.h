@@ -25,6 +25,7 @@
 
 #include "../Utility/Node.h"
 #include "../Utility/Accumulator.h"
+#include "../Utility/SlidingWindow.h"
 #include "PianoTypes.h"
 #include <set>
 
@@ -55,6 +56,12 @@ const key_velocity kPositionTrackerStartVelocityThreshold = scale_key_velocity(0
 const key_velocity kPositionTrackerStartVelocitySpikeThreshold = scale_key_velocity(2.5);
 const key_velocity kPositionTrackerReleaseVelocityThreshold = scale_key_velocity(-0.2);
 
+// How many recent samples to keep velocity history for; must cover the longest search above
+const int kPositionTrackerHistoryLength = 128;
+
+// How far back the escapement crossings are tracked, in samples
+const int kPositionTrackerMaxEscapementCrossingDistance = 1000;
+
 // Constants for feature calculations. The first one is the approximate location of the escapement
 // (empirically measured on one piano, so only approximate), used for velocity calculations
 const key_position kPositionTrackerDefaultPositionForPressVelocityCalculation = scale_key_position(0.65);
@@ -100,6 +107,13 @@ public:
 //
 // This class is triggered by new data points in the key position buffer. Its output is
 // a series of state changes which indicate what the key is doing.
+//
+// Everything the tracker would otherwise search the buffer for is kept up to date as each
+// sample arrives: a short history of where the velocity last crossed each threshold, the
+// most recent escapement crossings, and forward searches from the start of the current press
+// or release for the velocity and percussiveness features. State transitions then only look
+// up the history, and the feature accessors return what has been found so far. The history
+// catches up with the samples that arrived while disengaged when the tracker is engaged.
 
 class KeyPositionTracker : public Node<KeyPositionTrackerNotification> {
 public:
@@ -199,12 +213,16 @@ public:
             pressVelocityEscapementPosition_ = kPositionTrackerPressPosition + kPositionTrackerPressHysteresis;
         else
             pressVelocityEscapementPosition_ = pos;
+        pressEscapementCrossing_.setThreshold(pressVelocityEscapementPosition_);
+        restartEscapementSearch(pressVelocitySearch_, startIndex_, startTimestamp_);
     }
     void setReleaseVelocityEscapementPosition(key_position pos) {
         if(pos < kPositionTrackerReleaseFinishPosition)
             releaseVelocityEscapementPosition_ = kPositionTrackerReleaseFinishPosition;
         else
             releaseVelocityEscapementPosition_ = pos;
+        releaseEscapementCrossing_.setThreshold(releaseVelocityEscapementPosition_);
+        restartEscapementSearch(releaseVelocitySearch_, releaseBeginIndex_, releaseBeginTimestamp_);
     }
     
     
@@ -218,6 +236,9 @@ public:
     
     // Unregister for updates from the key position buffer
     void disengage();
+    
+    // Forget the velocity history; call when the key position buffer is cleared
+    void clearHistory();
 	
     // Reset the state back initial values
 	void reset();
@@ -229,6 +250,38 @@ public:
 	void triggerReceived(TriggerSource* who, timestamp_type timestamp);
 	
 private:
+    // Where the velocity history last met each threshold, at or before a given sample.
+    // Indices are 0 where no sample in the history did.
+    struct HistoryEntry {
+        key_buffer_index lastStartIndex;        // Velocity below the start threshold
+        key_buffer_index lastReleaseIndex;      // Velocity above the release threshold
+        key_buffer_index lastSpikeIndex;        // Velocity above the start spike threshold
+    };
+    
+    // Forward search from the start of a press or release for the first sample past the
+    // escapement position, and the velocity there
+    struct EscapementSearch {
+        bool active;                            // Whether there is a start to search from
+        key_buffer_index nextIndex;             // Next sample to examine
+        key_buffer_index foundIndex;            // Where the crossing was found, or 0
+        timestamp_type timestamp;
+        key_velocity velocity;
+    };
+    
+    // Running percussiveness calculation from the start of a press. The areas are summed in
+    // the same order as a calculation from scratch would, so the results are identical.
+    struct PercussivenessSearch {
+        bool active;                            // Whether there is a start to search from
+        bool finished;                          // Whether the early part of the press is over
+        key_buffer_index nextIndex;             // Next sample to examine
+        key_velocity maximumVelocity, largestVelocityDifference;
+        key_buffer_index maximumVelocityIndex, largestVelocityDifferenceIndex;
+        key_velocity area;                      // Sum of velocities from the start to nextIndex
+        key_velocity areaSinceMaximum;          // ...and from the maximum to nextIndex
+        key_velocity areaPrecedingSpike;        // Area from the start to the maximum
+        key_velocity areaFollowingSpike;        // Area from the maximum to the largest difference
+    };
+    
     // ***** Internal Helper Methods *****
     
     // Change the current state
@@ -242,7 +295,26 @@ private:
     void findKeyReleaseStart(timestamp_type timestamp);
     
     // Generic method to find the most recent crossing of a given point
-    key_buffer_index findMostRecentKeyPositionCrossing(key_position threshold, bool greaterThan, int maxDistance);
+    key_buffer_index findMostRecentKeyPositionCrossing(ThresholdCrossingTracker<key_position>& crossing, int maxDistance);
+    
+    // Average velocity over the window ending at the given index
+    key_velocity velocityAt(key_buffer_index index);
+    
+    // Bring the velocity history and escapement crossings up to date with the key buffer
+    void updateHistory();
+    
+    // History entry for the given index, or nullptr if it is no longer (or not yet) kept
+    HistoryEntry const* historyAt(key_buffer_index index);
+    
+    // Start the feature searches over from a new start index, catching up to the present
+    void restartEscapementSearch(EscapementSearch& search, key_buffer_index startIndex, timestamp_type startTimestamp);
+    void restartPercussivenessSearch();
+    
+    // Advance the feature searches through the samples that have arrived
+    void advanceEscapementSearch(EscapementSearch& search, key_position escapementPosition,
+                                 bool downwards, key_buffer_index limitIndex);
+    void advancePercussivenessSearch();
+    void advanceSearches();
     
     // Look for the crossing of the release velocity threshold to prepare to send the feature
     void prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, timestamp_type timestamp);
@@ -280,6 +352,19 @@ private:
     bool releaseVelocityWaitingForThresholdCross_;              // Set to true if we need to look for release escapement cross
     key_buffer_index percussivenessAvailableIndex_;             // When we can calculate percussiveness features
     
+    // Most recent samples meeting the thresholds we search back for, kept up to date
+    // incrementally rather than rescanning the key buffer each time
+    ThresholdCrossingTracker<key_position> pressEscapementCrossing_;    // Last position at or below press escapement
+    ThresholdCrossingTracker<key_position> releaseEscapementCrossing_;  // Last position at or above release escapement
+    
+    // Velocity history, one entry per sample in a ring, covering [historyBeginIndex_, historyEndIndex_)
+    HistoryEntry history_[kPositionTrackerHistoryLength];
+    key_buffer_index historyBeginIndex_, historyEndIndex_;
+    
+    // Feature searches for the current press and release
+    EscapementSearch pressVelocitySearch_, releaseVelocitySearch_;
+    PercussivenessSearch percussivenessSearch_;
+    
     /*
     typedef struct {
 		int runningSum;						// sum of last N points (i.e. mean * N)
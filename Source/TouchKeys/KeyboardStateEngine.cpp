@@ -0,0 +1,147 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ 
+  =====================================================================
+  KeyboardStateEngine.cpp: screens each frame of key position data for the
+  whole keyboard at once, so that only keys in motion get per-key tracking.
+*/
+
+#include "KeyboardStateEngine.h"
+#include "PianoKeyboard.h"
+#include <cstring>
+
+// Choose a where the mask is all ones and b where it is zero, on the bits so the
+// screening loops vectorize without blend instructions
+static inline float selectByMask(uint32_t mask, float a, float b) {
+    uint32_t aBits, bBits, result;
+    memcpy(&aBits, &a, sizeof(float));
+    memcpy(&bBits, &b, sizeof(float));
+    result = (aBits & mask) | (bBits & ~mask);
+    float selected;
+    memcpy(&selected, &result, sizeof(float));
+    return selected;
+}
+
+KeyboardStateEngine::KeyboardStateEngine(PianoKeyboard& keyboard)
+: keyboard_(keyboard), numFrameNotes_(0) {
+    memset(history_, 0, sizeof(history_));
+    memset(positions_, 0, sizeof(positions_));
+    memset(inFrame_, 0, sizeof(inFrame_));
+    memset(asleep_, 0, sizeof(asleep_));
+    memset(stayingIdle_, 0, sizeof(stayingIdle_));
+    memset(activeMask_, 0, sizeof(activeMask_));
+}
+
+void KeyboardStateEngine::beginFrame() {
+    for(int i = 0; i < numFrameNotes_; i++)
+        inFrame_[frameNotes_[i]] = 0;
+    numFrameNotes_ = 0;
+}
+
+// Add a key's position to the frame. A second position for the same key replaces the first.
+void KeyboardStateEngine::setPosition(int note, key_position position) {
+    if(note < 0 || note >= kKeyboardStateEngineKeys)
+        return;
+    if(inFrame_[note] == 0)
+        frameNotes_[numFrameNotes_++] = note;
+    inFrame_[note] = 0xFFFFFFFF;
+    positions_[note] = (float)position;
+}
+
+// Screen the frame, then deliver each position to its key. Keys staying idle only get the
+// sample in their buffers; the others are evaluated by their idle detectors, which are
+// either listening to the buffer already or woken here.
+void KeyboardStateEngine::endFrame(timestamp_type timestamp) {
+    if(numFrameNotes_ == 0)
+        return;
+    
+    screenFrame();
+    
+    for(int i = 0; i < numFrameNotes_; i++) {
+        int note = frameNotes_[i];
+        PianoKey *key = keyboard_.key(note);
+        if(key == 0)
+            continue;
+        
+        KeyIdleDetector& detector = key->idleDetector();
+        if(!detector.sleepAllowed())
+            detector.setSleepAllowed(true);
+        
+        key->insertSample(positions_[note], timestamp);
+        
+        // The screen worked from the state after the last frame; check the detector is still
+        // asleep, since a reset from elsewhere would have woken it to hear the sample itself
+        if(stayingIdle_[note] == 0 && detector.sleeping())
+            detector.evaluate(timestamp);
+        
+        updateKeyState(note, detector);
+    }
+}
+
+int KeyboardStateEngine::numberOfActiveKeys() {
+    int count = 0;
+    for(int word = 0; word < kKeyboardStateEngineKeys / 64; word++) {
+        for(uint64_t bits = activeMask_[word]; bits != 0; bits &= bits - 1)
+            count++;
+    }
+    return count;
+}
+
+// Shift each key in the frame's history along by one and add its new position, then test
+// whether a sleeping detector would stay idle: the same test as KeyIdleDetector, on the
+// latest position or the average of the history. Every lane is processed, with the masks
+// leaving the keys outside the frame unchanged, so the loops have fixed lengths.
+void KeyboardStateEngine::screenFrame() {
+    const float idleThreshold = (float)kDefaultKeyIdleThreshold;
+    const float sumThreshold = (float)(kKeyIdleNumSamples * 2) * idleThreshold * (1.0f - kKeyboardStateEngineScreenMargin);
+    float sum[kKeyboardStateEngineKeys];
+    
+    for(int k = 0; k < kKeyboardStateEngineKeys; k++)
+        sum[k] = 0;
+    
+    for(int j = 0; j < kKeyIdleNumSamples - 1; j++) {
+        for(int k = 0; k < kKeyboardStateEngineKeys; k++) {
+            float value = selectByMask(inFrame_[k], history_[j + 1][k], history_[j][k]);
+            history_[j][k] = value;
+            sum[k] += value;
+        }
+    }
+    
+    for(int k = 0; k < kKeyboardStateEngineKeys; k++) {
+        float position = selectByMask(inFrame_[k], positions_[k], history_[kKeyIdleNumSamples - 1][k]);
+        history_[kKeyIdleNumSamples - 1][k] = position;
+        sum[k] += position;
+        
+        uint32_t belowThreshold = (uint32_t)-(int32_t)(position < idleThreshold);
+        uint32_t averageBelowThreshold = (uint32_t)-(int32_t)(sum[k] < sumThreshold);
+        stayingIdle_[k] = inFrame_[k] & asleep_[k] & (belowThreshold | averageBelowThreshold);
+    }
+}
+
+// Mirror whether the detector is asleep into the arrays and the active mask
+void KeyboardStateEngine::updateKeyState(int note, KeyIdleDetector& detector) {
+    uint64_t bit = 1ULL << (note & 63);
+    
+    if(detector.sleeping()) {
+        asleep_[note] = 0xFFFFFFFF;
+        activeMask_[note >> 6] &= ~bit;
+    }
+    else {
+        asleep_[note] = 0;
+        activeMask_[note >> 6] |= bit;
+    }
+}
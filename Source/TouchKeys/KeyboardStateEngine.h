@@ -0,0 +1,101 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ 
+  =====================================================================
+  KeyboardStateEngine.h: screens each frame of key position data for the
+  whole keyboard at once, so that only keys in motion get per-key tracking.
+*/
+
+#pragma once
+
+#include "KeyIdleDetector.h"
+#include "PianoTypes.h"
+#include <stdint.h>
+
+const int kKeyboardStateEngineKeys = 128;                      // One lane per MIDI note
+const float kKeyboardStateEngineScreenMargin = 1e-3f;          // Relative margin for the screen's idle average
+
+class PianoKeyboard;
+
+/*
+ * KeyboardStateEngine
+ *
+ * Keeps the state needed to tell whether an idle key is staying idle (its last
+ * kKeyIdleNumSamples positions, and whether its idle detector is asleep) in arrays indexed by
+ * MIDI note, with the history stored sample by sample so that the same entry for every key is
+ * contiguous. The positions from one frame of analog data are collected, then a single
+ * branch-free pass over the arrays updates the history of every key in the frame and applies
+ * the idle detector's own test for staying idle, the latest position or the average being
+ * below the idle threshold. The pass has no dependencies between keys, so it vectorizes.
+ *
+ * Each position is then inserted into its key's buffer as before. A key whose idle detector is
+ * asleep has nothing listening to the buffer, so the insert costs no dispatch; its detector is
+ * only woken with evaluate() when the screen says the key might be going active. The screen
+ * uses a slightly lower average threshold than the detector, so that rounding in the float sum
+ * can only send the detector a sample it would have ignored, never hold back one it wouldn't.
+ * Keys whose detectors are awake make up the active mask.
+ */
+
+class KeyboardStateEngine {
+public:
+    // ***** Constructor *****
+    
+    KeyboardStateEngine(PianoKeyboard& keyboard);
+    
+    // ***** Frames *****
+    //
+    // Positions given between beginFrame() and endFrame() share the timestamp passed to
+    // endFrame(), where they are screened together and then delivered to the keys
+    
+    void beginFrame();
+    void setPosition(int note, key_position position);
+    void endFrame(timestamp_type timestamp);
+    
+    // ***** State *****
+    
+    // Whether a key's idle detector is awake, as of the last frame with a position for it
+    bool isActive(int note) {
+        if(note < 0 || note >= kKeyboardStateEngineKeys)
+            return false;
+        return (activeMask_[note >> 6] & (1ULL << (note & 63))) != 0;
+    }
+    
+    // Active keys as a bitmask, 64 notes per word, lowest note in the lowest bit
+    uint64_t activeMask(int word) { return (word >= 0 && word < kKeyboardStateEngineKeys / 64) ? activeMask_[word] : 0; }
+    int numberOfActiveKeys();
+    
+private:
+    // Update the history of the keys in the frame and work out which are staying idle
+    void screenFrame();
+    
+    // Record whether a key's detector is awake after delivering a sample to it
+    void updateKeyState(int note, KeyIdleDetector& detector);
+    
+    PianoKeyboard& keyboard_;
+    
+    // Per-key state, one lane per note. Masks are all ones for true and zero for false.
+    float history_[kKeyIdleNumSamples][kKeyboardStateEngineKeys];  // Last positions, oldest first
+    float positions_[kKeyboardStateEngineKeys];                     // Positions in this frame
+    uint32_t inFrame_[kKeyboardStateEngineKeys];                    // Whether each key has a position in this frame
+    uint32_t asleep_[kKeyboardStateEngineKeys];                     // Whether each key's detector is asleep
+    uint32_t stayingIdle_[kKeyboardStateEngineKeys];                // Result of the screen
+    
+    int frameNotes_[kKeyboardStateEngineKeys];                      // Notes in this frame, in order received
+    int numFrameNotes_;
+    
+    uint64_t activeMask_[kKeyboardStateEngineKeys / 64];            // Keys whose detectors are awake
+};
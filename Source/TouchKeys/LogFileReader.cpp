@@ -0,0 +1,79 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LogFileReader.cpp: memory-mapped, timestamp-indexed access to the
+  fixed-size records in a TouchKeys or MIDI log file.
+*/
+
+#include "LogFileReader.h"
+#include <algorithm>
+
+// Map the file and build its index. Returns true on success.
+bool LogFileReader::open(std::string const& path) {
+    close();
+
+    if(path == "" || recordLength_ <= 0)
+        return false;
+
+    juce::File file = juce::File::getCurrentWorkingDirectory().getChildFile(juce::String(path));
+    mappedFile_.reset(new juce::MemoryMappedFile(file, juce::MemoryMappedFile::readOnly));
+
+    if(mappedFile_->getData() == nullptr) {
+        // An empty file maps to nothing, but is still a valid (empty) log
+        if(!file.existsAsFile() || file.getSize() != 0) {
+            mappedFile_.reset();
+            return false;
+        }
+    }
+
+    data_ = (const unsigned char *)mappedFile_->getData();
+    numRecords_ = mappedFile_->getSize() / recordLength_;
+    position_ = 0;
+
+    // Touching one record per stride reads only a fraction of the pages
+    index_.clear();
+    index_.reserve(numRecords_ / kLogFileIndexStride + 1);
+    for(size_t i = 0; i < numRecords_; i += kLogFileIndexStride)
+        index_.push_back(timestamp(i));
+
+    return true;
+}
+
+void LogFileReader::close() {
+    mappedFile_.reset();
+    data_ = nullptr;
+    numRecords_ = position_ = 0;
+    index_.clear();
+}
+
+// Move to the first record whose timestamp is at or after the given time
+size_t LogFileReader::seek(timestamp_type time) {
+    // Find the last indexed record before the time; the target lies within
+    // the stride following it
+    std::vector<timestamp_type>::iterator it = std::lower_bound(index_.begin(), index_.end(), time);
+    size_t block = (it == index_.begin() ? 0 : (it - index_.begin()) - 1);
+    size_t end = std::min(numRecords_, (block + 1) * kLogFileIndexStride + 1);
+
+    size_t i = block * kLogFileIndexStride;
+    while(i < end && timestamp(i) < time)
+        i++;
+
+    setPosition(i);
+    return position_;
+}
@@ -0,0 +1,95 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LogFileReader.h: memory-mapped, timestamp-indexed access to the
+  fixed-size records in a TouchKeys or MIDI log file.
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "../Utility/Types.h"
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+const int kLogFileIndexStride = 256;    // Records between entries in the timestamp index
+
+/*
+ * LogFileReader
+ *
+ * Maps a log file into memory and reads it as an array of fixed-length records, each
+ * starting with a timestamp_type. On opening, the timestamp of every kLogFileIndexStride-th
+ * record is collected into a sparse index, so seeking to a timestamp in either direction is
+ * a binary search on the index followed by a short scan, without reading the file from the
+ * start. Records are returned as pointers into the mapping rather than copied out.
+ *
+ * Timestamps are assumed to be non-decreasing, which holds for the logs TouchkeyDevice and
+ * MidiInputController write. A partial record at the end of the file is ignored.
+ */
+
+class LogFileReader {
+public:
+    // ***** Constructor *****
+
+    LogFileReader(int recordLength) : recordLength_(recordLength), data_(nullptr), numRecords_(0), position_(0) {}
+
+    // ***** File management *****
+
+    // Map the file and build its index. Returns true on success.
+    bool open(std::string const& path);
+    void close();
+    bool isOpen() { return mappedFile_ != nullptr; }
+
+    // ***** Reading *****
+
+    // Return the record at the current position and advance, or nullptr at the end of the file.
+    // The pointer stays valid until the file is closed; the record may not be aligned.
+    const unsigned char *nextRecord() {
+        if(position_ >= numRecords_)
+            return nullptr;
+        return record(position_++);
+    }
+
+    const unsigned char *record(size_t index) { return data_ + index * recordLength_; }
+    timestamp_type timestamp(size_t index) {
+        timestamp_type result;
+        memcpy(&result, record(index), sizeof(timestamp_type));
+        return result;
+    }
+
+    // ***** Position *****
+
+    size_t numberOfRecords() { return numRecords_; }
+    size_t position() { return position_; }
+    void setPosition(size_t index) { position_ = (index < numRecords_ ? index : numRecords_); }
+
+    // Move to the first record whose timestamp is at or after the given time,
+    // or to the end if there isn't one. Returns the new position.
+    size_t seek(timestamp_type time);
+
+private:
+    int recordLength_;                                  // Size of each record in bytes
+    std::unique_ptr<juce::MemoryMappedFile> mappedFile_;
+    const unsigned char *data_;                         // Start of the mapped file
+    size_t numRecords_;                                 // Whole records in the file
+    size_t position_;                                   // Index of the next record to read
+    std::vector<timestamp_type> index_;                 // Timestamp of every kLogFileIndexStride-th record
+};
@@ -23,7 +23,8 @@
 #include "LogPlayback.h"
 
 LogPlayback::LogPlayback(PianoKeyboard& keyboard, MidiInputController& midi)
-: keyboard_(keyboard), midiInputController_(midi), open_(false), playing_(false), paused_(false),
+: keyboard_(keyboard), midiInputController_(midi),
+  touchLog_(kLogPlaybackTouchRecordLength), midiLog_(kLogPlaybackMidiRecordLength), open_(false), playing_(false), paused_(false),
   usingTouch_(false), usingMidi_(false), playbackRate_(1.0),
   nextTouchMidiNote_(0), nextTouchTimestamp_(0), nextMidiTimestamp_(0),
   lastMidiTimestamp_(0), timestampOffset_(0)
@@ -43,11 +44,11 @@ LogPlayback::~LogPlayback()
 // File management. Open a touch and/or MIDI file. Returns true on success.
 // Pass a blank string to either one of the paths to not use that form of data capture
 bool LogPlayback::openLogFiles( std::string const& touchPath, std::string const& midiPath) {
-    touchLog_.open (touchPath.c_str(), std::ios::in | std::ios::binary);
-    midiLog_.open (midiPath.c_str(), std::ios::in | std::ios::binary);
+    touchLog_.open(touchPath);
+    midiLog_.open(midiPath);
     
-    usingTouch_ = touchLog_.is_open();
-    usingMidi_ = midiLog_.is_open();
+    usingTouch_ = touchLog_.isOpen();
+    usingMidi_ = midiLog_.isOpen();
     
     // Check for bad file paths
     if(!usingTouch_ && touchPath != "")
@@ -83,7 +84,13 @@ void LogPlayback::startPlayback(timestamp_type startingTimestamp) {
     // Start the playback scheduler thread
     playbackScheduler_.start(0);
     
-    timestamp_type firstTouchTimestamp, firstMidiTimestamp;
+    timestamp_type firstTouchTimestamp = 0, firstMidiTimestamp = 0;
+    
+    // Start from the requested point in the files
+    usingTouch_ = touchLog_.isOpen();
+    usingMidi_ = midiLog_.isOpen();
+    touchLog_.seek(startingTimestamp);
+    midiLog_.seek(startingTimestamp);
     
     // Register actions on the scheduler thread
     if(usingTouch_) {
@@ -150,58 +157,44 @@ void LogPlayback::resumePlayback() {
     }
 }
 
-// Seek to a timestamp in the file
+// Seek to a timestamp in the file. The index in each log makes this quick
+// in either direction.
 void LogPlayback::seekPlayback(timestamp_type newTimestamp) {
-    // Advance through the file until we reach the indicated timestamp
-    
     if(!playing_ || !open_)
         return;
     
     // Remove any future actions while we perform the seek
     playbackScheduler_.unschedule(this);
-    //timestamp_diff_type offset = 0;
     timestamp_type firstUpcomingTimestamp = 0;
     
+    // Streams which had reached the end can play again after seeking backwards
+    usingTouch_ = touchLog_.isOpen();
+    usingMidi_ = midiLog_.isOpen();
+    
     if(usingTouch_) {
-        //timestamp_type lastTimestamp = nextTouchTimestamp_;
-        
-        // TODO: this assumes the seek is moving forward
-        while(nextTouchTimestamp_ <= newTimestamp) {
-            if(!readNextTouchFrame()) { // EOF or error
-                usingTouch_ = false;
-                if(!usingMidi_)
-                    playing_ = paused_ = false;
-                break;
-            }
-        }
-        
-        // Now we have the first event scheduled after the seek location
-        // Update timestamp offset to continue playback from here.
-
-        //offset = nextTouchTimestamp_ - lastTimestamp;
-        firstUpcomingTimestamp = nextTouchTimestamp_;
+        // Find the first event after the seek location
+        touchLog_.seek(newTimestamp);
+        if(!readNextTouchFrame()) // EOF or error
+            usingTouch_ = false;
+        else
+            firstUpcomingTimestamp = nextTouchTimestamp_;
     }
     if(usingMidi_) {
-        //timestamp_type lastTimestamp = nextMidiTimestamp_;
-        
-        // TODO: this assumes the seek is moving forward
-        while(nextMidiTimestamp_ <= newTimestamp) {
-            if(!readNextMidiFrame()) { // EOF or error
-                usingMidi_ = false;
-                if(!usingTouch_)
-                    playing_ = paused_ = false;
-                break;
-            }
+        midiLog_.seek(newTimestamp);
+        if(!readNextMidiFrame()) // EOF or error
+            usingMidi_ = false;
+        else {
+            // Update timestamp offset to continue playback from here.
+            // Use whichever event came first
+            if(!usingTouch_ || nextMidiTimestamp_ < nextTouchTimestamp_)
+                firstUpcomingTimestamp = nextMidiTimestamp_;
+            lastMidiTimestamp_ = nextMidiTimestamp_;
         }
-        
-        // Now we have the first event scheduled after the seek location
-        // Update timestamp offset to continue playback from here.
-        // Use whichever event came first
-        
-        //if(!(usingTouch_ && (nextMidiTimestamp_ - lastTimestamp) > offset))
-        //    offset = (nextMidiTimestamp_ - lastTimestamp);
-        if(!usingTouch_ || nextMidiTimestamp_ < nextTouchTimestamp_);
-            firstUpcomingTimestamp = nextMidiTimestamp_;
+    }
+    
+    if(!usingTouch_ && !usingMidi_) {
+        playing_ = paused_ = false;
+        return;
     }
     
     // Update the timestamp offset
@@ -337,26 +330,22 @@ timestamp_type LogPlayback::nextMidiEvent() {
 // Retrieve the next key touch frame from the log file
 // Return true if a touch was found, false if EOF or an error occurred
 bool LogPlayback::readNextTouchFrame() {
-    int frameCounter;
+    const unsigned char *record = touchLog_.nextRecord();
     
-    try {
-        touchLog_.read((char *)&nextTouchTimestamp_, sizeof(timestamp_type));
-        touchLog_.read((char *)&frameCounter, sizeof(int));
-        touchLog_.read((char *)&nextTouchMidiNote_, sizeof(int));
-        touchLog_.read((char *)&nextTouch_, sizeof(KeyTouchFrame));
-    }
-    catch(...) {
-        std::cout << "error reading touch\n";
-        return false;
-    }
-    if(touchLog_.eof()) {
+    if(record == nullptr) {
         std::cout << "Touch log playback finished\n";
         return false;
     }
     
-    //std::cout << "read touch on key " << nextTouchMidiNote_ << " timestamp " << nextTouchTimestamp_ << '\n';
-    
+    // Record layout: timestamp, frame counter, MIDI note, KeyTouchFrame.
     // TODO: what about frameCounter
+    memcpy(&nextTouchTimestamp_, record, sizeof(timestamp_type));
+    record += sizeof(timestamp_type) + sizeof(int);
+    memcpy(&nextTouchMidiNote_, record, sizeof(int));
+    record += sizeof(int);
+    memcpy(&nextTouch_, record, sizeof(KeyTouchFrame));
+    
+    //std::cout << "read touch on key " << nextTouchMidiNote_ << " timestamp " << nextTouchTimestamp_ << '\n';
     
     return true;
 }
@@ -364,30 +353,24 @@ bool LogPlayback::readNextTouchFrame() {
 // Retrieve the next MIDI frame from the log file
 // Return true if an event was found, false if EOF or an error occurred
 bool LogPlayback::readNextMidiFrame() {
-    int midi0, midi1, midi2;
+    const unsigned char *record = midiLog_.nextRecord();
+    int midi[3];
     
-    try {
-        midiLog_.read((char*)&nextMidiTimestamp_, sizeof (timestamp_type));
-        midiLog_.read((char*)&midi0, sizeof (int));
-        midiLog_.read((char*)&midi1, sizeof (int));
-        midiLog_.read((char*)&midi2, sizeof (int));
-    }
-    catch(...) {
-        std::cout << "error reading MIDI\n";
-        return false;
-    }
-    
-    if(midiLog_.eof()) {
+    if(record == nullptr) {
         std::cout << "MIDI log playback finished\n";
         return false;
     }
     
+    // Record layout: timestamp, then three MIDI bytes stored as ints
+    memcpy(&nextMidiTimestamp_, record, sizeof(timestamp_type));
+    memcpy(midi, record + sizeof(timestamp_type), sizeof(midi));
+    
     nextMidi_.clear();
-    nextMidi_.push_back((unsigned char)midi0);
-    nextMidi_.push_back((unsigned char)midi1);
-    nextMidi_.push_back((unsigned char)midi2);
+    nextMidi_.push_back((unsigned char)midi[0]);
+    nextMidi_.push_back((unsigned char)midi[1]);
+    nextMidi_.push_back((unsigned char)midi[2]);
     
-    //std::cout << "read MIDI data " << (int)midi0 << " " << (int)midi1 << " " << (int)midi2 << '\n';
+    //std::cout << "read MIDI data " << (int)midi[0] << " " << (int)midi[1] << " " << (int)midi[2] << '\n';
     
     return true;
-}
\ No newline at end of file
+}
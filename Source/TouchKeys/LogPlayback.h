@@ -25,12 +25,16 @@
 #include "MidiInputController.h"
 #include "KeyTouchFrame.h"
 #include "PianoKeyboard.h"
+#include "LogFileReader.h"
 #include "../Utility/Scheduler.h"
 #include <boost/bind.hpp>
 #include <iostream>
-#include <fstream>
 #include <vector>
 
+// Record layouts written by TouchkeyDevice and MidiInputController
+const int kLogPlaybackTouchRecordLength = sizeof(timestamp_type) + 2 * sizeof(int) + sizeof(KeyTouchFrame);
+const int kLogPlaybackMidiRecordLength = sizeof(timestamp_type) + 3 * sizeof(int);
+
 class LogPlayback {
 public:
     // ***** Constructor and Destructor *****
@@ -49,7 +53,7 @@ public:
     void pausePlayback();
     void resumePlayback();
     
-    // Seek to location and/or change the rate
+    // Seek to location (forwards or backwards, in log file time) and/or change the rate
     void seekPlayback(timestamp_type newTimestamp);
     void changePlaybackRate(float rate);
     
@@ -67,8 +71,8 @@ private:
     Scheduler::action touchAction_; // Scheduler action for playing next touch
     Scheduler::action midiAction_;  // Scheduler action for playing next MIDI event
     
-    std::ifstream touchLog_;           // Log file for key touches
-    std::ifstream midiLog_;            // Log file for MIDI data
+    LogFileReader touchLog_;      // Log file for key touches
+    LogFileReader midiLog_;       // Log file for MIDI data
     
     bool open_;                   // Whether files are open
     bool playing_;                // Whether playback is active
@@ -0,0 +1,277 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LogReplay.cpp: replays recorded TouchKeys and MIDI logs in virtual time,
+  as fast as possible, recording the resulting MIDI and OSC output.
+*/
+
+#include "LogReplay.h"
+#include <algorithm>
+
+// Device frame number of an analog record, stored 32-bit little endian after the octave
+static int analogRecordFrame(const unsigned char *record) {
+    return record[1] + ((int)record[2] << 8) + ((int)record[3] << 16) + ((int)record[4] << 24);
+}
+
+LogReplay::LogReplay(PianoKeyboard& keyboard, TouchkeyDevice& touchkeyDevice, MidiInputController& midiInput,
+                     MidiOutputController& midiOutput, OscTransmitter& oscTransmitter)
+: keyboard_(keyboard), touchkeyDevice_(touchkeyDevice), midiInputController_(midiInput),
+  midiOutputController_(midiOutput), oscTransmitter_(oscTransmitter),
+  touchLog_(kLogPlaybackTouchRecordLength), midiLog_(kLogPlaybackMidiRecordLength),
+  analogLog_(kLogReplayAnalogRecordLength), analogAnchorFrame_(0), analogAnchorTimestamp_(0),
+  touchFramesReplayed_(0), midiEventsReplayed_(0), analogFramesReplayed_(0),
+  midiMessagesOutput_(0), oscMessagesOutput_(0),
+  virtualDurationMilliseconds_(0), wallDurationMilliseconds_(0)
+{
+}
+
+LogReplay::~LogReplay() {
+    closeLogFiles();
+}
+
+// Open touch, MIDI and analog logs. Returns true on success.
+bool LogReplay::openLogFiles(std::string const& touchPath, std::string const& midiPath,
+                             std::string const& analogPath) {
+    closeLogFiles();
+
+    if((touchPath != "" && !touchLog_.open(touchPath)) ||
+       (midiPath != "" && !midiLog_.open(midiPath)) ||
+       (analogPath != "" && !analogLog_.open(analogPath))) {
+        closeLogFiles();
+        return false;
+    }
+
+    return touchLog_.isOpen() || midiLog_.isOpen() || analogLog_.isOpen();
+}
+
+void LogReplay::closeLogFiles() {
+    touchLog_.close();
+    midiLog_.close();
+    analogLog_.close();
+}
+
+// Load the key calibration for the analog log. Each analog frame covers two octaves
+// from the octave in its first byte, so the highest one gives the keyboard size.
+bool LogReplay::loadAnalogCalibration(std::string const& path) {
+    int highestOctave = -1;
+    for(size_t i = 0; i < analogLog_.numberOfRecords(); i++)
+        highestOctave = std::max(highestOctave, (int)analogLog_.record(i)[0]);
+
+    return touchkeyDevice_.replayLoadCalibration(highestOctave >= 0 ? highestOctave + 2 : 0, path);
+}
+
+// Replay both logs from the start in virtual time, merging them by timestamp
+bool LogReplay::run(std::string const& outputPath) {
+    if(!touchLog_.isOpen() && !midiLog_.isOpen())
+        return false;
+
+    output_.open(outputPath.c_str(), std::ios::out);
+    if(!output_.is_open())
+        return false;
+    output_ << std::fixed;
+
+    touchFramesReplayed_ = midiEventsReplayed_ = analogFramesReplayed_ = 0;
+    midiMessagesOutput_ = oscMessagesOutput_ = 0;
+    touchLog_.setPosition(0);
+    midiLog_.setPosition(0);
+    analogLog_.setPosition(0);
+
+    const unsigned char *nextTouch = touchLog_.nextRecord();
+    const unsigned char *nextMidi = midiLog_.nextRecord();
+    const unsigned char *nextAnalog = analogLog_.nextRecord();
+    timestamp_type nextTouchTimestamp = 0, nextMidiTimestamp = 0, nextAnalogTimestamp = 0;
+    if(nextTouch != nullptr)
+        memcpy(&nextTouchTimestamp, nextTouch, sizeof(timestamp_type));
+    if(nextMidi != nullptr)
+        memcpy(&nextMidiTimestamp, nextMidi, sizeof(timestamp_type));
+
+    // Tie the analog frame numbers to the first touch record, which has both,
+    // or failing that start them with the MIDI log
+    if(nextAnalog != nullptr) {
+        int frame;
+        if(nextTouch != nullptr) {
+            memcpy(&frame, nextTouch + sizeof(timestamp_type), sizeof(int));
+            analogAnchorTimestamp_ = nextTouchTimestamp;
+        }
+        else {
+            frame = analogRecordFrame(nextAnalog);
+            analogAnchorTimestamp_ = nextMidiTimestamp;
+        }
+        analogAnchorFrame_ = frame;
+        nextAnalogTimestamp = analogTimestamp(nextAnalog);
+    }
+
+    // Start the clock at the first recorded event
+    timestamp_type startTimestamp = 0;
+    bool started = false;
+    if(nextTouch != nullptr) {
+        startTimestamp = nextTouchTimestamp;
+        started = true;
+    }
+    if(nextMidi != nullptr && (!started || nextMidiTimestamp < startTimestamp)) {
+        startTimestamp = nextMidiTimestamp;
+        started = true;
+    }
+    if(nextAnalog != nullptr && (!started || nextAnalogTimestamp < startTimestamp))
+        startTimestamp = nextAnalogTimestamp;
+    timestamp_type lastTimestamp = startTimestamp;
+
+    double wallStartTime = juce::Time::getMillisecondCounterHiRes();
+
+    midiOutputController_.setMessageMonitor(boost::bind(&LogReplay::midiOutputMonitor, this, _1, _2));
+    oscTransmitter_.setMessageMonitor(boost::bind(&LogReplay::oscOutputMonitor, this, _1, _2, _3));
+    keyboard_.setVirtualTimeEnabled(true, startTimestamp);
+
+    while(nextTouch != nullptr || nextMidi != nullptr || nextAnalog != nullptr) {
+        // Play whichever comes first; on a tie touch goes first, then analog, then MIDI
+        bool touchFirst = nextTouch != nullptr &&
+                          (nextAnalog == nullptr || nextTouchTimestamp <= nextAnalogTimestamp) &&
+                          (nextMidi == nullptr || nextTouchTimestamp <= nextMidiTimestamp);
+        bool analogFirst = !touchFirst && nextAnalog != nullptr &&
+                           (nextMidi == nullptr || nextAnalogTimestamp <= nextMidiTimestamp);
+
+        if(touchFirst) {
+            if(nextTouchTimestamp > lastTimestamp)
+                lastTimestamp = nextTouchTimestamp;
+            keyboard_.advanceVirtualTime(lastTimestamp);
+            playTouchRecord(nextTouch);
+
+            nextTouch = touchLog_.nextRecord();
+            if(nextTouch != nullptr)
+                memcpy(&nextTouchTimestamp, nextTouch, sizeof(timestamp_type));
+        }
+        else if(analogFirst) {
+            if(nextAnalogTimestamp > lastTimestamp)
+                lastTimestamp = nextAnalogTimestamp;
+            keyboard_.advanceVirtualTime(lastTimestamp);
+            touchkeyDevice_.replayAnalogRecord(nextAnalog, lastTimestamp);
+            analogFramesReplayed_++;
+
+            nextAnalog = analogLog_.nextRecord();
+            if(nextAnalog != nullptr)
+                nextAnalogTimestamp = analogTimestamp(nextAnalog);
+        }
+        else {
+            if(nextMidiTimestamp > lastTimestamp)
+                lastTimestamp = nextMidiTimestamp;
+            keyboard_.advanceVirtualTime(lastTimestamp);
+            playMidiRecord(nextMidi);
+
+            nextMidi = midiLog_.nextRecord();
+            if(nextMidi != nullptr)
+                memcpy(&nextMidiTimestamp, nextMidi, sizeof(timestamp_type));
+        }
+    }
+
+    // Let anything still scheduled (releases, ramps) finish, then clear the keys
+    // so nothing is left running when the clock goes back to real time
+    keyboard_.advanceVirtualTime(lastTimestamp + milliseconds_to_timestamp(kLogReplayTailMilliseconds));
+    keyboard_.reset();
+    keyboard_.advanceVirtualTime(lastTimestamp + milliseconds_to_timestamp(kLogReplayTailMilliseconds));
+    keyboard_.setVirtualTimeEnabled(false);
+
+    midiOutputController_.setMessageMonitor(MidiOutputController::MessageMonitor());
+    oscTransmitter_.setMessageMonitor(OscTransmitter::MessageMonitor());
+
+    wallDurationMilliseconds_ = juce::Time::getMillisecondCounterHiRes() - wallStartTime;
+    virtualDurationMilliseconds_ = timestamp_to_milliseconds(lastTimestamp - startTimestamp);
+
+    output_.close();
+    return true;
+}
+
+// Deliver one key touch record at the current virtual time
+void LogReplay::playTouchRecord(const unsigned char *record) {
+    int midiNote;
+    KeyTouchFrame frame;
+
+    // Record layout: timestamp, frame counter, MIDI note, KeyTouchFrame
+    memcpy(&midiNote, record + sizeof(timestamp_type) + sizeof(int), sizeof(int));
+    memcpy(&frame, record + sizeof(timestamp_type) + 2 * sizeof(int), sizeof(KeyTouchFrame));
+
+    if(midiNote < 0 || midiNote > 127 || keyboard_.key(midiNote) == 0)
+        return;
+
+    if(frame.count == 0)
+        keyboard_.key(midiNote)->touchOff(keyboard_.schedulerCurrentTimestamp());
+    else
+        keyboard_.key(midiNote)->touchInsertFrame(frame, keyboard_.schedulerCurrentTimestamp());
+    touchFramesReplayed_++;
+}
+
+// Place an analog record on the replay clock. Device frames are 1ms apart.
+timestamp_type LogReplay::analogTimestamp(const unsigned char *record) {
+    long long offset = (long long)analogRecordFrame(record) - analogAnchorFrame_;
+    if(offset >= 0)
+        return analogAnchorTimestamp_ + milliseconds_to_timestamp(offset);
+    if(analogAnchorTimestamp_ > milliseconds_to_timestamp(-offset))
+        return analogAnchorTimestamp_ - milliseconds_to_timestamp(-offset);
+    return 0;
+}
+
+// Deliver one MIDI record at the current virtual time
+void LogReplay::playMidiRecord(const unsigned char *record) {
+    int midi[3];
+
+    // Record layout: timestamp, then three MIDI bytes stored as ints
+    memcpy(midi, record + sizeof(timestamp_type), sizeof(midi));
+
+    if((midi[0] & 0xF0) == 0xD0) // channel aftertouch has 2 bytes
+        midiInputController_.handleIncomingMidiMessage(0, juce::MidiMessage(midi[0], midi[1]));
+    else
+        midiInputController_.handleIncomingMidiMessage(0, juce::MidiMessage(midi[0], midi[1], midi[2]));
+    midiEventsReplayed_++;
+}
+
+// Record outgoing MIDI as: time midi port bytes...
+void LogReplay::midiOutputMonitor(int port, const juce::MidiMessage& message) {
+    const unsigned char *data = message.getRawData();
+    int dataSize = message.getRawDataSize();
+
+    output_ << std::setprecision(3) << timestamp_to_milliseconds(keyboard_.schedulerCurrentTimestamp())
+            << " midi " << port << std::hex;
+    for(int i = 0; i < dataSize; i++)
+        output_ << ' ' << (int)data[i];
+    output_ << std::dec << '\n';
+    midiMessagesOutput_++;
+}
+
+// Record outgoing OSC as: time osc path types arguments...
+void LogReplay::oscOutputMonitor(const char *path, const char *types, const lo_message& message) {
+    int argc = lo_message_get_argc(message);
+    lo_arg **argv = lo_message_get_argv(message);
+
+    output_ << std::setprecision(3) << timestamp_to_milliseconds(keyboard_.schedulerCurrentTimestamp())
+            << " osc " << path << ' ' << types << std::setprecision(6);
+    for(int i = 0; i < argc && types[i] != '\0'; i++) {
+        output_ << ' ';
+        switch(types[i]) {
+            case 'i': output_ << argv[i]->i; break;
+            case 'h': output_ << argv[i]->h; break;
+            case 'f': output_ << argv[i]->f; break;
+            case 'd': output_ << argv[i]->d; break;
+            case 's':
+            case 'S': output_ << &argv[i]->s; break;
+            case 'c': output_ << (int)argv[i]->c; break;
+            default:  output_ << types[i]; break;   // Types without a printable value
+        }
+    }
+    output_ << '\n';
+    oscMessagesOutput_++;
+}
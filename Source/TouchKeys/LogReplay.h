@@ -0,0 +1,121 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LogReplay.h: replays recorded TouchKeys and MIDI logs in virtual time,
+  as fast as possible, recording the resulting MIDI and OSC output.
+*/
+
+#pragma once
+
+#include "LogPlayback.h"
+#include "LogFileReader.h"
+#include "MidiOutputController.h"
+#include "TouchkeyDevice.h"
+#include "Osc.h"
+#include <fstream>
+#include <string>
+
+const double kLogReplayTailMilliseconds = 1000.0;   // Time to keep running after the last event
+const int kLogReplayAnalogRecordLength = 1 + kAnalogFrameLength;   // Octave, then the frame from the device
+
+/*
+ * LogReplay
+ *
+ * Headless counterpart to LogPlayback. Rather than feeding the logs through a real-time
+ * scheduler, the keyboard is switched to virtual time and each recorded event is delivered
+ * at its original timestamp, with the clock stepped through every scheduled event and
+ * mapping action in between. Nothing waits on the wall clock, so a long session replays in
+ * a fraction of its length, and the same logs and preset always produce the same output.
+ *
+ * The analog (key position) log carries no host timestamps, only the device's frame numbers,
+ * which count milliseconds. Its frames are placed on the touch log's clock using the frame
+ * number and timestamp of the first touch record, or start at the first MIDI event if there
+ * is no touch log. They go through the device's calibrators to the keyboard state engine, so
+ * a calibration matching the log must be loaded first.
+ *
+ * Every MIDI and OSC message sent during the replay is written to a text file, one per
+ * line with its virtual timestamp, suitable for comparing runs with diff. External OSC
+ * transmission is suspended for the duration.
+ */
+
+class LogReplay {
+public:
+    // ***** Constructor and Destructor *****
+    LogReplay(PianoKeyboard& keyboard, TouchkeyDevice& touchkeyDevice, MidiInputController& midiInput,
+              MidiOutputController& midiOutput, OscTransmitter& oscTransmitter);
+
+    ~LogReplay();
+
+    // ***** Replay *****
+
+    // Open touch, MIDI and analog logs. Pass a blank string to leave one out. Returns true on success.
+    bool openLogFiles(std::string const& touchPath, std::string const& midiPath,
+                      std::string const& analogPath = "");
+    void closeLogFiles();
+
+    // Load the key calibration for the analog log, sized to the octaves found in it
+    bool loadAnalogCalibration(std::string const& path);
+
+    // Replay the logs from the beginning, writing the output to the given file.
+    // Returns false if no log is open or the output can't be written.
+    bool run(std::string const& outputPath);
+
+    // ***** Statistics *****
+
+    unsigned long touchFramesReplayed() { return touchFramesReplayed_; }
+    unsigned long midiEventsReplayed() { return midiEventsReplayed_; }
+    unsigned long analogFramesReplayed() { return analogFramesReplayed_; }
+    unsigned long midiMessagesOutput() { return midiMessagesOutput_; }
+    unsigned long oscMessagesOutput() { return oscMessagesOutput_; }
+    double virtualDurationMilliseconds() { return virtualDurationMilliseconds_; }
+    double wallDurationMilliseconds() { return wallDurationMilliseconds_; }
+
+private:
+    // Deliver one log record to the keyboard at the current virtual time
+    void playTouchRecord(const unsigned char *record);
+    void playMidiRecord(const unsigned char *record);
+
+    // Timestamp of an analog record, from its frame number
+    timestamp_type analogTimestamp(const unsigned char *record);
+
+    // Record outgoing messages
+    void midiOutputMonitor(int port, const juce::MidiMessage& message);
+    void oscOutputMonitor(const char *path, const char *types, const lo_message& message);
+
+    PianoKeyboard& keyboard_;                   // Main keyboard controller
+    TouchkeyDevice& touchkeyDevice_;            // Destination for recorded key positions
+    MidiInputController& midiInputController_; // Destination for recorded MIDI
+    MidiOutputController& midiOutputController_; // Sources of output to record
+    OscTransmitter& oscTransmitter_;
+
+    LogFileReader touchLog_;                    // Log file for key touches
+    LogFileReader midiLog_;                     // Log file for MIDI data
+    LogFileReader analogLog_;                   // Log file for key positions (not timestamp-indexed)
+    long long analogAnchorFrame_;               // Device frame number corresponding to...
+    timestamp_type analogAnchorTimestamp_;      // ...this timestamp
+    std::ofstream output_;                      // Recorded MIDI and OSC output
+
+    unsigned long touchFramesReplayed_;         // Statistics
+    unsigned long midiEventsReplayed_;
+    unsigned long analogFramesReplayed_;
+    unsigned long midiMessagesOutput_;
+    unsigned long oscMessagesOutput_;
+    double virtualDurationMilliseconds_;
+    double wallDurationMilliseconds_;
+};
@@ -36,6 +36,8 @@ MidiInputController::MidiInputController(PianoKeyboard& keyboard)
 : keyboard_(keyboard), midiOutputController_(0), primaryActivePort_(-1),
   segmentUniqueIdentifier_(0)
 {    
+    logRecorder = nullptr;
+    midiLog = nullptr;
     logFileCreated = false;
     loggingActive = false;
 
@@ -53,8 +55,11 @@ void MidiInputController::setMidiOutputController(MidiOutputController* ct) {
 
 // ------------------------------------------------------
 // create a new MIDI log file, ready to have data written to it
-void MidiInputController::createLogFile(std::string midiLog_filename, std::string path)
+void MidiInputController::createLogFile(LogRecorder& recorder, std::string midiLog_filename, std::string path)
 {
+    if (logFileCreated)
+        closeLogFile();
+    
     // indicate that we have created a log file (so we can close it later)
     logFileCreated = true;
     
@@ -65,11 +70,9 @@ void MidiInputController::createLogFile(std::string midiLog_filename, std::strin
     
     midiLog_filename = path + midiLog_filename;
     
-    char *fileName = (char*)midiLog_filename.c_str();
-    
-    // create output file
-    midiLog.open (fileName, std::ios::out | std::ios::binary);
-    midiLog.seekp(0);
+    // create output stream, written by the recorder's thread
+    logRecorder = &recorder;
+    midiLog = recorder.openStream(midiLog_filename);
 }
 
 // ------------------------------------------------------
@@ -78,7 +81,8 @@ void MidiInputController::closeLogFile()
 {
     if (logFileCreated)
     {
-        midiLog.close();
+        // Records still queued are written before the file closes
+        logRecorder->closeStream(midiLog);
         logFileCreated = false;
     }
 }
@@ -450,25 +454,21 @@ void MidiInputController::handleIncomingMidiMessage( juce::MidiInput* source, co
     const unsigned char *messageData = message.getRawData();
 	
     // if logging is active
-    if (loggingActive)
+    if (loggingActive && midiLog != nullptr)
     {
-        ////////////////////////////////////////////////////////
-        ////////////////////////////////////////////////////////
-        //////////////////// BEGIN LOGGING /////////////////////
-        
+        // Record layout: timestamp, then channel, number and velocity as ints
         int midi_channel = (int)(messageData[0]);
         int midi_number = dataSize > 1 ? (int)(messageData[1]) : 0;
         int midi_velocity = dataSize > 2 ? (int)(messageData[2]) : 0;
         timestamp_type timestamp = keyboard_.schedulerCurrentTimestamp();
         
-        midiLog.write ((char*)&timestamp, sizeof (timestamp_type));
-        midiLog.write ((char*)&midi_channel, sizeof (int));
-        midiLog.write ((char*)&midi_number, sizeof (int));
-        midiLog.write ((char*)&midi_velocity, sizeof (int));
+        unsigned char record[sizeof(timestamp_type) + 3 * sizeof(int)];
+        memcpy(&record[0], &timestamp, sizeof(timestamp_type));
+        memcpy(&record[sizeof(timestamp_type)], &midi_channel, sizeof(int));
+        memcpy(&record[sizeof(timestamp_type) + sizeof(int)], &midi_number, sizeof(int));
+        memcpy(&record[sizeof(timestamp_type) + 2 * sizeof(int)], &midi_velocity, sizeof(int));
         
-        ///////////////////// END LOGGING //////////////////////
-        ////////////////////////////////////////////////////////
-        ////////////////////////////////////////////////////////
+        midiLog->write(record, sizeof(record));
     }
         
 #ifdef MIDI_INPUT_CONTROLLER_DEBUG_RAW
@@ -491,9 +491,7 @@ void MidiInputController::handleIncomingMidiMessage( juce::MidiInput* source, co
 
 // Destructor.  Free any existing callbacks
 MidiInputController::~MidiInputController() {
-    if(logFileCreated) {
-        midiLog.close();
-    }
+    closeLogFile();
 	disableAllPorts(false);
     removeAllSegments();
 }
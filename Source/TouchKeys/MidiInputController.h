@@ -26,6 +26,7 @@
 
 #include "PianoKeyboard.h"
 #include "MidiKeyboardSegment.h"
+#include "../Utility/LogRecorder.h"
 
 class MidiOutputController;
 
@@ -123,8 +124,8 @@ public:
 	// OSC method: used to get touch callback data from the keyboard
 	// bool oscHandlerMethod(const char *path, const char *types, int numValues, lo_arg **values, void *data);
     
-    // for logging
-    void createLogFile(std::string midiLog_filename, std::string path);
+    // for logging; recorder writes the file and must outlive this object
+    void createLogFile(LogRecorder& recorder, std::string midiLog_filename, std::string path);
     void closeLogFile();
     void startLogging();
     void stopLogging();
@@ -149,5 +150,6 @@ private:
     int segmentUniqueIdentifier_;                   // Identifier of when segment structure has changed
     
     // for logging
-    std::ofstream midiLog;
+    LogRecorder *logRecorder;
+    LogRecorder::Stream *midiLog;       // Stays valid after closing, until the recorder is destroyed
 };
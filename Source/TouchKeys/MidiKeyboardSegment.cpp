@@ -952,6 +952,11 @@ void MidiKeyboardSegment::addMappingFactory(MappingFactory* factory, bool autoGe
 		factory->setName(name);
 	}
 	
+	// Find where the scheduler records this type's statistics now, rather than
+	// on the scheduler thread when each mapping registers
+	if(factory->schedulerStatistics() == nullptr)
+		factory->setSchedulerStatistics(keyboard_.mappingScheduler().statistics().statisticsForType(factory->factoryTypeName()));
+	
 	// Add factory to internal vector, and add it to splitter class
 	mappingFactories_.push_back(factory);
 	mappingFactorySplitter_.addFactory(factory);
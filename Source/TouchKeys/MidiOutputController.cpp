@@ -260,6 +260,9 @@ void MidiOutputController::sendMessage(int port, const juce::MidiMessage& messag
 	std::cout << '\n';
 #endif /* MIDI_OUTPUT_CONTROLLER_DEBUG_RAW */
     
+    if(monitor_)
+        monitor_(port, message);
+    
 	if(activePorts_.count(port) == 0) {
 #ifdef MIDI_OUTPUT_CONTROLLER_DEBUG_RAW
         std::cout << "MIDI Output: no port on " << port << '\n';
@@ -24,6 +24,7 @@
 #pragma once
 
 #include "MidiInputController.h"
+#include <boost/function.hpp>
 #include <map>
 #include <utility>
 #include <memory>
@@ -38,6 +39,9 @@ private:
     };
     
 public:
+    // Called with each outgoing message, whether or not the port is open
+    typedef boost::function<void (int, const juce::MidiMessage&)> MessageMonitor;
+    
     enum {
         kMidiVirtualOutputPortNumber = -2,
         kMidiOutputNotOpen = -1
@@ -78,10 +82,14 @@ public:
 	
 	// Generic pre-formed messages
 	void sendMessage(int port, const juce::MidiMessage& message);
+    
+    // Observe outgoing messages, e.g. to record them; pass an empty function to stop
+    void setMessageMonitor(MessageMonitor const& monitor) { monitor_ = monitor; }
 	
 	// Destructor
 	~MidiOutputController() { disableAllPorts(); }
 	
 private:
     std::map<int, MidiOutputControllerRecord> activePorts_;              // Destinations for MIDI data
+    MessageMonitor monitor_;                                             // Observer of outgoing messages
 };
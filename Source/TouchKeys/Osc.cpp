@@ -498,6 +498,9 @@ void OscTransmitter::sendMessage(const char * path, const char * type, ...)
 
 void OscTransmitter::sendMessage(const char * path, const char * type, const lo_message& message)
 {
+    if(monitor_)
+        monitor_(path, type, message);
+    
     if(!enabled_)
         return;
     
@@ -25,7 +25,9 @@
 
 //#include <cstdint>
 #include "lo/lo.h"
+#include "../Utility/RealTimeProfile.h"
 #include <JuceHeader.h>
+#include <boost/function.hpp>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -140,7 +142,11 @@ public:
 	// to the object-specific handler method, which has access to all internal variables.
 	
 	int handler(const char *path, const char *types, lo_arg **argv, int argc, lo_message msg, void *data);
+	// liblo starts the server thread itself, so it takes on the real-time profile
+	// when it delivers its first message.
 	static int staticHandler(const char *path, const char *types, lo_arg **argv, int argc, lo_message msg, void *userData) {
+		static thread_local int profileGeneration = -1;
+		RealTimeProfile::applyIfChanged(kRealTimeRoleOscServer, profileGeneration);
 		return ((OscReceiver *)userData)->handler(path, types, argv, argc, msg, userData);
 	}
     
@@ -198,6 +204,9 @@ private:
 class OscTransmitter
 {
 public:
+    // Called with each outgoing message, whether or not transmission is enabled
+    typedef boost::function<void (const char *, const char *, const lo_message&)> MessageMonitor;
+    
 	OscTransmitter() : enabled_(true), debugMessages_(false) {}
     
     // Enable or disable transmission
@@ -215,6 +224,9 @@ public:
 	void sendByteArray(const char * path, const unsigned char * data, int length);
 	
 	void setDebugMessages(bool debug) { debugMessages_ = debug; }
+    
+    // Observe outgoing messages, e.g. to record them; pass an empty function to stop
+    void setMessageMonitor(MessageMonitor const& monitor) { monitor_ = monitor; }
 	
 	~OscTransmitter();
     
@@ -227,4 +239,5 @@ private:
     std::vector<lo_address> addresses_;
     bool enabled_;
 	bool debugMessages_;
+    MessageMonitor monitor_;
 };
@@ -24,6 +24,7 @@
 
 #include "PianoKey.h"
 #include "PianoKeyboard.h"
+#include "../Utility/AllocationCounter.h"
 #include "../Mappings/MappingFactory.h"
 
 #undef TOUCHKEYS_LEGACY_OSC
@@ -39,7 +40,8 @@ PianoKey::PianoKey(PianoKeyboard& keyboard, int noteNumber, int bufferLength)
   positionTracker_(kPianoKeyPositionTrackerBufferLength, positionBuffer_),
   stateBuffer_(kPianoKeyStateBufferLength), state_(kKeyStateToBeInitialized),
   touchSensorsArePresent_(true), touchIsActive_(false), 
-  touchBuffer_(bufferLength), touchIsWaiting_(false), touchWaitingSource_(0),
+  touchBuffer_(bufferLength), touchEvents_(kPianoKeyTouchEventBufferLength),
+  touchIsWaiting_(false), touchWaitingSource_(0),
   touchWaitingTimestamp_(0),
   touchTimeoutInterval_(kPianoKeyDefaultTouchTimeoutInterval)
 {    
@@ -87,6 +89,7 @@ void PianoKey::reset() {
 	
 	terminateActivity();		// Stop any current activity
 	positionBuffer_.clear();	// Clear all history
+	positionTracker_.clearHistory();
 	stateBuffer_.clear();
 	idleDetector_.clear();
 	changeState(kKeyStateUnknown);	// Reinitialize with unknown state
@@ -327,9 +330,9 @@ void PianoKey::midiNoteOn(MidiKeyboardSegment *who, int velocity, int channel, t
         touchWaitingSource_ = who;
 		touchIsWaiting_ = true;
 		touchWaitingTimestamp_ = keyboard_.schedulerCurrentTimestamp() + touchTimeoutInterval_;
-		keyboard_.scheduleEvent(this, 
-								boost::bind(&PianoKey::touchTimedOut, this),
-								touchWaitingTimestamp_);
+		touchTimeoutEvent_ = keyboard_.scheduleEvent(this,
+                                                     boost::bind(&PianoKey::touchTimedOut, this),
+                                                     touchWaitingTimestamp_);
 	}
 }
 
@@ -461,7 +464,9 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 	touchIsActive_ = true;
 	
 	// If previous touch frames are present on this key, check the preceding
-	// frame to see if the state has changed in any important ways
+	// frame to see if the state has changed in any important ways. Matching touches
+	// and assigning IDs happens on the data thread, so it must not allocate.
+	ScopedAllocationCheck allocationCheck;
 	if(!touchBuffer_.empty()) {
 		const KeyTouchFrame& lastFrame(touchBuffer_.latest());
 		
@@ -478,11 +483,10 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// One or more points have been added.  Match the new points to the old ones to figure out
 			// which points have been added, versus which moved from before.
 			
-			std::set<int> availableNewPoints;
-			for(int i = 0; i < newFrame.count; i++)
-				availableNewPoints.insert(i);
+			int ordering[3];
 			
-			std::list<int> ordering(touchMatchClosestPoints(lastFrame.locs, newFrame.locs, 3, 0, availableNewPoints, 0.0).second);
+			touchMatchClosestPoints(lastFrame.locs, newFrame.locs, newFrame.count, ordering);
+			int orderingLength = newFrame.count;
 			
 			// ordering tells us the index of the new point corresponding to each old index,
 			// e.g. {2, 0, 1} --> old point 0 goes to new point 2, old point 1 goes to new point 0, ...
@@ -491,7 +495,7 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// and send relevant "add" messages
 			
 			int counter = 0;
-			for( auto it = ordering.begin(); it != ordering.end(); ++it) {
+			for(int *it = ordering; it != ordering + orderingLength; ++it) {
 				newFrame.ids[*it] = lastFrame.ids[counter];
 				
 				if(newFrame.ids[*it] < 0) {
@@ -519,11 +523,11 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// One or more points have been removed.  Match the new points to the old ones to figure out
 			// which points have been removed, versus which moved from before.
 			
-			std::set<int> availableNewPoints;
-			for(int i = 0; i < 3; i++)		
-				availableNewPoints.insert(i);
+			int ordering[3];
 			
-			std::list<int> ordering(touchMatchClosestPoints(lastFrame.locs, newFrame.locs, 3, 0, availableNewPoints, 0.0).second);
+			// Match all three slots, so the old touches left over pair with the empty ones
+			touchMatchClosestPoints(lastFrame.locs, newFrame.locs, 3, ordering);
+			int orderingLength = 3;
 			
 			// ordering tells us the index of the new point corresponding to each old index,
 			// e.g. {2, 0, 1} --> old point 0 goes to new point 2, old point 1 goes to new point 0, ...
@@ -532,7 +536,7 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// and send relevant "add" messages
 			
 			int counter = 0;
-			for( auto it = ordering.begin(); it != ordering.end(); ++it) {
+			for(int *it = ordering; it != ordering + orderingLength; ++it) {
 				if(*it < newFrame.count) {
 					// Old index {counter} matches a valid new touch
 					
@@ -590,13 +594,16 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 		}
 	}
 	
+	// Inserting the frame notifies everything listening to this key, which may allocate
+	allocationCheck.end();
+	
 	// Add the new touch
 	touchBuffer_.insert(newFrame, timestamp);
     
 	if(touchIsWaiting_) {
 		// If this flag was set, we were waiting for a touch to occur before taking further
 		// action.  A timeout will have been scheduled, which we should clear.
-		keyboard_.unscheduleEvent(this, touchWaitingTimestamp_);
+		keyboard_.unscheduleEvent(touchTimeoutEvent_);
 		
 		// Send the queued up MIDI/OSC events
 		midiNoteOnHelper(touchWaitingSource_);
@@ -624,7 +631,7 @@ void PianoKey::touchOff(timestamp_type timestamp) {
 	// on at least one frame before idle occurred)
 	if(!touchBuffer_.empty()) {
 		KeyTouchEvent event = { kTouchEventIdle, timestamp, touchBuffer_.latest() };
-		touchEvents_.insert(std::pair<int, KeyTouchEvent>(-1, event));
+		touchEvents_.push_back(KeyTouchEventRecord(-1, event));
 	}		
 	
     // Insert a blank touch frame into the buffer so anyone listening knows the touch has gone off
@@ -653,89 +660,67 @@ timestamp_type PianoKey::touchTimedOut() {
     return 0;
 }
 
-// Recursive function for matching old and new frames of touch locations, each with up to (count) points
+// Every ordering of up to three new touches, in lexicographic order, for matching them to the
+// old touches. Entry i of an ordering is the new index matched to old index i. Ties between
+// orderings are resolved in favour of the earliest, so the order of the table matters.
+static constexpr int kTouchMatchPermutationCount[4] = {0, 1, 2, 6};
+static constexpr unsigned char kTouchMatchPermutations[4][6][3] = {
+	{},
+	{{0, 0, 0}},
+	{{0, 1, 0}, {1, 0, 0}},
+	{{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}}
+};
+
+// Match old and new frames of touch locations, trying every ordering of the first (count) new
+// points against the first (count) old points and keeping the one with the least total squared
+// distance. A pairing with a missing (negative) location costs 100.
 //
 // Example: old points 1-3, new points A-C
 //   1A  *2A*  3A
 //  *1B*  2B   3B
 //   1C   2C  *3C*
 
-std::pair<float, std::list<int> > PianoKey::touchMatchClosestPoints(const float* oldPoints, const float *newPoints, float count,
-															   int oldIndex, std::set<int>& availableNewPoints, float currentTotalDistance) {
-	if(availableNewPoints.size() == 0)	// Shouldn't happen but prevent an infinite loop
-		throw new std::exception;
+float PianoKey::touchMatchClosestPoints(const float* oldPoints, const float *newPoints, int count, int order[3]) {
+	if(count < 1)
+		return std::numeric_limits<float>::infinity();
+	if(count > 3)
+		count = 3;
 	
-	// End case: only one possible point available
-	if(availableNewPoints.size() == 1) {
-		int newIndex = *(availableNewPoints.begin());
-		
-		std::list<int> singleOrder;
-		singleOrder.push_front(newIndex);
-		
-		if(oldPoints[oldIndex] < 0.0 || newPoints[newIndex] < 0.0) {
-			//if(verbose_ >= 4)
-			//	std::cout << " -> [" << newIndex << "] (" << currentTotalDistance + 100.0 << ")\n";
-			
-			// Return the distance between the last old point and the only available new point
-			return std::pair<float, std::list<int> > (currentTotalDistance + 100.0, singleOrder);			
-		}
-		else {
-			//if(verbose_ >= 4)
-			//	std::cout << " -> [" << newIndex << "] (" << currentTotalDistance + (oldPoints[oldIndex] - newPoints[newIndex])*(oldPoints[oldIndex] - newPoints[newIndex]) << ")\n";
-			
-			// Return the distance between the last old point and the only available new point
-			return std::pair<float, std::list<int> > (currentTotalDistance + (oldPoints[oldIndex] - newPoints[newIndex])*(oldPoints[oldIndex] - newPoints[newIndex]), singleOrder);
+	// Distance between every pair of old and new points
+	float distance[3][3];
+	for(int oldIndex = 0; oldIndex < 3; oldIndex++) {
+		for(int newIndex = 0; newIndex < 3; newIndex++) {
+			float difference = oldPoints[oldIndex] - newPoints[newIndex];
+			bool present = (oldPoints[oldIndex] >= 0.0 && newPoints[newIndex] >= 0.0);
+			distance[oldIndex][newIndex] = present ? difference * difference : 100.0f;
 		}
 	}
 	
+	// Total each ordering in the order the old points are matched, keeping the first minimum
 	float minVal = std::numeric_limits<float>::infinity();
-	std::set<int> newPointsCopy(availableNewPoints);
-
-	std::list<int> order;
-	
-	// Go through all available new points
-	for( auto it = availableNewPoints.begin(); it != availableNewPoints.end(); ++it) {
-		// Temporarily remove (and test) one point and recursively call ourselves
-		newPointsCopy.erase(*it);
-		
-		float dist;
-		if(newPoints[*it] >= 0.0 && oldPoints[oldIndex] >= 0.0)
-			dist = (oldPoints[oldIndex] - newPoints[*it])*(oldPoints[oldIndex] - newPoints[*it]);
-		else
-			dist = 100.0;
-		
-		std::pair<float, std::list<int> > rval = touchMatchClosestPoints(oldPoints, newPoints, count, oldIndex + 1, newPointsCopy,
-														  currentTotalDistance + dist);
-		
-		//if(verbose_ >= 4)
-		//	std::cout << "     from " << *it << " got " << rval.first << '\n';
+	int best = 0;
+	for(int p = 0; p < kTouchMatchPermutationCount[count]; p++) {
+		const unsigned char *permutation = kTouchMatchPermutations[count][p];
+		float total = 0.0;
+		for(int oldIndex = 0; oldIndex < count; oldIndex++)
+			total += distance[oldIndex][permutation[oldIndex]];
 		
-		if(rval.first < minVal) {
-			minVal = rval.first;
-			order = rval.second;
-			order.push_front(*it);
-		}
-		
-		newPointsCopy.insert(*it);
+		bool better = (total < minVal);
+		minVal = better ? total : minVal;
+		best = better ? p : best;
 	}
 	
-	/*if(verbose_ >= 4) {
-		std::cout << " -> [";
-		list<int>::iterator it2;
-		
-		for(it2 = order.begin(); it2 != order.end(); ++it2)
-			std::cout << *it2 << ", ";
-		std::cout << "] (" << minVal << ")\n";
-	}*/
+	for(int oldIndex = 0; oldIndex < count; oldIndex++)
+		order[oldIndex] = kTouchMatchPermutations[count][best][oldIndex];
 	
-	return std::pair<float, std::list<int> >(minVal, order);
+	return minVal;
 }
 
 // A new touch was added from the last frame to this one
 
 void PianoKey::touchAdd(const KeyTouchFrame& frame, int index, timestamp_type timestamp) {
 	KeyTouchEvent event = { kTouchEventAdd, timestamp, frame };
-	touchEvents_.insert(std::pair<int, KeyTouchEvent>(frame.ids[index], event));
+	touchEvents_.push_back(KeyTouchEventRecord(frame.ids[index], event));
 #ifdef TOUCHKEYS_LEGACY_OSC
 	keyboard_.sendMessage("/touchkeys/add", "iiifff", noteNumber_, frame.ids[index], frame.count,
 						  frame.locs[index], frame.sizes[index], frame.horizontal(index),
@@ -748,7 +733,7 @@ void PianoKey::touchAdd(const KeyTouchFrame& frame, int index, timestamp_type ti
 
 void PianoKey::touchRemove(const KeyTouchFrame& frame, int idRemoved, int remainingCount, timestamp_type timestamp) {
 	KeyTouchEvent event = { kTouchEventRemove, timestamp, frame };
-	touchEvents_.insert(std::pair<int, KeyTouchEvent>(idRemoved, event));
+	touchEvents_.push_back(KeyTouchEventRecord(idRemoved, event));
 #ifdef TOUCHKEYS_LEGACY_OSC
 	keyboard_.sendMessage("/touchkeys/remove", "iii", noteNumber_, idRemoved,
 						  remainingCount, LO_ARGS_END);
@@ -31,6 +31,7 @@
 #include "KeyTouchFrame.h"
 #include "../Utility/Scheduler.h"
 #include "../Utility/IIRFilter.h"
+#include <boost/circular_buffer.hpp>
 #include <set>
 #include <map>
 #include <list>
@@ -43,6 +44,7 @@ const key_position kPianoKeyDefaultIdlePositionThreshold = scale_key_position(.0
 const int kPianoKeyDefaultIdleCounter = 20;
 const timestamp_diff_type kPianoKeyDefaultTouchTimeoutInterval = microseconds_to_timestamp(0); // was 20000
 const timestamp_diff_type kPianoKeyGuiUpdateInterval = microseconds_to_timestamp(15000); // How frequently to update the position display
+const unsigned int kPianoKeyTouchEventBufferLength = 16; // How many touch add/remove events to save
 
 // Possible key states
 enum {
@@ -83,6 +85,8 @@ private:
 		KeyTouchFrame frame;
 	};
 	
+	typedef std::pair<int, KeyTouchEvent> KeyTouchEventRecord;	// Touch number and event
+	
 public:
 	// ***** Constructors *****
 	
@@ -96,6 +100,7 @@ public:
 	// ***** Access Methods *****
 	
 	Node<key_position>& buffer() { return positionBuffer_; }
+	KeyIdleDetector& idleDetector() { return idleDetector_; }
 	
 	// ***** Control Methods *****
 	//
@@ -150,6 +155,10 @@ public:
 	// is called by the scheduler.
 	timestamp_type touchTimedOut();
 	
+	// Match the first count old touches to the first count new ones. On return, order[i] holds
+	// the new index for old index i, and the total squared distance of the match is returned.
+	static float touchMatchClosestPoints(const float* oldPoints, const float *newPoints, int count, int order[3]);
+	
 private:
 	// ***** MIDI Methods (private) *****
 	
@@ -159,8 +168,6 @@ private:
 	
 	// ***** Touch Methods (private) *****
 	
-	std::pair<float, std::list<int> > touchMatchClosestPoints(const float* oldPoints, const float *newPoints, float count,
-														 int oldIndex, std::set<int>& availableNewPoints, float currentTotalDistance); 
 	void touchAdd(const KeyTouchFrame& frame, int index, timestamp_type timestamp);
 	void touchRemove(const KeyTouchFrame& frame, int idRemoved, int remainingCount, timestamp_type timestamp);
 	void touchMultiFingerGestures(const KeyTouchFrame& lastFrame, const KeyTouchFrame& newFrame, timestamp_type timestamp);
@@ -213,10 +220,11 @@ private:
     bool touchSensorsArePresent_;                   // Whether touch sensitivity exists on this key
 	bool touchIsActive_;							// Whether the user is currently touching the key
 	Node<KeyTouchFrame> touchBuffer_;				// Buffer that holds touchkey frames
-	std::multimap<int, KeyTouchEvent> touchEvents_;	// Mapping from touch number to event
+	boost::circular_buffer<KeyTouchEventRecord> touchEvents_; // Recent touch events, preallocated
 	bool touchIsWaiting_;							// Whether we're waiting for a touch to occur
     MidiKeyboardSegment *touchWaitingSource_;  // Who we're waiting from a touch for
 	timestamp_type touchWaitingTimestamp_;			// When the timeout will occur
+    Scheduler::Handle touchTimeoutEvent_;           // Scheduled timeout, for cancelling it
 	timestamp_diff_type touchTimeoutInterval_;		// How long to wait for a touch before timing out
     
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PianoKey)
@@ -35,9 +35,11 @@ PianoKeyboard::PianoKeyboard()
 : gui_(0), graphGui_(0), midiOutputController_(0),
   oscTransmitter_(0), touchkeyDevice_(0),
   lowestMidiNote_(0), highestMidiNote_(0), numberOfPedals_(0),
-  isInitialized_(false), isRunning_(false), isCalibrated_(false), calibrationInProgress_(false)
+  isInitialized_(false), isRunning_(false), isCalibrated_(false), calibrationInProgress_(false),
+  stateEngine_(*this)
 {
 	  // Start a thread by which we can schedule future events
+	  futureEventScheduler_.setThreadRole(kRealTimeRoleScheduler);
 	  futureEventScheduler_.start(0);
       
       // Build the key list
@@ -60,6 +62,46 @@ void PianoKeyboard::reset() {
 		(*itPed)->clear();
 }
 
+// Switch between the real-time scheduler threads and a virtual clock
+void PianoKeyboard::setVirtualTimeEnabled(bool enable, timestamp_type startingTimestamp) {
+    if(enable) {
+        futureEventScheduler_.startVirtualTime(startingTimestamp);
+        mappingScheduler_->setVirtualTimeEnabled(true);
+    }
+    else {
+        mappingScheduler_->setVirtualTimeEnabled(false);
+        futureEventScheduler_.stopVirtualTime();
+    }
+}
+
+// Advance the virtual clock, stopping at each scheduled event or mapping action
+// on the way so that they all run at their own timestamps.
+void PianoKeyboard::advanceVirtualTime(timestamp_type timestamp) {
+    if(!futureEventScheduler_.virtualTimeEnabled())
+        return;
+    
+    while(true) {
+        // Anything due now, including mappings scheduled by the last event
+        mappingScheduler_->performPendingActions();
+        
+        timestamp_type nextEvent, nextMapping;
+        bool foundEvent = futureEventScheduler_.nextEventTimestamp(nextEvent) && nextEvent <= timestamp;
+        bool foundMapping = mappingScheduler_->nextActionTimestamp(nextMapping) && nextMapping <= timestamp;
+        
+        if(foundEvent && foundMapping)
+            futureEventScheduler_.advanceTo(nextEvent < nextMapping ? nextEvent : nextMapping);
+        else if(foundEvent)
+            futureEventScheduler_.advanceTo(nextEvent);
+        else if(foundMapping)
+            futureEventScheduler_.advanceTo(nextMapping);
+        else
+            break;
+    }
+    
+    futureEventScheduler_.advanceTo(timestamp);
+    mappingScheduler_->performPendingActions();
+}
+
 // Provide a pointer to the graphical display class
 
 void PianoKeyboard::setGUI(KeyboardDisplay* gui) {
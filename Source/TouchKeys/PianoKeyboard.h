@@ -31,6 +31,7 @@
 #include "../Display/KeyboardDisplay.h"
 #include "../Display/KeyPositionGraphDisplay.h"
 #include "../Utility/Scheduler.h"
+#include "KeyboardStateEngine.h"
 
 #define NUM_KEYS 88
 #define NUM_PEDALS 3
@@ -120,8 +121,8 @@ public:
 	// ***** Scheduling Methods *****
 	
 	// Add or remove events from the scheduler queue
-	void scheduleEvent(void *who, Scheduler::action func, timestamp_type timestamp) {
-		futureEventScheduler_.schedule(who, func, timestamp);
+	Scheduler::Handle scheduleEvent(void *who, Scheduler::action const& func, timestamp_type timestamp) {
+		return futureEventScheduler_.schedule(who, func, timestamp);
 	}
     void unscheduleEvent(void *who) {
 		futureEventScheduler_.unschedule(who);
@@ -129,9 +130,24 @@ public:
 	void unscheduleEvent(void *who, timestamp_type timestamp) {
 		futureEventScheduler_.unschedule(who, timestamp);
 	}
+    bool unscheduleEvent(Scheduler::Handle& handle) {
+        return futureEventScheduler_.unschedule(handle);
+    }
 	
 	// Return the current timestamp associated with the scheduler
 	timestamp_type schedulerCurrentTimestamp() { return futureEventScheduler_.currentTimestamp(); }
+    
+    // ***** Virtual Time *****
+    //
+    // Stop the scheduler threads and run the keyboard on a clock which only moves when
+    // advanceVirtualTime() is called. Scheduled events and mappings then run on the
+    // calling thread, so replaying recorded data is repeatable and as fast as the CPU allows.
+    
+    void setVirtualTimeEnabled(bool enable, timestamp_type startingTimestamp = 0);
+    bool virtualTimeEnabled() { return futureEventScheduler_.virtualTimeEnabled(); }
+    
+    // Move the clock forward, running everything scheduled up to the given time in order
+    void advanceVirtualTime(timestamp_type timestamp);
 	
 	// ***** Individual Key/Pedal Methods *****
 	
@@ -215,6 +231,9 @@ public:
                                               KeyPositionTracker* positionTracker);
     
     MappingScheduler& mappingScheduler() { return *mappingScheduler_; }
+    
+    // Idle screening for frames of key position data, shared across the keyboard
+    KeyboardStateEngine& stateEngine() { return stateEngine_; }
 	
 	// ***** Member Variables *****
 public:
@@ -273,5 +292,8 @@ private:
     // Scheduler specifically used for coordinating mappings
     MappingScheduler *mappingScheduler_;
     
+    // Per-key idle state for the whole keyboard
+    KeyboardStateEngine stateEngine_;
+    
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PianoKeyboard)
 };
@@ -0,0 +1,149 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  TouchkeyCommandEngine.cpp: queues configuration commands to the TouchKeys
+  hardware and matches them to the ACK/NAK responses from the device
+*/
+
+#include "TouchkeyCommandEngine.h"
+
+TouchkeyCommandEngine::Future TouchkeyCommandEngine::submit(const unsigned char *command, int length,
+                                                            int timeoutMilliseconds, double currentTime) {
+    if(command == 0 || length <= 0) {
+        std::promise<int> failed;
+        failed.set_value(kResultFailed);
+        return failed.get_future().share();
+    }
+    
+    Command newCommand;
+    newCommand.data.assign(command, command + length);
+    newCommand.timeoutMilliseconds = (double)timeoutMilliseconds;
+    newCommand.deadline = 0;
+    newCommand.result.reset(new std::promise<int>());
+    Future future = newCommand.result->get_future().share();
+    
+    juce::ScopedLock sl(mutex_);
+    
+    queued_.push_back(newCommand);
+    sendQueuedCommands(currentTime);
+    
+    return future;
+}
+
+bool TouchkeyCommandEngine::handleResponse(bool acknowledged, double currentTime) {
+    juce::ScopedLock sl(mutex_);
+    
+    // Responses still owed to commands which timed out come before any others
+    expireLateResponses(currentTime);
+    if(!lateResponseDeadlines_.empty()) {
+        lateResponseDeadlines_.pop_front();
+        lateResponses_++;
+        return true;
+    }
+    
+    if(inFlight_.empty()) {
+        unmatchedResponses_++;
+        return false;
+    }
+    
+    if(acknowledged) {
+        complete(inFlight_.front(), kResultAcknowledged);
+        commandsAcknowledged_++;
+    }
+    else {
+        complete(inFlight_.front(), kResultRejected);
+        commandsRejected_++;
+    }
+    inFlight_.pop_front();
+    
+    // Room for the next command
+    sendQueuedCommands(currentTime);
+    return true;
+}
+
+void TouchkeyCommandEngine::service(double currentTime) {
+    juce::ScopedLock sl(mutex_);
+    
+    // Responses come back in order, so once the oldest command is overdue its response
+    // is assumed lost. Anything after it still has a chance.
+    while(!inFlight_.empty() && currentTime > inFlight_.front().deadline) {
+        complete(inFlight_.front(), kResultTimedOut);
+        commandsTimedOut_++;
+        
+        // Kept in order, since a later deadline can't expire before an earlier one
+        double lateDeadline = currentTime + inFlight_.front().timeoutMilliseconds;
+        if(!lateResponseDeadlines_.empty() && lateResponseDeadlines_.back() > lateDeadline)
+            lateDeadline = lateResponseDeadlines_.back();
+        lateResponseDeadlines_.push_back(lateDeadline);
+        inFlight_.pop_front();
+    }
+    
+    expireLateResponses(currentTime);
+    sendQueuedCommands(currentTime);
+}
+
+void TouchkeyCommandEngine::cancelAll() {
+    juce::ScopedLock sl(mutex_);
+    
+    for(auto it = inFlight_.begin(); it != inFlight_.end(); ++it)
+        complete(*it, kResultCancelled);
+    for(auto it = queued_.begin(); it != queued_.end(); ++it)
+        complete(*it, kResultCancelled);
+    inFlight_.clear();
+    queued_.clear();
+    lateResponseDeadlines_.clear();
+}
+
+int TouchkeyCommandEngine::inFlight() {
+    juce::ScopedLock sl(mutex_);
+    return (int)inFlight_.size();
+}
+
+int TouchkeyCommandEngine::queued() {
+    juce::ScopedLock sl(mutex_);
+    return (int)queued_.size();
+}
+
+// Write queued commands while there is room. Must be called with the lock held.
+void TouchkeyCommandEngine::sendQueuedCommands(double currentTime) {
+    while(!queued_.empty() && (int)inFlight_.size() < maxInFlight_) {
+        Command& command = queued_.front();
+        
+        if(write_.empty() || !write_(&command.data[0], (int)command.data.size())) {
+            // Nothing to wait for
+            complete(command, kResultFailed);
+            queued_.pop_front();
+            continue;
+        }
+        
+        command.deadline = currentTime + command.timeoutMilliseconds;
+        inFlight_.push_back(command);
+        queued_.pop_front();
+        
+        commandsSent_++;
+        if((int)inFlight_.size() > maxInFlightSeen_)
+            maxInFlightSeen_ = (int)inFlight_.size();
+    }
+}
+
+// Stop waiting for late responses which haven't come. Must be called with the lock held.
+void TouchkeyCommandEngine::expireLateResponses(double currentTime) {
+    while(!lateResponseDeadlines_.empty() && currentTime > lateResponseDeadlines_.front())
+        lateResponseDeadlines_.pop_front();
+}
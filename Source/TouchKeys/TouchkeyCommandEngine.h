@@ -0,0 +1,145 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  TouchkeyCommandEngine.h: queues configuration commands to the TouchKeys
+  hardware and matches them to the ACK/NAK responses from the device
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <boost/function.hpp>
+#include <deque>
+#include <future>
+#include <memory>
+#include <vector>
+
+const int kCommandEngineMaxInFlight = 16;               // Commands sent without waiting for a response
+const int kCommandEngineServiceIntervalMilliseconds = 2; // How often waiting threads check for timeouts
+
+/*
+ * TouchkeyCommandEngine
+ *
+ * The device answers each command with an ACK or NAK but the response doesn't say which
+ * command it belongs to. Since the controller handles commands strictly in order, the
+ * responses are matched to the outstanding commands first-in, first-out. Up to
+ * kCommandEngineMaxInFlight commands are written back to back without waiting; the rest
+ * are queued and written as responses come back. For the matching to hold, every command
+ * the device answers has to go through the engine, including those nobody waits for.
+ *
+ * A command which times out may still be answered later. Its response would arrive ahead
+ * of those for the commands after it, so the next response is discarded rather than
+ * matched, for as long again as the command's timeout. If the response was lost instead,
+ * that costs the following command its response, but the matching is back in step as
+ * soon as the device catches up.
+ *
+ * submit() can be called from any thread and returns a future for the result. Whichever
+ * thread reads from the device passes the responses to handleResponse(); service()
+ * expires commands whose responses are overdue, and may be called by any thread.
+ */
+
+class TouchkeyCommandEngine {
+public:
+    // Outcome of a command
+    enum {
+        kResultAcknowledged = 0,    // Device sent ACK
+        kResultRejected,            // Device sent NAK
+        kResultTimedOut,            // No response within the timeout
+        kResultFailed,              // Command couldn't be written, or was invalid
+        kResultCancelled            // Discarded by cancelAll() before a response arrived
+    };
+
+    typedef std::shared_future<int> Future;
+    typedef boost::function<bool (const unsigned char*, int)> WriteFunction;
+
+    // ***** Constructor *****
+
+    TouchkeyCommandEngine() : maxInFlight_(kCommandEngineMaxInFlight) { clearStatistics(); }
+
+    // Function used to write commands to the device; returns true on success
+    void setWriteFunction(WriteFunction const& write) { write_ = write; }
+
+    // ***** Commands *****
+
+    // Queue a complete, escaped command frame. The timeout counts from when the command is
+    // written to the device.
+    Future submit(const unsigned char *command, int length, int timeoutMilliseconds, double currentTime);
+
+    // Match an ACK (acknowledged == true) or NAK to the oldest outstanding command, unless
+    // it is the late response to a command which timed out. Returns false if there was no
+    // command waiting for it.
+    bool handleResponse(bool acknowledged, double currentTime);
+
+    // Time out overdue commands and send any that are waiting for room
+    void service(double currentTime);
+
+    // Resolve every queued and outstanding command as cancelled, e.g. when the device closes
+    void cancelAll();
+
+    // Number of commands written but not yet answered, and waiting to be written
+    int inFlight();
+    int queued();
+
+    // ***** Statistics *****
+
+    void clearStatistics() {
+        commandsSent_ = commandsAcknowledged_ = commandsRejected_ = commandsTimedOut_ = 0;
+        unmatchedResponses_ = lateResponses_ = 0;
+        maxInFlightSeen_ = 0;
+    }
+
+    unsigned long commandsSent() { return commandsSent_; }
+    unsigned long commandsAcknowledged() { return commandsAcknowledged_; }
+    unsigned long commandsRejected() { return commandsRejected_; }
+    unsigned long commandsTimedOut() { return commandsTimedOut_; }
+    unsigned long unmatchedResponses() { return unmatchedResponses_; }
+    unsigned long lateResponses() { return lateResponses_; }     // Discarded after a timeout
+    int maxInFlightSeen() { return maxInFlightSeen_; }
+
+private:
+    struct Command {
+        std::vector<unsigned char> data;    // Frame as written to the device
+        double timeoutMilliseconds;
+        double deadline;                    // Time by which the response is due, once sent
+        std::shared_ptr<std::promise<int> > result;
+    };
+
+    // Write queued commands while there is room. Must be called with the lock held.
+    void sendQueuedCommands(double currentTime);
+    void expireLateResponses(double currentTime);
+
+    static void complete(Command& command, int result) {
+        command.result->set_value(result);
+    }
+
+    juce::CriticalSection mutex_;       // Protects the queues; held while writing so order is kept
+    WriteFunction write_;
+    int maxInFlight_;
+    std::deque<Command> queued_;        // Waiting for room to be sent
+    std::deque<Command> inFlight_;      // Sent, waiting for a response, oldest first
+    std::deque<double> lateResponseDeadlines_; // For each timed out command, until when its response is expected
+
+    unsigned long commandsSent_;        // Statistics
+    unsigned long commandsAcknowledged_;
+    unsigned long commandsRejected_;
+    unsigned long commandsTimedOut_;
+    unsigned long unmatchedResponses_;
+    unsigned long lateResponses_;
+    int maxInFlightSeen_;
+};
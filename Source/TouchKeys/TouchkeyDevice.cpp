@@ -36,16 +36,22 @@ serialHandle_(INVALID_HANDLE_VALUE),
 #else
 device_(-1),
 #endif
-ioThread_(boost::bind(&TouchkeyDevice::runLoop, this, _1), "TouchKeyDevice::ioThread"),
-rawDataThread_(boost::bind(&TouchkeyDevice::rawDataRunLoop, this, _1), "TouchKeyDevice::rawDataThread"),
+ioThread_(boost::bind(&TouchkeyDevice::runLoop, this, _1), "TouchKeyDevice::ioThread", kRealTimeRoleDeviceIO),
+rawDataThread_(boost::bind(&TouchkeyDevice::rawDataRunLoop, this, _1), "TouchKeyDevice::rawDataThread", kRealTimeRoleDeviceIO),
 autoGathering_(false), shouldStop_(false), sendRawOscMessages_(false),
-verbose_(0), numOctaves_(0), lowestMidiNote_(48), lowestKeyPresentMidiNote_(48),
+ingestMode_(kIngestModePolling),
+processingThread_(boost::bind(&TouchkeyDevice::processingLoop, this, _1), "TouchKeyDevice::processingThread", kRealTimeRoleFrameProcessing),
+framePipelineEnabled_(false), framePipelineActive_(false), framePipelineQueued_(0), framePipelineProcessed_(0),
+framePipelineMaxOccupancy_(0), framePipelineOverruns_(0), verbose_(0), numOctaves_(0), lowestMidiNote_(48), lowestKeyPresentMidiNote_(48),
 updatedLowestMidiNote_(48), lowestNotePerOctave_(0),
 deviceSoftwareVersion_(-1), deviceHardwareVersion_(-1),
 expectedLengthWhite_(kTransmissionLengthWhiteNewHardware),
 expectedLengthBlack_(kTransmissionLengthBlackNewHardware),
-strayTouchSuppression_(0), strayTouchSuppressionWasEnabled_(false), deviceHasRGBLEDs_(false),
-ledThread_(boost::bind(&TouchkeyDevice::ledUpdateLoop, this, _1), "TouchKeyDevice::ledThread"),
+strayTouchSuppression_(0), strayTouchSuppressionWasEnabled_(false),
+centroidFramesProcessed_(0), centroidFramesWithAllocations_(0), centroidFrameAllocations_(0),
+analogFramesProcessed_(0), analogFramesWithAllocations_(0), analogFrameAllocations_(0),
+deviceHasRGBLEDs_(false),
+ledThread_(boost::bind(&TouchkeyDevice::ledUpdateLoop, this, _1), "TouchKeyDevice::ledThread", kRealTimeRoleLED),
 isCalibrated_(false), calibrationInProgress_(false),
 keyCalibrators_(0), keyCalibratorsLength_(0), sensorDisplay_(0)
 {
@@ -59,18 +65,33 @@ keyCalibrators_(0), keyCalibratorsLength_(0), sensorDisplay_(0)
 	timestampSynchronizer_.setNominalSampleInterval(.001);
 	timestampSynchronizer_.setFrameModulus(65536);
     
-    for(int i = 0; i < 4; i++)
+    for(int i = 0; i < kAnalogMaxBoards; i++) {
         analogLastFrame_[i] = 0;
+        analogTargets_[i].octave = -1;
+    }
+    
+    for(int i = 0; i < 128; i++)
+        ledColors_[i] = 0;
+    ledDirty_[0] = ledDirty_[1] = 0;
+    ledAllOffPending_ = false;
+    ledUpdatesPerFrame_ = kRGBLEDDefaultUpdatesPerFrame;
     
+    commandEngine_.setWriteFunction(boost::bind(&TouchkeyDevice::writeCommand, this, _1, _2));
+    
+    logRecorder_ = nullptr;
+    keyTouchLog_ = analogLog_ = nullptr;
     logFileCreated_ = false;
     loggingActive_ = false;
 }
 
 
 // ------------------------------------------------------
-// create a new MIDI log file, ready to have data written to it
-void TouchkeyDevice::createLogFiles( std::string keyTouchLogFilename, std::string analogLogFilename, std::string path)
+// create new log files, ready to have data written to them
+void TouchkeyDevice::createLogFiles(LogRecorder& recorder, std::string keyTouchLogFilename, std::string analogLogFilename, std::string path)
 {
+    if (logFileCreated_)
+        closeLogFile();
+    
     if (path.compare("") != 0)
     {
         path = path + "/";
@@ -79,17 +100,11 @@ void TouchkeyDevice::createLogFiles( std::string keyTouchLogFilename, std::strin
     keyTouchLogFilename = path + keyTouchLogFilename;
     analogLogFilename = path + analogLogFilename;
     
-    char *fileName = (char*)keyTouchLogFilename.c_str();
-    
-    // create output file for key touch
-    keyTouchLog_.open (fileName, std::ios::out | std::ios::binary);
-    keyTouchLog_.seekp(0);
-
-    fileName = (char*)analogLogFilename.c_str();
-    
-    // create output file for analog data
-    analogLog_.open (fileName, std::ios::out | std::ios::binary);
-    analogLog_.seekp(0);
+    // create output streams for key touch and analog data; the files
+    // are written by the recorder's thread
+    logRecorder_ = &recorder;
+    keyTouchLog_ = recorder.openStream(keyTouchLogFilename);
+    analogLog_ = recorder.openStream(analogLogFilename);
     
     // indicate that we have created a log file (so we can close it later)
     logFileCreated_ = true;
@@ -101,8 +116,9 @@ void TouchkeyDevice::closeLogFile()
 {
     if (logFileCreated_)
     {
-        keyTouchLog_.close();
-        analogLog_.close();
+        // Records still queued are written before the files close
+        logRecorder_->closeStream(keyTouchLog_);
+        logRecorder_->closeStream(analogLog_);
         logFileCreated_ = false;
     }
     loggingActive_ = false;
@@ -122,6 +138,35 @@ void TouchkeyDevice::stopLogging()
     loggingActive_ = false;
 }
 
+// ------------------------------------------------------
+// load a calibration for replaying an analog log, setting up the
+// calibrators first if no device has done so
+bool TouchkeyDevice::replayLoadCalibration(int numOctaves, std::string const& filename)
+{
+    if(!isOpen() && numOctaves > 0 && keyCalibratorsLength_ != 12*numOctaves + 1) {
+        numOctaves_ = numOctaves;
+        calibrationInit(12*numOctaves_ + 1); // One more for the top C
+    }
+    
+    return calibrationLoadFromFile(filename);
+}
+
+// ------------------------------------------------------
+// deliver one analog log record at the given (virtual) time
+void TouchkeyDevice::replayAnalogRecord(const unsigned char *record, timestamp_type timestamp)
+{
+    int octave = record[0];
+    int board = octave / 2;
+    const unsigned char *frameData = &record[1];
+    int frame = frameData[0] + ((int)frameData[1] << 8) +
+                ((int)frameData[2] << 16) + ((int)frameData[3] << 24);
+    
+    if(board >= kAnalogMaxBoards)
+        return;
+    
+    deliverAnalogValues(analogTargetsForBoard(board, octave), frameData, frame, timestamp);
+}
+
 // Open the touchkey device (a USB CDC device).  Returns true on success.
 
 bool TouchkeyDevice::openDevice(const char * inputDevicePath) {
@@ -187,6 +232,7 @@ void TouchkeyDevice::closeDevice() {
 		return;
 	
 	stopAutoGathering();
+	commandEngine_.cancelAll();
 	keysPresent_.clear();
 
 #ifdef _MSC_VER
@@ -212,8 +258,8 @@ bool TouchkeyDevice::isOpen() {
 bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 	//struct timeval startTime, currentTime;
     double startTime, currentTime;
-	unsigned char ch;
-	bool controlSeq = false, startingFrame = false;
+	unsigned char buffer[TOUCHKEY_MAX_FRAME_LENGTH];
+	TouchkeyFrameDecoder decoder;
     
 	if(!isOpen())
 		return false;
@@ -231,7 +277,7 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
     currentTime = startTime;
 
 	while(currentTime - startTime < (double)millisecondsToWait) {
-        long count = deviceRead((char *)&ch, 1);
+        long count = deviceRead((char *)buffer, sizeof(buffer));
 
 		if(count < 0) {				// Check if an error occurred on read
 			if(errno != EAGAIN) {
@@ -243,167 +289,113 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 		else if(count > 0) {		// Data received
 			// Wait for a frame back that is of type status.  We don't even care what the 
 			// status is at this point, just that we got something.
+			decoder.setInput(buffer, count);
 			
-			if(controlSeq) {
-				controlSeq = false;
-				if(ch == kControlCharacterFrameBegin)
-					startingFrame = true;
-                else
-                    startingFrame = false;
-			}
-			else {
-				if(ch == ESCAPE_CHARACTER) {
-					controlSeq = true;
-                }
-				else if(startingFrame) {
-					if(ch == kFrameTypeStatus) {
-						ControllerStatus status;
-						unsigned char statusBuf[TOUCHKEY_MAX_FRAME_LENGTH];
-						int statusBufLength = 0;
-						bool frameError = false;
-						
-						// Gather and parse the status frame
-						
-						while(currentTime - startTime < millisecondsToWait) {
-							count = deviceRead((char *)&ch, 1);
+			int event;
+			while((event = decoder.decodeNext()) != TouchkeyFrameDecoder::kEventNone) {
+				if(event == TouchkeyFrameDecoder::kEventNak) {
+					if(verbose_ >= 1)
+						std::cout << "Warning: received NAK\n";
+					continue;
+				}
+				if(event != TouchkeyFrameDecoder::kEventFrame && event != TouchkeyFrameDecoder::kEventFrameTooLong)
+					continue;
+				if(decoder.frameLength() < 1 || decoder.frame()[0] != kFrameTypeStatus)
+					continue;
+				
+				// Parse the status frame, which follows the type byte
+				ControllerStatus status;
+				unsigned char *statusBuf = decoder.frame() + 1;
+				int statusBufLength = decoder.frameLength() - 1;
+				
+				if(event == TouchkeyFrameDecoder::kEventFrameTooLong || decoder.frameHadError()) {
+                    if(verbose_ >= 1)
+                        std::cout << "Warning: device present, but frame error received trying to get status.\n";
+				}
+				else if(processStatusFrame(statusBuf, statusBufLength, &status)) {
+					// Clear keys present in preparation to read new list of keys
+					keysPresent_.clear();
+					
+					numOctaves_ = status.octaves;
+                    deviceSoftwareVersion_ = status.softwareVersionMajor;
+                    deviceHardwareVersion_ = status.hardwareVersion;
+                    deviceHasRGBLEDs_ = status.hasRGBLEDs;
+                    lowestKeyPresentMidiNote_ = 127;
+					
+					if(verbose_ >= 1) {
+						std::cout << '\n' << "Found Device: Hardware Version " << status.hardwareVersion;
+						std::cout << " Software Version " << status.softwareVersionMajor << "." << status.softwareVersionMinor;
+						std::cout << '\n' << "  " << status.octaves << " octaves connected" << '\n';
+					}
+                    
+					for(int i = 0; i < status.octaves; i++) {
+						bool foundKey = false;
 						
-							if(count == 0)
-								continue;
-							if(count < 0) {
-								if(errno != EAGAIN && verbose_ >= 1) {	// EAGAIN just means no data was available
-                                    if(verbose_ >= 1)
-                                        std::cout << "Unable to read from device (error " << errno << ").  Aborting.\n";
-									return false;
-								}
-								
-								continue;
-							}
-							
-							if(controlSeq) {
-								controlSeq = false;
-								if(ch == kControlCharacterFrameEnd)	{		// frame finished?
-									break;
-                                }
-								else if(ch == kControlCharacterFrameError)	// device telling us about an internal comm error
-									frameError = true;
-								else if(ch == ESCAPE_CHARACTER) {			// double-escape means a literal escape character
-									statusBuf[statusBufLength++] = (unsigned char)ch;
-									if(statusBufLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
-										frameError = true;
-										break;
-									}				
-								}
-								else if(ch == kControlCharacterNak && verbose_ >= 1) {
-									std::cout << "Warning: received NAK\n";
-								}			
+						if(verbose_ >= 1) std::cout << "  Octave " << i << ": ";
+						for(int j = 0; j < 13; j++) {
+							if(status.connectedKeys[i] & (1<<j)) {
+								if(verbose_ >= 1) std::cout << kKeyNames[j] << " ";
+								keysPresent_.insert(octaveNoteToIndex(i, j));
+								foundKey = true;
+                                if(octaveKeyToMidi(i, j) < lowestKeyPresentMidiNote_)
+                                    lowestKeyPresentMidiNote_ = octaveKeyToMidi(i, j);
 							}
 							else {
-								if(ch == ESCAPE_CHARACTER)
-									controlSeq = true;
-								else {
-									statusBuf[statusBufLength++] = (unsigned char)ch;
-									if(statusBufLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
-										frameError = true;
-										break;
-									}
-								}
+								if(verbose_ >= 1) std::cout << "-  ";
 							}
-							
-							currentTime = juce::Time::getMillisecondCounterHiRes();
-						}
-						
-						if(frameError) {
-                            if(verbose_ >= 1)
-                                std::cout << "Warning: device present, but frame error received trying to get status.\n";
-						}
-						else if(processStatusFrame(statusBuf, statusBufLength, &status)) {
-							// Clear keys present in preparation to read new list of keys
-							keysPresent_.clear();
-							
-							numOctaves_ = status.octaves;
-                            deviceSoftwareVersion_ = status.softwareVersionMajor;
-                            deviceHardwareVersion_ = status.hardwareVersion;
-                            deviceHasRGBLEDs_ = status.hasRGBLEDs;
-                            lowestKeyPresentMidiNote_ = 127;
-							
-							if(verbose_ >= 1) {
-								std::cout << '\n' << "Found Device: Hardware Version " << status.hardwareVersion;
-								std::cout << " Software Version " << status.softwareVersionMajor << "." << status.softwareVersionMinor;
-								std::cout << '\n' << "  " << status.octaves << " octaves connected" << '\n';
-							}
-                            
-							for(int i = 0; i < status.octaves; i++) {
-								bool foundKey = false;
-								
-								if(verbose_ >= 1) std::cout << "  Octave " << i << ": ";
-								for(int j = 0; j < 13; j++) {
-									if(status.connectedKeys[i] & (1<<j)) {
-										if(verbose_ >= 1) std::cout << kKeyNames[j] << " ";
-										keysPresent_.insert(octaveNoteToIndex(i, j));
-										foundKey = true;
-                                        if(octaveKeyToMidi(i, j) < lowestKeyPresentMidiNote_)
-                                            lowestKeyPresentMidiNote_ = octaveKeyToMidi(i, j);
-									}
-									else {
-										if(verbose_ >= 1) std::cout << "-  ";
-									}
-
-								}
-
-								if(verbose_ >= 1) std::cout << '\n';
-							}
-                            
-                            // Hardware version determines whether all keys have XY or not
-                            if(status.hardwareVersion >= 2) {
-                                expectedLengthWhite_ = kTransmissionLengthWhiteNewHardware;
-                                expectedLengthBlack_ = kTransmissionLengthBlackNewHardware;
-                                whiteMaxX_ = kWhiteMaxXValueNewHardware;
-                                whiteMaxY_ = kWhiteMaxYValueNewHardware;
-                                blackMaxX_ = kBlackMaxXValueNewHardware;
-                                blackMaxY_ = kBlackMaxYValueNewHardware;
-                            }
-                            else {
-                                expectedLengthWhite_ = kTransmissionLengthWhiteOldHardware;
-                                expectedLengthBlack_ = kTransmissionLengthBlackOldHardware;
-                                whiteMaxX_ = kWhiteMaxXValueOldHardware;
-                                whiteMaxY_ = kWhiteMaxYValueOldHardware;
-                                blackMaxX_ = 1.0; // irrelevant -- no X data
-                                blackMaxY_ = kBlackMaxYValueOldHardware;
-                            }
-                            
-                            // Software version indicates what information is available. On version
-                            // 2 and greater, can indicate which is lowest sensor available. Might
-                            // be different from lowest connected key.
-                            if(status.softwareVersionMajor >= 2) {
-                                lowestKeyPresentMidiNote_ = octaveKeyToMidi(0, status.lowestHardwareNote);
-                                
-                                if(status.softwareVersionMinor == 1) {
-                                    // Version 2.1 uses the lowest MIDI note to handle keyboards which don't
-                                    // begin and end at C, e.g. E-E or F-F keyboards.
-                                    lowestNotePerOctave_ = status.lowestHardwareNote;
-                                }
-                                else {
-                                    lowestNotePerOctave_ = 0;
-                                }
-                            }
-                            else if(lowestKeyPresentMidiNote_ == 127) // No keys found and old device software
-                                lowestKeyPresentMidiNote_ = lowestMidiNote_;
-   
-                            keyboard_.setKeyboardGUIRange(lowestKeyPresentMidiNote_, lowestMidiNote_ + 12*numOctaves_ + lowestNotePerOctave_);
-                            calibrationInit(12*numOctaves_ + 1); // One more for the top C
-						}
-						else {
-							if(verbose_ >= 1) std::cout << "Warning: device present, but received invalid status frame.\n";
-                            deviceFlush(true);
-							return false;					// Yes... found the device
+
 						}
 
-                        deviceFlush(true);
-						return true;					// Yes... found the device
+						if(verbose_ >= 1) std::cout << '\n';
 					}
+                    
+                    // Hardware version determines whether all keys have XY or not
+                    if(status.hardwareVersion >= 2) {
+                        expectedLengthWhite_ = kTransmissionLengthWhiteNewHardware;
+                        expectedLengthBlack_ = kTransmissionLengthBlackNewHardware;
+                        whiteMaxX_ = kWhiteMaxXValueNewHardware;
+                        whiteMaxY_ = kWhiteMaxYValueNewHardware;
+                        blackMaxX_ = kBlackMaxXValueNewHardware;
+                        blackMaxY_ = kBlackMaxYValueNewHardware;
+                    }
+                    else {
+                        expectedLengthWhite_ = kTransmissionLengthWhiteOldHardware;
+                        expectedLengthBlack_ = kTransmissionLengthBlackOldHardware;
+                        whiteMaxX_ = kWhiteMaxXValueOldHardware;
+                        whiteMaxY_ = kWhiteMaxYValueOldHardware;
+                        blackMaxX_ = 1.0; // irrelevant -- no X data
+                        blackMaxY_ = kBlackMaxYValueOldHardware;
+                    }
+                    
+                    // Software version indicates what information is available. On version
+                    // 2 and greater, can indicate which is lowest sensor available. Might
+                    // be different from lowest connected key.
+                    if(status.softwareVersionMajor >= 2) {
+                        lowestKeyPresentMidiNote_ = octaveKeyToMidi(0, status.lowestHardwareNote);
+                        
+                        if(status.softwareVersionMinor == 1) {
+                            // Version 2.1 uses the lowest MIDI note to handle keyboards which don't
+                            // begin and end at C, e.g. E-E or F-F keyboards.
+                            lowestNotePerOctave_ = status.lowestHardwareNote;
+                        }
+                        else {
+                            lowestNotePerOctave_ = 0;
+                        }
+                    }
+                    else if(lowestKeyPresentMidiNote_ == 127) // No keys found and old device software
+                        lowestKeyPresentMidiNote_ = lowestMidiNote_;
+   
+                    keyboard_.setKeyboardGUIRange(lowestKeyPresentMidiNote_, lowestMidiNote_ + 12*numOctaves_ + lowestNotePerOctave_);
+                    calibrationInit(12*numOctaves_ + 1); // One more for the top C
 				}
-                
-                startingFrame = false;
+				else {
+					if(verbose_ >= 1) std::cout << "Warning: device present, but received invalid status frame.\n";
+                    deviceFlush(true);
+					return false;					// Yes... found the device
+				}
+
+                deviceFlush(true);
+				return true;					// Yes... found the device
 			}
 		}
 	
@@ -429,16 +421,29 @@ bool TouchkeyDevice::startAutoGathering() {
 	if(verbose_ >= 1)
 		std::cout << "Starting auto centroid collection\n";
 	
+    frameLatencyHistogram_.clear();
+    analogProcessingHistogram_.clear();
+    centroidFramesProcessed_ = centroidFramesWithAllocations_ = centroidFrameAllocations_ = 0;
+    analogFramesProcessed_ = analogFramesWithAllocations_ = analogFrameAllocations_ = 0;
+    frameDecoder_.clearStatistics();
+    
+    // Prepare the pipeline between the I/O and processing threads, if used. No other threads
+    // are touching it at this point.
+    framePipelineActive_ = framePipelineEnabled_;
+    framePipeline_.reset();
+    framePipelineQueued_ = framePipelineProcessed_ = 0;
+    framePipelineMaxOccupancy_ = 0;
+    framePipelineOverruns_ = 0;
+    
     // Start the data input and LED threads
+    if(framePipelineActive_)
+        processingThread_.startThread();
     ioThread_.startThread();
     ledThread_.startThread();
 	autoGathering_ = true;
     
-    // Tell the device to start scanning for new data
-	if(deviceWrite((char*)kCommandStartScanning, 5) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write startAutoGather command.  errno = " << errno << '\n';
-	}
+    // Tell the device to start scanning for new data. The I/O thread collects the ACK.
+	sendCommand(kCommandStartScanning, 5, kCommandTimeoutMilliseconds);
 
 	keyboard_.sendMessage("/touchkeys/allnotesoff", "", LO_ARGS_END);
 	if(keyboard_.gui() != nullptr) {
@@ -463,16 +468,14 @@ void TouchkeyDevice::stopAutoGathering(bool writeStopCommandToDevice) {
     calibrationAbort();	
     
     if(writeStopCommandToDevice) {
-        // Tell device to stop scanning
-        if(deviceWrite((char*)kCommandStopScanning, 5) < 0) {
-            if(verbose_ >= 1)
-                std::cout << "ERROR: unable to write stopAutoGather command.  errno = " << errno << '\n';
-        }
+        // Tell device to stop scanning. The ACK is collected below once the threads have stopped.
+        sendCommand(kCommandStopScanning, 5, kCommandTimeoutMilliseconds);
     }
 	
     // Setting this to true tells the run loop to exit what it's doing
 	shouldStop_ = true;
     ledShouldStop_ = true;
+    ledUpdateAvailable_.signal();
 	
 	if(verbose_ >= 1)
 		std::cout << "Stopping auto centroid collection\n";
@@ -482,12 +485,23 @@ void TouchkeyDevice::stopAutoGathering(bool writeStopCommandToDevice) {
     if(ioThread_.getThreadId() != juce::Thread::getCurrentThreadId())
         if(ioThread_.isThreadRunning())
             ioThread_.stopThread(3000);
+    if(processingThread_.getThreadId() != juce::Thread::getCurrentThreadId())
+        if(processingThread_.isThreadRunning())
+            processingThread_.stopThread(3000);
     if(ledThread_.getThreadId() != juce::Thread::getCurrentThreadId())
         if(ledThread_.isThreadRunning())
             ledThread_.stopThread(3000);
     if(rawDataThread_.getThreadId() != juce::Thread::getCurrentThreadId())
         if(rawDataThread_.isThreadRunning())
             rawDataThread_.stopThread(3000);
+    
+    // The processing thread may have finished before the I/O thread queued its last
+    // frames; process those here so the statistics account for every frame received
+    if(framePipelineActive_ && !ioThread_.isThreadRunning() && !processingThread_.isThreadRunning())
+        processPipelineFrames();
+    
+    // Nobody else is reading now, so wait here for the responses to any commands still out
+    finishOutstandingCommands();
 	
     // Stop any currently playing notes
 	keyboard_.sendMessage("/touchkeys/allnotesoff", "", LO_ARGS_END);
@@ -506,6 +520,30 @@ void TouchkeyDevice::stopAutoGathering(bool writeStopCommandToDevice) {
         keyboard_.gui()->clearAnalogData();
 	}
 	
+	if(verbose_ >= 1) {
+        frameLatencyHistogram_.print(std::cout, ingestMode_ == kIngestModeEventDriven ?
+                                     "Frame latency (event-driven ingest)" : "Frame latency (polling ingest)");
+        analogProcessingHistogram_.print(std::cout, "Analog frame processing time");
+        if(AllocationCounter::isEnabled()) {
+            std::cout << "Centroid frames with heap allocations: " << centroidFramesWithAllocations_ << " of " << centroidFramesProcessed_;
+            std::cout << " (" << centroidFrameAllocations_ << " allocations)\n";
+            std::cout << "Analog frames with heap allocations: " << analogFramesWithAllocations_ << " of " << analogFramesProcessed_;
+            std::cout << " (" << analogFrameAllocations_ << " allocations)\n";
+        }
+        std::cout << "Frame decoder: " << frameDecoder_.bytesProcessed() << " bytes, " << frameDecoder_.framesDecoded() << " frames, ";
+        std::cout << frameDecoder_.escapeSequences() << " escape sequences, " << frameDecoder_.framesDropped() << " dropped, ";
+        std::cout << frameDecoder_.frameErrors() << " frame errors\n";
+        if(framePipelineActive_) {
+            std::cout << "Frame pipeline: " << framePipelineQueued_.load() << " frames queued, ";
+            std::cout << framePipelineProcessed_.load() << " processed, maximum occupancy ";
+            std::cout << framePipelineMaxOccupancy_.load() << "/" << kFramePipelineCapacity << ", ";
+            std::cout << framePipelineOverruns_.load() << " overruns\n";
+        }
+        std::cout << "Command engine: " << commandEngine_.commandsSent() << " commands sent, " << commandEngine_.commandsAcknowledged() << " ACK, ";
+        std::cout << commandEngine_.commandsRejected() << " NAK, " << commandEngine_.commandsTimedOut() << " timed out, maximum ";
+        std::cout << commandEngine_.maxInFlightSeen() << " in flight, " << commandEngine_.lateResponses() << " late responses discarded\n";
+    }
+    framePipelineActive_ = false;
 	if(verbose_ >= 2)
 		std::cout << "...done.\n";
 
@@ -533,6 +571,9 @@ bool TouchkeyDevice::startRawDataCollection(int octave, int key, int mode, int s
     rawDataShouldChangeMode_ = true;
     
 	shouldStop_ = false;
+    framePipelineActive_ = false;
+    frameLatencyHistogram_.clear();
+    frameDecoder_.clearStatistics();
     rawDataThread_.startThread();
     
 	if(verbose_ >= 1)
@@ -560,25 +601,22 @@ void TouchkeyDevice::rawDataChangeKeyAndMode(int octave, int key, int mode, int
 // Set the scan interval in milliseconds.  Returns true on success.
 
 bool TouchkeyDevice::setScanInterval(int intervalMilliseconds) {
+	return waitForCommand(setScanIntervalAsync(intervalMilliseconds));
+}
+
+TouchkeyCommandEngine::Future TouchkeyDevice::setScanIntervalAsync(int intervalMilliseconds) {
 	if(!isOpen())
-		return false;	
+		return TouchkeyCommandEngine::Future();
 	if(intervalMilliseconds <= 0 || intervalMilliseconds > 255)
-		return false;
+		return TouchkeyCommandEngine::Future();
 	
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
 		kFrameTypeScanRate, (unsigned char)(intervalMilliseconds & 0xFF), ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(deviceWrite((char*)command, 6) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write startRawDataCollection command.  errno = " << errno << '\n';
-	}
-	
 	if(verbose_ >= 2)
 		std::cout << "Setting scan interval to " << intervalMilliseconds << '\n';
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);
+	return sendCommand(command, 6, kCommandTimeoutMilliseconds);
 }
 
 // Key parameters.  Setting octave or key to -1 means all octaves or all keys, respectively.
@@ -586,16 +624,16 @@ bool TouchkeyDevice::setScanInterval(int intervalMilliseconds) {
 // It is a balance between achieving the best range of data and not saturating the sensors
 // for the largest touches.
 bool TouchkeyDevice::setKeySensitivity(int octave, int key, int value) {
+	return waitForCommand(setKeySensitivityAsync(octave, key, value));
+}
+
+TouchkeyCommandEngine::Future TouchkeyDevice::setKeySensitivityAsync(int octave, int key, int value) {
 	unsigned char chOctave, chKey, chVal;
 	
 	if(!isOpen())
-		return false;
-	if(octave > 255)
-		return false;
-	if(key > 12)
-		return false;
-	if(value > 255 || value < 0)
-		return false;
+		return TouchkeyCommandEngine::Future();
+	if(octave > 255 || key > 12 || value > 255 || value < 0)
+		return TouchkeyCommandEngine::Future();
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -608,33 +646,26 @@ bool TouchkeyDevice::setKeySensitivity(int octave, int key, int value) {
 	
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeSensitivity,
 		chOctave, chKey, chVal, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
-	
-	// Send command
-	if(deviceWrite((char*)command, 8) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setKeySensitivity command.  errno = " << errno << '\n';
-	}
 
 	if(verbose_ >= 2)
 		std::cout << "Setting sensitivity to " << value << '\n';
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);	
+	return sendCommand(command, 8, kCommandTimeoutMilliseconds);
 }
 
 // Change how the calculated centroids are scaled to fit in a single byte. They
 // will be right-shifted by the indicated number of bits before being transmitted.
 bool TouchkeyDevice::setKeyCentroidScaler(int octave, int key, int value) {
+	return waitForCommand(setKeyCentroidScalerAsync(octave, key, value));
+}
+
+TouchkeyCommandEngine::Future TouchkeyDevice::setKeyCentroidScalerAsync(int octave, int key, int value) {
 	unsigned char chOctave, chKey, chVal;
 	
 	if(!isOpen())
-		return false;	
-	if(octave > 255)
-		return false;
-	if(key > 12)
-		return false;
-	if(value > 7 || value < 0)
-		return false;
+		return TouchkeyCommandEngine::Future();
+	if(octave > 255 || key > 12 || value > 7 || value < 0)
+		return TouchkeyCommandEngine::Future();
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -647,33 +678,26 @@ bool TouchkeyDevice::setKeyCentroidScaler(int octave, int key, int value) {
 	
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeSizeScaler,
 		chOctave, chKey, chVal, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
-	
-	// Send command
-	if(deviceWrite((char*)command, 8) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setKeyCentroidScaler command.  errno = " << errno << '\n';
-	}
     
 	if(verbose_ >= 2)
 		std::cout << "Setting size scaler to " << value << '\n';
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);
+	return sendCommand(command, 8, kCommandTimeoutMilliseconds);
 }
 
 // Set the minimum size of a centroid calculated on the key which is considered
 // "real" and not noise.
 bool TouchkeyDevice::setKeyMinimumCentroidSize(int octave, int key, int value) {
+	return waitForCommand(setKeyMinimumCentroidSizeAsync(octave, key, value));
+}
+
+TouchkeyCommandEngine::Future TouchkeyDevice::setKeyMinimumCentroidSizeAsync(int octave, int key, int value) {
 	unsigned char chOctave, chKey, chValHi, chValLo;
 	
 	if(!isOpen())
-		return false;	
-	if(octave > 255)
-		return false;
-	if(key > 12)
-		return false;
-	if(value > 0xFFFF || value < 0)
-		return false;
+		return TouchkeyCommandEngine::Future();
+	if(octave > 255 || key > 12 || value > 0xFFFF || value < 0)
+		return TouchkeyCommandEngine::Future();
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -685,33 +709,38 @@ bool TouchkeyDevice::setKeyMinimumCentroidSize(int octave, int key, int value) {
 	chValHi = (unsigned char)((value >> 8) & 0xFF);
 	chValLo = (unsigned char)(value & 0xFF);
 	
-	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeMinimumSize,
-		chOctave, chKey, chValHi, chValLo, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
-	
-	// Send command
-	if(deviceWrite((char*)command, 9) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setKeyMinimumCentroidSize command.  errno = " << errno << '\n';
-	}
+	// Either half of the value could come out as the escape character, which has to be doubled
+	unsigned char command[11] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeMinimumSize,
+		chOctave, chKey};
+	int length = 5;
+	command[length++] = chValHi;
+	if(chValHi == ESCAPE_CHARACTER)
+		command[length++] = chValHi;
+	command[length++] = chValLo;
+	if(chValLo == ESCAPE_CHARACTER)
+		command[length++] = chValLo;
+	command[length++] = ESCAPE_CHARACTER;
+	command[length++] = kControlCharacterFrameEnd;
 
 	if(verbose_ >= 2)
 		std::cout << "Setting minimum centroid size to " << value << '\n';
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);	
+	return sendCommand(command, length, kCommandTimeoutMilliseconds);
 }
 
 // Set the noise threshold for individual sensor pads: the reading must exceed
 // the background value by this amount to be considered an actual touch.
 bool TouchkeyDevice::setKeyNoiseThreshold(int octave, int key, int value) {
+	return waitForCommand(setKeyNoiseThresholdAsync(octave, key, value));
+}
+
+TouchkeyCommandEngine::Future TouchkeyDevice::setKeyNoiseThresholdAsync(int octave, int key, int value) {
 	unsigned char chOctave, chKey, chVal;
 	
-	if(octave > 255)
-		return false;
-	if(key > 12)
-		return false;
-	if(value > 255 || value < 0)
-		return false;
+	if(!isOpen())
+		return TouchkeyCommandEngine::Future();
+	if(octave > 255 || key > 12 || value > 255 || value < 0)
+		return TouchkeyCommandEngine::Future();
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -724,50 +753,106 @@ bool TouchkeyDevice::setKeyNoiseThreshold(int octave, int key, int value) {
 	
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeNoiseThreshold,
 		chOctave, chKey, chVal, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
-	
-	// Send command
-	if(deviceWrite((char*)command, 8) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setKeyNoiseThreshold command.  errno = " << errno << '\n';
-	}
 
 	if(verbose_ >= 2)
 		std::cout << "Setting noise threshold to " << value << '\n';
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);	
+	return sendCommand(command, 8, kCommandTimeoutMilliseconds);
 }
 
-// Update the baseline sensor values on the given key
+// Update the baseline sensor values on the given key. The baseline update and the read
+// preparation that follows it are sent back to back; the result is that of the second.
 bool TouchkeyDevice::setKeyUpdateBaseline(int octave, int key) {
+	return waitForCommand(setKeyUpdateBaselineAsync(octave, key));
+}
+
+TouchkeyCommandEngine::Future TouchkeyDevice::setKeyUpdateBaselineAsync(int octave, int key) {
+	if(!isOpen())
+		return TouchkeyCommandEngine::Future();
+	
     unsigned char baselineCommand[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
         kFrameTypeSendI2CCommand, (unsigned char)octave, (unsigned char)key,
         2 /* xmit */, 0 /* response */, 0 /* command offset */, 6 /* baseline update */,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
-    
-    // Send command
-	if(deviceWrite((char*)baselineCommand, 11) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write baseline update command.  errno = " << errno << '\n';
-	}
 
 	if(verbose_ >= 2)
 		std::cout << "Updating baseline on octave " << octave << " key " << key << '\n';
 	
-    checkForAck(100);
+    sendCommand(baselineCommand, 11, kCommandI2CTimeoutMilliseconds);
     
     unsigned char commandPrepareRead[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
         kFrameTypeSendI2CCommand, (unsigned char)octave, (unsigned char)key,
         1 /* xmit */, 0 /* response */, 6 /* data offset */,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
     
-	if(deviceWrite((char*)commandPrepareRead, 10) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write prepareRead command.  errno = " << errno << '\n';
-	}
+	return sendCommand(commandPrepareRead, 10, kCommandI2CTimeoutMilliseconds);
+}
+
+// Wait for a queued command to complete. Returns true if the device
+// acknowledged it. If the I/O thread is running it matches the response; otherwise we
+// read from the device here until the response arrives.
+bool TouchkeyDevice::waitForCommand(TouchkeyCommandEngine::Future result) {
+    if(!result.valid())
+        return false;
+    
+    while(result.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) {
+        if(autoGathering_)
+            result.wait_for(std::chrono::milliseconds(kCommandEngineServiceIntervalMilliseconds));
+        else if(!readCommandResponses(kCommandEngineServiceIntervalMilliseconds))
+            commandEngine_.cancelAll();
+        commandEngine_.service(juce::Time::getMillisecondCounterHiRes());
+    }
+    
+    switch(result.get()) {
+        case TouchkeyCommandEngine::kResultAcknowledged:
+            if(verbose_ >= 2)
+                std::cout << "Received ACK\n";
+            return true;
+        case TouchkeyCommandEngine::kResultRejected:
+            if(verbose_ >= 1)
+                std::cout << "Warning: received NAK\n";
+            break;
+        case TouchkeyCommandEngine::kResultTimedOut:
+            if(verbose_ >= 1)
+                std::cout << "Error: timeout waiting for ACK\n";
+            break;
+        default:
+            break;
+    }
+    return false;
+}
 
-	// Return value depends on ACK or NAK received
-	return checkForAck(100);
+// Wait for several queued commands. The device answers them in order, so once the last
+// has finished the rest have too. Returns true if every one was acknowledged.
+bool TouchkeyDevice::waitForCommands(std::vector<TouchkeyCommandEngine::Future> const& results) {
+    if(results.empty())
+        return true;
+    
+    bool allAcknowledged = waitForCommand(results.back());
+    for(size_t i = 0; i + 1 < results.size(); i++) {
+        if(!waitForCommand(results[i]))
+            allAcknowledged = false;
+    }
+    return allAcknowledged;
+}
+
+// Send the parameters for each key (or group of keys) back to back, then wait for them
+// all. Values of -1 are left as they are on the device.
+bool TouchkeyDevice::configureKeys(std::vector<KeySettings> const& settings) {
+    std::vector<TouchkeyCommandEngine::Future> results;
+    
+    for(auto it = settings.begin(); it != settings.end(); ++it) {
+        if(it->sensitivity >= 0)
+            results.push_back(setKeySensitivityAsync(it->octave, it->key, it->sensitivity));
+        if(it->centroidScaler >= 0)
+            results.push_back(setKeyCentroidScalerAsync(it->octave, it->key, it->centroidScaler));
+        if(it->minimumCentroidSize >= 0)
+            results.push_back(setKeyMinimumCentroidSizeAsync(it->octave, it->key, it->minimumCentroidSize));
+        if(it->noiseThreshold >= 0)
+            results.push_back(setKeyNoiseThresholdAsync(it->octave, it->key, it->noiseThreshold));
+    }
+    
+    return waitForCommands(results);
 }
 
 // Set whether to ignore stray touches that might not be actual finger touch events
@@ -787,28 +872,26 @@ void TouchkeyDevice::jumpToBootloader() {
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeEnterSelfProgramMode,
 		0xA1, 0xB2, 0xC3, 0xD4, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(deviceWrite((char*)command, 9) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write jumpToBootloader command.  errno = " << errno << '\n';
-	}
+	// Send command. The device acknowledges it before jumping.
+	sendCommand(command, 9, kCommandTimeoutMilliseconds);
 }
 
 // Set the LED color for the given MIDI note (if RGB LEDs are present). This method
 // does not directly communicate with the device, but it schedules an update to take
 // place in the relevant thread.
 void TouchkeyDevice::rgbledSetColor(const int midiNote, const float red, const float green, const float blue) {
-    RGBLEDUpdate updateStructure;
-    
-    updateStructure.allLedsOff = false;
-    updateStructure.midiNote = midiNote;
+    if(midiNote < 0 || midiNote > 127)
+        return;
     
-    // Convert 0-1 floating point range to 0-255
-    updateStructure.red = (int)(red * 4095.0);
-    updateStructure.green = (int)(green * 4095.0);
-    updateStructure.blue = (int)(blue * 4095.0);
+    // Convert 0-1 floating point range to 0-4095, and pack the three values together
+    uint64_t color = ((uint64_t)rgbledComponent(red) << 24) | ((uint64_t)rgbledComponent(green) << 12) |
+                     (uint64_t)rgbledComponent(blue);
     
-    ledUpdateQueue_.push_front(updateStructure);
+    // Only the latest color for each note matters. The LED thread picks it up along
+    // with any others that have changed the next time it runs.
+    ledColors_[midiNote].store(color, std::memory_order_relaxed);
+    ledDirty_[midiNote >> 6].fetch_or(1ULL << (midiNote & 63), std::memory_order_release);
+    ledUpdateAvailable_.signal();
 }
 
 // Same as rgbledSetColor() but uses HSV format color instead of RGB
@@ -858,84 +941,81 @@ void TouchkeyDevice::rgbledSetColorHSV(const int midiNote, const float hue, cons
 // directly communicate with the device, but it schedules an update to take
 // place in the relevant thread.
 void TouchkeyDevice::rgbledAllOff() {
-    RGBLEDUpdate updateStructure;
-    
-    updateStructure.allLedsOff = true;
-    updateStructure.midiNote = 0;
-    updateStructure.red = 0;
-    updateStructure.green = 0;
-    updateStructure.blue = 0;
-    
-    ledUpdateQueue_.push_front(updateStructure);
+    // Any changes not yet sent are superseded
+    for(int i = 0; i < 128; i++)
+        ledColors_[i].store(0, std::memory_order_relaxed);
+    ledDirty_[0].store(0, std::memory_order_relaxed);
+    ledDirty_[1].store(0, std::memory_order_relaxed);
+    
+    ledAllOffPending_.store(true, std::memory_order_release);
+    ledUpdateAvailable_.signal();
+}
+
+// Set how many LED records may share a frame. Only firmware which reads several
+// records per frame should be given more than one.
+void TouchkeyDevice::rgbledSetMaxUpdatesPerFrame(int updates) {
+    if(updates < 1)
+        updates = 1;
+    if(updates > kRGBLEDMaxUpdatesPerFrame)
+        updates = kRGBLEDMaxUpdatesPerFrame;
+    ledUpdatesPerFrame_ = updates;
 }
 
-// Set the color of a given RGB LED (piano scanner boards only). LEDs are numbered from 0-24
-// starting at left. Boards are numbered 0-3 starting at left.
-bool TouchkeyDevice::internalRGBLEDSetColor(const int device, const int led, const int red, const int green, const int blue) {
+// Set the colors of several RGB LEDs on one board (piano scanner boards only) with a single
+// frame. LEDs are numbered from 0-24 starting at left. Boards are numbered 0-3 starting at
+// left. Colors hold 12-bit red, green and blue values packed as by rgbledSetColor().
+bool TouchkeyDevice::internalRGBLEDSetColors(const int device, const int *leds, const uint64_t *colors, const int count) {
 	if(!isOpen())
 		return false;
     if(!deviceHasRGBLEDs_)
         return false;
     if(device < 0 || device > 3)
         return false;
-    if(led < 0 || led > 24)
-        return false;
-    if(red < 0 || red > 4095)
-        return false;
-    if(green < 0 || green > 4095)
+    if(count <= 0 || count > kRGBLEDMaxUpdatesPerFrame)
         return false;
-    if(blue < 0 || blue > 4095)
-        return false;
-    
-    unsigned char command[17]; // 11 bytes + possibly 6 doubled characters
     
-    // There's a chance that one of the bytes will come out to ESCAPE_CHARACTER (0xFE) depending
-    // on LED color. We need to double up any bytes that come in that way.
+    unsigned char command[5 + 12 * kRGBLEDMaxUpdatesPerFrame]; // 6 bytes per LED, possibly all doubled
+    unsigned char record[6];
+    int location = 3;
     
     command[0] = ESCAPE_CHARACTER;
     command[1] = kControlCharacterFrameBegin;
     command[2] = kFrameTypeRGBLEDSetColors;
     
-    int byte, location = 3;
-    
-    byte = (((unsigned char)device & 0xFF) << 6) | (unsigned char)led;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (red >> 4) & 0xFF;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = ((red << 4) & 0xF0) | ((green >> 8) & 0x0F);
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (green & 0xFF);
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (blue >> 4) & 0xFF;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (blue << 4) & 0xF0;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
+    for(int i = 0; i < count; i++) {
+        if(leds[i] < 0 || leds[i] > 24)
+            continue;
+        
+        int red = (int)((colors[i] >> 24) & 0xFFF);
+        int green = (int)((colors[i] >> 12) & 0xFFF);
+        int blue = (int)(colors[i] & 0xFFF);
+        
+        record[0] = (((unsigned char)device & 0xFF) << 6) | (unsigned char)leds[i];
+        record[1] = (red >> 4) & 0xFF;
+        record[2] = ((red << 4) & 0xF0) | ((green >> 8) & 0x0F);
+        record[3] = (green & 0xFF);
+        record[4] = (blue >> 4) & 0xFF;
+        record[5] = (blue << 4) & 0xF0;
+        
+        // There's a chance that one of the bytes will come out to ESCAPE_CHARACTER (0xFE) depending
+        // on LED color. We need to double up any bytes that come in that way.
+        for(int j = 0; j < 6; j++) {
+            command[location++] = record[j];
+            if(record[j] == ESCAPE_CHARACTER)
+                command[location++] = record[j];
+        }
+    }
+    
     command[location++] = ESCAPE_CHARACTER;
     command[location++] = kControlCharacterFrameEnd;
     
-	// Send command
-	if(deviceWrite((char*)command, location) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setRGBLEDColor command.  errno = " << errno << '\n';
-	}
-	
 	if(verbose_ >= 3)
-		std::cout << "Setting RGB LED color for device " << device << ", led " << led << '\n';
-        
-	// Return value depends on ACK or NAK received
-	return true; //checkForAck(20);
+		std::cout << "Setting " << count << " RGB LED colors for device " << device << '\n';
+    
+	// Send command. Nobody waits for the ACK, but it has to go through the command
+	// engine so it isn't taken as the response to another command.
+	sendCommand(command, location, kCommandTimeoutMilliseconds);
+	return true;
 }
 
 // Turn off all RGB LEDs on a given board
@@ -953,17 +1033,12 @@ bool TouchkeyDevice::internalRGBLEDAllOff() {
     command[3] = ESCAPE_CHARACTER;
     command[4] = kControlCharacterFrameEnd;
 	
-	// Send command
-	if(deviceWrite((char*)command, 5) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setRGBLEDAllOff command.  errno = " << errno << '\n';
-	}
-    
 	if(verbose_ >= 3)
 		std::cout << "Turning off all RGB LEDs" << '\n';
     
-	// Return value depends on ACK or NAK received
-	return true; //checkForAck(20);
+	// Send command; as above, nobody waits for the ACK
+	sendCommand(command, 5, kCommandTimeoutMilliseconds);
+	return true;
 }
 
 // Get board number for MIDI note
@@ -1200,6 +1275,10 @@ void TouchkeyDevice::calibrationInit(int numberOfCalibrators) {
 		keyCalibrators_[i] = new PianoKeyCalibrator(true, 0);
 	}
     
+    // Analog data needs to find the new calibrators
+    for(int i = 0; i < kAnalogMaxBoards; i++)
+        analogTargets_[i].octave = -1;
+    
     calibrationClear();
 }
 
@@ -1215,6 +1294,8 @@ void TouchkeyDevice::calibrationDeinit() {
     }
     free(keyCalibrators_);
     
+    for(int i = 0; i < kAnalogMaxBoards; i++)
+        analogTargets_[i].octave = -1;
     keyCalibratorsLength_ = 0;
     isCalibrated_ = calibrationInProgress_ = false;
 }
@@ -1259,49 +1340,113 @@ int TouchkeyDevice::octaveKeyToMidi(int octave, int key) {
 // in a separate thread from data collection so the device's capacity
 // to process incoming data doesn't gate its transmission of sensor data
 void TouchkeyDevice::ledUpdateLoop(DeviceThread *thread) {
+    int leds[4][kRGBLEDMaxUpdatesPerFrame];         // Pending changes for each board
+    uint64_t colors[4][kRGBLEDMaxUpdatesPerFrame];
+    int counts[4];
+    const int updatesPerFrame = ledUpdatesPerFrame_;
     
-    // Run until told to stop, looking for updates to send to the board
+    // We don't know what the LEDs are showing until we've set them
+    for(int i = 0; i < 128; i++)
+        ledSentColors_[i] = ~0ULL;
+    
+    // Run until told to stop, sending updates to the board whenever notes change color
     while(!shouldStop_ && !ledShouldStop_ && !thread->threadShouldExit()) {
-        while(!ledUpdateQueue_.empty()) {
-            // Get the update
-            RGBLEDUpdate& updateStructure = ledUpdateQueue_.back();
+        if(ledAllOffPending_.exchange(false, std::memory_order_acquire)) {
+            internalRGBLEDAllOff();
+            for(int i = 0; i < 128; i++)
+                ledSentColors_[i] = 0;
+        }
+        
+        // Collect the latest color of each note that changed, skipping any which
+        // ended up where they started, and send them a board at a time
+        for(int board = 0; board < 4; board++)
+            counts[board] = 0;
+        
+        for(int word = 0; word < 2; word++) {
+            uint64_t dirty = ledDirty_[word].exchange(0, std::memory_order_acquire);
             
-            if(updateStructure.allLedsOff) {
-                internalRGBLEDAllOff();
-            }
-            else {
-                // Convert MIDI note number to board/LED pair. If valid, send to device.
-                int board = internalRGBLEDMIDIToBoardNumber(updateStructure.midiNote);
-                int led = internalRGBLEDMIDIToLEDNumber(updateStructure.midiNote);
+            for(int bit = 0; dirty != 0; bit++, dirty >>= 1) {
+                if(!(dirty & 1))
+                    continue;
                 
-                if(board >= 0 && board <= 3 && led >= 0)
-                    internalRGBLEDSetColor(board, led, updateStructure.red, updateStructure.green, updateStructure.blue);
+                int midiNote = word * 64 + bit;
+                uint64_t color = ledColors_[midiNote].load(std::memory_order_relaxed);
+                if(color == ledSentColors_[midiNote])
+                    continue;
+                
+                // Convert MIDI note number to board/LED pair. If valid, queue for the device.
+                int board = internalRGBLEDMIDIToBoardNumber(midiNote);
+                int led = internalRGBLEDMIDIToLEDNumber(midiNote);
+                if(board < 0 || board > 3 || led < 0)
+                    continue;
+                
+                leds[board][counts[board]] = led;
+                colors[board][counts[board]] = color;
+                ledSentColors_[midiNote] = color;
+                
+                if(++counts[board] == updatesPerFrame) {
+                    internalRGBLEDSetColors(board, leds[board], colors[board], counts[board]);
+                    counts[board] = 0;
+                }
             }
-            
-            // Remove the update we just transmitted
-            ledUpdateQueue_.pop_back();
         }
         
-        juce::Thread::sleep(20);
+        for(int board = 0; board < 4; board++) {
+            if(counts[board] > 0)
+                internalRGBLEDSetColors(board, leds[board], colors[board], counts[board]);
+        }
+        
+        // Nobody waits on the LED commands (or the start scanning command), so expire
+        // them here if their responses are lost
+        commandEngine_.service(juce::Time::getMillisecondCounterHiRes());
+        
+        // Sleep until another update arrives. The timeout is only so we periodically
+        // check whether the thread should stop.
+        ledUpdateAvailable_.wait(kRGBLEDUpdateTimeoutMilliseconds);
     }
 }
 
 // Main run loop, which runs in its own thread
 void TouchkeyDevice::runLoop(DeviceThread *thread) {
 	unsigned char buffer[1024];							// Raw data from device
-	unsigned char frame[TOUCHKEY_MAX_FRAME_LENGTH];		// Accumulated frame of data
-	int frameLength;
-	bool controlSeq = false, inFrame = false, frameError = false;
+    
+    frameDecoder_.reset();
+    
+    // Event-driven ingest is only available where the device can be waited on
+#ifdef _MSC_VER
+    const bool eventDriven = false;
+#else
+    const bool eventDriven = (ingestMode_ == kIngestModeEventDriven);
+#endif
+    
+    // Earliest time the most recently read data could have arrived, for latency statistics.
+    // When polling, data may have been waiting since just after the last empty read.
+    double arrivalTime = juce::Time::getMillisecondCounterHiRes();
+    bool lastReadWasEmpty = false;
 
    /* struct timeval currentTime;
     unsigned long long currentTicks = 0, lastTicks = 0;
     int currentNote = 21;*/
 
 	// Continuously read from the input device.  Read as much data as is available, up to
-	// 1024 bytes at a time.  If no data is available, wait 0.5ms before trying again.  USB
-	// data comes in every 1ms, so this guarantees no more than a 1ms wait for data, and often less.
+	// 1024 bytes at a time.  In polling mode, if no data is available, wait 0.5ms before trying
+	// again.  USB data comes in every 1ms, so this guarantees no more than a 1ms wait for data,
+	// and often less.  In event-driven mode, block until data arrives instead, so there is no
+	// added latency and no wakeups when the keyboard is idle.
 	
+    // Frames are processed here when there is no processing thread. Every wait is bounded,
+    // so a quiescent state each pass is enough.
+    TriggerSource::registerSendingThread();
+    
 	while(!shouldStop_ && !thread->threadShouldExit()) {
+        TriggerSource::threadQuiescent();
+        
+        if(eventDriven) {
+            // Timeout is only so we periodically check whether the thread should stop. An empty
+            // read after this returns means the device hung up, and is handled as in polling mode.
+            if(!deviceWaitForData(kIngestEventDrivenTimeoutMilliseconds))
+                continue;
+        }
         
 /*
             // This code for RGBLED testing
@@ -1319,9 +1464,12 @@ void TouchkeyDevice::runLoop(DeviceThread *thread) {
                 rgbledSetColorHSV(currentNote, (float)(currentNote - 21)/(float)(highestMidiNote() - 21), 1.0, 1.0);
             }
 */        
+        double readTime = juce::Time::getMillisecondCounterHiRes();
  		long count = deviceRead((char *)buffer, 1024);
 
 		if(count == 0) {
+            arrivalTime = readTime;
+            lastReadWasEmpty = true;
 #ifdef _MSC_VER
             juce::Thread::sleep(1);
 #else
@@ -1337,6 +1485,8 @@ void TouchkeyDevice::runLoop(DeviceThread *thread) {
 				//shouldStop_ = true;
 			}
 			
+            arrivalTime = readTime;
+            lastReadWasEmpty = true;
 #ifdef _MSC_VER
 			juce::Thread::sleep(1);
 #else
@@ -1345,82 +1495,25 @@ void TouchkeyDevice::runLoop(DeviceThread *thread) {
 			continue;
 		}	
 		
+        // In event-driven mode we were woken as the data arrived. When polling, the data arrived
+        // some time after the last empty read; take that as the worst case.
+        if(eventDriven || !lastReadWasEmpty)
+            arrivalTime = readTime;
+        lastReadWasEmpty = false;
+        
 		// Process the received data
-		
-		for(int i = 0; i < count; i++) {
-			unsigned char ch = buffer[i];
-		
-			if(inFrame) {
-				// Receiving a frame
-				
-				if(controlSeq) {
-					controlSeq = false;
-					if(ch == kControlCharacterFrameEnd)	{		// frame finished?
-						inFrame = false;
-						processFrame(frame, frameLength);
-					}
-					else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error
-						if(verbose_ >= 1)
-							std::cout << "Warning: received frame error, continuing anyway.\n";
-						frameError = true;
-					}
-					else if(ch == ESCAPE_CHARACTER) {			// double-escape means a literal escape character
-						frame[frameLength++] = ch;
-						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
-							inFrame = false;
-							if(verbose_ >= 1)
-								std::cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << '\n';
-						}				
-					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						std::cout << "Warning: received NAK (while receiving frame)\n";
-					}			
-				}
-				else {
-					if(ch == ESCAPE_CHARACTER)
-						controlSeq = true;
-					else {
-						frame[frameLength++] = ch;
-						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
-							inFrame = false;
-							if(verbose_ >= 1)
-								std::cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << '\n';
-						}
-					}
-				}				
-			}
-			else {
-				// Waiting for a frame beginning control sequence
-				
-				if(controlSeq) {
-					controlSeq = false;
-					if(ch == kControlCharacterFrameBegin) {
-						inFrame = true;
-						frameLength = 0;
-						frameError = false;
-					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						std::cout << "Warning: received NAK (while waiting for frame)\n";
-					}
-				}
-				else {
-					if(ch == ESCAPE_CHARACTER)
-						controlSeq = true;
-				}
-			}
-		}
+		processReceivedData(buffer, count, arrivalTime);
 	}
+    
+    TriggerSource::unregisterSendingThread();
 }
 
 // Main run loop for gathering raw data from a particular key, used for debugging
 // and testing purposes
 void TouchkeyDevice::rawDataRunLoop(DeviceThread *thread) {
 	unsigned char buffer[1024];							// Raw data from device
-	unsigned char frame[TOUCHKEY_MAX_FRAME_LENGTH];		// Accumulated frame of data
-	int frameLength;
-	bool controlSeq = false, inFrame = false, frameError = false;
+    
+    frameDecoder_.reset();
     
     unsigned char gatherDataCommand[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
         kFrameTypeSendI2CCommand, (unsigned char)rawDataCurrentOctave_, (unsigned char)rawDataCurrentKey_,
@@ -1442,6 +1535,9 @@ void TouchkeyDevice::rawDataRunLoop(DeviceThread *thread) {
         if(currentTime - lastTime > 50.0) {
             lastTime = currentTime;
             
+            // Nobody waits on the key preparation commands, so expire them here
+            commandEngine_.service(currentTime);
+            
             // Check if we need to choose a new key or mode
             if(rawDataShouldChangeMode_) {
                 // Prepare the key and update the command
@@ -1450,11 +1546,8 @@ void TouchkeyDevice::rawDataRunLoop(DeviceThread *thread) {
                 gatherDataCommand[4] = rawDataCurrentKey_;
             }
             
-            // Request data
-            if(deviceWrite((char*)gatherDataCommand, 9) < 0) {
-                if(verbose_ >= 1)
-                    std::cout << "ERROR: unable to write gather data command.  errno = " << errno << '\n';
-            }
+            // Request data. The data comes back in an I2C response frame after the ACK.
+            sendCommand(gatherDataCommand, 9, kCommandI2CTimeoutMilliseconds);
         }
       
  		long count = deviceRead((char *)buffer, 1024);
@@ -1484,74 +1577,114 @@ void TouchkeyDevice::rawDataRunLoop(DeviceThread *thread) {
 		}
 		
 		// Process the received data
-		
-		for(int i = 0; i < count; i++) {
-			unsigned char ch = buffer[i];
-            
-			if(inFrame) {
-				// Receiving a frame
-				
-				if(controlSeq) {
-					controlSeq = false;
-					if(ch == kControlCharacterFrameEnd)	{		// frame finished?
-						inFrame = false;
-						processFrame(frame, frameLength);
-					}
-					else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error
-						if(verbose_ >= 1)
-							std::cout << "Warning: received frame error, continuing anyway.\n";
-						frameError = true;
-					}
-					else if(ch == ESCAPE_CHARACTER) {			// double-escape means a literal escape character
-						frame[frameLength++] = ch;
-						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
-							inFrame = false;
-							if(verbose_ >= 1)
-								std::cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << '\n';
-						}
-					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						std::cout << "Warning: received NAK (while receiving frame)\n";
-					}
-				}
-				else {
-					if(ch == ESCAPE_CHARACTER)
-						controlSeq = true;
-					else {
-						frame[frameLength++] = ch;
-						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
-							inFrame = false;
-							if(verbose_ >= 1)
-								std::cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << '\n';
-						}
-					}
-				}
-			}
-			else {
-				// Waiting for a frame beginning control sequence
-				
-				if(controlSeq) {
-					controlSeq = false;
-					if(ch == kControlCharacterFrameBegin) {
-						inFrame = true;
-						frameLength = 0;
-						frameError = false;
-					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						std::cout << "Warning: received NAK (while waiting for frame)\n";
-					}
-				}
-				else {
-					if(ch == ESCAPE_CHARACTER)
-						controlSeq = true;
-				}
-			}
-		}
+		processReceivedData(buffer, count, juce::Time::getMillisecondCounterHiRes());
 	}
 }
 
+// Processing loop for frames passed on by the I/O thread, used when the frame pipeline is active
+void TouchkeyDevice::processingLoop(DeviceThread *thread) {
+    // Every wait here is bounded, so a quiescent state each pass is enough
+    TriggerSource::registerSendingThread();
+    
+    while(!shouldStop_ && !thread->threadShouldExit()) {
+        TriggerSource::threadQuiescent();
+        
+        if(framePipeline_.read_available() == 0) {
+            // Timeout is only so we periodically check whether the thread should stop
+            framePipelineDataAvailable_.wait(kIngestEventDrivenTimeoutMilliseconds);
+            continue;
+        }
+        
+        processPipelineFrames();
+    }
+    
+    // Frames the I/O thread queued before stopping are still processed
+    processPipelineFrames();
+    TriggerSource::unregisterSendingThread();
+}
+
+// Process every frame waiting in the pipeline. Only one thread at a time may do this:
+// the processing thread while it runs, or stopAutoGathering() once it has stopped.
+void TouchkeyDevice::processPipelineFrames() {
+    while(framePipeline_.read_available() > 0) {
+        PipelineFrame& pipelineFrame = framePipeline_.front();
+        
+        processFrame(pipelineFrame.data, pipelineFrame.length);
+        frameLatencyHistogram_.addSample((juce::Time::getMillisecondCounterHiRes() - pipelineFrame.arrivalTime) * 1000.0);
+        
+        framePipeline_.pop();
+        framePipelineProcessed_.store(framePipelineProcessed_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+// Split a block of data from the device into frames and process each one, either here
+// or by passing it to the processing thread
+void TouchkeyDevice::processReceivedData(const unsigned char *buffer, long count, double arrivalTime) {
+    frameDecoder_.setInput(buffer, count);
+    bool framesQueued = false;
+    
+    while(true) {
+        switch(frameDecoder_.decodeNext()) {
+            case TouchkeyFrameDecoder::kEventNone:
+                if(framesQueued)
+                    framePipelineDataAvailable_.signal();
+                return;
+            case TouchkeyFrameDecoder::kEventFrame:
+                if(framePipelineActive_) {
+                    if(queueFrameForProcessing(arrivalTime))
+                        framesQueued = true;
+                }
+                else {
+                    processFrame(frameDecoder_.frame(), frameDecoder_.frameLength());
+                    frameLatencyHistogram_.addSample((juce::Time::getMillisecondCounterHiRes() - arrivalTime) * 1000.0);
+                }
+                break;
+            case TouchkeyFrameDecoder::kEventFrameError:
+                if(verbose_ >= 1)
+                    std::cout << "Warning: received frame error, continuing anyway.\n";
+                break;
+            case TouchkeyFrameDecoder::kEventFrameTooLong:
+                if(verbose_ >= 1)
+                    std::cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << '\n';
+                break;
+            case TouchkeyFrameDecoder::kEventAck:
+                // Responses to commands are matched to the oldest one waiting
+                if(!commandEngine_.handleResponse(true, juce::Time::getMillisecondCounterHiRes()) && verbose_ >= 2)
+                    std::cout << "Received ACK with no command waiting\n";
+                break;
+            case TouchkeyFrameDecoder::kEventNak:
+                if(!commandEngine_.handleResponse(false, juce::Time::getMillisecondCounterHiRes()) && verbose_ >= 1)
+                    std::cout << "Warning: received NAK with no command waiting\n";
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Copy the frame just decoded into the pipeline. Returns false if the pipeline is full,
+// in which case the frame is dropped.
+bool TouchkeyDevice::queueFrameForProcessing(double arrivalTime) {
+    PipelineFrame pipelineFrame;
+    
+    pipelineFrame.arrivalTime = arrivalTime;
+    pipelineFrame.length = frameDecoder_.frameLength();
+    memcpy(pipelineFrame.data, frameDecoder_.frame(), pipelineFrame.length);
+    
+    if(!framePipeline_.push(pipelineFrame)) {
+        framePipelineOverruns_.store(framePipelineOverruns_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    unsigned long queued = framePipelineQueued_.load(std::memory_order_relaxed) + 1;
+    framePipelineQueued_.store(queued, std::memory_order_relaxed);
+    
+    int occupancy = (int)(queued - framePipelineProcessed_.load(std::memory_order_relaxed));
+    if(occupancy > framePipelineMaxOccupancy_.load(std::memory_order_relaxed))
+        framePipelineMaxOccupancy_.store(occupancy, std::memory_order_relaxed);
+    return true;
+}
+
 // Process the contents of a frame that has been received from the device
 void TouchkeyDevice::processFrame(unsigned char * const frame, int length) {
 	if(length == 0)	// Empty frame --> nothing to do here
@@ -1636,6 +1769,11 @@ void TouchkeyDevice::processCentroidFrame(unsigned char * const buffer, const in
 	
 	//ioMutex_.enter();
 	
+    // In debug builds, check whether handling the frame touched the heap. Allocations by
+    // mappings and OSC output downstream of the keys are included in the count, so this is
+    // only counted; the parts of the path which must not allocate assert it themselves.
+    uint64_t allocationsBefore = AllocationCounter::allocationsOnThisThread();
+    
 	while(bufferIndex < bufferLength) {
 		// First byte tells us the number of the key (0-12); next bytes hold the data frame
 		int key = (int)buffer[bufferIndex++];
@@ -1657,6 +1795,13 @@ void TouchkeyDevice::processCentroidFrame(unsigned char * const buffer, const in
 		bufferIndex += bytesParsed;
 	}
     
+    uint64_t allocations = AllocationCounter::allocationsOnThisThread() - allocationsBefore;
+    centroidFramesProcessed_++;
+    if(allocations > 0) {
+        centroidFramesWithAllocations_++;
+        centroidFrameAllocations_ += allocations;
+    }
+    
     if(updatedLowestMidiNote_ != lowestMidiNote_) {
         int keyPresentDifference = (lowestKeyPresentMidiNote_ - lowestMidiNote_);
         
@@ -1853,7 +1998,9 @@ int TouchkeyDevice::processKeyCentroid(int frame, int octave, int key, timestamp
     // From here on out, grab the performance data mutex so no MIDI events can show up in the middle
     juce::ScopedLock ksl(keyboard_.performanceDataMutex_);
     
-    // Check for stray touches, usually caused by moisture on the keys in the absence of a key press
+    // Check for stray touches, usually caused by moisture on the keys in the absence of a key press.
+    // The records are kept in fixed-size storage so none of this allocates.
+    ScopedAllocationCheck strayTouchAllocationCheck;
     if(strayTouchSuppression_ > 0) {
         // strayTouchSuppression_ ranges from 1 (least suppression) to 5 (most suppression)
         const float positionTolerance = (float)strayTouchSuppression_ * 0.02;
@@ -1879,7 +2026,7 @@ int TouchkeyDevice::processKeyCentroid(int frame, int octave, int key, timestamp
                 if(recordIndex < 0) {
                     // Need a new record. Sanity check that they are not growing without bound;
                     // they will be cleared when all touches go off.
-                    if(strayTouchRegister_[midiNote].size() >= 16)
+                    if(strayTouchRegister_[midiNote].full())
                         strayTouchRegister_[midiNote].clear();
                     
                     strayTouchRegister_[midiNote].push_back(
@@ -2015,6 +2162,8 @@ int TouchkeyDevice::processKeyCentroid(int frame, int octave, int key, timestamp
         strayTouchSuppressionWasEnabled_ = false;
     }
 
+    strayTouchAllocationCheck.end();
+    
 	// Turn off touch activity on this key if there's no active touches
 	if(touchCount == 0) {
 		if(keyboard_.key(midiNote)->touchIsActive())
@@ -2023,20 +2172,7 @@ int TouchkeyDevice::processKeyCentroid(int frame, int octave, int key, timestamp
             KeyTouchFrame newFrame(0, sliderPosition, sliderSize, sliderPositionH, white);
             
             if (loggingActive_)
-            {
-                ////////////////////////////////////////////////////////
-                ////////////////////////////////////////////////////////
-                //////////////////// BEGIN LOGGING /////////////////////
-                
-                keyTouchLog_.write((char*)&timestamp, sizeof(timestamp_type));
-                keyTouchLog_.write((char*)&frame, sizeof(int));
-                keyTouchLog_.write((char*)&midiNote, sizeof(int));
-                keyTouchLog_.write((char*)&newFrame, sizeof(KeyTouchFrame));
-                
-                ///////////////////// END LOGGING //////////////////////
-                ////////////////////////////////////////////////////////
-                ////////////////////////////////////////////////////////
-            }
+                logKeyTouchFrame(timestamp, frame, midiNote, newFrame);
             
             // Send raw OSC message if enabled
             if(sendRawOscMessages_) {
@@ -2060,20 +2196,7 @@ int TouchkeyDevice::processKeyCentroid(int frame, int octave, int key, timestamp
     
     
     if (loggingActive_)
-    {
-        ////////////////////////////////////////////////////////
-        ////////////////////////////////////////////////////////
-        //////////////////// BEGIN LOGGING /////////////////////
-        
-        keyTouchLog_.write((char*)&timestamp, sizeof(timestamp_type));
-        keyTouchLog_.write((char*)&frame, sizeof(int));
-        keyTouchLog_.write((char*)&midiNote, sizeof(int));
-        keyTouchLog_.write((char*)&newFrame, sizeof(KeyTouchFrame));
-        
-        ///////////////////// END LOGGING //////////////////////
-        ////////////////////////////////////////////////////////
-        ////////////////////////////////////////////////////////
-    }
+        logKeyTouchFrame(timestamp, frame, midiNote, newFrame);
 	
 	// Send raw OSC message if enabled
 	if(sendRawOscMessages_) {
@@ -2100,8 +2223,30 @@ int TouchkeyDevice::processKeyCentroid(int frame, int octave, int key, timestamp
 	return bytesParsed;
 }
 
+// Queue one key touch record for the log. The layout matches the files written by
+// earlier versions: timestamp, frame, MIDI note, then the raw KeyTouchFrame.
+void TouchkeyDevice::logKeyTouchFrame(timestamp_type timestamp, int frame, int midiNote, KeyTouchFrame const& touchFrame) {
+    if(keyTouchLog_ == nullptr)
+        return;
+
+    unsigned char record[sizeof(timestamp_type) + 2 * sizeof(int) + sizeof(KeyTouchFrame)];
+    unsigned char *p = record;
+
+    memcpy(p, &timestamp, sizeof(timestamp_type));
+    p += sizeof(timestamp_type);
+    memcpy(p, &frame, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &midiNote, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &touchFrame, sizeof(KeyTouchFrame));
+
+    keyTouchLog_->write(record, sizeof(record));
+}
+
 // Process a frame of data containing analog values (i.e. key angle, Z-axis). These
-// always come as a group for a whole board, and should be parsed apart into individual keys
+// always come as a group for a whole board, and should be parsed apart into individual keys.
+// Each frame is handled as a batch: unpack all the samples, calibrate them, then find one
+// timestamp for the frame and insert the results into the keys.
 void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int bufferLength) {
     // Format: [Octave] [TS0] [TS1] [TS2] [TS3] [Key0L] [Key0H] [Key1L] [Key1H] ... [Key24L] [Key24H]
     //                   ... (more frames)
@@ -2113,24 +2258,38 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
         return;
     }
     
+    double startTime = juce::Time::getMillisecondCounterHiRes();
     int octave = buffer[0];
     int board = octave / 2;
     int frame;
     int bufferIndex = 1;
-    int midiNote, value;
+    
+    if(board >= kAnalogMaxBoards) {
+        if(verbose_ >= 1)
+            std::cout << "Warning: ignoring analog frame from octave " << octave << '\n';
+        return;
+    }
+    
+    AnalogBoardTargets& targets = analogTargetsForBoard(board, octave);
+    
+    // As for centroid frames, allocations made downstream by the key trackers and mappings
+    // are counted over the whole frame but not asserted
+    uint64_t allocationsBefore = AllocationCounter::allocationsOnThisThread();
     
     // Parse the buffer one frame at a time
     while(bufferIndex < bufferLength) {
-        if(bufferLength - bufferIndex < 54) {
+        if(bufferLength - bufferIndex < kAnalogFrameLength) {
             // This condition indicates a malformed analog frame (not enough data)
             if(verbose_ >= 1)
-                std::cout << "Warning: ignoring extra analog data of " << bufferLength - bufferIndex << " bytes, less than full frame 54 (total " << bufferLength << ")\n";
+                std::cout << "Warning: ignoring extra analog data of " << bufferLength - bufferIndex << " bytes, less than full frame " << kAnalogFrameLength << " (total " << bufferLength << ")\n";
             break;
         }
         
+        const unsigned char *frameData = &buffer[bufferIndex];
+        
         // Find the timestamp (i.e. frame ID generated by the device). 32-bit little-endian.
-        frame = buffer[bufferIndex] + ((int)buffer[bufferIndex+1] << 8) +
-                ((int)buffer[bufferIndex+2] << 16) + ((int)buffer[bufferIndex+3] << 24);
+        frame = frameData[0] + ((int)frameData[1] << 8) +
+                ((int)frameData[2] << 16) + ((int)frameData[3] << 24);
         
         // Check the timestamp against the last frame from this board to see if any frames have been dropped
         if(frame > analogLastFrame_[board] + 1) {
@@ -2143,61 +2302,121 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
         }
         analogLastFrame_[board] = frame;
         
-        // TESTING
-        /*if(verbose_ >= 3 || (frame % 500 == 0))
-            std::cout << "Analog frame octave " << octave << " timestamp " << frame << '\n';
-        if(verbose_ >= 4 || (frame % 500 == 0)) {
-            std::cout << "Values: ";
-            for(int i = 0; i < 25; i++) {
-                std::cout << std::setw(5) << (((signed char)buffer[i*2 + 6])*256 + buffer[i*2 + 5]) << " ";
-            }
-            std::cout << '\n';
-        }*/
+        deliverAnalogValues(targets, frameData, frame, missing_value<timestamp_type>::missing());
         
-        // Process key values individually and add them to the keyboard data structure
-        for(int key = 0; key < 25; key++) {
-            // Every analog frame contains 25 values, however only the top board actually uses all 25
-            // sensors. There are several "high C" values in the lower boards (i.e. key == 24) which
-            // do not correspond to real sensors. These should be ignored.
-            if(key == 24 && octave != numberOfOctaves() - 2)
-                continue;
-            
-            midiNote = octaveKeyToMidi(octave, key);
-            
-            // Check that this note is in range to the available calibrators and keys.
-            if(keyboard_.key(midiNote) == 0 || (octave*12 + key) >= keyCalibratorsLength_ || midiNote < 21)
-                continue;
-            
-            // Pull the value out from the packed buffer (little endian 16 bit)
-            value = (((signed char)buffer[key*2 + 6])*256 + buffer[key*2 + 5]);
+        if(loggingActive_ && analogLog_ != nullptr) {
+            unsigned char record[1 + kAnalogFrameLength];
+            record[0] = buffer[0];  // Octave number
+            memcpy(&record[1], frameData, kAnalogFrameLength);
+            analogLog_->write(record, sizeof(record));
+        }
+        
+        // Skip to next frame
+        bufferIndex += kAnalogFrameLength;
+    }
+    
+    uint64_t allocations = AllocationCounter::allocationsOnThisThread() - allocationsBefore;
+    analogFramesProcessed_++;
+    if(allocations > 0) {
+        analogFramesWithAllocations_++;
+        analogFrameAllocations_ += allocations;
+    }
+    
+    analogProcessingHistogram_.addSample((juce::Time::getMillisecondCounterHiRes() - startTime) * 1000.0);
+}
+
+// Find where each value from the given board goes, unless the keyboard layout is the same as last time
+TouchkeyDevice::AnalogBoardTargets& TouchkeyDevice::analogTargetsForBoard(int board, int octave) {
+    AnalogBoardTargets& targets = analogTargets_[board];
+    if(targets.octave != octave || targets.lowestMidiNote != lowestMidiNote_ || targets.lowestNotePerOctave != lowestNotePerOctave_ ||
+       targets.numOctaves != numOctaves_)
+        updateAnalogTargets(board, octave);
+    return targets;
+}
+
+// Unpack, calibrate and deliver the values of one analog frame (frame number, then samples).
+// If the timestamp is missing, the frame number is converted with the device clock.
+void TouchkeyDevice::deliverAnalogValues(AnalogBoardTargets& targets, const unsigned char *frameData, int frame, timestamp_type timestamp) {
+    int values[kAnalogValuesPerFrame];
+    key_position positions[kAnalogValuesPerFrame];
+    
+    // Unpacking, calibrating and timestamping the values happens on the data thread
+    // for every frame, so it must not allocate
+    ScopedAllocationCheck parseAllocationCheck;
+    
+    // Unpack all the values (little endian signed 16 bit)
+    const unsigned char *samples = &frameData[4];
+    for(int key = 0; key < kAnalogValuesPerFrame; key++)
+        values[key] = (int)(int16_t)(samples[key*2] | (samples[key*2 + 1] << 8));
+    
+    // Calibrate the values, assuming the calibrators are ready and running
+    bool anyCalibrated = false;
+    for(int key = 0; key < kAnalogValuesPerFrame; key++) {
+        if(targets.key[key] == nullptr)
+            continue;
+        positions[key] = targets.calibrator[key]->evaluate(values[key]);
+        if(!missing_value<key_position>::isMissing(positions[key]))
+            anyCalibrated = true;
+    }
+    
+    // All the values in the frame share one timestamp
+    if(missing_value<timestamp_type>::isMissing(timestamp))
+        timestamp = anyCalibrated ? timestampSynchronizer_.synchronizedTimestamp(frame) : 0;
+    parseAllocationCheck.end();
+    
+    // Add the values to the keyboard data structure, screening the whole frame for
+    // keys staying idle before any of them are delivered
+    KeyboardStateEngine& stateEngine = keyboard_.stateEngine();
+    stateEngine.beginFrame();
+    for(int key = 0; key < kAnalogValuesPerFrame; key++) {
+        if(targets.key[key] == nullptr)
+            continue;
+        
+        if(!missing_value<key_position>::isMissing(positions[key])) {
+            stateEngine.setPosition(targets.midiNote[key], positions[key]);
+        }
+        else if(keyboard_.gui() != nullptr){
+            // Update the GUI but don't actually save the value since it's uncalibrated
+            keyboard_.gui()->setAnalogValueForKey(targets.midiNote[key], (float)values[key] / kTouchkeyAnalogValueMax);
             
-            // Calibrate the value, assuming the calibrator is ready and running
-            key_position calibratedPosition = keyCalibrators_[octave*12 + key]->evaluate(value);
-            if(!missing_value<key_position>::isMissing(calibratedPosition)) {
-                timestamp_type timestamp = timestampSynchronizer_.synchronizedTimestamp(frame);
-                keyboard_.key(midiNote)->insertSample(calibratedPosition, timestamp);
-            }
-            else if(keyboard_.gui() != nullptr){
-                
-                //keyboard_.key(midiNote)->insertSample((float)value / 4096.0, timestampSynchronizer_.synchronizedTimestamp(frame));
-                
-                // Update the GUI but don't actually save the value since it's uncalibrated
-                keyboard_.gui()->setAnalogValueForKey(midiNote, (float)value / kTouchkeyAnalogValueMax);
-                
-                if(keyCalibrators_[octave*12 + key]->calibrationStatus() == kPianoKeyCalibrated) {
-                    if(verbose_ >= 1)
-                        std::cout << "key " << midiNote << " calibrated but missing (raw value " << value << ")\n";
-                }
+            if(targets.calibrator[key]->calibrationStatus() == kPianoKeyCalibrated) {
+                if(verbose_ >= 1)
+                    std::cout << "key " << targets.midiNote[key] << " calibrated but missing (raw value " << values[key] << ")\n";
             }
         }
+    }
+    stateEngine.endFrame(timestamp);
+}
+
+// Work out which key and calibrator each value in an analog frame from the given board
+// belongs to, for the current keyboard layout
+void TouchkeyDevice::updateAnalogTargets(int board, int octave) {
+    AnalogBoardTargets& targets = analogTargets_[board];
+    
+    targets.octave = octave;
+    targets.lowestMidiNote = lowestMidiNote_;
+    targets.lowestNotePerOctave = lowestNotePerOctave_;
+    targets.numOctaves = numOctaves_;
+    
+    for(int key = 0; key < kAnalogValuesPerFrame; key++) {
+        int midiNote = octaveKeyToMidi(octave, key);
         
-        if(loggingActive_) {
-            analogLog_.write((char*)&buffer[0], 1); // Octave number
-            analogLog_.write((char*)&buffer[bufferIndex], 54);
-        }
+        targets.midiNote[key] = midiNote;
+        targets.key[key] = nullptr;
+        targets.calibrator[key] = nullptr;
         
-        // Skip to next frame
-        bufferIndex += 54;
+        // Every analog frame contains 25 values, however only the top board actually uses all 25
+        // sensors. There are several "high C" values in the lower boards (i.e. key == 24) which
+        // do not correspond to real sensors. These should be ignored.
+        if(key == 24 && octave != numberOfOctaves() - 2)
+            continue;
+        
+        // Check that this note is in range to the available calibrators and keys.
+        if(keyboard_.key(midiNote) == 0 || (octave*12 + key) >= keyCalibratorsLength_ || midiNote < 21)
+            continue;
+        
+        targets.key[key] = keyboard_.key(midiNote);
+        targets.calibrator[key] = keyCalibrators_[octave*12 + key];
     }
 }
 
@@ -2344,22 +2563,17 @@ bool TouchkeyDevice::processStatusFrame(unsigned char * buffer, int maxLength, T
 	return true;
 }
 
-// Prepare the indicated key for raw data collection
+// Prepare the indicated key for raw data collection. This is called from the raw data
+// thread, which also reads the responses, so the commands are queued without waiting.
+// The device carries them out in order.
 void TouchkeyDevice::rawDataPrepareCollection(int octave, int key, int mode, int scaler) {
-    juce::Thread::sleep(10);
-    
     // Command to set the mode of the key
     unsigned char commandSetMode[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
         kFrameTypeSendI2CCommand, (unsigned char)octave, (unsigned char)key,
         3 /* xmit */, 0 /* response */, 0 /* command offset */, 1 /* mode */, (unsigned char)mode,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	if(deviceWrite((char*)commandSetMode, 12) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setMode command.  errno = " << errno << '\n';
-	}
-
-    juce::Thread::sleep(10);
+    sendCommand(commandSetMode, 12, kCommandI2CTimeoutMilliseconds);
     
     // Command to set the scaler of the key
     unsigned char commandSetScaler[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
@@ -2367,78 +2581,80 @@ void TouchkeyDevice::rawDataPrepareCollection(int octave, int key, int mode, int
         3 /* xmit */, 0 /* response */, 0 /* command offset */, 3 /* raw scaler */, (unsigned char)scaler,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	if(deviceWrite((char*)commandSetScaler, 12) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write setMode command.  errno = " << errno << '\n';
-	}
-    
-    juce::Thread::sleep(10);
+    sendCommand(commandSetScaler, 12, kCommandI2CTimeoutMilliseconds);
     
     unsigned char commandPrepareRead[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
         kFrameTypeSendI2CCommand, (unsigned char)octave, (unsigned char)key,
         1 /* xmit */, 0 /* response */, 6 /* data offset */,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
     
-	if(deviceWrite((char*)commandPrepareRead, 10) < 0) {
-        if(verbose_ >= 1)
-            std::cout << "ERROR: unable to write prepareRead command.  errno = " << errno << '\n';
-	}
-
-   juce::Thread::sleep(10);
+    sendCommand(commandPrepareRead, 10, kCommandI2CTimeoutMilliseconds);
     
     rawDataShouldChangeMode_ = false;
 }
 
-// Check for an ACK response from the device.  Returns true if found.  Returns
-// false if NAK received, or if a timeout occurs.
-// TODO: this implementation needs to change to not chew up other data coming in.
-
-bool TouchkeyDevice::checkForAck(int timeoutMilliseconds) {
-	//struct timeval startTime, currentTime;
-	bool controlSeq = false;
-	unsigned char ch;
-	
-    double startTime = juce::Time::getMillisecondCounterHiRes();
-    double currentTime = startTime;
-    
-	//gettimeofday(&startTime, 0);
-	//gettimeofday(&currentTime, 0);
-	
-	while(currentTime - startTime < (double)timeoutMilliseconds) {
-		long count = deviceRead((char *)&ch, 1);
+// Queue a command frame with the command engine, which writes it as soon as there is room
+TouchkeyCommandEngine::Future TouchkeyDevice::sendCommand(const unsigned char *command, int length, int timeoutMilliseconds) {
+    return commandEngine_.submit(command, length, timeoutMilliseconds, juce::Time::getMillisecondCounterHiRes());
+}
 
-		if(count < 0) {				// Check if an error occurred on read
-			if(errno != EAGAIN) {
-                if(verbose_ >= 1)
-                    std::cout << "Unable to read from device while waiting for ACK (error " << errno << ").  Aborting.\n";
-				return false;
-			}
-		}
-		else if(count > 0) {		// Data received
-			// Wait for a sequence {ESCAPE_CHARACTER, ACK} or {ESCAPE_CHARACTER, NAK}
-			if(controlSeq) {
-				controlSeq = false;
-				if(ch == kControlCharacterAck) {
-					if(verbose_ >= 2)
-						std::cout << "Received ACK\n";
-					return true;
-				}
-				else if(ch == kControlCharacterNak) {
-					if(verbose_ >= 1)
-						std::cout << "Warning: received NAK\n";
-					return false;
-				}
-			}
-			else if(ch == ESCAPE_CHARACTER)
-				controlSeq = true;
-		}
-		
-		currentTime = juce::Time::getMillisecondCounterHiRes();
+// Write function used by the command engine
+bool TouchkeyDevice::writeCommand(const unsigned char *command, int length) {
+    if(!isOpen())
+        return false;
+	if(deviceWrite((char*)command, length) < 0) {
+        if(verbose_ >= 1)
+            std::cout << "ERROR: unable to write command " << (int)command[2] << ".  errno = " << errno << '\n';
+        return false;
 	}
-	
-    if(verbose_ >= 1)
-        std::cout << "Error: timeout waiting for ACK\n";
-	return false;
+    return true;
+}
+
+// Once the I/O thread has stopped, read the responses to any commands still in flight.
+// Each one either gets its response or times out, so this finishes within the longest
+// command timeout.
+void TouchkeyDevice::finishOutstandingCommands() {
+    while(true) {
+        commandEngine_.service(juce::Time::getMillisecondCounterHiRes());
+        if(commandEngine_.inFlight() == 0 && commandEngine_.queued() == 0)
+            break;
+        if(!readCommandResponses(kCommandEngineServiceIntervalMilliseconds)) {
+            commandEngine_.cancelAll();
+            break;
+        }
+    }
+}
+
+// When the I/O thread isn't running, read from the device for up to the given time, passing
+// any ACK or NAK on to the command engine. Anything else received is discarded since the
+// device isn't scanning. Returns false if the device couldn't be read.
+bool TouchkeyDevice::readCommandResponses(int timeoutMilliseconds) {
+	unsigned char buffer[TOUCHKEY_MAX_FRAME_LENGTH];
+    
+    if(!isOpen())
+        return false;
+    if(!deviceWaitForData(timeoutMilliseconds))
+        return true;
+    
+    long count = deviceRead((char *)buffer, sizeof(buffer));
+    
+    if(count < 0) {				// Check if an error occurred on read
+        if(errno != EAGAIN) {
+            if(verbose_ >= 1)
+                std::cout << "Unable to read from device while waiting for ACK (error " << errno << ").  Aborting.\n";
+            return false;
+        }
+        return true;
+    }
+    
+    frameDecoder_.setInput(buffer, count);
+    
+    int event;
+    while((event = frameDecoder_.decodeNext()) != TouchkeyFrameDecoder::kEventNone) {
+        if(event == TouchkeyFrameDecoder::kEventAck || event == TouchkeyFrameDecoder::kEventNak)
+            commandEngine_.handleResponse(event == TouchkeyFrameDecoder::kEventAck, juce::Time::getMillisecondCounterHiRes());
+    }
+    return true;
 }
 
 // Convenience method to dump hexadecimal output
@@ -2452,6 +2668,27 @@ void TouchkeyDevice::hexDump( std::ostream& str, unsigned char * buffer, int len
 	str << std::dec;
 }
 
+// Wait up to the given time for data to become available from the TouchKeys device.
+// Returns true if data (or an error condition) is ready to be read.
+bool TouchkeyDevice::deviceWaitForData(int timeoutMilliseconds) {
+#ifdef _MSC_VER
+    // WINDOWS_TODO: needs overlapped I/O to wait on the port; callers should poll instead
+    juce::Thread::sleep(1);
+    return true;
+#else
+    struct pollfd pfd;
+    
+    pfd.fd = device_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    
+    int result = poll(&pfd, 1, timeoutMilliseconds);
+    if(result < 0)
+        return (errno != EINTR);    // Let the read report any real error
+    return (result > 0);
+#endif
+}
+
 // Read from the TouchKeys device
 long TouchkeyDevice::deviceRead(char *buffer, unsigned int count) {
 #ifdef _MSC_VER
@@ -2502,11 +2739,7 @@ void TouchkeyDevice::deviceDrainOutput() {
 
 
 TouchkeyDevice::~TouchkeyDevice() {
-    if (logFileCreated_)
-    {
-        keyTouchLog_.close();
-        analogLog_.close();
-    }
+    closeLogFile();
     
 	closeDevice();
     calibrationDeinit();
@@ -24,10 +24,19 @@
 
 #include "Osc.h"
 #include "../Utility/TimestampSynchronizer.h"
+#include "../Utility/LatencyHistogram.h"
+#include "../Utility/AllocationCounter.h"
+#include "../Utility/FixedCapacityVector.h"
+#include "../Utility/LogRecorder.h"
+#include "../Utility/RealTimeProfile.h"
+#include "TouchkeyFrameDecoder.h"
+#include "TouchkeyCommandEngine.h"
 #include "PianoKeyCalibrator.h"
 #include "../Display/RawSensorDisplay.h"
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <atomic>
 #include <cstdio>
 #include <cmath>
 #include <deque>
@@ -35,14 +44,13 @@
 #include <fcntl.h>
 #include <limits>
 #include <list>
+#include <vector>
 #ifndef _MSC_VER
+#include <poll.h>
 #include <termios.h>
 #endif
 
 
-#define TOUCHKEY_MAX_FRAME_LENGTH 256	// Maximum data length in a single frame
-#define ESCAPE_CHARACTER 0xFE			// Indicates control sequence
-
 //#define TRANSMISSION_LENGTH_WHITE 9
 //#define TRANSMISSION_LENGTH_BLACK 8
 //#define TRANSMISSION_LENGTH_TOTAL (8*TRANSMISSION_LENGTH_WHITE + 5*TRANSMISSION_LENGTH_BLACK)
@@ -71,14 +79,6 @@ const float kBlackMaxXValueNewHardware = 256.0;     // Black keys, horizontal (1
 
 const float kSizeMaxValue = 255.0;
 
-enum {
-	kControlCharacterFrameBegin = 0x00,
-	kControlCharacterAck = 0x01,
-	kControlCharacterNak = 0x02,
-	kControlCharacterFrameError = 0xFD,
-	kControlCharacterFrameEnd = 0xFF
-};
-
 // Frame types for data sent over USB.  The first byte following a frame start control sequence gives the type.
 
 enum {
@@ -145,25 +145,61 @@ const unsigned char kCommandStopScanning[] = { ESCAPE_CHARACTER, kControlCharact
 
 const float kTouchkeyAnalogValueMax = 4095.0; // Maximum value any analog sample can take
 
+// Ways the I/O thread can wait for incoming data
+enum {
+    kIngestModePolling = 0,     // Non-blocking reads, sleeping 0.5ms when nothing is available
+    kIngestModeEventDriven      // Block in poll() until data arrives (falls back to polling on Windows)
+};
+
+const int kIngestEventDrivenTimeoutMilliseconds = 50; // Longest wait before checking whether to stop
+
+const int kFramePipelineCapacity = 1024; // Frames buffered between the I/O and processing threads
+
+// RGB LED updates. Each LED in a kFrameTypeRGBLEDSetColors frame is a self-contained
+// 6-byte record, so all the changes for one board could share a frame, but only one
+// record per frame is known to be accepted by the firmware. More are sent only if
+// rgbledSetMaxUpdatesPerFrame() is used to allow it.
+const int kRGBLEDMaxUpdatesPerFrame = 25;           // One full board
+const int kRGBLEDDefaultUpdatesPerFrame = 1;
+const int kRGBLEDUpdateTimeoutMilliseconds = 50;    // Longest wait before checking whether to stop
+
+// Analog frames: a 4-byte frame number and 25 16-bit values for each board
+const int kAnalogMaxBoards = 4;
+const int kAnalogValuesPerFrame = 25;
+const int kAnalogFrameLength = 4 + 2 * kAnalogValuesPerFrame;
+
+// How long to wait for the device to acknowledge a configuration command, and one passed on to a key
+const int kCommandTimeoutMilliseconds = 250;
+const int kCommandI2CTimeoutMilliseconds = 100;
+
+// Most stray touch records kept for one key; they are cleared if this fills up
+const int kStrayTouchMaxRecords = 16;
+
 // This class implements device access to the touchkey hardware.
 
 class TouchkeyDevice /*: public OscHandler*/
 {
+    friend class Benchmarks;    // Times the analog path against the loop it replaced
+    
     // ***** Class to implement the Juce thread *****
 private:
     class DeviceThread : public juce::Thread {
     public:
-        DeviceThread(boost::function<void (DeviceThread*)> action, juce::String name = "DeviceThread")
-        : juce::Thread(name), actionFunction_(action) {}
+        DeviceThread(boost::function<void (DeviceThread*)> action, juce::String name = "DeviceThread",
+                     RealTimeThreadRole role = kRealTimeRoleNone)
+        : juce::Thread(name), actionFunction_(action), role_(role) {}
         
         ~DeviceThread() {}
         
+        // The profile is applied once per run; the threads restart with the device
         void run() {
+            RealTimeProfile::applyToCurrentThread(role_);
             actionFunction_(this);
         }
         
     private:
         boost::function<void (DeviceThread*)> actionFunction_;
+        RealTimeThreadRole role_;
     };
     
 public:
@@ -200,16 +236,6 @@ public:
 		float keyPosition[2];
 	};
     
-    // Structure to hold changes to RGB LEDs on relevant hardware
-    class RGBLEDUpdate {
-    public:
-        bool allLedsOff;        // Set to true if all LEDs should turn off on indicated board
-        int midiNote;           // MIDI note number to change
-        int red;                // RGB color
-        int green;
-        int blue;
-    };
-    
 private:
     // Data structure to keep track of stray touches. Implements a state machine
     // to check what state each touch is in along with some other information on where
@@ -224,6 +250,11 @@ private:
             StateActive,
         } TouchState;
         
+        StrayTouchRecord()
+        : state(StateOff), startingTimestamp(0), startingPosition(0), currentPosition(0),
+          midiNoteIsOn(false), matched(false)
+        {}
+        
         StrayTouchRecord(TouchState _state,
                          timestamp_type _startingTimestamp,
                          float _startingPosition, float _currentPosition,
@@ -275,6 +306,11 @@ public:
     void rgbledSetColorHSV(const int midiNote, const float hue, const float saturation, const float value);
     void rgbledAllOff();
     
+    // LED records to send in each frame, up to kRGBLEDMaxUpdatesPerFrame. Only raise this for
+    // firmware known to read more than one. Takes effect when the LED thread next starts.
+    void rgbledSetMaxUpdatesPerFrame(int updates);
+    int rgbledMaxUpdatesPerFrame() { return ledUpdatesPerFrame_; }
+    
     // ***** Device Parameters *****
     
 	// Set the scan interval in milliseconds
@@ -287,6 +323,32 @@ public:
 	bool setKeyNoiseThreshold(int octave, int key, int value);
     bool setKeyUpdateBaseline(int octave, int key);
     
+    // Asynchronous versions of the above. These queue the command and return straight away;
+    // the result can be collected with waitForCommand(). Use these to send many commands
+    // back to back rather than waiting for each acknowledgement in turn. An invalid
+    // argument gives an invalid future, which waitForCommand() reports as a failure.
+    TouchkeyCommandEngine::Future setScanIntervalAsync(int intervalMilliseconds);
+    TouchkeyCommandEngine::Future setKeySensitivityAsync(int octave, int key, int value);
+    TouchkeyCommandEngine::Future setKeyCentroidScalerAsync(int octave, int key, int value);
+    TouchkeyCommandEngine::Future setKeyMinimumCentroidSizeAsync(int octave, int key, int value);
+    TouchkeyCommandEngine::Future setKeyNoiseThresholdAsync(int octave, int key, int value);
+    TouchkeyCommandEngine::Future setKeyUpdateBaselineAsync(int octave, int key);
+    
+    // Wait for asynchronous commands to finish. Returns true if the device acknowledged
+    // the command, or all of them.
+    bool waitForCommand(TouchkeyCommandEngine::Future result);
+    bool waitForCommands(std::vector<TouchkeyCommandEngine::Future> const& results);
+    
+    // Parameters for one key, or a group of keys with octave or key -1 as above. A value
+    // of -1 leaves that parameter unchanged.
+    struct KeySettings {
+        int octave, key;
+        int sensitivity, centroidScaler, minimumCentroidSize, noiseThreshold;
+    };
+    
+    // Send a list of key parameters as one batch. Returns true if they were all acknowledged.
+    bool configureKeys(std::vector<KeySettings> const& settings);
+    
     // Set whether to ignore stray touches that might not be actual finger touch events
     void setSuppressStrayTouches(int level);
     
@@ -309,10 +371,21 @@ public:
 	bool calibrationLoadFromFile(std::string const& filename);
     
     // ***** Data Logging *****
-    void createLogFiles( std::string keyTouchLogFilename, std::string analogLogFilename, std::string path);
+    // Log files are written by recorder's background thread; it must outlive this object.
+    void createLogFiles(LogRecorder& recorder, std::string keyTouchLogFilename, std::string analogLogFilename, std::string path);
     void closeLogFile();
     void startLogging();
     void stopLogging();
+    
+    // ***** Log Replay *****
+    
+    // Load a calibration for replaying an analog log. With no device open, the key layout
+    // is set up for the given number of octaves first. Returns true on success.
+    bool replayLoadCalibration(int numOctaves, std::string const& filename);
+    
+    // Deliver one analog log record (octave, then the frame as sent by the device) with
+    // the given timestamp in place of the device clock
+    void replayAnalogRecord(const unsigned char *record, timestamp_type timestamp);
 
     // ***** Debugging and Utility *****
     
@@ -331,15 +404,65 @@ public:
     // Sensor data display
     void setSensorDisplay(RawSensorDisplay *display) { sensorDisplay_ = display; }
     
+    // How the I/O thread waits for data. Takes effect the next time data gathering starts.
+    void setIngestMode(int mode) { ingestMode_ = mode; }
+    int ingestMode() { return ingestMode_; }
+    
+    // Statistics on the time from data arriving to the end of processing its frame, in microseconds
+    LatencyHistogram& frameLatencyHistogram() { return frameLatencyHistogram_; }
+    
+    // Statistics on the time taken to process each analog frame from one board, in microseconds
+    LatencyHistogram& analogProcessingHistogram() { return analogProcessingHistogram_; }
+    
+    // Statistics on the incoming byte stream (bytes, frames, errors) from the most recent run
+    const TouchkeyFrameDecoder& frameDecoder() { return frameDecoder_; }
+    
+    // Whether to hand decoded frames to a separate processing thread, so that reading from
+    // the device never waits on key processing. Takes effect the next time data gathering starts.
+    void setFramePipelineEnabled(bool enable) { framePipelineEnabled_ = enable; }
+    bool framePipelineEnabled() { return framePipelineEnabled_; }
+    
+    // Frame pipeline statistics: current and highest number of frames waiting to be
+    // processed, and number of frames dropped because the pipeline was full
+    int framePipelineOccupancy() { return (int)(framePipelineQueued_.load() - framePipelineProcessed_.load()); }
+    int framePipelineMaxOccupancy() { return framePipelineMaxOccupancy_.load(); }
+    unsigned long framePipelineOverruns() { return framePipelineOverruns_.load(); }
+    
+    // Statistics on commands sent to the device and their responses
+    TouchkeyCommandEngine& commandEngine() { return commandEngine_; }
+    
 	// ***** Run Loop Functions *****
     void ledUpdateLoop(DeviceThread *thread);
 	void runLoop(DeviceThread *thread);
     void rawDataRunLoop(DeviceThread *thread);
+    void processingLoop(DeviceThread *thread);
     
     // for debugging
     void testStopLeds() { ledShouldStop_ = true; }
 	
 private:
+    // Where each value in an analog frame from one board goes, for the keyboard layout
+    // it was worked out for (octave is -1 if it needs working out)
+    struct AnalogBoardTargets {
+        int octave, lowestMidiNote, lowestNotePerOctave, numOctaves;
+        int midiNote[kAnalogValuesPerFrame];
+        PianoKey *key[kAnalogValuesPerFrame];               // nullptr if the value is unused
+        PianoKeyCalibrator *calibrator[kAnalogValuesPerFrame];
+    };
+    
+    // A decoded frame waiting for the processing thread
+    struct PipelineFrame {
+        double arrivalTime;     // When the data arrived, for latency statistics
+        int length;
+        unsigned char data[TOUCHKEY_MAX_FRAME_LENGTH];
+    };
+    
+    // Decode a block of data read from the device, processing each complete frame.
+    // arrivalTime gives the earliest time the data could have arrived, for statistics.
+    void processReceivedData(const unsigned char *buffer, long count, double arrivalTime);
+    bool queueFrameForProcessing(double arrivalTime);
+    void processPipelineFrames();
+    
 	// Read and parse new data from the device, splitting out by frame type
 	void processFrame(unsigned char * const frame, int length);
 
@@ -347,6 +470,9 @@ private:
 	void processCentroidFrame(unsigned char * const buffer, const int bufferLength);
 	int processKeyCentroid(int frame,int octave, int key, timestamp_type timestamp, unsigned char * buffer, int maxLength);
     void processAnalogFrame(unsigned char * const buffer, const int bufferLength);
+    void deliverAnalogValues(AnalogBoardTargets& targets, const unsigned char *frameData, int frame, timestamp_type timestamp);
+    AnalogBoardTargets& analogTargetsForBoard(int board, int octave);
+    void updateAnalogTargets(int board, int octave);
 	void processRawDataFrame(unsigned char * const buffer, const int bufferLength);
 	bool processStatusFrame(unsigned char * buffer, int maxLength, ControllerStatus *status);
     void processI2CResponseFrame(unsigned char * const buffer, const int bufferLength);
@@ -356,6 +482,9 @@ private:
 	//pair<float, list<int> > matchClosestPoints(float* oldPoints, float *newPoints, float count,
 	//										   int oldIndex, set<int>& availableNewPoints, float currentTotalDistance);
 	void processTwoFingerGestures(int octave, int key, KeyTouchFrame& previousPosition, KeyTouchFrame& newPosition);
+    
+    // Queue a record for the key touch log
+    void logKeyTouchFrame(timestamp_type timestamp, int frame, int midiNote, KeyTouchFrame const& touchFrame);
 	void processThreeFingerGestures(int octave, int key, KeyTouchFrame& previousPosition, KeyTouchFrame& newPosition);
 	
 	// Utility method for parsing multi-key gestures
@@ -364,8 +493,15 @@ private:
     // Write the commands to prepare a given key for raw data collection
     void rawDataPrepareCollection(int octave, int key, int mode, int scaler);
     
-	// After writing a command, check whether it was acknolwedged by the controller
-	bool checkForAck(int timeoutMilliseconds);
+    // Queue a command which the device will acknowledge, and the write function the
+    // command engine uses to send it
+    TouchkeyCommandEngine::Future sendCommand(const unsigned char *command, int length, int timeoutMilliseconds);
+    bool writeCommand(const unsigned char *command, int length);
+    
+	// Read responses to commands from the device when the I/O thread isn't running, and
+	// wait for those still in flight when it stops
+	bool readCommandResponses(int timeoutMilliseconds);
+    void finishOutstandingCommands();
 	
 	// Utility method for debugging
 	void hexDump( std::ostream& str, unsigned char * buffer, int length);
@@ -374,13 +510,21 @@ private:
     void calibrationInit(int numberOfCalibrators);
     void calibrationDeinit();
     
-    // Set RGB LED color (for piano scanner boards)
-    bool internalRGBLEDSetColor(const int device, const int led, const int red, const int green, const int blue);
+    // Set RGB LED colors (for piano scanner boards), up to kRGBLEDMaxUpdatesPerFrame LEDs on one board per frame
+    bool internalRGBLEDSetColors(const int device, const int *leds, const uint64_t *colors, const int count);
     bool internalRGBLEDAllOff();                        // RGB LEDs off
     int  internalRGBLEDMIDIToBoardNumber(const int midiNote);   // Get board number for MIDI note
     int  internalRGBLEDMIDIToLEDNumber(const int midiNote);     // Get LED number for MIDI note
+    static unsigned int rgbledComponent(const float value) {     // Convert 0-1 to 12-bit color value
+        if(!(value > 0.0))
+            return 0;
+        if(value >= 1.0)
+            return 4095;
+        return (unsigned int)(value * 4095.0);
+    }
     
     // Device low-level access methods
+    bool deviceWaitForData(int timeoutMilliseconds);
     long deviceRead(char *buffer, unsigned int count);
     int deviceWrite(char *buffer, unsigned int count);
     void deviceFlush(bool bothDirections);
@@ -400,6 +544,21 @@ private:
 	bool autoGathering_;		// Whether auto-scanning is enabled
 	volatile bool shouldStop_;	// Communication variable between threads
 	bool sendRawOscMessages_;	// Whether we should transmit the raw frame data by OSC
+    int ingestMode_;            // How the I/O thread waits for new data
+    LatencyHistogram frameLatencyHistogram_; // Time from data arrival to frame dispatch
+    TouchkeyFrameDecoder frameDecoder_;         // Splits data from the I/O thread into frames
+    
+    // Optional pipeline between the I/O thread and a frame processing thread
+    DeviceThread processingThread_;             // Thread that processes frames when the pipeline is active
+    bool framePipelineEnabled_;                 // Whether to use the pipeline for the next run
+    bool framePipelineActive_;                  // Whether the pipeline is in use by the current run
+    boost::lockfree::spsc_queue<PipelineFrame> framePipeline_ { kFramePipelineCapacity };
+    juce::WaitableEvent framePipelineDataAvailable_; // Wakes the processing thread
+    std::atomic<unsigned long> framePipelineQueued_;    // Written only by the I/O thread
+    std::atomic<unsigned long> framePipelineProcessed_; // Written only by the processing thread
+    std::atomic<int> framePipelineMaxOccupancy_;
+    std::atomic<unsigned long> framePipelineOverruns_;
+    TouchkeyCommandEngine commandEngine_;       // Matches commands to the device's ACK/NAK responses
 	int verbose_;				// Logging level
 	int numOctaves_;			// Number of connected octaves (determined from device)
 	int lowestMidiNote_;		// MIDI note number for the lowest C on the lowest octave
@@ -416,10 +575,20 @@ private:
     
     int strayTouchSuppression_; // Whether to suppress stray touches on the keys
     bool strayTouchSuppressionWasEnabled_; // Internal cache of whether suppression was enabled, in case it turns off on the fly
-    std::vector<StrayTouchRecord> strayTouchRegister_[128];  // Information on active and stray touches
+    FixedCapacityVector<StrayTouchRecord, kStrayTouchMaxRecords> strayTouchRegister_[128];  // Information on active and stray touches
     
     // Frame counter for analog data, to detect dropped frames
-    unsigned int analogLastFrame_[4];    // Max 4 boards
+    unsigned int analogLastFrame_[kAnalogMaxBoards];
+    AnalogBoardTargets analogTargets_[kAnalogMaxBoards]; // Used only by the thread processing frames
+    LatencyHistogram analogProcessingHistogram_;
+    
+    // Heap allocations while processing centroid and analog frames; only counted in debug builds
+    unsigned long centroidFramesProcessed_;
+    unsigned long centroidFramesWithAllocations_;
+    uint64_t centroidFrameAllocations_;
+    unsigned long analogFramesProcessed_;
+    unsigned long analogFramesWithAllocations_;
+    uint64_t analogFrameAllocations_;
 	
 	// Synchronization between frame time and system timestamp, allowing interaction
 	// with other simultaneous streams using different clocks.  Also save the last timestamp
@@ -436,7 +605,12 @@ private:
     bool deviceHasRGBLEDs_;                 // Whether the device has RGB LEDs
     DeviceThread ledThread_;                   // Thread that handles LED updates (communication to the device)
     volatile bool ledShouldStop_;           // testing
-	std::deque<RGBLEDUpdate> ledUpdateQueue_; // Queue that holds new LED messages to be sent to device
+    std::atomic<uint64_t> ledColors_[128];  // Latest requested color for each MIDI note, 12 bits per channel
+    std::atomic<uint64_t> ledDirty_[2];     // Bitmask of MIDI notes whose color has changed since last sent
+    std::atomic<bool> ledAllOffPending_;    // Whether all LEDs should be turned off before the next update
+    int ledUpdatesPerFrame_;                // LED records sent in one frame
+    juce::WaitableEvent ledUpdateAvailable_;// Wakes the LED thread when there is something to send
+    uint64_t ledSentColors_[128];           // Colors last sent to the device; used only by the LED thread
     
     // ***** Calibration *****
     bool isCalibrated_;
@@ -446,8 +620,9 @@ private:
     int keyCalibratorsLength_;              // How many calibrators
     
     // ***** Logging *****
-	std::ofstream keyTouchLog_;
-	std::ofstream analogLog_;
+    LogRecorder *logRecorder_;              // Writes the log files
+    LogRecorder::Stream *keyTouchLog_;      // Stay valid after closing, until the recorder is destroyed
+    LogRecorder::Stream *analogLog_;
     bool logFileCreated_;
     bool loggingActive_;
     
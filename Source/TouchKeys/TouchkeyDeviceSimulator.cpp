@@ -0,0 +1,739 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  TouchkeyDeviceSimulator.cpp: simulates the TouchKeys hardware on a
+  pseudo-terminal, for testing and benchmarking without physical boards
+*/
+
+#include "TouchkeyDeviceSimulator.h"
+#include <fstream>
+#include <iostream>
+#ifndef _MSC_VER
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+// Raw optical sensor readings for a key at rest and fully pressed. The reading falls as
+// the key goes down, which is how TouchkeyDevice sets up its calibrators.
+const int kSimulatorAnalogRestValue = 3600;
+const int kSimulatorAnalogPressedValue = 300;
+
+// Time taken by the synthetic key press and release (milliseconds)
+const double kSimulatorPressDuration = 40.0;
+const double kSimulatorReleaseDuration = 60.0;
+
+TouchkeyDeviceSimulator::TouchkeyDeviceSimulator()
+: juce::Thread("TouchkeyDeviceSimulator"),
+  master_(-1), slave_(-1), isRunning_(false), verbose_(0),
+  numOctaves_(4), hardwareVersion_(2), softwareVersionMajor_(2), softwareVersionMinor_(0),
+  hasAnalogSensors_(true), maxLEDRecordsPerFrame_(1), lowestMidiNote_(48), scanning_(false), scanIntervalMilliseconds_(1), frameCounter_(0),
+  dataSource_(kSourceSynthetic), syntheticTouchRate_(4.0), randomState_(1),
+  logPosition_(0), logFrameOffset_(0), loopPlayback_(true), capture_(nullptr),
+  framesSent_(0), bytesSent_(0), bytesDropped_(0), commandsReceived_(0), commandsRejected_(0)
+{
+    for(int i = 0; i < kSimulatorMaxOctaves / 2; i++)
+        analogFrameCounter_[i] = 0;
+    for(int i = 0; i < 128; i++)
+        touchOnsetTimes_[i] = -1.0;
+}
+
+void TouchkeyDeviceSimulator::setNumberOfOctaves(int octaves) {
+    if(octaves < 1)
+        octaves = 1;
+    if(octaves > kSimulatorMaxOctaves)
+        octaves = kSimulatorMaxOctaves;
+    numOctaves_ = octaves;
+}
+
+void TouchkeyDeviceSimulator::setScanInterval(int intervalMilliseconds) {
+    if(intervalMilliseconds < 1)
+        intervalMilliseconds = 1;
+    scanIntervalMilliseconds_ = intervalMilliseconds;
+}
+
+double TouchkeyDeviceSimulator::takeTouchOnsetTime(int midiNote) {
+    if(midiNote < 0 || midiNote > 127)
+        return -1.0;
+    return touchOnsetTimes_[midiNote].exchange(-1.0, std::memory_order_relaxed);
+}
+
+// Load a log in the format written by TouchkeyDevice: timestamp, frame number,
+// MIDI note and touch frame for each record.
+bool TouchkeyDeviceSimulator::loadKeyTouchLog(std::string const& filename, int lowestMidiNote) {
+    std::ifstream log(filename.c_str(), std::ios::in | std::ios::binary);
+
+    if(!log.is_open())
+        return false;
+
+    logRecords_.clear();
+    while(true) {
+        timestamp_type timestamp;
+        int frame, midiNote;
+        KeyTouchFrame touchFrame;
+
+        log.read((char *)&timestamp, sizeof(timestamp_type));
+        log.read((char *)&frame, sizeof(int));
+        log.read((char *)&midiNote, sizeof(int));
+        log.read((char *)&touchFrame, sizeof(KeyTouchFrame));
+        if(!log)
+            break;
+
+        if(midiNote < lowestMidiNote)
+            continue;
+
+        LogRecord record;
+        record.frame = frame;
+        record.noteOffset = midiNote - lowestMidiNote;
+        record.touchFrame = touchFrame;
+        logRecords_.push_back(record);
+    }
+
+    if(verbose_ >= 1)
+        std::cout << "Simulator: loaded " << logRecords_.size() << " touch frames from " << filename << '\n';
+
+    if(logRecords_.empty())
+        return false;
+    dataSource_ = kSourceKeyTouchLog;
+    return true;
+}
+
+// Open the pseudo-terminal and start the thread which handles it
+bool TouchkeyDeviceSimulator::start() {
+	if(isRunning_)
+		return true;
+#ifdef _MSC_VER
+    return false;
+#else
+    master_ = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master_ < 0)
+        return false;
+    if(grantpt(master_) != 0 || unlockpt(master_) != 0 || ptsname(master_) == 0) {
+        close(master_);
+        master_ = -1;
+        return false;
+    }
+    devicePath_ = ptsname(master_);
+
+    // Hold the slave open ourselves: this keeps the raw terminal settings in place and
+    // keeps the master usable while the host opens and closes the device.
+    slave_ = open(devicePath_.c_str(), O_RDWR | O_NOCTTY);
+    if(slave_ < 0) {
+        close(master_);
+        master_ = -1;
+        return false;
+    }
+
+    struct termios settings;
+    tcgetattr(slave_, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(slave_, TCSANOW, &settings);
+
+    fcntl(master_, F_SETFL, fcntl(master_, F_GETFL) | O_NONBLOCK);
+
+    resetKeys();
+    decoder_.reset();
+    scanning_ = false;
+
+    if(verbose_ >= 1)
+        std::cout << "Simulator: TouchKeys device with " << numOctaves_ << " octaves on " << devicePath_ << '\n';
+
+    isRunning_ = true;
+    startThread();
+    return true;
+#endif
+}
+
+// Generate scans at the current scan interval without a host or a thread, collecting
+// what would have been written to the pseudo-terminal
+void TouchkeyDeviceSimulator::captureScans(int scans, std::vector<unsigned char>& output) {
+    if(isRunning_)
+        return;
+
+    resetKeys();
+    if(!logRecords_.empty())
+        logFrameOffset_ = logRecords_[0].frame - frameCounter_;
+
+    capture_ = &output;
+    double currentTime = 0;
+    for(int i = 0; i < scans; i++) {
+        scan(currentTime);
+        currentTime += scanIntervalMilliseconds_;
+    }
+    capture_ = nullptr;
+}
+
+// Stop the thread and close the pseudo-terminal
+void TouchkeyDeviceSimulator::stop() {
+	if(!isRunning_)
+		return;
+
+    signalThreadShouldExit();
+    stopThread(-1);
+
+#ifndef _MSC_VER
+    close(slave_);
+    close(master_);
+#endif
+    slave_ = master_ = -1;
+    devicePath_ = "";
+	isRunning_ = false;
+
+    if(verbose_ >= 1) {
+        std::cout << "Simulator: sent " << framesSent_ << " frames (" << bytesSent_ << " bytes, ";
+        std::cout << bytesDropped_ << " dropped), received " << commandsReceived_ << " commands (";
+        std::cout << commandsRejected_ << " rejected)\n";
+    }
+}
+
+// Run the simulator in its own thread: answer commands as they arrive, and send
+// a scan of data at each scan interval while scanning.
+void TouchkeyDeviceSimulator::run() {
+#ifndef _MSC_VER
+    double nextScanTime = juce::Time::getMillisecondCounterHiRes();
+
+    while(!threadShouldExit()) {
+        double currentTime = juce::Time::getMillisecondCounterHiRes();
+
+        if(scanning_ && currentTime >= nextScanTime) {
+            scan(currentTime);
+            nextScanTime += scanIntervalMilliseconds_;
+
+            // Don't try to catch up after a long stall
+            if(nextScanTime < currentTime - 100.0)
+                nextScanTime = currentTime + scanIntervalMilliseconds_;
+            continue;
+        }
+        if(!scanning_)
+            nextScanTime = currentTime;
+
+        // Wait for commands until the next scan is due. Limit the wait so we can check
+        // whether the thread should exit.
+        int timeout = scanning_ ? (int)ceil(nextScanTime - currentTime) : 10;
+
+        struct pollfd pfd;
+        pfd.fd = master_;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN))
+            processIncomingData();
+    }
+#endif
+}
+
+// Read whatever the host has sent and act on each command frame
+void TouchkeyDeviceSimulator::processIncomingData() {
+#ifndef _MSC_VER
+    unsigned char buffer[1024];
+    long count = read(master_, buffer, sizeof(buffer));
+
+    if(count <= 0)
+        return;
+
+    decoder_.setInput(buffer, count);
+    int event;
+    while((event = decoder_.decodeNext()) != TouchkeyFrameDecoder::kEventNone) {
+        if(event == TouchkeyFrameDecoder::kEventFrame && decoder_.frameLength() > 0)
+            processCommandFrame(decoder_.frame(), decoder_.frameLength());
+        else if(event == TouchkeyFrameDecoder::kEventFrameTooLong) {
+            // The firmware can't act on a command it couldn't hold
+            commandsReceived_++;
+            commandsRejected_++;
+            sendControlCharacter(kControlCharacterNak);
+        }
+    }
+#endif
+}
+
+void TouchkeyDeviceSimulator::processCommandFrame(const unsigned char *frame, int length) {
+    commandsReceived_++;
+
+    // The status request is answered with a status frame rather than an ACK
+    if(frame[0] == kFrameTypeStatus) {
+        sendStatusFrame();
+        return;
+    }
+    if(frame[0] == kFrameTypeEnterISPMode)
+        return;     // Not simulated; the real device stops responding
+
+    if(!commandIsValid(frame, length)) {
+        if(verbose_ >= 1)
+            std::cout << "Simulator: rejected command " << (int)frame[0] << " of length " << length << '\n';
+        commandsRejected_++;
+        sendControlCharacter(kControlCharacterNak);
+        return;
+    }
+
+    switch(frame[0]) {
+        case kFrameTypeStartScanning:
+            if(verbose_ >= 1)
+                std::cout << "Simulator: start scanning\n";
+            if(!scanning_) {
+                // Restart log playback with the current frame matching the first record
+                logPosition_ = 0;
+                if(!logRecords_.empty())
+                    logFrameOffset_ = logRecords_[0].frame - frameCounter_;
+            }
+            scanning_ = true;
+            break;
+        case kFrameTypeStopScanning:
+            if(verbose_ >= 1)
+                std::cout << "Simulator: stop scanning\n";
+            scanning_ = false;
+            break;
+        case kFrameTypeScanRate:
+            setScanInterval(frame[1]);
+            break;
+        case kFrameTypeEnterSelfProgramMode:
+            // Acknowledged before the jump; the bootloader itself isn't simulated
+            if(verbose_ >= 1)
+                std::cout << "Simulator: enter bootloader\n";
+            scanning_ = false;
+            break;
+        default:
+            // Parameter changes, I2C and LED commands: nothing to simulate beyond acknowledging them
+            if(verbose_ >= 2)
+                std::cout << "Simulator: received command " << (int)frame[0] << '\n';
+            break;
+    }
+
+    sendControlCharacter(kControlCharacterAck);
+}
+
+// Check the length and arguments of a command as the firmware does before acting on it.
+// The frame includes the type byte but not the framing or doubled escape characters.
+bool TouchkeyDeviceSimulator::commandIsValid(const unsigned char *frame, int length) {
+    switch(frame[0]) {
+        case kFrameTypeStartScanning:
+        case kFrameTypeStopScanning:
+        case kFrameTypeResetDevices:
+        case kFrameTypeUpdateBaselines:
+        case kFrameTypeRescanKeyboard:
+        case kFrameTypeRGBLEDAllOff:
+            return length == 1;
+        case kFrameTypeScanRate:
+            return length == 2 && frame[1] > 0;
+        case kFrameTypeNoiseThreshold:
+        case kFrameTypeSensitivity:
+            return length == 4 && octaveAndKeyAreValid(frame[1], frame[2]);
+        case kFrameTypeSizeScaler:
+            return length == 4 && octaveAndKeyAreValid(frame[1], frame[2]) && frame[3] <= 7;
+        case kFrameTypeMinimumSize:
+            return length == 5 && octaveAndKeyAreValid(frame[1], frame[2]);
+        case kFrameTypeSendI2CCommand:
+            // Octave, key, bytes to transmit, bytes of response, then the bytes to transmit
+            return length >= 5 && length == 5 + frame[3] && frame[1] < numOctaves_ && frame[2] <= 12;
+        case kFrameTypeSetEnabledKeys:
+        case kFrameTypeMonitorRawFromKey:
+        case kFrameTypeEncapsulatedMIDI:
+            return length > 1;
+        case kFrameTypeRGBLEDSetColors: {
+            // Whole 6-byte records, each naming a board and an LED on it
+            if(length < 7 || (length - 1) % 6 != 0 || (length - 1) / 6 > maxLEDRecordsPerFrame_)
+                return false;
+            for(int i = 1; i < length; i += 6) {
+                if((frame[i] & 0x3F) > 24)
+                    return false;
+            }
+            return true;
+        }
+        case kFrameTypeEnterSelfProgramMode:
+            return length == 5 && frame[1] == 0xA1 && frame[2] == 0xB2 && frame[3] == 0xC3 && frame[4] == 0xD4;
+        default:
+            return false;
+    }
+}
+
+// 0xFF means all octaves or all keys
+bool TouchkeyDeviceSimulator::octaveAndKeyAreValid(unsigned char octave, unsigned char key) {
+    if(octave != 0xFF && octave >= numOctaves_)
+        return false;
+    return key == 0xFF || key <= 12;
+}
+
+// Return every key to rest and playback to the start of the log
+void TouchkeyDeviceSimulator::resetKeys() {
+    for(int octave = 0; octave < kSimulatorMaxOctaves; octave++) {
+        for(int key = 0; key < 13; key++) {
+            SimulatedKey& k = keys_[octave][key];
+            k.touchCount = 0;
+            k.locH = -1.0;
+            k.needsUpdate = false;
+            k.touchSent = false;
+            k.gestureStartTime = k.gestureDuration = 0;
+            k.gestureBaseLocation = k.gestureVibratoRate = 0;
+            k.analogValue = kSimulatorAnalogRestValue;
+            for(int i = 0; i < 3; i++) {
+                k.locs[i] = -1.0;
+                k.sizes[i] = 0.0;
+            }
+        }
+    }
+
+    logPosition_ = 0;
+    framesSent_ = bytesSent_ = bytesDropped_ = commandsReceived_ = commandsRejected_ = 0;
+    for(int i = 0; i < 128; i++)
+        touchOnsetTimes_[i] = -1.0;
+}
+
+// Send one scan worth of data: a centroid frame for each octave and an analog frame for each board
+void TouchkeyDeviceSimulator::scan(double currentTime) {
+    frameCounter_ += scanIntervalMilliseconds_;
+
+    if(dataSource_ == kSourceKeyTouchLog)
+        updateKeysFromLog();
+    else
+        updateSyntheticKeys(currentTime);
+
+    for(int octave = 0; octave < numOctaves_; octave++)
+        sendCentroidFrame(octave);
+
+    if(hasAnalogSensors_) {
+        for(int board = 0; board < (numOctaves_ + 1) / 2; board++)
+            sendAnalogFrame(board);
+    }
+}
+
+// Start, continue and finish synthetic gestures: a touch (sometimes two) with some vibrato,
+// together with a key press on the optical sensors
+void TouchkeyDeviceSimulator::updateSyntheticKeys(double currentTime) {
+    int keysPresent = numOctaves_ * 12 + 1;
+    float startProbability = syntheticTouchRate_ * (float)scanIntervalMilliseconds_ * 0.001 / (float)keysPresent;
+
+    for(int octave = 0; octave < numOctaves_; octave++) {
+        for(int key = 0; key < 13; key++) {
+            if(!keyIsPresent(octave, key))
+                continue;
+            SimulatedKey& k = keys_[octave][key];
+
+            if(k.touchCount == 0) {
+                k.analogValue = kSimulatorAnalogRestValue + (int)(nextRandom() % 5) - 2;
+                if(randomFloat() >= startProbability)
+                    continue;
+
+                // Start a new gesture
+                k.gestureStartTime = currentTime;
+                k.gestureDuration = 150.0 + 1350.0 * randomFloat();
+                k.gestureBaseLocation = 0.15 + 0.6 * randomFloat();
+                k.gestureVibratoRate = 4.0 + 3.0 * randomFloat();
+                k.touchCount = (randomFloat() < 0.2 ? 2 : 1);
+                k.locH = 0.2 + 0.6 * randomFloat();
+                for(int i = 0; i < k.touchCount; i++)
+                    k.sizes[i] = 0.3 + 0.4 * randomFloat();
+            }
+
+            double elapsed = currentTime - k.gestureStartTime;
+            if(elapsed >= k.gestureDuration) {
+                // Gesture finished: send one more update to show the touch has ended
+                k.touchCount = 0;
+                k.locH = -1.0;
+                for(int i = 0; i < 3; i++) {
+                    k.locs[i] = -1.0;
+                    k.sizes[i] = 0.0;
+                }
+                k.needsUpdate = true;
+                k.analogValue = kSimulatorAnalogRestValue;
+                continue;
+            }
+
+            // Vibrato on each touch, second touch above the first
+            float vibrato = 0.01 * sinf(2.0 * M_PI * k.gestureVibratoRate * elapsed * 0.001);
+            for(int i = 0; i < k.touchCount; i++)
+                k.locs[i] = k.gestureBaseLocation + 0.2 * i + vibrato;
+
+            // Key press: ramp in at the start, hold, ramp out at the end
+            float press = 1.0;
+            if(elapsed < kSimulatorPressDuration)
+                press = elapsed / kSimulatorPressDuration;
+            else if(k.gestureDuration - elapsed < kSimulatorReleaseDuration)
+                press = (k.gestureDuration - elapsed) / kSimulatorReleaseDuration;
+            k.analogValue = kSimulatorAnalogRestValue + (int)(press * (kSimulatorAnalogPressedValue - kSimulatorAnalogRestValue));
+        }
+    }
+}
+
+// Apply all log records up to the current frame
+void TouchkeyDeviceSimulator::updateKeysFromLog() {
+    if(logRecords_.empty())
+        return;
+
+    while(true) {
+        if(logPosition_ >= logRecords_.size()) {
+            if(!loopPlayback_)
+                return;
+            // Start again from the beginning, as if the first record followed this frame
+            logPosition_ = 0;
+            logFrameOffset_ = logRecords_[0].frame - frameCounter_;
+        }
+
+        LogRecord const& record = logRecords_[logPosition_];
+        if(record.frame - logFrameOffset_ > frameCounter_)
+            return;
+        logPosition_++;
+
+        // Convert to the octave and key numbering of the device. The top C of the
+        // keyboard is key 12 of the octave below it.
+        int octave = record.noteOffset / 12;
+        int key = record.noteOffset % 12;
+        if(key == 0 && octave == numOctaves_) {
+            octave--;
+            key = 12;
+        }
+        if(octave >= numOctaves_ || !keyIsPresent(octave, key))
+            continue;
+
+        SimulatedKey& k = keys_[octave][key];
+        k.touchCount = record.touchFrame.count;
+        if(k.touchCount > 3)
+            k.touchCount = 3;
+        for(int i = 0; i < 3; i++) {
+            k.locs[i] = (i < k.touchCount ? record.touchFrame.locs[i] : -1.0);
+            k.sizes[i] = (i < k.touchCount ? record.touchFrame.sizes[i] : 0.0);
+        }
+        k.locH = record.touchFrame.locH;
+        k.needsUpdate = true;
+    }
+}
+
+// Status frame: versions, flags, octaves, lowest sensor and a bitmask of connected keys per octave
+void TouchkeyDeviceSimulator::sendStatusFrame() {
+    unsigned char payload[6 + 2 * kSimulatorMaxOctaves];
+    int length = 0;
+
+    payload[length++] = (unsigned char)hardwareVersion_;
+    payload[length++] = (unsigned char)softwareVersionMajor_;
+    payload[length++] = (unsigned char)softwareVersionMinor_;
+
+    unsigned char flags = kStatusFlagHasI2C | kStatusFlagHasRGBLED;
+    if(scanning_)
+        flags |= kStatusFlagRunning;
+    if(hasAnalogSensors_)
+        flags |= kStatusFlagHasAnalog;
+    payload[length++] = flags;
+    payload[length++] = (unsigned char)numOctaves_;
+    if(softwareVersionMajor_ >= 2)
+        payload[length++] = 0;      // Lowest hardware note
+
+    for(int octave = 0; octave < numOctaves_; octave++) {
+        unsigned int connectedKeys = (octave == numOctaves_ - 1 ? 0x1FFF : 0x0FFF);
+        payload[length++] = (unsigned char)(connectedKeys >> 8);
+        payload[length++] = (unsigned char)(connectedKeys & 0xFF);
+    }
+
+    sendFrame(kFrameTypeStatus, payload, length);
+}
+
+// Centroid frame: octave and timestamp, followed by the key number and data for each active key
+void TouchkeyDeviceSimulator::sendCentroidFrame(int octave) {
+    unsigned char payload[TOUCHKEY_MAX_FRAME_LENGTH];
+    int length = 0;
+
+    if(softwareVersionMajor_ > 0) {
+        payload[length++] = (unsigned char)octave;
+        payload[length++] = (unsigned char)(frameCounter_ & 0xFF);
+        payload[length++] = (unsigned char)((frameCounter_ >> 8) & 0xFF);
+        payload[length++] = (unsigned char)((frameCounter_ >> 16) & 0xFF);
+        payload[length++] = (unsigned char)((frameCounter_ >> 24) & 0xFF);
+    }
+    else {
+        payload[length++] = (unsigned char)((frameCounter_ >> 8) & 0xFF);
+        payload[length++] = (unsigned char)(frameCounter_ & 0xFF);
+        payload[length++] = (unsigned char)octave;
+    }
+
+    unsigned int touchesStarting = 0;
+
+    for(int key = 0; key < 13; key++) {
+        SimulatedKey& k = keys_[octave][key];
+        if(k.touchCount == 0 && !k.needsUpdate)
+            continue;
+        payload[length++] = (unsigned char)key;
+        length += encodeKeyCentroid(octave, key, &payload[length]);
+        k.needsUpdate = false;
+
+        if(k.touchCount > 0 && !k.touchSent)
+            touchesStarting |= (1U << key);
+        k.touchSent = (k.touchCount > 0);
+    }
+
+    sendFrame(kFrameTypeCentroid, payload, length);
+
+    // Note the time each new touch went out, once it has been written
+    if(touchesStarting != 0) {
+        double sentTime = juce::Time::getMillisecondCounterHiRes();
+        for(int key = 0; key < 13; key++) {
+            int midiNote = lowestMidiNote_ + 12 * octave + key;
+            if((touchesStarting & (1U << key)) && midiNote >= 0 && midiNote <= 127)
+                touchOnsetTimes_[midiNote].store(sentTime, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Pack the touches on one key in the format parsed by TouchkeyDevice::processKeyCentroid().
+// Returns the number of bytes used.
+int TouchkeyDeviceSimulator::encodeKeyCentroid(int octave, int key, unsigned char *buffer) {
+    SimulatedKey& k = keys_[octave][key];
+    bool white = (kKeyColor[key] == kKeyColorWhite);
+
+    // Original firmware sends a single byte for a key with no touches
+    if(softwareVersionMajor_ <= 0 && k.touchCount == 0) {
+        buffer[0] = 0xFF;
+        return 1;
+    }
+
+    float maxY, maxX;
+    if(hardwareVersion_ >= 2) {
+        maxY = white ? kWhiteMaxYValueNewHardware : kBlackMaxYValueNewHardware;
+        maxX = white ? kWhiteMaxXValueNewHardware : kBlackMaxXValueNewHardware;
+    }
+    else {
+        maxY = white ? kWhiteMaxYValueOldHardware : kBlackMaxYValueOldHardware;
+        maxX = kWhiteMaxXValueOldHardware;
+    }
+
+    int rawPosition[3], rawSize[3];
+    for(int i = 0; i < 3; i++) {
+        if(i < k.touchCount && k.locs[i] >= 0) {
+            rawPosition[i] = (int)(k.locs[i] * maxY);
+            if(rawPosition[i] > 0x0FFE)
+                rawPosition[i] = 0x0FFE;    // 0x0FFF means no touch
+            rawSize[i] = (int)(k.sizes[i] * kSizeMaxValue);
+            if(rawSize[i] > 255)
+                rawSize[i] = 255;
+        }
+        else {
+            rawPosition[i] = 0x0FFF;
+            rawSize[i] = 0;
+        }
+    }
+
+    int rawPositionH = 0x0FFF;
+    if(k.touchCount > 0 && k.locH >= 0 && (white || hardwareVersion_ >= 2)) {
+        rawPositionH = (int)(k.locH * maxX);
+        if(rawPositionH > 0x0FFE)
+            rawPositionH = 0x0FFE;
+    }
+
+    // 0x88 in the first byte is reserved to mean the data was not ready; nudge the
+    // second touch by one step to avoid it
+    if(((rawPosition[0] >> 8) & 0x0F) == 0x08 && ((rawPosition[1] >> 8) & 0x0F) == 0x08)
+        rawPosition[1] = 0x07FF;
+
+    buffer[0] = (unsigned char)(((rawPosition[0] >> 4) & 0xF0) | ((rawPosition[1] >> 8) & 0x0F));
+    buffer[1] = (unsigned char)(rawPosition[0] & 0xFF);
+    buffer[2] = (unsigned char)(rawPosition[1] & 0xFF);
+    buffer[3] = (unsigned char)(((rawPosition[2] >> 4) & 0xF0) | ((rawPositionH >> 8) & 0x0F));
+    buffer[4] = (unsigned char)(rawPosition[2] & 0xFF);
+
+    // Black keys on old hardware have no horizontal position
+    if(hardwareVersion_ < 2 && !white) {
+        for(int i = 0; i < 3; i++)
+            buffer[i + 5] = (unsigned char)rawSize[i];
+        return kTransmissionLengthBlackOldHardware;
+    }
+
+    buffer[5] = (unsigned char)(rawPositionH & 0xFF);
+    for(int i = 0; i < 3; i++)
+        buffer[i + 6] = (unsigned char)rawSize[i];
+    return (hardwareVersion_ >= 2 ? kTransmissionLengthWhiteNewHardware : kTransmissionLengthWhiteOldHardware);
+}
+
+// Analog frame: octave of the board, then a timestamp and 25 16-bit values
+void TouchkeyDeviceSimulator::sendAnalogFrame(int board) {
+    unsigned char payload[1 + 54];
+    int frame = ++analogFrameCounter_[board];
+
+    payload[0] = (unsigned char)(board * 2);
+    payload[1] = (unsigned char)(frame & 0xFF);
+    payload[2] = (unsigned char)((frame >> 8) & 0xFF);
+    payload[3] = (unsigned char)((frame >> 16) & 0xFF);
+    payload[4] = (unsigned char)((frame >> 24) & 0xFF);
+
+    for(int sensor = 0; sensor < 25; sensor++) {
+        int octave = board * 2 + sensor / 12;
+        int key = sensor % 12;
+        int value = 0;
+
+        if(sensor == 24) {
+            // Top C belongs to the octave below
+            octave--;
+            key = 12;
+        }
+        if(octave < numOctaves_ && keyIsPresent(octave, key))
+            value = keys_[octave][key].analogValue;
+
+        payload[5 + sensor * 2] = (unsigned char)(value & 0xFF);
+        payload[6 + sensor * 2] = (unsigned char)((value >> 8) & 0xFF);
+    }
+
+    sendFrame(kFrameTypeAnalog, payload, sizeof(payload));
+}
+
+// Wrap the payload in frame begin/end sequences, doubling any escape characters
+void TouchkeyDeviceSimulator::sendFrame(unsigned char type, const unsigned char *payload, int length) {
+    unsigned char buffer[2 * TOUCHKEY_MAX_FRAME_LENGTH + 8];
+    int location = 0;
+
+    buffer[location++] = ESCAPE_CHARACTER;
+    buffer[location++] = kControlCharacterFrameBegin;
+    buffer[location++] = type;
+    for(int i = 0; i < length; i++) {
+        buffer[location++] = payload[i];
+        if(payload[i] == ESCAPE_CHARACTER)
+            buffer[location++] = ESCAPE_CHARACTER;
+    }
+    buffer[location++] = ESCAPE_CHARACTER;
+    buffer[location++] = kControlCharacterFrameEnd;
+
+    deviceWrite(buffer, location);
+    framesSent_++;
+}
+
+void TouchkeyDeviceSimulator::sendControlCharacter(unsigned char ch) {
+    unsigned char buffer[2] = {ESCAPE_CHARACTER, ch};
+    deviceWrite(buffer, 2);
+}
+
+// Write to the host. If the host isn't keeping up and the terminal buffer is full,
+// the data is lost, as it would be from the real device.
+void TouchkeyDeviceSimulator::deviceWrite(const unsigned char *buffer, int length) {
+    if(capture_ != nullptr) {
+        capture_->insert(capture_->end(), buffer, buffer + length);
+        bytesSent_ += length;
+        return;
+    }
+#ifndef _MSC_VER
+    long written = write(master_, buffer, length);
+
+    if(written < 0)
+        written = 0;
+    bytesSent_ += written;
+    bytesDropped_ += (length - written);
+#endif
+}
+
+// xorshift generator, so the synthetic data can be reproduced from its seed
+unsigned int TouchkeyDeviceSimulator::nextRandom() {
+    randomState_ ^= randomState_ << 13;
+    randomState_ ^= randomState_ >> 17;
+    randomState_ ^= randomState_ << 5;
+    return randomState_;
+}
@@ -0,0 +1,223 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  TouchkeyDeviceSimulator.h: simulates the TouchKeys hardware on a
+  pseudo-terminal, for testing and benchmarking without physical boards
+*/
+
+#pragma once
+
+#include "TouchkeyDevice.h"
+#include "TouchkeyFrameDecoder.h"
+#include "KeyTouchFrame.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+const int kSimulatorMaxOctaves = 8;             // Four boards of two octaves each
+
+/*
+ * TouchkeyDeviceSimulator
+ *
+ * Opens a pseudo-terminal and speaks the TouchKeys wire protocol on it, so that
+ * TouchkeyDevice can be pointed at devicePath() as if it were a real controller. Replies
+ * to status requests, and like the firmware answers every other command with an ACK if it
+ * is well formed or a NAK if not; while scanning it sends centroid (and optionally analog)
+ * frames for each octave at the scan rate. Touch data either comes from a synthetic
+ * gesture generator or from a key touch log recorded by TouchkeyDevice.
+ *
+ * The time each touch begins is kept per MIDI note, so that the host's response to it can
+ * be timed with takeTouchOnsetTime().
+ *
+ * Configuration methods should be called before start(). POSIX only.
+ */
+
+class TouchkeyDeviceSimulator : public juce::Thread {
+public:
+    // Sources of touch data
+    enum {
+        kSourceSynthetic = 0,   // Randomly generated touches with vibrato and key presses
+        kSourceKeyTouchLog      // Touch frames replayed from a recorded log
+    };
+
+    // *** Constructor ***
+    TouchkeyDeviceSimulator();
+
+    // *** Destructor ***
+    ~TouchkeyDeviceSimulator() {
+        stop();
+    }
+
+    // *** Configuration ***
+
+    // What the simulated controller reports in its status frame
+    void setNumberOfOctaves(int octaves);
+    void setHardwareVersion(int version) { hardwareVersion_ = version; }
+    void setSoftwareVersion(int major, int minor) { softwareVersionMajor_ = major; softwareVersionMinor_ = minor; }
+    void setHasAnalogSensors(bool hasAnalog) { hasAnalogSensors_ = hasAnalog; }
+
+    // Most LED records accepted in one RGB LED frame; longer frames are rejected with a NAK.
+    // Defaults to one, the most the host sent before multi-record frames were added.
+    void setMaxLEDRecordsPerFrame(int records) { maxLEDRecordsPerFrame_ = (records > 0 ? records : 1); }
+
+    // MIDI note of the lowest key, matching the TouchkeyDevice setting. Used for touch onset times.
+    void setLowestMidiNote(int note) { lowestMidiNote_ = note; }
+
+    // Interval between scans in milliseconds. The host can also change this with a scan rate command.
+    void setScanInterval(int intervalMilliseconds);
+
+    // Average number of new touches per second from the synthetic generator, and its random seed
+    void setSyntheticTouchRate(float touchesPerSecond) { syntheticTouchRate_ = touchesPerSecond; }
+    void setRandomSeed(unsigned int seed) { randomState_ = (seed != 0 ? seed : 1); }
+
+    // Replay a key touch log instead of synthetic data. lowestMidiNote should match the
+    // TouchkeyDevice setting when the log was recorded. Returns false if the log can't be read.
+    bool loadKeyTouchLog(std::string const& filename, int lowestMidiNote = 48);
+    void setLoopPlayback(bool loop) { loopPlayback_ = loop; }
+
+    void setVerboseLevel(int verbose) { verbose_ = verbose; }
+
+    // *** Control methods ***
+
+    // Open the pseudo-terminal and start responding to the host. Returns true on success.
+    bool start();
+
+    // Stop the simulator and close the pseudo-terminal
+    void stop();
+
+    bool isRunning() { return isRunning_; }
+
+    // Path for the host to open, valid while running
+    std::string devicePath() { return devicePath_; }
+
+    // *** Offline output ***
+
+    // Generate this many scans of touch and analog data as if the host had started scanning,
+    // appending the bytes that would have been sent to output. Runs on the calling thread
+    // with virtual time, so it is repeatable for a given seed; call only while stopped.
+    void captureScans(int scans, std::vector<unsigned char>& output);
+
+    // *** Statistics ***
+
+    unsigned long framesSent() { return framesSent_; }
+    unsigned long bytesSent() { return bytesSent_; }
+    unsigned long bytesDropped() { return bytesDropped_; }  // Host not reading fast enough
+    unsigned long commandsReceived() { return commandsReceived_; }
+    unsigned long commandsRejected() { return commandsRejected_; }
+
+    // Time (in milliseconds, from juce::Time::getMillisecondCounterHiRes()) at which a frame
+    // starting a touch on the given note was sent, or -1 if none since the last call. Can
+    // be called from any thread.
+    double takeTouchOnsetTime(int midiNote);
+
+    // *** Juce Thread method ***
+    void run();
+
+private:
+    // State of one simulated key, in the raw units sent over the wire
+    struct SimulatedKey {
+        int touchCount;             // Number of active touches (0-3)
+        float locs[3];              // Normalised touch locations (0-1)
+        float sizes[3];             // Normalised touch sizes (0-1)
+        float locH;                 // Normalised horizontal location, or -1
+        bool needsUpdate;           // Whether to include this key in the next centroid frame
+        bool touchSent;             // Whether the last centroid frame showed a touch
+
+        // Synthetic gesture state
+        double gestureStartTime;    // Milliseconds
+        double gestureDuration;
+        float gestureBaseLocation;
+        float gestureVibratoRate;   // Hz
+        int analogValue;            // Current optical sensor value
+    };
+
+    // One record of a key touch log
+    struct LogRecord {
+        int frame;                  // Device frame number when recorded
+        int noteOffset;             // Semitones above the lowest MIDI note
+        KeyTouchFrame touchFrame;
+    };
+
+    // Handle commands from the host
+    void processIncomingData();
+    void processCommandFrame(const unsigned char *frame, int length);
+    bool commandIsValid(const unsigned char *frame, int length);
+    bool octaveAndKeyAreValid(unsigned char octave, unsigned char key);
+
+    // Generate and send one scan worth of data
+    void resetKeys();
+    void scan(double currentTime);
+    void updateSyntheticKeys(double currentTime);
+    void updateKeysFromLog();
+    void sendStatusFrame();
+    void sendCentroidFrame(int octave);
+    void sendAnalogFrame(int board);
+    int encodeKeyCentroid(int octave, int key, unsigned char *buffer);
+
+    // Send a frame with the given type, escaping the payload
+    void sendFrame(unsigned char type, const unsigned char *payload, int length);
+    void sendControlCharacter(unsigned char ch);
+    void deviceWrite(const unsigned char *buffer, int length);
+
+    bool keyIsPresent(int octave, int key) {
+        return (key < 12 || (key == 12 && octave == numOctaves_ - 1));
+    }
+    unsigned int nextRandom();
+    float randomFloat() { return (float)(nextRandom() & 0xFFFFFF) / (float)0x1000000; }
+
+private:
+    int master_;                        // Pseudo-terminal file descriptors
+    int slave_;
+    std::string devicePath_;
+    bool isRunning_;
+    int verbose_;
+
+    int numOctaves_;                    // Reported configuration
+    int hardwareVersion_;
+    int softwareVersionMajor_;
+    int softwareVersionMinor_;
+    bool hasAnalogSensors_;
+    int maxLEDRecordsPerFrame_;
+    int lowestMidiNote_;
+
+    bool scanning_;                     // Whether the host has started scanning
+    int scanIntervalMilliseconds_;
+    int frameCounter_;                  // Device timestamp in milliseconds
+    int analogFrameCounter_[kSimulatorMaxOctaves / 2]; // Frame numbers for each board's analog data
+
+    SimulatedKey keys_[kSimulatorMaxOctaves][13];
+
+    int dataSource_;                    // Synthetic or log playback
+    float syntheticTouchRate_;
+    unsigned int randomState_;
+    std::vector<LogRecord> logRecords_; // Loaded key touch log
+    size_t logPosition_;                // Next record to play
+    int logFrameOffset_;                // Difference between log and device frame numbers
+    bool loopPlayback_;
+    std::vector<unsigned char> *capture_; // Where captureScans() collects output, or nullptr
+
+    TouchkeyFrameDecoder decoder_;      // For commands from the host
+    std::atomic<double> touchOnsetTimes_[128]; // When each note's latest touch was sent, or -1
+
+    unsigned long framesSent_;          // Statistics
+    unsigned long bytesSent_;
+    unsigned long bytesDropped_;
+    unsigned long commandsReceived_;
+    unsigned long commandsRejected_;
+};
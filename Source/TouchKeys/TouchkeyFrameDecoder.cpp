@@ -0,0 +1,107 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  TouchkeyFrameDecoder.cpp: streaming decoder for the escaped serial
+  framing used by the TouchKeys hardware
+*/
+
+#include "TouchkeyFrameDecoder.h"
+#include <cstring>
+
+void TouchkeyFrameDecoder::reset() {
+    input_ = inputEnd_ = 0;
+    frameLength_ = 0;
+    inFrame_ = controlSeq_ = frameError_ = false;
+}
+
+int TouchkeyFrameDecoder::decodeNext() {
+    while(input_ < inputEnd_) {
+        if(controlSeq_) {
+            // Byte following an escape character
+            unsigned char ch = *input_++;
+            controlSeq_ = false;
+            escapeSequences_++;
+
+            if(ch == ESCAPE_CHARACTER) {                // double-escape means a literal escape character
+                if(inFrame_ && !appendToFrame(&ch, 1))
+                    return kEventFrameTooLong;
+            }
+            else if(ch == kControlCharacterFrameBegin) {
+                inFrame_ = true;
+                frameLength_ = 0;
+                frameError_ = false;
+            }
+            else if(ch == kControlCharacterFrameEnd) {  // frame finished?
+                if(inFrame_) {
+                    inFrame_ = false;
+                    framesDecoded_++;
+                    return kEventFrame;
+                }
+            }
+            else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error
+                if(inFrame_) {
+                    frameError_ = true;
+                    frameErrors_++;
+                    return kEventFrameError;
+                }
+            }
+            else if(ch == kControlCharacterAck)
+                return kEventAck;
+            else if(ch == kControlCharacterNak)
+                return kEventNak;
+            continue;
+        }
+
+        // Everything up to the next escape character is literal data: part of the frame
+        // if we're in one, otherwise ignored.
+        const unsigned char *escape = (const unsigned char *)memchr(input_, ESCAPE_CHARACTER, inputEnd_ - input_);
+        const unsigned char *literalEnd = (escape != 0 ? escape : inputEnd_);
+
+        if(inFrame_ && literalEnd > input_) {
+            if(!appendToFrame(input_, literalEnd - input_)) {
+                // Rest of the run is discarded along with the frame
+                input_ = literalEnd;
+                return kEventFrameTooLong;
+            }
+        }
+
+        input_ = literalEnd;
+        if(escape != 0) {
+            controlSeq_ = true;
+            input_++;
+        }
+    }
+
+    return kEventNone;
+}
+
+bool TouchkeyFrameDecoder::appendToFrame(const unsigned char *data, long length) {
+    long space = TOUCHKEY_MAX_FRAME_LENGTH - frameLength_;
+
+    if(length < space) {
+        memcpy(&frame_[frameLength_], data, length);
+        frameLength_ += length;
+        return true;
+    }
+
+    // A frame which fills the buffer is too long; drop it and wait for the next one
+    inFrame_ = false;
+    framesDropped_++;
+    return false;
+}
@@ -0,0 +1,126 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  TouchkeyFrameDecoder.h: streaming decoder for the escaped serial
+  framing used by the TouchKeys hardware
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define TOUCHKEY_MAX_FRAME_LENGTH 256	// Maximum data length in a single frame
+#define ESCAPE_CHARACTER 0xFE			// Indicates control sequence
+
+// Control characters which follow ESCAPE_CHARACTER on the wire
+
+enum {
+	kControlCharacterFrameBegin = 0x00,
+	kControlCharacterAck = 0x01,
+	kControlCharacterNak = 0x02,
+	kControlCharacterFrameError = 0xFD,
+	kControlCharacterFrameEnd = 0xFF
+};
+
+/*
+ * TouchkeyFrameDecoder
+ *
+ * Turns the raw byte stream from the device into frames. Data is handed over a whole
+ * read at a time with setInput(), then decodeNext() is called until it returns
+ * kEventNone, handling each event as it comes. Decoding state is kept between reads,
+ * so frames and control sequences may be split across any number of reads.
+ *
+ * Runs of ordinary bytes between escape characters are located with memchr() and
+ * copied into the frame in one go, so the per-byte cost is only paid on the (rare)
+ * escape sequences.
+ */
+
+class TouchkeyFrameDecoder {
+public:
+    // Events returned by decodeNext()
+    enum {
+        kEventNone = 0,         // Input exhausted; call setInput() with the next read
+        kEventFrame,            // Complete frame available from frame() and frameLength()
+        kEventAck,              // Device acknowledged a command
+        kEventNak,              // Device rejected a command
+        kEventFrameError,       // Device reported an internal error in the current frame
+        kEventFrameTooLong      // Frame exceeded TOUCHKEY_MAX_FRAME_LENGTH and was dropped
+    };
+
+    // ***** Constructor *****
+
+    TouchkeyFrameDecoder() { reset(); clearStatistics(); }
+
+    // ***** Decoding *****
+
+    // Discard any partial frame and return to waiting for the start of a frame
+    void reset();
+
+    // Provide the next block of data. The buffer must remain valid until decodeNext()
+    // returns kEventNone.
+    void setInput(const unsigned char *data, long length) {
+        input_ = data;
+        inputEnd_ = data + (length > 0 ? length : 0);
+        bytesProcessed_ += (length > 0 ? length : 0);
+    }
+
+    // Consume input until something happens, returning the event type
+    int decodeNext();
+
+    // The most recently completed frame, valid after kEventFrame until the next decodeNext()
+    unsigned char *frame() { return frame_; }
+    int frameLength() const { return frameLength_; }
+
+    // Whether the device flagged an error during the current or most recent frame
+    bool frameHadError() const { return frameError_; }
+
+    // Whether the input provided by setInput() has been used up
+    bool inputRemaining() const { return input_ < inputEnd_; }
+
+    // ***** Statistics *****
+
+    void clearStatistics() {
+        bytesProcessed_ = framesDecoded_ = framesDropped_ = frameErrors_ = escapeSequences_ = 0;
+    }
+
+    uint64_t bytesProcessed() const { return bytesProcessed_; }
+    uint64_t framesDecoded() const { return framesDecoded_; }
+    uint64_t framesDropped() const { return framesDropped_; }
+    uint64_t frameErrors() const { return frameErrors_; }
+    uint64_t escapeSequences() const { return escapeSequences_; }
+
+private:
+    // Add literal bytes to the frame, returning false if it became too long
+    bool appendToFrame(const unsigned char *data, long length);
+
+    const unsigned char *input_;        // Next byte to decode
+    const unsigned char *inputEnd_;     // One past the last byte of input
+
+    unsigned char frame_[TOUCHKEY_MAX_FRAME_LENGTH]; // Accumulated frame of data
+    int frameLength_;
+    bool inFrame_;                      // Whether we are between frame begin and end
+    bool controlSeq_;                   // Whether the last byte was an escape character
+    bool frameError_;                   // Whether the device flagged an error in this frame
+
+    uint64_t bytesProcessed_;           // Statistics on the decoded stream
+    uint64_t framesDecoded_;
+    uint64_t framesDropped_;
+    uint64_t frameErrors_;
+    uint64_t escapeSequences_;
+};
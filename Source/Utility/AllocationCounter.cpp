@@ -0,0 +1,77 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  AllocationCounter.cpp: debug-build counting of heap allocations, for
+  checking that real-time code paths don't allocate.
+*/
+
+#include "AllocationCounter.h"
+
+#if TOUCHKEYS_ALLOCATION_COUNTER
+
+#include <cstdlib>
+#include <new>
+
+static thread_local uint64_t gAllocationsOnThisThread = 0;
+
+uint64_t AllocationCounter::allocationsOnThisThread() {
+    return gAllocationsOnThisThread;
+}
+
+// Replacements for the global allocation functions. The library's sized deletes
+// forward to these; over-aligned allocations aren't counted.
+
+void* operator new(std::size_t size) {
+    gAllocationsOnThisThread++;
+    void *p = malloc(size > 0 ? size : 1);
+    if(p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](std::size_t size) {
+    gAllocationsOnThisThread++;
+    void *p = malloc(size > 0 ? size : 1);
+    if(p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    gAllocationsOnThisThread++;
+    return malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    gAllocationsOnThisThread++;
+    return malloc(size > 0 ? size : 1);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void *p, const std::nothrow_t&) noexcept { free(p); }
+
+#else
+
+uint64_t AllocationCounter::allocationsOnThisThread() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  AllocationCounter.h: debug-build counting of heap allocations, for
+  checking that real-time code paths don't allocate.
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <stdint.h>
+
+// Counting is on by default in debug builds. It works by replacing the global
+// operator new, so it can be turned off with -DTOUCHKEYS_ALLOCATION_COUNTER=0 if
+// that clashes with something else.
+#ifndef TOUCHKEYS_ALLOCATION_COUNTER
+#if JUCE_DEBUG
+#define TOUCHKEYS_ALLOCATION_COUNTER 1
+#else
+#define TOUCHKEYS_ALLOCATION_COUNTER 0
+#endif
+#endif
+
+/*
+ * AllocationCounter
+ *
+ * Counts calls to operator new on each thread. Always returns 0 when counting
+ * is compiled out.
+ */
+
+class AllocationCounter {
+public:
+    // Number of allocations made so far by the calling thread
+    static uint64_t allocationsOnThisThread();
+
+    // Whether counting is compiled in
+    static bool isEnabled() { return TOUCHKEYS_ALLOCATION_COUNTER != 0; }
+};
+
+/*
+ * ScopedAllocationCheck
+ *
+ * Asserts that the calling thread makes no heap allocations between construction
+ * and destruction, or an earlier call to end(). Compiles to nothing when counting is off.
+ */
+
+class ScopedAllocationCheck {
+public:
+#if TOUCHKEYS_ALLOCATION_COUNTER
+    ScopedAllocationCheck() : start_(AllocationCounter::allocationsOnThisThread()), active_(true) {}
+    ~ScopedAllocationCheck() { end(); }
+    
+    // Allocations so far within this scope
+    uint64_t allocations() const { return AllocationCounter::allocationsOnThisThread() - start_; }
+    
+    // Check now and stop checking, for when the rest of the scope is allowed to allocate
+    void end() {
+        if(active_)
+            jassert(allocations() == 0);
+        active_ = false;
+    }
+
+private:
+    uint64_t start_;
+    bool active_;
+#else
+    uint64_t allocations() const { return 0; }
+    void end() {}
+#endif
+};
@@ -0,0 +1,94 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  FixedCapacityVector.h: vector with inline storage and a fixed maximum
+  size, for use on real-time threads where allocation is not allowed.
+*/
+
+#pragma once
+
+#include <cstddef>
+
+/*
+ * FixedCapacityVector
+ *
+ * A subset of the std::vector interface backed by an array of Capacity elements
+ * inside the object itself, so it never touches the heap. push_back() returns false
+ * rather than growing when the vector is full. Elements must be default-constructible
+ * and copyable; erased elements are shifted down by assignment.
+ */
+
+template<typename T, int Capacity>
+class FixedCapacityVector {
+public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    // ***** Constructor *****
+
+    FixedCapacityVector() : size_(0) {}
+
+    // ***** Capacity *****
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ >= Capacity; }
+    static size_t capacity() { return Capacity; }
+
+    // ***** Element Access *****
+
+    T& operator[](size_t index) { return items_[index]; }
+    const T& operator[](size_t index) const { return items_[index]; }
+    T& back() { return items_[size_ - 1]; }
+    const T& back() const { return items_[size_ - 1]; }
+
+    iterator begin() { return items_; }
+    iterator end() { return items_ + size_; }
+    const_iterator begin() const { return items_; }
+    const_iterator end() const { return items_ + size_; }
+
+    // ***** Modifiers *****
+
+    // Add an element to the end. Returns false if there is no room.
+    bool push_back(const T& item) {
+        if(size_ >= Capacity)
+            return false;
+        items_[size_++] = item;
+        return true;
+    }
+
+    void pop_back() {
+        if(size_ > 0)
+            size_--;
+    }
+
+    // Remove one element, keeping the order of the rest
+    iterator erase(iterator position) {
+        for(iterator it = position; it + 1 < end(); ++it)
+            *it = *(it + 1);
+        size_--;
+        return position;
+    }
+
+    void clear() { size_ = 0; }
+
+private:
+    T items_[Capacity];
+    size_t size_;
+};
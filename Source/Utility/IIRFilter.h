@@ -245,6 +245,81 @@ private:
     typename Node<DataType>::size_type lastInputIndex_;              // Where in the input buffer we had the last sample
 };
 
+/*
+ * IIRFilterStage
+ *
+ * The same filter as IIRFilterNode, as a Pipeline stage (see Pipeline.h) with the number of
+ * feedforward and feedback coefficients fixed at compile time. It keeps only the histories it
+ * needs, in fixed arrays, and computes in the same order as IIRFilterNode so the results match.
+ * With no coefficients set, it passes samples through.
+ *
+ * Each note keeps its own stage rather than sharing a keyboard-wide bank of filters: every
+ * output still has to be inserted into the note's Node, which costs more than the filter, so
+ * batching the arithmetic across notes saves nothing (see "-B filter-bank").
+ */
+
+template<typename DataType, int NumB, int NumA>
+class IIRFilterStage {
+public:
+	typedef DataType input_type;
+	typedef DataType output_type;
+	
+	IIRFilterStage() {
+		for(int i = 0; i < NumB; i++)
+			bCoefficients_[i] = DataType();
+		for(int i = 0; i < NumA; i++)
+			aCoefficients_[i] = DataType();
+		bCoefficients_[0] = 1;
+		clear();
+	}
+	
+	// Set the coefficients in the same form as IIRFilterNode. Coefficients beyond the
+	// template lengths are ignored and missing ones are zero. Optionally keep the history.
+	void setCoefficients(std::vector<DataType> const& bCoeffs,
+	                     std::vector<DataType> const& aCoeffs,
+	                     bool clearBuffer = true) {
+		if(bCoeffs.empty())
+			return;
+		for(int i = 0; i < NumB; i++)
+			bCoefficients_[i] = (i < (int)bCoeffs.size() ? bCoeffs[i] : DataType());
+		for(int i = 0; i < NumA; i++)
+			aCoefficients_[i] = (i < (int)aCoeffs.size() ? aCoeffs[i] : DataType());
+		if(clearBuffer)
+			clear();
+	}
+	
+	output_type process(input_type const& sample, timestamp_type timestamp) {
+		DataType result = bCoefficients_[0] * sample;
+		for(int i = 1; i < NumB; i++)
+			result += inputHistory_[i - 1] * bCoefficients_[i];
+		for(int i = 0; i < NumA; i++)
+			result -= outputHistory_[i] * aCoefficients_[i];
+		
+		// Histories are kept most recent first
+		for(int i = NumB - 2; i > 0; i--)
+			inputHistory_[i] = inputHistory_[i - 1];
+		if(NumB > 1)
+			inputHistory_[0] = sample;
+		for(int i = NumA - 1; i > 0; i--)
+			outputHistory_[i] = outputHistory_[i - 1];
+		if(NumA > 0)
+			outputHistory_[0] = result;
+		return result;
+	}
+	
+	// Reset the history to zeros
+	void clear() {
+		for(int i = 0; i < NumB; i++)
+			inputHistory_[i] = DataType();
+		for(int i = 0; i < NumA + 1; i++)
+			outputHistory_[i] = DataType();
+	}
+	
+private:
+	DataType bCoefficients_[NumB], aCoefficients_[NumA + 1];
+	DataType inputHistory_[NumB], outputHistory_[NumA + 1];   // Extra element allows NumA == 0
+};
+
 // ***** Static Filter Design Methods *****
 
 // These methods calculate specific coefficients and store them in the provided
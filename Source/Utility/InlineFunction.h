@@ -0,0 +1,134 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  InlineFunction.h: a function wrapper which stores its target inside
+  the object, so creating and copying it never allocates
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ * InlineFunction
+ *
+ * Works like boost::function for the small callables used with the schedulers, such as
+ * boost::bind(&Class::method, this), but keeps the callable in a fixed buffer of Capacity
+ * bytes instead of on the heap. A callable which doesn't fit is a compile-time error.
+ */
+
+template<typename Signature, size_t Capacity = 4 * sizeof(void*)>
+class InlineFunction;
+
+template<typename R, typename... Args, size_t Capacity>
+class InlineFunction<R (Args...), Capacity> {
+public:
+    // ***** Constructors *****
+
+    InlineFunction() : invoke_(nullptr), manage_(nullptr) {}
+
+    template<typename F,
+             typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+    InlineFunction(F&& function) : invoke_(nullptr), manage_(nullptr) {
+        assign(std::forward<F>(function));
+    }
+
+    InlineFunction(InlineFunction const& other) : invoke_(nullptr), manage_(nullptr) {
+        copyFrom(other);
+    }
+
+    // ***** Destructor *****
+
+    ~InlineFunction() { clear(); }
+
+    // ***** Assignment *****
+
+    InlineFunction& operator=(InlineFunction const& other) {
+        if(&other != this) {
+            clear();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    template<typename F,
+             typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+    InlineFunction& operator=(F&& function) {
+        clear();
+        assign(std::forward<F>(function));
+        return *this;
+    }
+
+    // Release the stored callable, leaving this object empty
+    void clear() {
+        if(manage_ != nullptr)
+            manage_(storage_, nullptr);
+        invoke_ = nullptr;
+        manage_ = nullptr;
+    }
+
+    // ***** Calling *****
+
+    explicit operator bool() const { return invoke_ != nullptr; }
+
+    R operator()(Args... args) const {
+        return invoke_(const_cast<unsigned char *>(storage_), std::forward<Args>(args)...);
+    }
+
+private:
+    template<typename F>
+    void assign(F&& function) {
+        typedef typename std::decay<F>::type Callable;
+        static_assert(sizeof(Callable) <= Capacity, "Callable is too large for InlineFunction");
+        static_assert(alignof(Callable) <= alignof(std::max_align_t), "Callable alignment not supported by InlineFunction");
+
+        new (storage_) Callable(std::forward<F>(function));
+        invoke_ = &invokeCallable<Callable>;
+        manage_ = &manageCallable<Callable>;
+    }
+
+    void copyFrom(InlineFunction const& other) {
+        if(other.manage_ == nullptr)
+            return;
+        other.manage_(storage_, other.storage_);
+        invoke_ = other.invoke_;
+        manage_ = other.manage_;
+    }
+
+    template<typename Callable>
+    static R invokeCallable(void *storage, Args... args) {
+        return (*static_cast<Callable *>(storage))(std::forward<Args>(args)...);
+    }
+
+    // Copy-construct into storage from source, or destroy storage if source is null
+    template<typename Callable>
+    static void manageCallable(void *storage, const void *source) {
+        if(source != nullptr)
+            new (storage) Callable(*static_cast<const Callable *>(source));
+        else
+            static_cast<Callable *>(storage)->~Callable();
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[Capacity];
+    R (*invoke_)(void *, Args...);
+    void (*manage_)(void *, const void *);
+};
@@ -0,0 +1,150 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LatencyHistogram.h: lock-free histogram of durations in microseconds,
+  for measuring latency and execution time on real-time threads.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <stdint.h>
+
+/*
+ * LatencyHistogram
+ *
+ * Collects durations into log-linear buckets: each power of two (in microseconds)
+ * is divided into kSubBucketsPerOctave equal parts, which gives roughly 20% resolution
+ * from 1us up to several seconds. Samples can be added from one thread while another
+ * thread reads the statistics; all counters are atomic and adding a sample never
+ * blocks or allocates.
+ */
+
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketsPerOctave = 4;
+    static constexpr int kOctaves = 24;              // 1us to ~16s
+    static constexpr int kNumBuckets = 1 + kOctaves * kSubBucketsPerOctave + 1; // + underflow, overflow
+
+    // ***** Constructor *****
+
+    LatencyHistogram() { clear(); }
+
+    // ***** Modifiers *****
+
+    // Add a new sample, given in microseconds
+    void addSample(double microseconds) {
+        buckets_[bucketForValue(microseconds)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t us = microseconds > 0 ? (uint64_t)microseconds : 0;
+        totalMicroseconds_.fetch_add(us, std::memory_order_relaxed);
+        uint64_t previousMax = maxMicroseconds_.load(std::memory_order_relaxed);
+        while(us > previousMax && !maxMicroseconds_.compare_exchange_weak(previousMax, us, std::memory_order_relaxed)) {}
+    }
+
+    // Reset all the counters. Not synchronized with addSample(), so samples arriving
+    // during the clear may or may not be kept.
+    void clear() {
+        for(int i = 0; i < kNumBuckets; i++)
+            buckets_[i].store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        totalMicroseconds_.store(0, std::memory_order_relaxed);
+        maxMicroseconds_.store(0, std::memory_order_relaxed);
+    }
+
+    // ***** Statistics *****
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t bucketCount(int bucket) const { return buckets_[bucket].load(std::memory_order_relaxed); }
+    double maximum() const { return (double)maxMicroseconds_.load(std::memory_order_relaxed); }
+    double mean() const {
+        uint64_t c = count();
+        if(c == 0)
+            return 0;
+        return (double)totalMicroseconds_.load(std::memory_order_relaxed) / (double)c;
+    }
+
+    // Return the upper edge of the bucket containing the given percentile (0-100)
+    double percentile(double pct) const {
+        uint64_t c = count();
+        if(c == 0)
+            return 0;
+        uint64_t target = (uint64_t)ceil((double)c * pct / 100.0);
+        if(target == 0)
+            target = 1;
+        uint64_t running = 0;
+        for(int i = 0; i < kNumBuckets; i++) {
+            running += bucketCount(i);
+            if(running >= target)
+                return bucketUpperEdge(i);
+        }
+        return maximum();
+    }
+
+    // Lower and upper bounds (in microseconds) of each bucket
+    static double bucketLowerEdge(int bucket) {
+        if(bucket <= 0)
+            return 0;
+        if(bucket >= kNumBuckets - 1)
+            return ldexp(1.0, kOctaves);
+        int octave = (bucket - 1) / kSubBucketsPerOctave;
+        int sub = (bucket - 1) % kSubBucketsPerOctave;
+        return ldexp(1.0 + (double)sub / (double)kSubBucketsPerOctave, octave);
+    }
+    static double bucketUpperEdge(int bucket) {
+        if(bucket >= kNumBuckets - 1)
+            return std::numeric_limits<double>::infinity();
+        return bucketLowerEdge(bucket + 1);
+    }
+
+    // Print a summary followed by the non-empty buckets
+    void print(std::ostream& str, const char *name) const {
+        str << name << ": " << count() << " samples, mean " << mean() << "us, max " << maximum() << "us, ";
+        str << "p50 " << percentile(50) << "us, p99 " << percentile(99) << "us, p99.9 " << percentile(99.9) << "us\n";
+        for(int i = 0; i < kNumBuckets; i++) {
+            uint64_t c = bucketCount(i);
+            if(c == 0)
+                continue;
+            str << "  " << std::setw(10) << bucketLowerEdge(i) << " - " << std::setw(10) << bucketUpperEdge(i) << "us: " << c << '\n';
+        }
+    }
+
+private:
+    static int bucketForValue(double microseconds) {
+        if(!(microseconds >= 1.0))      // Also catches NaN
+            return 0;
+        int exponent;
+        double mantissa = frexp(microseconds, &exponent);   // microseconds = mantissa * 2^exponent, mantissa in [0.5, 1)
+        int octave = exponent - 1;
+        if(octave >= kOctaves)
+            return kNumBuckets - 1;
+        int sub = (int)((mantissa * 2.0 - 1.0) * kSubBucketsPerOctave);
+        return 1 + octave * kSubBucketsPerOctave + sub;
+    }
+
+    std::atomic<uint64_t> buckets_[kNumBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> totalMicroseconds_;
+    std::atomic<uint64_t> maxMicroseconds_;
+};
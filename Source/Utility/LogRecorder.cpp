@@ -0,0 +1,247 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LogRecorder.cpp: writes binary log records to disk on a background
+  thread, so the threads producing them never wait on the file system
+*/
+
+#include "LogRecorder.h"
+#include <algorithm>
+
+// ***** Stream *****
+
+LogRecorder::Stream::Stream(std::string const& filename, int ringSize)
+: filename_(filename), accepting_(false), activeWriters_(0),
+  recordsWritten_(0), recordsDropped_(0), recordsDroppedReported_(0), bytesWritten_(0)
+{
+    // Rings are allocated up front so write() never allocates
+    for(int i = 0; i < kLogRecorderMaxProducers; i++) {
+        producers_[i].owner = nullptr;
+        producers_[i].pushing = 0;
+        producers_[i].lastWrite = 0;
+        producers_[i].ring.reset(new Ring(ringSize));
+    }
+}
+
+bool LogRecorder::Stream::write(const void *data, int length) {
+    if(length <= 0 || length > kLogRecorderMaxRecordLength)
+        return false;
+
+    // Register as a writer before checking whether the stream is open, so
+    // closeStream() can wait for us to finish
+    activeWriters_++;
+    if(!accepting_) {
+        activeWriters_--;
+        return false;
+    }
+
+    juce::uint32 now = juce::Time::getMillisecondCounter();
+    Producer *producer = acquireProducer(juce::Thread::getCurrentThreadId(), now);
+    bool queued = false;
+
+    // Only whole records go into the ring. If there isn't room, drop the new record
+    // rather than blocking the caller.
+    if(producer != nullptr) {
+        Ring *ring = producer->ring.get();
+        if(ring != nullptr && ring->write_available() >= (size_t)length) {
+            ring->push((const unsigned char *)data, length);
+            queued = true;
+        }
+        producer->lastWrite.store(now, std::memory_order_relaxed);
+        releaseProducer(producer);
+    }
+
+    if(queued)
+        recordsWritten_.fetch_add(1, std::memory_order_relaxed);
+    else
+        recordsDropped_.fetch_add(1, std::memory_order_relaxed);
+
+    activeWriters_--;
+    return queued;
+}
+
+bool LogRecorder::Stream::holdProducer(Producer *producer, juce::Thread::ThreadID thisThread) {
+    // Announce the push before checking ownership. A thread taking the ring over changes
+    // the owner before waiting for pushing to reach zero, so either we see the new owner
+    // here or it waits for us to finish.
+    producer->pushing.fetch_add(1, std::memory_order_seq_cst);
+    if(producer->owner.load(std::memory_order_seq_cst) == thisThread)
+        return true;
+    releaseProducer(producer);
+    return false;
+}
+
+LogRecorder::Stream::Producer *LogRecorder::Stream::acquireProducer(juce::Thread::ThreadID thisThread, juce::uint32 now) {
+    for(int i = 0; i < kLogRecorderMaxProducers; i++) {
+        if(producers_[i].owner.load(std::memory_order_acquire) == thisThread
+           && holdProducer(&producers_[i], thisThread))
+            return &producers_[i];
+    }
+
+    // First record from this thread, or its ring was taken while it was idle: claim a
+    // free ring, or failing that one whose owner has stopped writing (most likely
+    // because the thread has ended).
+    for(int pass = 0; pass < 2; pass++) {
+        for(int i = 0; i < kLogRecorderMaxProducers; i++) {
+            Producer& producer = producers_[i];
+            juce::Thread::ThreadID expected = producer.owner.load(std::memory_order_acquire);
+
+            if(pass == 0 && expected != nullptr)
+                continue;
+            if(pass == 1 && (juce::uint32)(now - producer.lastWrite.load(std::memory_order_relaxed))
+                            < (juce::uint32)kLogRecorderProducerIdleMilliseconds)
+                continue;
+            if(!producer.owner.compare_exchange_strong(expected, thisThread, std::memory_order_seq_cst))
+                continue;
+
+            // The previous owner may be part way through a push; the ring only
+            // ever has one producer at a time.
+            while(producer.pushing.load(std::memory_order_acquire) != 0)
+                juce::Thread::yield();
+            producer.lastWrite.store(now, std::memory_order_relaxed);
+
+            if(holdProducer(&producer, thisThread))
+                return &producer;
+        }
+    }
+
+    // Every ring is in active use
+    return nullptr;
+}
+
+void LogRecorder::Stream::drain(unsigned char *buffer, int bufferSize) {
+    for(int i = 0; i < kLogRecorderMaxProducers; i++) {
+        Ring *ring = producers_[i].ring.get();
+        if(ring == nullptr)
+            continue;
+
+        // Records are published whole, so emptying the ring always ends on a
+        // record boundary and records from different threads don't mix.
+        size_t count;
+        while((count = ring->pop(buffer, bufferSize)) > 0) {
+            file_.write((const char *)buffer, count);
+            bytesWritten_.fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+}
+
+// ***** LogRecorder *****
+
+LogRecorder::LogRecorder()
+: juce::Thread("LogRecorder"), writeBuffer_(kLogRecorderWriteBufferSize)
+{
+}
+
+LogRecorder::~LogRecorder() {
+    closeAllStreams();
+}
+
+LogRecorder::Stream *LogRecorder::openStream(std::string const& filename, int ringSize) {
+    std::unique_ptr<Stream> stream(new Stream(filename, std::max(ringSize, kLogRecorderMaxRecordLength)));
+
+    stream->file_.open(filename.c_str(), std::ios::out | std::ios::binary);
+    if(!stream->file_.is_open())
+        return nullptr;
+
+    Stream *result = stream.get();
+    result->accepting_ = true;
+
+    {
+        juce::ScopedLock sl(streamsMutex_);
+        openStreams_.push_back(result);
+        allStreams_.push_back(std::move(stream));
+    }
+
+    if(!isThreadRunning())
+        startThread();
+
+    return result;
+}
+
+void LogRecorder::closeStream(Stream *stream) {
+    if(stream == nullptr)
+        return;
+
+    juce::ScopedLock sl(streamsMutex_);
+
+    std::vector<Stream*>::iterator it = std::find(openStreams_.begin(), openStreams_.end(), stream);
+    if(it == openStreams_.end())
+        return;
+    openStreams_.erase(it);
+
+    // Turn away new records and wait for any write() in progress to finish
+    stream->accepting_ = false;
+    while(stream->activeWriters_ > 0)
+        juce::Thread::yield();
+
+    stream->drain(writeBuffer_.data(), (int)writeBuffer_.size());
+    stream->file_.close();
+
+    // Nothing can write to the rings any more
+    for(int i = 0; i < kLogRecorderMaxProducers; i++)
+        stream->producers_[i].ring.reset();
+
+    reportDroppedRecords(stream);
+}
+
+void LogRecorder::closeAllStreams() {
+    std::vector<Stream*> streams;
+    {
+        juce::ScopedLock sl(streamsMutex_);
+        streams = openStreams_;
+    }
+
+    for(size_t i = 0; i < streams.size(); i++)
+        closeStream(streams[i]);
+
+    signalThreadShouldExit();
+    wakeEvent_.signal();
+    stopThread(1000);
+}
+
+void LogRecorder::run() {
+    juce::uint32 lastReport = juce::Time::getMillisecondCounter();
+
+    while(!threadShouldExit()) {
+        wakeEvent_.wait(kLogRecorderWriteIntervalMilliseconds);
+
+        juce::ScopedLock sl(streamsMutex_);
+        for(size_t i = 0; i < openStreams_.size(); i++)
+            openStreams_[i]->drain(writeBuffer_.data(), (int)writeBuffer_.size());
+
+        // Drops would otherwise only show up when the stream is closed
+        juce::uint32 now = juce::Time::getMillisecondCounter();
+        if((juce::uint32)(now - lastReport) >= (juce::uint32)kLogRecorderReportIntervalMilliseconds) {
+            for(size_t i = 0; i < openStreams_.size(); i++)
+                reportDroppedRecords(openStreams_[i]);
+            lastReport = now;
+        }
+    }
+}
+
+void LogRecorder::reportDroppedRecords(Stream *stream) {
+    unsigned long dropped = stream->recordsDropped();
+    if(dropped == stream->recordsDroppedReported_)
+        return;
+
+    std::string message = "LogRecorder: dropped " + std::to_string(dropped - stream->recordsDroppedReported_)
+                          + " records from " + stream->filename_ + " (" + std::to_string(dropped) + " in total)";
+    juce::Logger::writeToLog(message.c_str());
+    stream->recordsDroppedReported_ = dropped;
+}
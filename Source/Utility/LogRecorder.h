@@ -0,0 +1,149 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  LogRecorder.h: writes binary log records to disk on a background
+  thread, so the threads producing them never wait on the file system
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+const int kLogRecorderMaxProducers = 4;                 // Threads which can write to one stream
+const int kLogRecorderDefaultRingSize = 256 * 1024;     // Bytes buffered per producer
+const int kLogRecorderMaxRecordLength = 256;            // Largest record accepted by write()
+const int kLogRecorderWriteBufferSize = 64 * 1024;      // Size of each write to disk
+const int kLogRecorderWriteIntervalMilliseconds = 20;   // How often the writer thread drains the rings
+const int kLogRecorderProducerIdleMilliseconds = 1000;  // Idle time after which another thread may take a ring
+const int kLogRecorderReportIntervalMilliseconds = 1000; // How often dropped records are reported
+
+/*
+ * LogRecorder
+ *
+ * Owns a set of output files (streams) and a single writer thread. Each thread that
+ * writes to a stream gets its own single-producer ring, claimed the first time it writes,
+ * so write() never takes a lock or touches the disk. A ring whose owner hasn't written for
+ * kLogRecorderProducerIdleMilliseconds can be taken over by another thread, so threads
+ * which have ended (e.g. the I/O thread of a device that was restarted) don't keep their
+ * rings. Records go into a ring whole or not at all: if a ring is full, or every ring is
+ * in use, the new record is dropped and counted. The writer thread empties the rings into
+ * the file every kLogRecorderWriteIntervalMilliseconds in large sequential writes, and
+ * reports dropped records as they happen.
+ *
+ * Within a stream, records from one thread stay in order. Records from different threads
+ * are interleaved in the order the writer drains them, so each record should carry its
+ * own timestamp if the order between threads matters.
+ */
+
+class LogRecorder : public juce::Thread {
+public:
+    class Stream {
+        friend class LogRecorder;
+
+    public:
+        // Queue one record for writing. Safe to call from any thread, up to
+        // kLogRecorderMaxProducers of them. Returns false if the record was dropped.
+        bool write(const void *data, int length);
+
+        const std::string& filename() { return filename_; }
+
+        // ***** Statistics *****
+
+        unsigned long recordsWritten() { return recordsWritten_.load(std::memory_order_relaxed); }
+        unsigned long recordsDropped() { return recordsDropped_.load(std::memory_order_relaxed); }
+        unsigned long long bytesWritten() { return bytesWritten_.load(std::memory_order_relaxed); }
+
+    private:
+        typedef boost::lockfree::spsc_queue<unsigned char> Ring;
+
+        struct Producer {
+            std::atomic<juce::Thread::ThreadID> owner;  // Thread which writes to this ring
+            std::atomic<int> pushing;                   // Threads between claiming and releasing the ring
+            std::atomic<juce::uint32> lastWrite;        // Millisecond counter at the owner's last record
+            std::unique_ptr<Ring> ring;
+        };
+
+        Stream(std::string const& filename, int ringSize);
+
+        // Find, claim or take over a ring for the calling thread. On success the
+        // ring is held for pushing and must be given back with releaseProducer().
+        Producer *acquireProducer(juce::Thread::ThreadID thisThread, juce::uint32 now);
+        void releaseProducer(Producer *producer) { producer->pushing.fetch_sub(1, std::memory_order_acq_rel); }
+
+        // Hold the ring for pushing if the calling thread still owns it
+        bool holdProducer(Producer *producer, juce::Thread::ThreadID thisThread);
+
+        // Move everything in the rings to the file. Called only by the writer thread
+        // or with the stream closed to writers.
+        void drain(unsigned char *buffer, int bufferSize);
+
+        std::string filename_;
+        std::ofstream file_;
+        Producer producers_[kLogRecorderMaxProducers];
+        std::atomic<bool> accepting_;           // Whether write() accepts new records
+        std::atomic<int> activeWriters_;        // Threads currently inside write()
+
+        std::atomic<unsigned long> recordsWritten_;   // Records queued
+        std::atomic<unsigned long> recordsDropped_;   // Records lost because a ring was full or none was free
+        unsigned long recordsDroppedReported_;        // Drops already reported, used by the writer thread
+        std::atomic<unsigned long long> bytesWritten_; // Bytes written to the file
+    };
+
+    // ***** Constructor *****
+
+    LogRecorder();
+
+    // ***** Destructor *****
+
+    ~LogRecorder();
+
+    // ***** Streams *****
+
+    // Open a file for recording, starting the writer thread if needed. Returns
+    // nullptr if the file can't be opened. ringSize is the number of bytes buffered
+    // for each producing thread.
+    Stream *openStream(std::string const& filename, int ringSize = kLogRecorderDefaultRingSize);
+
+    // Stop accepting records, write everything already queued, and close the file.
+    // The Stream object stays valid (for its statistics) until the recorder is destroyed.
+    void closeStream(Stream *stream);
+
+    // Close every stream and stop the writer thread
+    void closeAllStreams();
+
+    // ***** Juce Thread method *****
+
+    void run();
+
+private:
+    // Log any records dropped since the last report. Called with streamsMutex_ held.
+    void reportDroppedRecords(Stream *stream);
+
+    juce::CriticalSection streamsMutex_;        // Protects the stream list and the files
+    std::vector<Stream*> openStreams_;          // Streams the writer thread drains
+    std::vector<std::unique_ptr<Stream> > allStreams_;  // Including closed streams
+    juce::WaitableEvent wakeEvent_;             // Wakes the writer thread early
+    std::vector<unsigned char> writeBuffer_;    // Used by whichever thread is draining
+};
@@ -30,11 +30,15 @@
 #pragma once
 
 #include "Trigger.h"
+#include "NodeRingBuffer.h"
 #include <boost/circular_buffer.hpp>
-#include <boost/lambda/lambda.hpp>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstddef>
 #include <stdint.h>
 
+const unsigned int kNodeSnapshotSpinAttempts = 100;	// Retries before a snapshot reader starts yielding to the writer
 
 template<typename OutputType> class NodeNonInterpolating;
 template<typename OutputType> class Node;
@@ -42,116 +46,86 @@ template<typename OutputType> class Node;
 /*
  * NodeIterator
  *
- * Abstract class that implements common functionality for all types of Sources and Filters
- * Modeled on (and contains) boost::cb_details::iterator
- * See boost/circular_buffer/details.hpp for more information
+ * Const iterator over the samples held in a Node. Modeled on boost::cb_details::iterator,
+ * but it holds the always-increasing sample index rather than a position in the storage,
+ * so it stays meaningful as the buffer wraps.
  *
  */
 
  // Custom iterator type to move through the Node buffer
-template <class OutputType, class Traits, class NonConstTraits>
+template <class OutputType>
 struct NodeIterator :
 	public boost::iterator<
 	std::random_access_iterator_tag,
-	typename Traits::value_type,
-	typename Traits::difference_type,
-	typename Traits::pointer,
-	typename Traits::reference>
+	OutputType,
+	std::ptrdiff_t,
+	const OutputType*,
+	const OutputType&>
 {
-	typedef boost::iterator<
-		std::random_access_iterator_tag,
-		typename Traits::value_type,
-		typename Traits::difference_type,
-		typename Traits::pointer,
-		typename Traits::reference> base_iterator;
-
 	typedef NodeNonInterpolating<OutputType> Buff;
 
-	typedef NodeIterator<Buff, typename Traits::nonconst_self, NonConstTraits> nonconst_self;
-	typedef typename boost::cb_details::iterator<boost::circular_buffer<OutputType>, NonConstTraits> cb_iterator;
-
-	typedef typename base_iterator::value_type value_type;
-	typedef typename base_iterator::pointer pointer;
-	typedef typename base_iterator::reference reference;
-	typedef typename Traits::size_type size_type;
-	typedef typename base_iterator::difference_type difference_type;
+	typedef OutputType value_type;
+	typedef const OutputType* pointer;
+	typedef const OutputType& reference;
+	typedef uint32_t size_type;
+	typedef std::ptrdiff_t difference_type;
 
 	// ***** Member Variables *****
 
 	// Pointer to the Node object
 	Buff* m_buff;
 
-	// Base (non-const) iterator to the circular buffer
-	cb_iterator m_cb_it;
+	// Sample index this iterator points to
+	size_type m_index;
 
 	// ***** Constructors *****
 
 	// Default constructor
-	NodeIterator() : m_buff( 0 ), m_cb_it( cb_iterator() ) {}
+	NodeIterator() : m_buff( 0 ), m_index( 0 ) {}
 
-	// Copy constructor
-	NodeIterator( const nonconst_self& it ) : m_cb_it( it.m_cb_it ) {}
-
-	// Constructor based on a circular_buffer iterator
-	NodeIterator( Buff* cb, const cb_iterator cb_it ) : m_buff( cb ), m_cb_it( cb_it ) {}
+	// Constructor based on a sample index
+	NodeIterator( Buff* buff, size_type index ) : m_buff( buff ), m_index( index ) {}
 
 	// ***** Operators *****
 	//
 	// Modeled on boost::cb_details::iterator (boost/circular_buffer/details.hpp)
 
-	NodeIterator& operator = ( const NodeIterator& it ) {
-		if( this == &it )
-			return *this;
-		m_buff = it.m_buff;
-		m_cb_it = it.m_cb_it;
-		return *this;
-	}
-
-	// Dereferencing operator.  We change the behavior here to evaluate missing values as needed.
-	// Note that this requires m_cb_it to be a non_const type, even if we are a const iterator.
-
-	reference operator * () const {
-		return *m_cb_it;
-		//reference val = *m_cb_it;
-		//if(!missing_value<OutputType>::isMissing(val))
-		//	return val;
-		//return (*m_cb_it = m_buff->evaluate(index()));
-	}
+	reference operator * () const { return m_buff->storage_.value( m_index ); }
 
 	pointer operator -> () const { return &( operator*() ); }
 
-	template <class Traits0, class Traits1>
-	difference_type operator - ( const NodeIterator<OutputType, Traits0, Traits1>& it ) const { return m_cb_it - it.m_cb_it; }
+	template <class OutputType0>
+	difference_type operator - ( const NodeIterator<OutputType0>& it ) const { return ( difference_type ) index() - ( difference_type ) it.index(); }
 
 	NodeIterator& operator ++ () {			// ++it
-		++m_cb_it;
+		++m_index;
 		return *this;
 	}
 	NodeIterator operator ++ ( int ) {		// it++
-		NodeIterator<OutputType, Traits, NonConstTraits> tmp = *this;
-		++m_cb_it;
+		NodeIterator<OutputType> tmp = *this;
+		++m_index;
 		return tmp;
 	}
 	NodeIterator& operator -- () {			// --it
-		--m_cb_it;
+		--m_index;
 		return *this;
 	}
 	NodeIterator operator -- ( int ) {		// it--
-		NodeIterator<OutputType, Traits, NonConstTraits> tmp = *this;
-		m_cb_it--;
+		NodeIterator<OutputType> tmp = *this;
+		m_index--;
 		return tmp;
 	}
 	NodeIterator& operator += ( difference_type n ) {		// it += n
-		m_cb_it += n;
+		m_index += ( size_type ) n;
 		return *this;
 	}
 	NodeIterator& operator -= ( difference_type n ) {		// it -= n
-		m_cb_it -= n;
+		m_index -= ( size_type ) n;
 		return *this;
 	}
 
-	NodeIterator operator + ( difference_type n ) const { return NodeIterator<OutputType, Traits, NonConstTraits>( *this ) += n; }
-	NodeIterator operator - ( difference_type n ) const { return NodeIterator<OutputType, Traits, NonConstTraits>( *this ) -= n; }
+	NodeIterator operator + ( difference_type n ) const { return NodeIterator<OutputType>( *this ) += n; }
+	NodeIterator operator - ( difference_type n ) const { return NodeIterator<OutputType>( *this ) -= n; }
 
 	reference operator [] ( difference_type n ) const { return *( *this + n ); }
 
@@ -161,39 +135,37 @@ struct NodeIterator :
 	// their respective buffers, even if they point to separate buffers.  When used on synchronized buffers, this allows
 	// us to evaluate which of two iterators points to the earlier event.
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator == ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const {
+	template <class OutputType0>
+	bool operator == ( const NodeIterator<OutputType0>& it ) const {
 		return index() == it.index();
 	}
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator != ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const {
+	template <class OutputType0>
+	bool operator != ( const NodeIterator<OutputType0>& it ) const {
 		return index() != it.index();
 	}
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator < ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const {
+	template <class OutputType0>
+	bool operator < ( const NodeIterator<OutputType0>& it ) const {
 		return index() < it.index();
 	}
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator > ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return it < *this; }
+	template <class OutputType0>
+	bool operator > ( const NodeIterator<OutputType0>& it ) const { return it < *this; }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator <= ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return !( it < *this ); }
+	template <class OutputType0>
+	bool operator <= ( const NodeIterator<OutputType0>& it ) const { return !( it < *this ); }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator >= ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return !( *this < it ); }
+	template <class OutputType0>
+	bool operator >= ( const NodeIterator<OutputType0>& it ) const { return !( *this < it ); }
 
 	// ***** Special Methods *****
 
-	// Return the offset within the buffer for this iterator's current location
+	// Return the index of the sample this iterator points to
 	// Can be used with at() or operator[], and can be used to compare relative locations
 	// of two iterators, even if they don't refer to the same buffer
 
-	size_type index() const {
-		return ( size_type ) ( *this - m_buff->begin() + m_buff->firstSampleIndex_ );
-	}
+	size_type index() const { return m_index; }
 
 	// Return the timestamp associated with the sample this iterator points to
 
@@ -230,28 +202,21 @@ struct NodeReverseIterator : public boost::reverse_iterator<T>
  * values and timestamps.  This is always a const iterator class.
  */
 
-template<typename OutputType, typename Traits>
+template<typename OutputType>
 struct NodeInterpolatedIterator :
 	public boost::iterator<
 	std::random_access_iterator_tag,
-	typename Traits::value_type,
-	typename Traits::difference_type,
-	typename Traits::pointer,
-	typename Traits::reference>
+	OutputType,
+	std::ptrdiff_t,
+	const OutputType*,
+	const OutputType&>
 {
-	typedef NodeInterpolatedIterator<OutputType, Traits> self_type;
+	typedef NodeInterpolatedIterator<OutputType> self_type;
 
-	typedef boost::iterator<
-		std::random_access_iterator_tag,
-		typename Traits::value_type,
-		typename Traits::difference_type,
-		typename Traits::pointer,
-		typename Traits::reference> base_iterator;
-
-	typedef typename Traits::size_type size_type;
-	typedef typename base_iterator::value_type value_type;
-	typedef typename base_iterator::pointer pointer;
-	typedef typename base_iterator::reference reference;
+	typedef uint32_t size_type;
+	typedef OutputType value_type;
+	typedef const OutputType* pointer;
+	typedef const OutputType& reference;
 
 	// ***** Member Variables *****
 
@@ -331,8 +296,8 @@ struct NodeInterpolatedIterator :
 		return *this;
 	}
 
-	self_type operator + ( double n ) const { return NodeInterpolatedIterator<OutputType, Traits>( *this ) += n; }
-	self_type operator - ( double n ) const { return NodeInterpolatedIterator<OutputType, Traits>( *this ) -= n; }
+	self_type operator + ( double n ) const { return NodeInterpolatedIterator<OutputType>( *this ) += n; }
+	self_type operator - ( double n ) const { return NodeInterpolatedIterator<OutputType>( *this ) -= n; }
 
 	reference operator [] ( double n ) const { return *( *this + n ); }
 
@@ -343,43 +308,43 @@ struct NodeInterpolatedIterator :
 	// they can be compared on the basis of the indices.  Of course, this is only meaningful if the two buffers are synchronized
 	// in time.
 
-	template<class OutputType0, class Traits0>
-	bool operator == ( const NodeInterpolatedIterator<OutputType0, Traits0>& it ) const { return m_index == it.m_index; }
+	template<class OutputType0>
+	bool operator == ( const NodeInterpolatedIterator<OutputType0>& it ) const { return m_index == it.m_index; }
 
-	template<class OutputType0, class Traits0>
-	bool operator != ( const NodeInterpolatedIterator<OutputType0, Traits0>& it ) const { return m_index != it.m_index; }
+	template<class OutputType0>
+	bool operator != ( const NodeInterpolatedIterator<OutputType0>& it ) const { return m_index != it.m_index; }
 
-	template<class OutputType0, class Traits0>
-	bool operator < ( const NodeInterpolatedIterator<OutputType0, Traits0>& it ) const { return m_index < it.m_index; }
+	template<class OutputType0>
+	bool operator < ( const NodeInterpolatedIterator<OutputType0>& it ) const { return m_index < it.m_index; }
 
-	template<class OutputType0, class Traits0>
-	bool operator > ( const NodeInterpolatedIterator<OutputType0, Traits0>& it ) const { return m_index > it.m_index; }
+	template<class OutputType0>
+	bool operator > ( const NodeInterpolatedIterator<OutputType0>& it ) const { return m_index > it.m_index; }
 
-	template<class OutputType0, class Traits0>
-	bool operator <= ( const NodeInterpolatedIterator<OutputType0, Traits0>& it ) const { return !( it < *this ); }
+	template<class OutputType0>
+	bool operator <= ( const NodeInterpolatedIterator<OutputType0>& it ) const { return !( it < *this ); }
 
-	template<class OutputType0, class Traits0>
-	bool operator >= ( const NodeInterpolatedIterator<OutputType0, Traits0>& it ) const { return !( *this < it ); }
+	template<class OutputType0>
+	bool operator >= ( const NodeInterpolatedIterator<OutputType0>& it ) const { return !( *this < it ); }
 
 	// We can also compare interpolated and non-interpolated iterators.
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator == ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return m_index == ( double ) it.index(); }
+	template <class OutputType0>
+	bool operator == ( const NodeIterator<OutputType0>& it ) const { return m_index == ( double ) it.index(); }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator != ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return m_index != ( double ) it.index(); }
+	template <class OutputType0>
+	bool operator != ( const NodeIterator<OutputType0>& it ) const { return m_index != ( double ) it.index(); }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator < ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return m_index < ( double ) it.index(); }
+	template <class OutputType0>
+	bool operator < ( const NodeIterator<OutputType0>& it ) const { return m_index < ( double ) it.index(); }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator > ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return m_index > ( double ) it.index(); }
+	template <class OutputType0>
+	bool operator > ( const NodeIterator<OutputType0>& it ) const { return m_index > ( double ) it.index(); }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator <= ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return m_index <= ( double ) it.index(); }
+	template <class OutputType0>
+	bool operator <= ( const NodeIterator<OutputType0>& it ) const { return m_index <= ( double ) it.index(); }
 
-	template <class OutputType0, class Traits0, class Traits1>
-	bool operator >= ( const NodeIterator<OutputType0, Traits0, Traits1>& it ) const { return m_index >= ( double ) it.index(); }
+	template <class OutputType0>
+	bool operator >= ( const NodeIterator<OutputType0>& it ) const { return m_index >= ( double ) it.index(); }
 
 	// ***** Special Methods *****
 
@@ -625,59 +590,36 @@ template<typename OutputType>
 class NodeNonInterpolating : public NodeBase
 {
 public:
-	// Useful type shorthands.  See <boost/circular_buffer.hpp> for details.
-	typedef typename boost::container::allocator_traits<std::allocator<OutputType> > Alloc;
-
-	typedef typename boost::circular_buffer<OutputType, Alloc>::value_type value_type;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::pointer pointer;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::const_pointer const_pointer;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::reference reference;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::const_reference const_reference;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::difference_type difference_type;
-	//typedef typename boost::circular_buffer<OutputType,Alloc>::size_type size_type;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::capacity_type capacity_type;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::array_range array_range;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::const_array_range const_array_range;
-	typedef typename boost::circular_buffer<OutputType, Alloc>::param_value_type return_value_type;
+	// Useful type shorthands, following <boost/circular_buffer.hpp>
+	typedef OutputType value_type;
+	typedef OutputType* pointer;
+	typedef const OutputType* const_pointer;
+	typedef OutputType& reference;
+	typedef const OutputType& const_reference;
+	typedef std::ptrdiff_t difference_type;
+	typedef typename NodeRingBuffer<OutputType>::size_type capacity_type;
+	typedef const OutputType& return_value_type;
 
 	// We only support const iterators.  (Modifying data in the buffer is restricted to only a few specialized instances.)
 
-	typedef NodeIterator<OutputType, boost::cb_details::const_traits<Alloc>,
-		boost::cb_details::nonconst_traits<Alloc> > const_iterator;
+	typedef NodeIterator<OutputType> const_iterator;
 	typedef const_iterator iterator;
 	typedef NodeReverseIterator<const_iterator> const_reverse_iterator;
 	typedef const_reverse_iterator reverse_iterator;
 
-	template<class O, class T, class NCT> friend struct NodeIterator;
+	template<class O> friend struct NodeIterator;
 
 	// ***** Constructors *****
 
-	//Node() : buffer_(0), insertMissingLastTimestamp_(0), numSamples_(0), firstSampleIndex_(0) {}	
-
 	// Recommended constructor: specify the capacity in samples
-	explicit NodeNonInterpolating( capacity_type capacity ) : insertMissingLastTimestamp_( 0 ), buffer_( 0 ), numSamples_( 0 ), firstSampleIndex_( 0 ) {
-		buffer_ = new boost::circular_buffer<OutputType>( capacity );
-		timestamps_ = new boost::circular_buffer<timestamp_type>( capacity );
-	}
+	explicit NodeNonInterpolating( capacity_type capacity ) : insertMissingLastTimestamp_( 0 ), sequence_( 0 ), storage_( capacity ) {}
 
 	// Copy constructor
-	NodeNonInterpolating( const NodeNonInterpolating<OutputType>& obj ) : numSamples_( obj.numSamples_ ), firstSampleIndex_( obj.firstSampleIndex_ ) {
-		if( obj.buffer_ != nullptr )
-			this->buffer_ = new boost::circular_buffer<OutputType>( *obj.buffer_ );
-		else
-			this->buffer_ = 0;
-		if( obj.timestamps_ != nullptr )
-			timestamps_ = new boost::circular_buffer<timestamp_type>( *obj.timestamps_ );
-		else
-			this->timestamps_ = 0;
-	}
+	NodeNonInterpolating( const NodeNonInterpolating<OutputType>& obj ) : insertMissingLastTimestamp_( 0 ), sequence_( 0 ), storage_( obj.storage_ ) {}
 
 	// ***** Destructor *****
 
-	virtual ~NodeNonInterpolating() {
-		delete buffer_;
-		delete timestamps_;
-	}
+	virtual ~NodeNonInterpolating() {}
 
 	// ***** Circular Buffer (STL) Methods *****
 	//
@@ -687,22 +629,22 @@ public:
 
 	// ***** Accessors *****
 
-	const_iterator begin() { return const_iterator( this, buffer_->begin() ); }
-	const_iterator end() { return const_iterator( this, buffer_->end() ); }
+	const_iterator begin() { return const_iterator( this, storage_.beginIndex() ); }
+	const_iterator end() { return const_iterator( this, storage_.endIndex() ); }
 	const_reverse_iterator rbegin() { return const_reverse_iterator( end() ); }
 	const_reverse_iterator rend() { return const_reverse_iterator( begin() ); }
 
-	const_iterator iteratorAtIndex( size_type index ) { return const_iterator( this, buffer_->begin() ) + ( index - firstSampleIndex_ ); }
+	const_iterator iteratorAtIndex( size_type index ) { return const_iterator( this, index ); }
 	const_reverse_iterator riteratorAtIndex( size_type index ) { return const_reverse_iterator( iteratorAtIndex( index + 1 ) ); }
 
-	return_value_type operator [] ( size_type index ) { return ( *( this->buffer_ ) )[ index - this->firstSampleIndex_ ]; }
-	return_value_type at( size_type index ) { return this->buffer_->at( index - this->firstSampleIndex_ ); }
-	return_value_type front() { return this->buffer_->front(); }
-	return_value_type back() { return this->buffer_->back(); }
+	return_value_type operator [] ( size_type index ) { return storage_.value( index ); }
+	return_value_type at( size_type index ) { return storage_.valueAt( index ); }
+	return_value_type front() { return storage_.value( storage_.beginIndex() ); }
+	return_value_type back() { return storage_.value( storage_.endIndex() - 1 ); }
 
 	// Two more convenience methods to avoid confusion about what front and back mean!
-	return_value_type earliest() { return this->buffer_->front(); }
-	return_value_type latest() { return this->buffer_->back(); }
+	return_value_type earliest() { return front(); }
+	return_value_type latest() { return back(); }
 
 	// In the following methods, check whether the value is missing and calculate it as necessary
 	// These methods return a value_type (i.e. not a reference, can't be used to modify the buffer.)
@@ -733,23 +675,23 @@ public:
 		return (buffer_->back() = evaluate(buffer_->size() - 1 + firstSampleIndex_));
 	}*/
 
-	size_type size() { return buffer_->size(); }					// Size: how many elements are currently in the buffer
-	bool empty() { return buffer_->empty(); }
-	bool full() { return buffer_->full(); }
-	size_type reserve() { return buffer_->reserve(); }				// Reserve: how many elements are left before the buffer is full
-	size_type capacity() const { return buffer_->capacity(); }		// Capacity: how many elements could be in the buffer
+	size_type size() { return storage_.size(); }					// Size: how many elements are currently in the buffer
+	bool empty() { return storage_.empty(); }
+	bool full() { return storage_.full(); }
+	size_type reserve() { return storage_.capacity() - storage_.size(); }	// Reserve: how many elements are left before the buffer is full
+	size_type capacity() const { return storage_.capacity(); }		// Capacity: how many elements could be in the buffer
 
-	size_type beginIndex() { return firstSampleIndex_; }					// Index of the first sample we still have in the buffer
-	size_type endIndex() { return firstSampleIndex_ + buffer_->size(); }	// Index just past the end of the buffer
+	size_type beginIndex() { return storage_.beginIndex(); }			// Index of the first sample we still have in the buffer
+	size_type endIndex() { return storage_.endIndex(); }				// Index just past the end of the buffer
 
 	// ***** Modifiers *****
 
 	// Clear all stored samples and timestamps
 	void clear() {
 		bufferAccessMutex_.enter();
-		timestamps_->clear();
-		buffer_->clear();
-		numSamples_ = firstSampleIndex_ = 0;
+		beginPublish();
+		storage_.clear();
+		endPublish();
 		bufferAccessMutex_.exit();
 
 		//notifyListenersOfClear();
@@ -758,11 +700,9 @@ public:
 	// Insert a new item into the buffer
 	void insert( const OutputType& item, timestamp_type timestamp ) {
 		this->bufferAccessMutex_.enter();
-		if( this->buffer_->full() )
-			this->firstSampleIndex_++;
-		this->timestamps_->push_back( timestamp );
-		this->buffer_->push_back( item );
-		this->numSamples_++;
+		this->beginPublish();
+		this->storage_.push_back( item, timestamp );
+		this->endPublish();
 		this->bufferAccessMutex_.exit();
 
 		// Notify anyone who's listening for a trigger
@@ -785,12 +725,104 @@ public:
 		this->notifyListenersOfInsert(timestamp);
 	}	*/
 
+	// ***** Lock-Free Snapshots *****
+	//
+	// Writers hold bufferAccessMutex_ against each other, and also bump a sequence counter before and after
+	// each change, leaving it odd while the change is under way.  A reader on another thread can copy samples
+	// out without taking the mutex: it notes the counter, copies, and starts again if the counter was odd or
+	// has moved on in the meantime.  Copying never blocks the writer, so these are the methods to use from
+	// threads other than the one inserting, in preference to lock_mutex() or the reference-returning accessors.
+
+	// Copy the latest sample and its timestamp.  Returns false if the buffer is empty.
+	bool snapshotLatest( OutputType& value, timestamp_type& timestamp ) {
+		for( unsigned int attempt = 0; ; attempt++ ) {
+			uint32_t sequence = readBegin( attempt );
+			bool available = !storage_.empty();
+			if( available ) {
+				value = storage_.value( storage_.endIndex() - 1 );
+				timestamp = storage_.timestamp( storage_.endIndex() - 1 );
+			}
+			if( readValidate( sequence ) )
+				return available;
+		}
+	}
+
+	bool snapshotLatest( OutputType& value ) {
+		timestamp_type timestamp;
+		return snapshotLatest( value, timestamp );
+	}
+
+	// Copy up to count samples starting at firstIndex, or at the oldest sample held if that is later, into the
+	// given arrays.  Either array may be null.  On return firstIndex holds the index of the first sample copied,
+	// and the number copied is returned.
+	size_type snapshot( size_type& firstIndex, size_type count, OutputType *values, timestamp_type *timestamps ) {
+		for( unsigned int attempt = 0; ; attempt++ ) {
+			uint32_t sequence = readBegin( attempt );
+			size_type first = std::max( firstIndex, storage_.beginIndex() );
+			size_type copied = 0;
+			for( size_type index = first; index < storage_.endIndex() && copied < count; index++, copied++ ) {
+				if( values != 0 )
+					values[ copied ] = storage_.value( index );
+				if( timestamps != 0 )
+					timestamps[ copied ] = storage_.timestamp( index );
+			}
+			if( readValidate( sequence ) ) {
+				firstIndex = first;
+				return copied;
+			}
+		}
+	}
+
+	// Copy the latest count samples, oldest first.  Returns the number copied, which is less than count if the
+	// buffer holds fewer samples.
+	size_type snapshotLatest( size_type count, OutputType *values, timestamp_type *timestamps, size_type *firstIndex = 0 ) {
+		for( unsigned int attempt = 0; ; attempt++ ) {
+			uint32_t sequence = readBegin( attempt );
+			size_type available = std::min( count, storage_.size() );
+			size_type first = storage_.endIndex() - available;
+			for( size_type i = 0; i < available; i++ ) {
+				if( values != 0 )
+					values[ i ] = storage_.value( first + i );
+				if( timestamps != 0 )
+					timestamps[ i ] = storage_.timestamp( first + i );
+			}
+			if( readValidate( sequence ) ) {
+				if( firstIndex != 0 )
+					*firstIndex = first;
+				return available;
+			}
+		}
+	}
+
 protected:
+	// Writers call these around each change to the storage, holding bufferAccessMutex_
+	void beginPublish() {
+		sequence_.store( sequence_.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+		std::atomic_thread_fence( std::memory_order_release );
+	}
+	void endPublish() {
+		sequence_.store( sequence_.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+	}
+
+	// Readers take the sequence before copying, waiting out any write in progress, and check it afterwards
+	uint32_t readBegin( unsigned int& attempt ) {
+		uint32_t sequence;
+		while( ( sequence = sequence_.load( std::memory_order_acquire ) ) & 1 ) {
+			if( ++attempt >= kNodeSnapshotSpinAttempts )
+				juce::Thread::yield();		// The writer may have been preempted mid-write
+		}
+		return sequence;
+	}
+	bool readValidate( uint32_t sequence ) {
+		std::atomic_thread_fence( std::memory_order_acquire );
+		return sequence_.load( std::memory_order_relaxed ) == sequence;
+	}
+
 	// Subclasses are allowed to change the values stored in their buffers.  Give this a different
 	// name to avoid confusion with the behavior of [] and at(), which call evaluate() if the sample
 	// is missing.
 
-	reference rawValueAt( size_type index ) { return ( *buffer_ )[ index - firstSampleIndex_ ]; }
+	reference rawValueAt( size_type index ) { return storage_.value( index ); }
 
 public:
 	// ***** Timestamp Methods *****
@@ -799,42 +831,42 @@ public:
 	// with the Source of any particular sample.  We also support methods to return an iterator to a piece of data most closely
 	// matching a given timestamp.
 
-	timestamp_type timestampAt( size_type index ) { return timestamps_->at( index - this->firstSampleIndex_ ); }
-	timestamp_type latestTimestamp() { return timestamps_->back(); }
-	timestamp_type earliestTimestamp() { return timestamps_->front(); }
+	timestamp_type timestampAt( size_type index ) { return storage_.timestampAt( index ); }
+	timestamp_type latestTimestamp() { return storage_.timestamp( storage_.endIndex() - 1 ); }
+	timestamp_type earliestTimestamp() { return storage_.timestamp( storage_.beginIndex() ); }
 
 	size_type indexNearestBefore( timestamp_type t ) {
-		boost::circular_buffer<timestamp_type>::iterator it = std::find_if( timestamps_->begin(), timestamps_->end(), t < boost::lambda::_1 );
-		if( it == timestamps_->end() )
-			return timestamps_->size() - 1 + this->firstSampleIndex_;
-		if( it - timestamps_->begin() == 0 )
-			return this->firstSampleIndex_;
-		return ( size_type ) ( ( --it ) - timestamps_->begin() ) + this->firstSampleIndex_;
+		size_type after = storage_.firstIndexAfter( t );
+		if( after == storage_.endIndex() )
+			return storage_.endIndex() - 1;
+		if( after == storage_.beginIndex() )
+			return storage_.beginIndex();
+		return after - 1;
 	}
 	size_type indexNearestAfter( timestamp_type t ) {
-		boost::circular_buffer<timestamp_type>::iterator it = std::find_if( timestamps_->begin(), timestamps_->end(), t < boost::lambda::_1 );
-		return std::min<size_type>( ( it - timestamps_->begin() ), timestamps_->size() - 1 ) + this->firstSampleIndex_;
+		size_type after = storage_.firstIndexAfter( t );
+		return std::min<size_type>( after - storage_.beginIndex(), storage_.size() - 1 ) + storage_.beginIndex();
 	}
 	size_type indexNearestTo( timestamp_type t ) {
-		boost::circular_buffer<timestamp_type>::iterator it = std::find_if( timestamps_->begin(), timestamps_->end(), t < boost::lambda::_1 );
-		if( it == timestamps_->end() )
-			return timestamps_->size() - 1 + this->firstSampleIndex_;
-		if( it - timestamps_->begin() == 0 )
-			return this->firstSampleIndex_;
-		timestamp_diff_type after = *it - t;		// Calculate the distance between the desired timestamp and the before/after values,
-		timestamp_diff_type before = t - *( it - 1 );	// then return whichever index gets closer to the target.
-		if( after < before )
-			return ( size_type ) ( it - timestamps_->begin() ) + this->firstSampleIndex_;
-		return ( size_type ) ( ( --it ) - timestamps_->begin() ) + this->firstSampleIndex_;
-	}
-
-	const_iterator nearestTo( timestamp_type t ) { return begin() + ( difference_type ) indexNearestTo( t ); }
-	const_iterator nearestBefore( timestamp_type t ) { return begin() + ( difference_type ) indexNearestBefore( t ); }
-	const_iterator nearestAfter( timestamp_type t ) { return begin() + ( difference_type ) indexNearestAfter( t ); }
-
-	const_reverse_iterator rnearestTo( timestamp_type t ) { return rend() - ( difference_type ) indexNearestTo( t ); }
-	const_reverse_iterator rnearestBefore( timestamp_type t ) { return rend() - ( difference_type ) indexNearestBefore( t ); }
-	const_reverse_iterator rnearestAfter( timestamp_type t ) { return rend() - ( difference_type ) indexNearestAfter( t ); }
+		size_type after = storage_.firstIndexAfter( t );
+		if( after == storage_.endIndex() )
+			return storage_.endIndex() - 1;
+		if( after == storage_.beginIndex() )
+			return storage_.beginIndex();
+		timestamp_diff_type afterDistance = storage_.timestamp( after ) - t;		// Calculate the distance between the desired timestamp and the before/after values,
+		timestamp_diff_type beforeDistance = t - storage_.timestamp( after - 1 );	// then return whichever index gets closer to the target.
+		if( afterDistance < beforeDistance )
+			return after;
+		return after - 1;
+	}
+
+	const_iterator nearestTo( timestamp_type t ) { return iteratorAtIndex( indexNearestTo( t ) ); }
+	const_iterator nearestBefore( timestamp_type t ) { return iteratorAtIndex( indexNearestBefore( t ) ); }
+	const_iterator nearestAfter( timestamp_type t ) { return iteratorAtIndex( indexNearestAfter( t ) ); }
+
+	const_reverse_iterator rnearestTo( timestamp_type t ) { return riteratorAtIndex( indexNearestTo( t ) ); }
+	const_reverse_iterator rnearestBefore( timestamp_type t ) { return riteratorAtIndex( indexNearestBefore( t ) ); }
+	const_reverse_iterator rnearestAfter( timestamp_type t ) { return riteratorAtIndex( indexNearestAfter( t ) ); }
 
 private:
 	// Calculate the actual value of one sample.  Behavior of this method will be different for Source and Filter types.
@@ -842,12 +874,10 @@ private:
 
 	timestamp_type insertMissingLastTimestamp_;	// The last timestamp that came from insertMissing(), so we can avoid duplication	
 
-protected:
-	boost::circular_buffer<OutputType>* buffer_;			// Internal buffer to store or cache values
-	boost::circular_buffer<timestamp_type>* timestamps_;	// Internal buffer to hold timestamps for each value
+	std::atomic<uint32_t> sequence_;			// Odd while a writer is changing storage_; see snapshot()
 
-	size_type numSamples_;							// How many samples total we've stored in this buffer
-	size_type firstSampleIndex_;					// Index of the first sample that still remains in the buffer
+protected:
+	NodeRingBuffer<OutputType> storage_;			// Values and their timestamps, by sample index
 };
 
 /*
@@ -861,8 +891,7 @@ template<typename OutputType>
 class Node : public NodeNonInterpolating<OutputType>
 {
 public:
-	typedef typename std::allocator<OutputType> Alloc;
-	typedef NodeInterpolatedIterator<OutputType, boost::cb_details::const_traits<Alloc> > interpolated_iterator;
+	typedef NodeInterpolatedIterator<OutputType> interpolated_iterator;
 
 	typedef typename NodeNonInterpolating<OutputType>::return_value_type return_value_type;
 	typedef typename NodeNonInterpolating<OutputType>::capacity_type capacity_type;
@@ -880,13 +909,13 @@ public:
 	// These overloaded methods allow querying a location between two samples, using linear
 	// interpolation to generate the value.
 
-	return_value_type interpolate( double index ) {
+	OutputType interpolate( double index ) {
 		size_type before = floor( index );				// Find the sample before the interpolated location
 		double frac = index - ( double ) before;			// Find the fractional remainder component
-		OutputType val1 = this->buffer_->at( before - this->firstSampleIndex_ );
+		OutputType val1 = this->storage_.valueAt( before );
 		if( before == this->endIndex() - 1 )
 			return val1;
-		OutputType val2 = this->buffer_->at( before + 1 - this->firstSampleIndex_ );
+		OutputType val2 = this->storage_.valueAt( before + 1 );
 		//if(missing_value<OutputType>::isMissing(val1))	// Make sure both values have been calculated
 		//	val1 = (buffer_->at(before-firstSampleIndex_) = evaluate(before));
 		//if(missing_value<OutputType>::isMissing(val2))
@@ -917,7 +946,7 @@ public:
 	// Timestamp --> fractional index
 	double interpolatedIndexForTimestamp( timestamp_type timestamp ) {
 		size_type before = this->indexNearestBefore( timestamp );
-		if( before >= this->timestamps_->size() - 1 + this->firstSampleIndex_ )		// If it's at the end of the buffer, return the last available timestamp
+		if( before >= this->endIndex() - 1 )		// If it's at the end of the buffer, return the last available timestamp
 			return ( double ) before;
 		timestamp_type beforeTimestamp = this->timestampAt( before );			// Get the timestamp immediately before
 		if( beforeTimestamp >= timestamp )								// If it comes after the requested timestamp, we're at the beginning of the buffer
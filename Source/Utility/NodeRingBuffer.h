@@ -0,0 +1,170 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  NodeRingBuffer.h: fixed-capacity ring buffer of values and timestamps,
+  addressed by an always-increasing sample index, for Node.
+*/
+
+#pragma once
+
+#include "Types.h"
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <stdint.h>
+
+/*
+ * NodeRingBuffer
+ *
+ * Storage behind NodeNonInterpolating. Timestamps and values live in one allocation, as an
+ * array of timestamps followed by an array of values, each with the capacity rounded up to a
+ * power of two so that a sample index maps to its slot with a mask rather than a division or
+ * a wraparound test. Keeping the timestamps together means searching them doesn't stride
+ * over the values, which for KeyTouchFrame are large.
+ *
+ * Indices count every sample ever pushed: the oldest sample held is beginIndex() and the
+ * next to be written is endIndex(). At most capacity() samples are held; the unused slots
+ * from rounding up are never read.
+ */
+
+template<typename OutputType>
+class NodeRingBuffer {
+public:
+	typedef uint32_t size_type;
+
+	// ***** Constructors *****
+
+	explicit NodeRingBuffer( size_type capacity )
+	: capacity_( capacity ), mask_( slotsForCapacity( capacity ) - 1 ), beginIndex_( 0 ), endIndex_( 0 ) {
+		allocate();
+		for( size_type i = 0; i <= mask_; i++ )
+			new ( &values_[ i ] ) OutputType();
+	}
+
+	NodeRingBuffer( NodeRingBuffer const& obj )
+	: capacity_( obj.capacity_ ), mask_( obj.mask_ ), beginIndex_( obj.beginIndex_ ), endIndex_( obj.endIndex_ ) {
+		allocate();
+		for( size_type i = 0; i <= mask_; i++ ) {
+			timestamps_[ i ] = obj.timestamps_[ i ];
+			new ( &values_[ i ] ) OutputType( obj.values_[ i ] );
+		}
+	}
+
+	// ***** Destructor *****
+
+	~NodeRingBuffer() {
+		for( size_type i = 0; i <= mask_; i++ )
+			values_[ i ].~OutputType();
+		::operator delete( block_ );
+	}
+
+	// ***** Size *****
+
+	size_type size() const { return endIndex_ - beginIndex_; }
+	size_type capacity() const { return capacity_; }
+	bool empty() const { return endIndex_ == beginIndex_; }
+	bool full() const { return size() == capacity_; }
+
+	size_type beginIndex() const { return beginIndex_; }
+	size_type endIndex() const { return endIndex_; }
+
+	// Whether the sample at this index is still held. Wraps correctly with the indices.
+	bool contains( size_type index ) const { return index - beginIndex_ < size(); }
+
+	// ***** Modifiers *****
+
+	// Add a sample, dropping the oldest if the buffer is full
+	void push_back( const OutputType& value, timestamp_type timestamp ) {
+		if( full() )
+			beginIndex_++;
+		timestamps_[ endIndex_ & mask_ ] = timestamp;
+		values_[ endIndex_ & mask_ ] = value;
+		endIndex_++;
+	}
+
+	void clear() { beginIndex_ = endIndex_ = 0; }
+
+	// ***** Access *****
+	//
+	// Unchecked: the index must be between beginIndex() and endIndex() - 1.
+
+	OutputType& value( size_type index ) { return values_[ index & mask_ ]; }
+	const OutputType& value( size_type index ) const { return values_[ index & mask_ ]; }
+	timestamp_type timestamp( size_type index ) const { return timestamps_[ index & mask_ ]; }
+
+	// Checked versions, throwing std::out_of_range like boost::circular_buffer::at()
+	const OutputType& valueAt( size_type index ) const {
+		if( !contains( index ) )
+			throw std::out_of_range( "NodeRingBuffer" );
+		return value( index );
+	}
+	timestamp_type timestampAt( size_type index ) const {
+		if( !contains( index ) )
+			throw std::out_of_range( "NodeRingBuffer" );
+		return timestamp( index );
+	}
+
+	// Index of the first sample whose timestamp is later than t, or endIndex() if none is.
+	// The held samples are at most two contiguous runs of slots, which are scanned in turn.
+	size_type firstIndexAfter( timestamp_type t ) const {
+		size_type count = size();
+		size_type start = beginIndex_ & mask_;
+		size_type firstRun = std::min<size_type>( count, mask_ + 1 - start );
+
+		for( size_type i = 0; i < firstRun; i++ ) {
+			if( t < timestamps_[ start + i ] )
+				return beginIndex_ + i;
+		}
+		for( size_type i = firstRun; i < count; i++ ) {
+			if( t < timestamps_[ i - firstRun ] )
+				return beginIndex_ + i;
+		}
+		return endIndex_;
+	}
+
+private:
+	NodeRingBuffer& operator=( NodeRingBuffer const& );
+
+	// Allocate the block: timestamps, then values at the next suitably aligned offset
+	void allocate() {
+		static_assert( alignof( OutputType ) <= alignof( std::max_align_t ), "Node value alignment not supported" );
+		size_t slots = ( size_t ) mask_ + 1;
+		size_t valuesOffset = slots * sizeof( timestamp_type );
+		valuesOffset = ( valuesOffset + alignof( OutputType ) - 1 ) / alignof( OutputType ) * alignof( OutputType );
+		block_ = ::operator new( valuesOffset + slots * sizeof( OutputType ) );
+		timestamps_ = static_cast<timestamp_type *>( block_ );
+		values_ = reinterpret_cast<OutputType *>( static_cast<unsigned char *>( block_ ) + valuesOffset );
+	}
+
+	static size_type slotsForCapacity( size_type capacity ) {
+		size_type slots = 1;
+		while( slots < capacity )
+			slots <<= 1;
+		return slots;
+	}
+
+	size_type capacity_;			// Most samples held at once
+	size_type mask_;				// Number of slots minus one
+	void *block_;					// Single allocation holding both arrays
+	timestamp_type *timestamps_;	// Timestamp of each slot, indexed by sample index & mask_
+	OutputType *values_;			// Value of each slot
+	size_type beginIndex_;			// Index of the oldest sample held
+	size_type endIndex_;			// Index the next sample will take
+};
@@ -0,0 +1,191 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+ 
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ 
+  =====================================================================
+
+  Pipeline.h: template classes fusing a chain of signal processing stages
+  into a single per-sample computation.
+*/
+
+#pragma once
+
+#include "Node.h"
+#include <cstddef>
+
+// A chain of Nodes, each registered for triggers from the last, keeps every intermediate signal in
+// its own buffer and passes each sample along through a virtual triggerReceived() call per stage.
+// A Pipeline instead composes its stages at compile time, so the whole chain is one inlined
+// computation per sample and only the final output (plus any PipelineTap placed in the chain)
+// is stored in a Node.
+//
+// A stage is any class providing:
+//
+//   typedef ... input_type;
+//   typedef ... output_type;
+//   output_type process(input_type const& sample, timestamp_type timestamp);
+//   void clear();          // Return to the state before any samples
+
+/*
+ * Pipeline
+ *
+ * The fused kernel: process() runs a sample through each stage in turn. The stages are held by
+ * value and can be reached with stage<N>() for setting parameters.
+ */
+
+template<class... Stages>
+class Pipeline;
+
+template<std::size_t N, class PipelineType>
+struct PipelineStage;
+
+template<class Last>
+class Pipeline<Last> {
+public:
+	typedef typename Last::input_type input_type;
+	typedef typename Last::output_type output_type;
+	
+	output_type process(input_type const& sample, timestamp_type timestamp) {
+		return first_.process(sample, timestamp);
+	}
+	
+	void clear() { first_.clear(); }
+	
+	Last& first() { return first_; }
+	
+	template<std::size_t N>
+	typename PipelineStage<N, Pipeline>::type& stage() { return PipelineStage<N, Pipeline>::get(*this); }
+	
+private:
+	Last first_;
+};
+
+template<class First, class... Rest>
+class Pipeline<First, Rest...> {
+public:
+	typedef typename First::input_type input_type;
+	typedef typename Pipeline<Rest...>::output_type output_type;
+	
+	output_type process(input_type const& sample, timestamp_type timestamp) {
+		return rest_.process(first_.process(sample, timestamp), timestamp);
+	}
+	
+	void clear() {
+		first_.clear();
+		rest_.clear();
+	}
+	
+	First& first() { return first_; }
+	Pipeline<Rest...>& rest() { return rest_; }
+	
+	template<std::size_t N>
+	typename PipelineStage<N, Pipeline>::type& stage() { return PipelineStage<N, Pipeline>::get(*this); }
+	
+private:
+	First first_;
+	Pipeline<Rest...> rest_;
+};
+
+// Compile-time lookup of the Nth stage of a Pipeline
+template<class First, class... Rest>
+struct PipelineStage<0, Pipeline<First, Rest...> > {
+	typedef First type;
+	static type& get(Pipeline<First, Rest...>& pipeline) { return pipeline.first(); }
+};
+
+template<std::size_t N, class First, class... Rest>
+struct PipelineStage<N, Pipeline<First, Rest...> > {
+	typedef typename PipelineStage<N - 1, Pipeline<Rest...> >::type type;
+	static type& get(Pipeline<First, Rest...>& pipeline) { return PipelineStage<N - 1, Pipeline<Rest...> >::get(pipeline.rest()); }
+};
+
+/*
+ * PipelineNode
+ *
+ * A Node holding the output of a Pipeline. Samples are given to process() rather than inserted
+ * into an input Node, and each output is inserted with the timestamp of its input, so listeners
+ * are triggered once per sample however many stages there are.
+ */
+
+template<class... Stages>
+class PipelineNode : public Node<typename Pipeline<Stages...>::output_type> {
+public:
+	typedef typename Pipeline<Stages...>::input_type input_type;
+	typedef typename Pipeline<Stages...>::output_type output_type;
+	typedef typename Node<output_type>::capacity_type capacity_type;
+	
+	// ***** Constructor *****
+	
+	PipelineNode(capacity_type capacity) : Node<output_type>(capacity) {}
+	
+	// ***** Modifiers *****
+	//
+	// Clearing the buffer also returns every stage to its initial state
+	
+	void clear() {
+		Node<output_type>::clear();
+		pipeline_.clear();
+	}
+	
+	// Run one sample through the stages and store the result
+	void process(input_type const& sample, timestamp_type timestamp) {
+		this->insert(pipeline_.process(sample, timestamp), timestamp);
+	}
+	
+	// ***** Stages *****
+	
+	Pipeline<Stages...>& pipeline() { return pipeline_; }
+	
+	template<std::size_t N>
+	typename PipelineStage<N, Pipeline<Stages...> >::type& stage() { return pipeline_.template stage<N>(); }
+	
+private:
+	Pipeline<Stages...> pipeline_;
+};
+
+/*
+ * PipelineTap
+ *
+ * A stage that passes its input through unchanged, also storing it in a Node owned by someone
+ * else. Placed in the middle of a Pipeline, it materializes an intermediate signal that needs
+ * to be read; stages that nobody reads are never stored.
+ */
+
+template<typename DataType>
+class PipelineTap {
+public:
+	typedef DataType input_type;
+	typedef DataType output_type;
+	
+	PipelineTap() : node_(0) {}
+	
+	// Set the Node to store samples in (0 to store nothing)
+	void setNode(Node<DataType>* node) { node_ = node; }
+	
+	output_type process(input_type const& sample, timestamp_type timestamp) {
+		if(node_ != 0)
+			node_->insert(sample, timestamp);
+		return sample;
+	}
+	
+	void clear() {
+		if(node_ != 0)
+			node_->clear();
+	}
+	
+private:
+	Node<DataType>* node_;
+};
@@ -0,0 +1,249 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  RealTimeProfile.cpp: optional real-time scheduling, core pinning and
+  memory locking for the threads on the path from sensor to output.
+*/
+
+#include "RealTimeProfile.h"
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+
+#if JUCE_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+std::atomic<bool> RealTimeProfile::enabled_(false);
+std::atomic<bool> RealTimeProfile::lockMemory_(true);
+std::atomic<int> RealTimeProfile::generation_(0);
+
+// Device I/O highest, since a missed read loses frames; OSC lowest
+std::atomic<int> RealTimeProfile::priorities_[kNumRealTimeRoles] = { {80}, {75}, {70}, {65}, {50}, {40} };
+std::atomic<int> RealTimeProfile::cores_[kNumRealTimeRoles] = { {-1}, {-1}, {-1}, {-1}, {-1}, {-1} };
+
+static std::atomic<bool> gRealTimeSchedulingWarned(false);
+static std::atomic<bool> gRealTimeMemoryLockWarned(false);
+
+void RealTimeProfile::setEnabled(bool enable) {
+    enabled_.store(enable, std::memory_order_relaxed);
+    updateMemoryLock();
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+void RealTimeProfile::setPriority(RealTimeThreadRole role, int priority) {
+    if(role < 0 || role >= kNumRealTimeRoles)
+        return;
+    if(priority < 1)
+        priority = 1;
+    if(priority > 99)
+        priority = 99;
+    priorities_[role].store(priority, std::memory_order_relaxed);
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+int RealTimeProfile::priority(RealTimeThreadRole role) {
+    if(role < 0 || role >= kNumRealTimeRoles)
+        return 0;
+    return priorities_[role].load(std::memory_order_relaxed);
+}
+
+void RealTimeProfile::setCore(RealTimeThreadRole role, int core) {
+    if(role < 0 || role >= kNumRealTimeRoles)
+        return;
+    if(core < 0 || core >= 32)      // Affinity masks are 32 bits
+        core = -1;
+    cores_[role].store(core, std::memory_order_relaxed);
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+int RealTimeProfile::core(RealTimeThreadRole role) {
+    if(role < 0 || role >= kNumRealTimeRoles)
+        return -1;
+    return cores_[role].load(std::memory_order_relaxed);
+}
+
+bool RealTimeProfile::setCoresFromString(juce::String const& cores) {
+    juce::StringArray tokens;
+    tokens.addTokens(cores, ",", "");
+    if(tokens.size() > kNumRealTimeRoles)
+        return false;
+    
+    int parsed[kNumRealTimeRoles];
+    for(int i = 0; i < kNumRealTimeRoles; i++) {
+        parsed[i] = -1;
+        if(i >= tokens.size())
+            continue;
+        juce::String token = tokens[i].trim();
+        if(token.isEmpty())
+            continue;
+        if(!token.containsOnly("-0123456789"))
+            return false;
+        parsed[i] = token.getIntValue();
+    }
+    
+    for(int i = 0; i < kNumRealTimeRoles; i++)
+        setCore((RealTimeThreadRole)i, parsed[i]);
+    return true;
+}
+
+juce::String RealTimeProfile::coresAsString() {
+    juce::String result;
+    for(int i = 0; i < kNumRealTimeRoles; i++) {
+        if(i > 0)
+            result += ",";
+        result += juce::String(core((RealTimeThreadRole)i));
+    }
+    return result;
+}
+
+void RealTimeProfile::setLockMemory(bool lock) {
+    lockMemory_.store(lock, std::memory_order_relaxed);
+    updateMemoryLock();
+}
+
+const char *RealTimeProfile::roleName(RealTimeThreadRole role) {
+    switch(role) {
+        case kRealTimeRoleDeviceIO:         return "device I/O";
+        case kRealTimeRoleFrameProcessing:  return "frame processing";
+        case kRealTimeRoleMappingScheduler: return "mapping scheduler";
+        case kRealTimeRoleScheduler:        return "scheduler";
+        case kRealTimeRoleLED:              return "LED";
+        case kRealTimeRoleOscServer:        return "OSC server";
+        default:                            return "none";
+    }
+}
+
+// Switch the calling thread to the role's scheduling, or back to normal if the
+// profile is off. Pinning is left alone when off, since the OS will have
+// spread the threads out already.
+void RealTimeProfile::applyToCurrentThread(RealTimeThreadRole role) {
+    if(role < 0 || role >= kNumRealTimeRoles)
+        return;
+    bool enabled = isEnabled();
+    
+#if !JUCE_WINDOWS
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    int policy = SCHED_OTHER;
+    if(enabled) {
+        policy = SCHED_FIFO;
+        param.sched_priority = priority(role);
+    }
+    int result = pthread_setschedparam(pthread_self(), policy, &param);
+    if(result != 0 && enabled && !gRealTimeSchedulingWarned.exchange(true)) {
+        std::cout << "RealTimeProfile: couldn't set SCHED_FIFO for the " << roleName(role)
+                  << " thread (" << strerror(result) << "); running at normal priority\n";
+    }
+#else
+    // No SCHED_FIFO on Windows; the nearest thing is the time-critical priority
+    SetThreadPriority(GetCurrentThread(), enabled ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL);
+#endif
+    
+    if(!enabled)
+        return;
+    
+    int pinnedCore = core(role);
+    if(pinnedCore >= 0)
+        juce::Thread::setCurrentThreadAffinityMask((juce::uint32)1 << pinnedCore);
+    
+    prefaultStack();
+}
+
+// Measure how late a thread of the given role wakes from a timed wait
+void RealTimeProfile::measureWakeupJitter(RealTimeThreadRole role, LatencyHistogram& histogram,
+                                          int wakeups, double periodMilliseconds) {
+    class JitterThread : public juce::Thread {
+    public:
+        JitterThread(RealTimeThreadRole role, LatencyHistogram& histogram, int wakeups, double period)
+        : juce::Thread("RealTimeProfile::jitter"), role_(role), histogram_(histogram),
+          wakeups_(wakeups), periodMilliseconds_(period) {}
+        
+        void run() {
+            RealTimeProfile::applyToCurrentThread(role_);
+            
+            // Nothing signals the event, so every wait runs to its timeout
+            juce::WaitableEvent event;
+            double targetTime = juce::Time::getMillisecondCounterHiRes();
+            for(int i = 0; i < wakeups_ && !threadShouldExit(); i++) {
+                targetTime += periodMilliseconds_;
+                int waitMilliseconds = (int)floor(targetTime - juce::Time::getMillisecondCounterHiRes() + 0.5);
+                if(waitMilliseconds > 0)
+                    event.wait(waitMilliseconds);
+                double lateness = juce::Time::getMillisecondCounterHiRes() - targetTime;
+                histogram_.addSample(lateness * 1000.0);
+                
+                // Don't let one long stall turn into a burst of zero-length waits
+                if(lateness > periodMilliseconds_)
+                    targetTime = juce::Time::getMillisecondCounterHiRes();
+            }
+        }
+        
+    private:
+        RealTimeThreadRole role_;
+        LatencyHistogram& histogram_;
+        int wakeups_;
+        double periodMilliseconds_;
+    };
+    
+    JitterThread thread(role, histogram, wakeups, periodMilliseconds);
+    thread.startThread();
+    thread.waitForThreadToExit(-1);
+}
+
+// Lock or unlock the process's memory to match the settings
+void RealTimeProfile::updateMemoryLock() {
+#if !JUCE_WINDOWS
+    static juce::CriticalSection lockMutex;
+    static bool locked = false;
+    juce::ScopedLock sl(lockMutex);
+    
+    bool shouldLock = isEnabled() && lockMemory();
+    if(shouldLock == locked)
+        return;
+    if(shouldLock) {
+        if(mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+            locked = true;
+        else if(!gRealTimeMemoryLockWarned.exchange(true))
+            std::cout << "RealTimeProfile: couldn't lock memory (" << strerror(errno) << ")\n";
+    }
+    else {
+        munlockall();
+        locked = false;
+    }
+#endif
+}
+
+// Write to the stack below the caller so its pages are mapped (and locked,
+// with mlockall) before the thread needs them
+#if defined(_MSC_VER)
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+void RealTimeProfile::prefaultStack() {
+    volatile unsigned char buffer[kRealTimeStackPrefaultBytes];
+    for(int i = 0; i < kRealTimeStackPrefaultBytes; i += 1024)
+        buffer[i] = 0;
+}
@@ -0,0 +1,119 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  RealTimeProfile.h: optional real-time scheduling, core pinning and
+  memory locking for the threads on the path from sensor to output.
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include "LatencyHistogram.h"
+
+// The threads the profile knows about
+enum RealTimeThreadRole {
+    kRealTimeRoleDeviceIO = 0,          // TouchkeyDevice serial I/O
+    kRealTimeRoleFrameProcessing,       // TouchkeyDevice frame pipeline
+    kRealTimeRoleMappingScheduler,      // MappingScheduler workers
+    kRealTimeRoleScheduler,             // PianoKeyboard's future event Scheduler
+    kRealTimeRoleLED,                   // TouchkeyDevice LED updates
+    kRealTimeRoleOscServer,             // liblo server thread
+    kNumRealTimeRoles,
+    kRealTimeRoleNone = kNumRealTimeRoles
+};
+
+const int kRealTimeStackPrefaultBytes = 64 * 1024;     // Stack touched when a thread takes on the profile
+const int kRealTimeJitterDefaultWakeups = 2000;
+const double kRealTimeJitterPeriodMilliseconds = 1.0;
+
+/*
+ * RealTimeProfile
+ *
+ * Process-wide settings, from the command line or the preferences, for how each thread
+ * role runs. When enabled, each thread switches itself to SCHED_FIFO at its role's
+ * priority, optionally pins itself to one core, and touches enough of its stack that
+ * the first burst of activity doesn't page fault. Enabling also locks the process into
+ * memory with mlockall(). Disabling returns the threads to normal scheduling.
+ *
+ * Threads apply the profile themselves: the long-running loops call applyIfChanged()
+ * on every pass, which costs one atomic load unless the settings have changed. Real-time
+ * scheduling usually needs privileges (CAP_SYS_NICE or an rtprio limit); if they're
+ * missing a message is printed once and the thread carries on at normal priority.
+ */
+
+class RealTimeProfile {
+public:
+    // ***** Settings *****
+
+    static void setEnabled(bool enable);
+    static bool isEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    // SCHED_FIFO priority for each role, 1-99
+    static void setPriority(RealTimeThreadRole role, int priority);
+    static int priority(RealTimeThreadRole role);
+
+    // Core to pin each role to, or -1 to leave it to the OS
+    static void setCore(RealTimeThreadRole role, int core);
+    static int core(RealTimeThreadRole role);
+
+    // Cores for every role as a comma-separated list in role order, e.g. "2,2,3,3,-1,-1".
+    // Missing entries mean no pinning. Returns false if the list can't be parsed.
+    static bool setCoresFromString(juce::String const& cores);
+    static juce::String coresAsString();
+
+    // Whether enabling the profile also locks the process into memory
+    static void setLockMemory(bool lock);
+    static bool lockMemory() { return lockMemory_.load(std::memory_order_relaxed); }
+
+    static const char *roleName(RealTimeThreadRole role);
+
+    // ***** Applying *****
+
+    // Apply the current settings to the calling thread
+    static void applyToCurrentThread(RealTimeThreadRole role);
+
+    // Apply the settings if they've changed since this thread last did. The thread keeps
+    // appliedGeneration, initialised to -1.
+    static void applyIfChanged(RealTimeThreadRole role, int& appliedGeneration) {
+        int generation = generation_.load(std::memory_order_acquire);
+        if(generation != appliedGeneration) {
+            appliedGeneration = generation;
+            applyToCurrentThread(role);
+        }
+    }
+
+    // ***** Benchmark *****
+
+    // Wake a new thread of the given role every periodMilliseconds, the way Scheduler waits
+    // for its next event, and record how late each wakeup was in microseconds.
+    static void measureWakeupJitter(RealTimeThreadRole role, LatencyHistogram& histogram,
+                                    int wakeups = kRealTimeJitterDefaultWakeups,
+                                    double periodMilliseconds = kRealTimeJitterPeriodMilliseconds);
+
+private:
+    static void updateMemoryLock();
+    static void prefaultStack();
+
+    static std::atomic<bool> enabled_;
+    static std::atomic<bool> lockMemory_;
+    static std::atomic<int> generation_;            // Incremented on every change
+    static std::atomic<int> priorities_[kNumRealTimeRoles];
+    static std::atomic<int> cores_[kNumRealTimeRoles];
+};
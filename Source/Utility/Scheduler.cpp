@@ -21,10 +21,22 @@
   thread in which these actions are executed.
 */
 
+
 #include "Scheduler.h"
 #undef DEBUG_SCHEDULER
 
 
+// Constructor. Preallocate the event pool so scheduling doesn't allocate.
+Scheduler::Scheduler(juce::String threadName)
+: juce::Thread(threadName), waitableEvent_(true), isRunning_(false),
+  virtualTimeEnabled_(false), virtualTimestamp_(0), threadRole_(kRealTimeRoleNone),
+  nextSequence_(0), executingSlot_(-1), executingCancelled_(false)
+{
+    events_.reserve(kSchedulerInitialCapacity);
+    heap_.reserve(kSchedulerInitialCapacity);
+    freeSlots_.reserve(kSchedulerInitialCapacity);
+}
+
 // Start the thread handling the scheduling.  Pass it an initial timestamp.
 void Scheduler::start(timestamp_type where) {
 	if(isRunning_)
@@ -49,75 +61,127 @@ void Scheduler::stop() {
 
 // Return the current timestamp, relative to this class's start time.
 timestamp_type Scheduler::currentTimestamp() {
+    if(virtualTimeEnabled_)
+        return virtualTimestamp_;
 	if(!isRunning_)
 		return 0;
     return milliseconds_to_timestamp( juce::Time::getMillisecondCounterHiRes() - startTimeMilliseconds_);
 	//return ptime_to_timestamp(microsec_clock::universal_time() - startTime_);
 }
 
+// Stop the thread and run on a virtual clock starting at the given timestamp.
+// Events already scheduled stay in the queue, as far in the future as they were.
+void Scheduler::startVirtualTime(timestamp_type where) {
+    timestamp_type now = currentTimestamp();
+    stop();
+    
+    juce::ScopedLock sl(eventMutex_);
+    rebaseEvents(now, where);
+    virtualTimestamp_ = where;
+    virtualTimeEnabled_ = true;
+}
+
+// Return to real time, restarting the thread with the clock at zero. Events
+// scheduled in virtual time keep their delay from the current virtual time.
+void Scheduler::stopVirtualTime() {
+    if(!virtualTimeEnabled_)
+        return;
+    
+    {
+        juce::ScopedLock sl(eventMutex_);
+        rebaseEvents(virtualTimestamp_, 0);
+        virtualTimeEnabled_ = false;
+    }
+    start(0);
+}
+
+// Run every event due at or before the given time, advancing the virtual clock
+// to each event's timestamp before it runs.
+void Scheduler::advanceTo(timestamp_type timestamp) {
+    if(!virtualTimeEnabled_)
+        return;
+    
+    juce::ScopedLock sl(eventMutex_);
+    
+    while(!heap_.empty() && events_[heap_[0]].timestamp <= timestamp) {
+        if(events_[heap_[0]].timestamp > virtualTimestamp_)
+            virtualTimestamp_ = events_[heap_[0]].timestamp;
+        runFirstEvent();
+    }
+    
+    if(timestamp > virtualTimestamp_)
+        virtualTimestamp_ = timestamp;
+}
+
+// Find the time of the next event; returns false if there are none
+bool Scheduler::nextEventTimestamp(timestamp_type& timestamp) {
+    juce::ScopedLock sl(eventMutex_);
+    
+    if(heap_.empty())
+        return false;
+    timestamp = events_[heap_[0]].timestamp;
+    return true;
+}
+
 // Schedule a new event
-void Scheduler::schedule(void *who, action func, timestamp_type timestamp) {
+Scheduler::Handle Scheduler::schedule(void *who, action const& func, timestamp_type timestamp) {
     juce::ScopedLock sl(eventMutex_);
     
 #ifdef DEBUG_SCHEDULER
     std::cerr << "Scheduler::schedule: " << who << ", " << timestamp << " (" << timestamp - currentTimestamp() << " from now)\n";
 #endif
     
-    // Check if this timestamp will become the next thing in the queue
-    bool newActionWillComeFirst = false;
-    if(events_.empty())
-        newActionWillComeFirst = true;
-    else if(timestamp < events_.begin()->first)
-        newActionWillComeFirst = true;
-    events_.insert(std::pair<timestamp_type,std::pair<void*, action> >
-					(timestamp, std::pair<void*, action>(who, func)));
-
+    int slot = allocateSlot();
+    Event& event = events_[slot];
+    event.timestamp = timestamp;
+    event.sequence = nextSequence_++;
+    event.who = who;
+    event.func = func;
+    heapInsert(slot);
+    
+    Handle handle;
+    handle.slot = slot;
+    handle.generation = event.generation;
+    
 	// Tell the thread to wake up and recheck its status if the
     // time of the next event has changed
-    if(newActionWillComeFirst)
+    if(heap_[0] == slot)
         waitableEvent_.signal();
+    
+    return handle;
 }
 
-// Remove an existing event
+// Remove existing events from a source: all of them if timestamp is 0, otherwise
+// only those at the given timestamp
 void Scheduler::unschedule(void *who, timestamp_type timestamp) {
 #ifdef DEBUG_SCHEDULER
     std::cerr << "Scheduler::unschedule: " << who << ", " << timestamp << std::endl;
 #endif
     juce::ScopedLock sl(eventMutex_);
     
-	// Find all events with this timestamp, and remove only the ones matching the given source
-    
-    if(timestamp == 0) {
-        // Remove all events from this source
-        auto it = events_.begin();
-        while(it != events_.end()) {
-#ifdef DEBUG_SCHEDULER
-            std::cerr << "| (" << it->first << ", " << it->second.first << ")\n";
-#endif
-            if(it->second.first == who) {
+    // Walk the heap from the end. Removing an event moves another into its position,
+    // so check the same position again before moving on.
+    int position = (int)heap_.size() - 1;
+    while(position >= 0) {
+        Event const& event = events_[heap_[position]];
+        if(event.who == who && (timestamp == 0 || event.timestamp == timestamp)) {
 #ifdef DEBUG_SCHEDULER
-                std::cerr << "--> erased " << it->first << ", " << it->second.first << ")\n";
+            std::cerr << "--> erased " << event.timestamp << ", " << event.who << ")\n";
 #endif
-                events_.erase(it++);
-            }
-            else
-                it++;
-        }
-    }
-    else {
-        // Remove only a specific event from this source with the given timestmap
-        auto it = events_.find(timestamp);
-        while(it != events_.end()) {
-            if(it->second.first == who) {
-#ifdef DEBUG_SCHEDULER
-                std::cerr << "--> erased " << it->first << ", " << it->second.first << ")\n";
-#endif
-                events_.erase(it++);
-            }
-            else
-                it++;
+            int slot = heap_[position];
+            heapRemove(position);
+            releaseSlot(slot);
+            if(position >= (int)heap_.size())
+                position = (int)heap_.size() - 1;
         }
+        else
+            position--;
     }
+    
+    // An event which is running right now shouldn't be requeued
+    if(executingSlot_ >= 0 && events_[executingSlot_].who == who &&
+       (timestamp == 0 || events_[executingSlot_].timestamp == timestamp))
+        executingCancelled_ = true;
 
 #ifdef DEBUG_SCHEDULER
     std::cerr << "Scheduler::unschedule: done\n";
@@ -125,11 +189,44 @@ void Scheduler::unschedule(void *who, timestamp_type timestamp) {
 	// No need to wake up the thread...
 }
 
+// Cancel one event by its handle
+bool Scheduler::unschedule(Handle& handle) {
+    if(!handle.isValid())
+        return false;
+    
+    juce::ScopedLock sl(eventMutex_);
+    
+    int slot = handle.slot;
+    bool cancelled = false;
+    
+    if(slot < (int)events_.size() && events_[slot].generation == handle.generation) {
+        if(events_[slot].heapIndex >= 0) {
+            heapRemove(events_[slot].heapIndex);
+            releaseSlot(slot);
+            cancelled = true;
+        }
+        else if(slot == executingSlot_) {
+            executingCancelled_ = true;
+            cancelled = true;
+        }
+    }
+    
+    handle = Handle();
+	// No need to wake up the thread...
+    return cancelled;
+}
+
 // Clear all events from the queue
 void Scheduler::clear() {
     juce::ScopedLock sl(eventMutex_);
     
-	events_.clear();
+    while(!heap_.empty()) {
+        int slot = heap_.back();
+        heapRemove((int)heap_.size() - 1);
+        releaseSlot(slot);
+    }
+    if(executingSlot_ >= 0)
+        executingCancelled_ = true;
 	
 	// No need to signal the condition variable.  If the thread is waiting, it can keep waiting.
 }
@@ -146,17 +243,19 @@ void Scheduler::run() {
 	//startTime_ = microsec_clock::universal_time();
     startTimeMilliseconds_ = juce::Time::getMillisecondCounterHiRes();
 	isRunning_ = true;
+    int profileGeneration = -1;
 	
     // This will run until the thread is interrupted (in the stop() method)
-    // events_ is ordered by increasing timestamp, so the next event to execute is always the first item.
+    // heap_ is ordered by increasing timestamp, so the next event to execute is always the first item.
     while(!threadShouldExit()) {
-        if(events_.empty())	{					// If there are no events in the queue, wait until we're signaled
+        RealTimeProfile::applyIfChanged(threadRole_, profileGeneration);
+        if(heap_.empty())	{					// If there are no events in the queue, wait until we're signaled
             eventMutex_.exit();                 // that a new one comes in.  Unlock the mutex and wait.
             waitableEvent_.wait();
             eventMutex_.enter();
         }
         else {
-            timestamp_type t = events_.begin()->first;				// Find the timestamp of the first event
+            timestamp_type t = events_[heap_[0]].timestamp;         // Find the timestamp of the first event
             double targetTimeMilliseconds = startTimeMilliseconds_ + timestamp_to_milliseconds(t);
             
             // Wait until that time arrives, provided it hasn't already
@@ -176,40 +275,155 @@ void Scheduler::run() {
         if(threadShouldExit())
             break;
         
-        // At this point, the mutex is locked.  We can change the contents of events_ without worrying about disrupting anything.
+        // At this point, the mutex is locked.  We can change the contents of the queue without worrying about disrupting anything.
         
-        if(events_.empty())				// Double check that we actually have an event to execute
+        if(heap_.empty())				// Double check that we actually have an event to execute
             continue;
-        if(currentTimestamp() + kAllowableAdvanceExecutionTime < events_.begin()->first) {
+        if(currentTimestamp() + kAllowableAdvanceExecutionTime < events_[heap_[0]].timestamp) {
 #ifdef DEBUG_SCHEDULER
-            std::cerr << "Scheduler::run: next event hasn't arrived (currently " << currentTimestamp() << ", waiting for " << events_.begin()->first << "\n";
+            std::cerr << "Scheduler::run: next event hasn't arrived (currently " << currentTimestamp() << ", waiting for " << events_[heap_[0]].timestamp << "\n";
 #endif
             continue;
         }
         
-        // Run the function that's stored, which takes no arguments and returns a timestamp
-        // of the next time this particular function should run.
-        auto it = events_.begin();
-        action actionFunction = (it->second).second;
-        //timestamp_type testingTimestamp = it->first;
-        void *who = it->second.first;
-        
+        runFirstEvent();
+    }
+    
+    eventMutex_.exit();
+}
+
+// Run the function that's stored, which takes no arguments and returns a timestamp
+// of the next time this particular function should run. Called with the mutex held.
+void Scheduler::runFirstEvent() {
+    int slot = heap_[0];
+    heapRemove(0);
+    
 #ifdef DEBUG_SCHEDULER
-        std::cerr << "Scheduler::run: " << who << ", " << it->first << std::endl;
+    std::cerr << "Scheduler::run: " << events_[slot].who << ", " << events_[slot].timestamp << std::endl;
 #endif
+    
+    // The slot stays allocated while the action runs so its handle can still
+    // cancel it. Copy the action since the pool may grow in the meantime.
+    executingSlot_ = slot;
+    executingCancelled_ = false;
+    action actionFunction = events_[slot].func;
+    
+    timestamp_type timeOfNextEvent = actionFunction();
+    
+    executingSlot_ = -1;
+    
+    if(timeOfNextEvent > 0 && !executingCancelled_) {
+        // Reschedule the same event for some (hopefully) future time,
+        // keeping its slot so existing handles stay valid
+        events_[slot].timestamp = timeOfNextEvent;
+        events_[slot].sequence = nextSequence_++;
+        heapInsert(slot);
+    }
+    else
+        releaseSlot(slot);
+}
+
+// ***** Slot and heap management *****
+
+int Scheduler::allocateSlot() {
+    if(!freeSlots_.empty()) {
+        int slot = freeSlots_.back();
+        freeSlots_.pop_back();
+        return slot;
+    }
+    
+    // Only grows when more events are pending than ever before
+    events_.push_back(Event());
+    Event& event = events_.back();
+    event.timestamp = 0;
+    event.sequence = 0;
+    event.who = nullptr;
+    event.heapIndex = -1;
+    event.generation = 0;
+    return (int)events_.size() - 1;
+}
+
+void Scheduler::releaseSlot(int slot) {
+    Event& event = events_[slot];
+    event.func.clear();
+    event.who = nullptr;
+    event.heapIndex = -1;
+    event.generation++;         // Invalidates outstanding handles
+    freeSlots_.push_back(slot);
+}
+
+// Move every queued event by the jump in the clock from oldNow to newNow, so each stays
+// the same time ahead of the clock. Events already due become due at newNow.
+void Scheduler::rebaseEvents(timestamp_type oldNow, timestamp_type newNow) {
+    for(size_t i = 0; i < heap_.size(); i++) {
+        Event& event = events_[heap_[i]];
+        timestamp_type ahead = (event.timestamp > oldNow ? event.timestamp - oldNow : 0);
+        event.timestamp = newNow + ahead;
+    }
+    
+    // Order is kept apart from overdue events, which now tie; restore it
+    for(int position = (int)heap_.size() / 2 - 1; position >= 0; position--)
+        heapSiftDown(position);
+}
+
+void Scheduler::heapInsert(int slot) {
+    heap_.push_back(slot);
+    events_[slot].heapIndex = (int)heap_.size() - 1;
+    heapSiftUp((int)heap_.size() - 1);
+}
+
+void Scheduler::heapRemove(int position) {
+    int last = (int)heap_.size() - 1;
+    events_[heap_[position]].heapIndex = -1;
+    
+    if(position != last) {
+        heap_[position] = heap_[last];
+        events_[heap_[position]].heapIndex = position;
+        heap_.pop_back();
         
-        timestamp_type timeOfNextEvent = actionFunction();
-        
-        // Remove the last event from the queue
-        events_.erase(it);
-        
-        if(timeOfNextEvent > 0) {
-            // Reschedule the same event for some (hopefully) future time.
-            events_.insert(std::pair<timestamp_type,std::pair<void*, action> >
-                           (timeOfNextEvent,
-                            std::pair<void*, action>(who, actionFunction)));
-        }
+        // The moved event may belong either above or below its new position
+        if(position > 0 && eventComesBefore(heap_[position], heap_[(position - 1) / 2]))
+            heapSiftUp(position);
+        else
+            heapSiftDown(position);
     }
+    else
+        heap_.pop_back();
+}
+
+void Scheduler::heapSiftUp(int position) {
+    while(position > 0) {
+        int parent = (position - 1) / 2;
+        if(!eventComesBefore(heap_[position], heap_[parent]))
+            break;
+        heapSwap(position, parent);
+        position = parent;
+    }
+}
+
+void Scheduler::heapSiftDown(int position) {
+    int size = (int)heap_.size();
     
-    eventMutex_.exit();
-}
\ No newline at end of file
+    while(true) {
+        int left = 2 * position + 1;
+        int right = left + 1;
+        int smallest = position;
+        
+        if(left < size && eventComesBefore(heap_[left], heap_[smallest]))
+            smallest = left;
+        if(right < size && eventComesBefore(heap_[right], heap_[smallest]))
+            smallest = right;
+        if(smallest == position)
+            break;
+        heapSwap(position, smallest);
+        position = smallest;
+    }
+}
+
+void Scheduler::heapSwap(int a, int b) {
+    int slot = heap_[a];
+    heap_[a] = heap_[b];
+    heap_[b] = slot;
+    events_[heap_[a]].heapIndex = a;
+    events_[heap_[b]].heapIndex = b;
+}
@@ -24,11 +24,14 @@
 #pragma once
 
 #include "Types.h"
+#include "InlineFunction.h"
+#include "RealTimeProfile.h"
 #include <JuceHeader.h>
 #include <boost/bind.hpp>
-#include <boost/function.hpp>
 #include <iostream>
-#include <map>
+#include <vector>
+
+const int kSchedulerInitialCapacity = 256;      // Events that can be pending before any allocation
 
 /*
  * Scheduler
@@ -37,11 +40,26 @@
  * It maintains a list of future events, ordered by timestamp.  A dedicated thread scans the
  * list, and when it is time for an event to occur, the thread wakes up, executes it, deletes
  * it from the list, and goes back to sleep.
+ *
+ * Events live in a pool of reusable slots, ordered by an indexed binary heap on (timestamp,
+ * insertion order), and their actions are stored inline, so scheduling doesn't allocate once
+ * the pool is warm. schedule() returns a Handle which cancels that one event in O(log n).
+ * An event which reschedules itself by returning a new timestamp keeps its handle.
  */
 
 class Scheduler : public juce::Thread {
 public:	
-	typedef boost::function<timestamp_type ()> action;
+	typedef InlineFunction<timestamp_type ()> action;
+    
+    // Identifies one scheduled event. Stale handles (the event has run or been
+    // cancelled) are detected and ignored.
+    struct Handle {
+        Handle() : slot(-1), generation(0) {}
+        bool isValid() const { return slot >= 0; }
+        
+        int slot;
+        unsigned int generation;
+    };
     
 private:
     static constexpr timestamp_diff_type kAllowableAdvanceExecutionTime = milliseconds_to_timestamp( 1.0 );
@@ -51,7 +69,7 @@ public:
 	//
 	// Note: This class is not copy-constructable.
 	
-	Scheduler(juce::String threadName = "Scheduler") : juce::Thread(threadName), waitableEvent_(true), isRunning_(false) {}
+	Scheduler(juce::String threadName = "Scheduler");
 	
 	// ***** Destructor *****
 	
@@ -66,30 +84,88 @@ public:
 	
 	bool isRunning() { return isRunning_; }
 	timestamp_type currentTimestamp();
+    
+    // Which RealTimeProfile settings the thread follows; kRealTimeRoleNone by default
+    void setThreadRole(RealTimeThreadRole role) { threadRole_ = role; }
+	
+	// ***** Virtual Time Methods *****
+	//
+	// In virtual time the thread is stopped and the clock only moves when advanceTo() is
+	// called, which runs the events due by then on the calling thread. Used for replaying
+	// recorded data deterministically and faster than real time.
+	
+	void startVirtualTime(timestamp_type where);
+	void stopVirtualTime();
+	bool virtualTimeEnabled() { return virtualTimeEnabled_; }
+	
+	// Run every event due at or before the given time, in order, then set the clock to it
+	void advanceTo(timestamp_type timestamp);
+	
+	// Find the time of the next event; returns false if there are none
+	bool nextEventTimestamp(timestamp_type& timestamp);
 	
 	// ***** Event Management Methods *****
 	//
 	// This interface provides the ability to schedule and unschedule events for
 	// future times.
 	
-	void schedule(void *who, action func, timestamp_type timestamp);
+	Handle schedule(void *who, action const& func, timestamp_type timestamp);
 	void unschedule(void *who, timestamp_type timestamp = 0);
 	void clear();
+    
+    // Cancel one event, leaving the handle invalid. Returns false if it had already
+    // run or been cancelled.
+    bool unschedule(Handle& handle);
 	
 	//static void staticRunLoop(Scheduler* sch, timestamp_type starting_timestamp) { sch->runLoop(starting_timestamp); }
 	
     // The main Thread run loop
 	void run();
 
-private:    
+private:
+    struct Event {
+        timestamp_type timestamp;
+        unsigned long sequence;     // Insertion order, so equal timestamps run first-in first-out
+        void *who;                  // Owner, for unscheduling by owner
+        action func;
+        int heapIndex;              // Position in heap_, or -1 if not queued
+        unsigned int generation;    // Incremented each time the slot is released
+    };
+    
+    // Slot and heap management. Must be called with the mutex held.
+    int allocateSlot();
+    void releaseSlot(int slot);
+    bool eventComesBefore(int slotA, int slotB) {
+        Event const& a = events_[slotA];
+        Event const& b = events_[slotB];
+        return a.timestamp < b.timestamp || (a.timestamp == b.timestamp && a.sequence < b.sequence);
+    }
+    void heapInsert(int slot);
+    void heapRemove(int position);
+    void heapSiftUp(int position);
+    void heapSiftDown(int position);
+    void heapSwap(int a, int b);
+    void rebaseEvents(timestamp_type oldNow, timestamp_type newNow);
+    
+    // Remove the first event and run it, requeueing it if it asks to run again
+    void runFirstEvent();
+    
 	// These variables keep track of the status of the separate thread running the events
     juce::CriticalSection eventMutex_;
 	juce::WaitableEvent waitableEvent_;
     timestamp_type startingTimestamp_;
 	bool isRunning_;
+	bool virtualTimeEnabled_;
+	timestamp_type virtualTimestamp_;   // Current time when virtualTimeEnabled_ is set
+	RealTimeThreadRole threadRole_;     // RealTimeProfile role of the thread
 	
 	// Collection of future events to execute
 	//boost::posix_time::ptime startTime_;
     double startTimeMilliseconds_;
-	std::multimap<timestamp_type, std::pair<void*, action> > events_;
+    std::vector<Event> events_;         // Slot pool, indexed by Handle::slot
+    std::vector<int> heap_;             // Queued slots, earliest first
+    std::vector<int> freeSlots_;        // Slots available for reuse
+    unsigned long nextSequence_;
+    int executingSlot_;                 // Slot whose action is running, or -1
+    bool executingCancelled_;           // Whether that event was cancelled while running
 };
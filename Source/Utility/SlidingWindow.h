@@ -0,0 +1,361 @@
+/*
+  TouchKeys: multi-touch musical keyboard control software
+  Copyright (c) 2013 Andrew McPherson
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =====================================================================
+
+  SlidingWindow.h: running statistics over the most recent samples of
+  a Node, each updated in constant amortized time per sample.
+*/
+
+#pragma once
+
+#include "Node.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// The operators below follow a Node by sample index rather than by trigger. Each remembers the
+// index of the next sample it hasn't seen, and update() catches up with whatever the Node has
+// gained since, so an operator can be brought up to date on every sample or only when it is
+// needed. Samples which have fallen out of the window (or out of the Node) before being seen
+// are skipped, and a Node which has been cleared since the last update starts the operator over.
+
+/*
+ * SlidingWindowMinMax
+ *
+ * Minimum and maximum of the last N samples. Each is kept as a monotonic deque of (index, value)
+ * pairs: a new sample removes any older entries it dominates, so the front of each deque is the
+ * extreme of the window, and every sample is added and removed at most once.
+ */
+
+template<typename DataType>
+class SlidingWindowMinMax {
+public:
+	typedef NodeBase::size_type size_type;
+
+	// ***** Constructor *****
+
+	explicit SlidingWindowMinMax(size_type window)
+	: window_(window > 0 ? window : 1), minimum_(window_), maximum_(window_) {
+		clear();
+	}
+
+	// ***** Modifiers *****
+
+	void clear() {
+		minimum_.clear();
+		maximum_.clear();
+		nextIndex_ = 0;
+	}
+
+	// Add the sample with the given index, which must be later than any added before
+	void push(size_type index, DataType value) {
+		minimum_.evictBefore(index, window_);
+		maximum_.evictBefore(index, window_);
+		while(!minimum_.empty() && !(minimum_.back().value < value))
+			minimum_.popBack();
+		while(!maximum_.empty() && !(value < maximum_.back().value))
+			maximum_.popBack();
+		minimum_.pushBack(index, value);
+		maximum_.pushBack(index, value);
+		nextIndex_ = index + 1;
+	}
+
+	// Catch up with the samples added to a Node since the last update
+	template<class NodeType>
+	void update(NodeType& node) {
+		size_type endIndex = node.endIndex();
+		if(endIndex < nextIndex_)
+			clear();
+		size_type index = std::max(nextIndex_, node.beginIndex());
+		if(endIndex - index > window_)
+			index = endIndex - window_;
+		for(; index < endIndex; index++)
+			push(index, node[index]);
+	}
+
+	// ***** Accessors *****
+	//
+	// Only valid when the window isn't empty.
+
+	bool empty() { return maximum_.empty(); }
+	DataType minimum() { return minimum_.front().value; }
+	DataType maximum() { return maximum_.front().value; }
+	size_type minimumIndex() { return minimum_.front().index; }
+	size_type maximumIndex() { return maximum_.front().index; }
+	DataType range() { return maximum() - minimum(); }
+
+	size_type window() { return window_; }
+	size_type nextIndex() { return nextIndex_; }
+
+private:
+	struct Entry {
+		size_type index;
+		DataType value;
+	};
+
+	// Fixed-capacity deque of entries; never holds more than the window
+	class Deque {
+	public:
+		explicit Deque(size_type capacity) : entries_(capacity), head_(0), size_(0) {}
+
+		void clear() { head_ = size_ = 0; }
+		bool empty() { return size_ == 0; }
+		Entry& front() { return entries_[head_]; }
+		Entry& back() { return entries_[(head_ + size_ - 1) % entries_.size()]; }
+		void popBack() { size_--; }
+		void pushBack(size_type index, DataType value) {
+			Entry& entry = entries_[(head_ + size_) % entries_.size()];
+			entry.index = index;
+			entry.value = value;
+			size_++;
+		}
+
+		// Drop entries which will be outside the window once the given index is added
+		void evictBefore(size_type index, size_type window) {
+			while(size_ > 0 && index - entries_[head_].index >= window) {
+				head_ = (head_ + 1) % entries_.size();
+				size_--;
+			}
+		}
+
+	private:
+		std::vector<Entry> entries_;
+		size_type head_, size_;
+	};
+
+	size_type window_;          // Number of samples covered
+	Deque minimum_, maximum_;   // Candidates for each extreme, oldest first
+	size_type nextIndex_;       // Index of the next sample expected
+};
+
+/*
+ * SlidingWindowStatistics
+ *
+ * Mean and variance of the last N samples using Welford's method: a sample entering the full
+ * window replaces the one leaving it in a single update of the mean and the sum of squared
+ * differences. Rounding error from the replacements is discarded by recomputing both from the
+ * stored samples once per window's worth of samples, which is still constant time amortized.
+ */
+
+template<typename DataType>
+class SlidingWindowStatistics {
+public:
+	typedef NodeBase::size_type size_type;
+
+	// ***** Constructor *****
+
+	explicit SlidingWindowStatistics(size_type window)
+	: window_(window > 0 ? window : 1), samples_(window_) {
+		clear();
+	}
+
+	// ***** Modifiers *****
+
+	void clear() {
+		count_ = head_ = replacementsSinceRecalculation_ = 0;
+		mean_ = sumOfSquares_ = 0;
+		nextIndex_ = 0;
+	}
+
+	// Add the sample with the given index, which must follow the previous one
+	void push(size_type index, DataType value) {
+		double x = (double)value;
+
+		if(count_ < window_) {
+			samples_[(head_ + count_) % window_] = value;
+			count_++;
+			double delta = x - mean_;
+			mean_ += delta / (double)count_;
+			sumOfSquares_ += delta * (x - mean_);
+		}
+		else {
+			double y = (double)samples_[head_];
+			samples_[head_] = value;
+			head_ = (head_ + 1) % window_;
+
+			double previousMean = mean_;
+			mean_ += (x - y) / (double)window_;
+			sumOfSquares_ += (x - y) * (x - mean_ + y - previousMean);
+
+			if(++replacementsSinceRecalculation_ >= window_)
+				recalculate();
+		}
+		if(sumOfSquares_ < 0)
+			sumOfSquares_ = 0;
+		nextIndex_ = index + 1;
+	}
+
+	// Catch up with the samples added to a Node since the last update
+	template<class NodeType>
+	void update(NodeType& node) {
+		size_type endIndex = node.endIndex();
+		if(endIndex < nextIndex_)
+			clear();
+		size_type index = std::max(nextIndex_, node.beginIndex());
+		if(endIndex - index > window_)
+			index = endIndex - window_;
+		if(index != nextIndex_)
+			clear();    // Samples were missed, so the window starts over
+		for(; index < endIndex; index++)
+			push(index, node[index]);
+	}
+
+	// ***** Accessors *****
+
+	size_type count() { return count_; }        // Samples in the window, up to its length
+	size_type window() { return window_; }
+	size_type nextIndex() { return nextIndex_; }
+
+	double mean() { return mean_; }
+	double variance() { return count_ > 0 ? sumOfSquares_ / (double)count_ : 0; }    // Population variance
+	double standardDeviation() { return sqrt(variance()); }
+
+	// Average absolute deviation from the mean. This one visits every sample in the window.
+	double averageDeviation() {
+		double total = 0;
+		for(size_type i = 0; i < count_; i++)
+			total += fabs((double)samples_[(head_ + i) % window_] - mean_);
+		return count_ > 0 ? total / (double)count_ : 0;
+	}
+
+private:
+	// Two-pass recalculation from the stored samples
+	void recalculate() {
+		double total = 0;
+		for(size_type i = 0; i < count_; i++)
+			total += (double)samples_[i];
+		mean_ = total / (double)count_;
+		sumOfSquares_ = 0;
+		for(size_type i = 0; i < count_; i++) {
+			double delta = (double)samples_[i] - mean_;
+			sumOfSquares_ += delta * delta;
+		}
+		replacementsSinceRecalculation_ = 0;
+	}
+
+	size_type window_;                          // Number of samples covered
+	std::vector<DataType> samples_;             // The samples in the window, oldest at head_
+	size_type count_, head_;
+	double mean_, sumOfSquares_;                // Running mean and sum of squared differences from it
+	size_type replacementsSinceRecalculation_;
+	size_type nextIndex_;                       // Index of the next sample expected
+};
+
+/*
+ * ThresholdCrossingTracker
+ *
+ * Remembers the most recent sample meeting a comparison against a threshold (for example, the
+ * last time the key was at or above a given position), and whether the latest sample meets it.
+ * Since only the most recent match matters, update() examines the new samples from the latest
+ * backwards and stops at the first match, so each sample is examined at most once between
+ * changes of threshold, and never more often than a backwards search would.
+ */
+
+template<typename DataType>
+class ThresholdCrossingTracker {
+public:
+	typedef NodeBase::size_type size_type;
+
+	enum {
+		kComparisonAtOrAbove = 0,
+		kComparisonAtOrBelow,
+		kComparisonAbove,
+		kComparisonBelow
+	};
+
+	// ***** Constructor *****
+
+	ThresholdCrossingTracker(DataType threshold, int comparison)
+	: threshold_(threshold), comparison_(comparison) {
+		clear();
+	}
+
+	// ***** Threshold *****
+
+	DataType threshold() { return threshold_; }
+
+	// Changing the threshold forgets the samples seen so far
+	void setThreshold(DataType threshold) {
+		if(threshold == threshold_)
+			return;
+		threshold_ = threshold;
+		clear();
+	}
+
+	bool meets(DataType value) {
+		switch(comparison_) {
+			case kComparisonAtOrAbove: return value >= threshold_;
+			case kComparisonAtOrBelow: return value <= threshold_;
+			case kComparisonAbove:     return value > threshold_;
+			default:                   return value < threshold_;
+		}
+	}
+
+	// ***** Modifiers *****
+
+	void clear() {
+		found_ = latestMeets_ = false;
+		mostRecentIndex_ = nextIndex_ = 0;
+	}
+
+	// Catch up with samples up to (not including) endIndex, reading each one with
+	// valueAt(index). Samples before firstIndex are never examined, which is how a
+	// caller limits the search to the part of the history it cares about.
+	template<class ValueAt>
+	void update(size_type firstIndex, size_type endIndex, ValueAt valueAt) {
+		if(endIndex < nextIndex_)
+			clear();    // The source was cleared
+		if(endIndex == nextIndex_)
+			return;
+
+		size_type stopIndex = std::max(nextIndex_, firstIndex);
+		latestMeets_ = false;
+		for(size_type index = endIndex; index > stopIndex; ) {
+			index--;
+			bool meetsThreshold = meets(valueAt(index));
+			if(index == endIndex - 1)
+				latestMeets_ = meetsThreshold;
+			if(meetsThreshold) {
+				found_ = true;
+				mostRecentIndex_ = index;
+				break;
+			}
+		}
+		nextIndex_ = endIndex;
+	}
+
+	// Catch up with the samples added to a Node since the last update
+	template<class NodeType>
+	void update(NodeType& node) {
+		update(node.beginIndex(), node.endIndex(), [&node](size_type index) { return node[index]; });
+	}
+
+	// ***** Accessors *****
+
+	bool found() { return found_; }                         // Whether any sample seen has met the threshold
+	size_type mostRecentIndex() { return mostRecentIndex_; } // ...and if so, the latest that did
+	bool latestMeets() { return latestMeets_; }             // Whether the latest sample meets it
+	size_type nextIndex() { return nextIndex_; }
+
+private:
+	DataType threshold_;
+	int comparison_;                // One of the kComparison... values
+	bool found_, latestMeets_;
+	size_type mostRecentIndex_;
+	size_type nextIndex_;           // Index of the next sample not yet examined
+};
@@ -27,26 +27,109 @@
 
 #undef DEBUG_TRIGGERS
 
+std::atomic<uint64_t> TriggerSource::epoch_(1);
+TriggerSource::SendingThreadSlot TriggerSource::sendingThreads_[kTriggerMaxSendingThreads];
+thread_local TriggerSource::SendingThreadSlot* TriggerSource::currentSendingThread_ = nullptr;
+
+TriggerSource::~TriggerSource() {
+    clearTriggerDestinations();
+    
+    juce::ScopedLock sl(triggerSourceMutex_);
+    for(auto it = retiredDestinations_.begin(); it != retiredDestinations_.end(); ++it)
+        ::operator delete(it->list);
+    retiredDestinations_.clear();
+}
+
 void TriggerSource::sendTrigger(timestamp_type timestamp) {
 #ifdef DEBUG_TRIGGERS
     std::cerr << "sendTrigger (" << this << ")\n";
 #endif
     
-    if(triggerDestinationsModified_) {
-        juce::ScopedLock sl(triggerSourceMutex_);
-        processAddRemoveQueue();
-    }
+    // Nothing to protect if there's nobody to send to
+    if(triggerDestinations_.load(std::memory_order_relaxed) == nullptr)
+        return;
+    
+    // An online sending thread keeps any list it loads safe until its next quiescent
+    // state. Otherwise announce the send before loading the list, so a concurrent
+    // change won't free the list while we're walking it.
+    SendingThreadSlot* slot = currentSendingThread_;
+    bool counted = (slot == nullptr || slot->epoch.load(std::memory_order_relaxed) == 0);
+    if(counted)
+        sendersActive_.fetch_add(1);
     
-    auto it = triggerDestinations_.begin();
-	TriggerDestination* target;
-	while(it != triggerDestinations_.end()) {	// Advance the iterator before sending the trigger
-		target = *it;							// in case the triggerReceived routine causes the object to unregister
+    // The list doesn't change under us, so a destination can unregister (or
+    // register another) from within triggerReceived(); that takes effect
+    // from the next trigger.
+    DestinationList* list = triggerDestinations_.load();
+    if(list != nullptr) {
+        for(int i = 0; i < list->count; i++) {
 #ifdef DEBUG_TRIGGERS
-        std::cerr << " --> " << target << std::endl;
+            std::cerr << " --> " << list->destinations[i] << std::endl;
 #endif
-		target->triggerReceived(this, timestamp);
-        it++;
-	}
+            list->destinations[i]->triggerReceived(this, timestamp);
+        }
+    }
+    
+    if(counted)
+        sendersActive_.fetch_sub(1);
+}
+
+// ***** Sending Threads *****
+
+void TriggerSource::registerSendingThread() {
+    if(currentSendingThread_ != nullptr)
+        return;
+    for(int i = 0; i < kTriggerMaxSendingThreads; i++) {
+        bool expected = false;
+        if(sendingThreads_[i].used.compare_exchange_strong(expected, true)) {
+            currentSendingThread_ = &sendingThreads_[i];
+            threadOnline();
+            return;
+        }
+    }
+}
+
+void TriggerSource::unregisterSendingThread() {
+    SendingThreadSlot* slot = currentSendingThread_;
+    if(slot == nullptr)
+        return;
+    threadOffline();
+    currentSendingThread_ = nullptr;
+    slot->used.store(false);
+}
+
+// Lists replaced before the epoch we read can no longer be reached from this thread.
+// The release store keeps our earlier uses of them before the announcement.
+void TriggerSource::threadQuiescent() {
+    SendingThreadSlot* slot = currentSendingThread_;
+    if(slot != nullptr && slot->epoch.load(std::memory_order_relaxed) != 0)
+        slot->epoch.store(epoch_.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+void TriggerSource::threadOffline() {
+    SendingThreadSlot* slot = currentSendingThread_;
+    if(slot != nullptr)
+        slot->epoch.store(0, std::memory_order_release);
+}
+
+// Coming online has to be ordered before any list we load afterwards, so that a change
+// either sees us online or has already published its new list. That needs sequential
+// consistency here and in freeRetiredDestinations(), but not in each send.
+void TriggerSource::threadOnline() {
+    SendingThreadSlot* slot = currentSendingThread_;
+    if(slot != nullptr)
+        slot->epoch.store(epoch_.load());
+}
+
+// The oldest epoch announced by an online sending thread, or the current one if none are online
+uint64_t TriggerSource::oldestSendingThreadEpoch() {
+    uint64_t oldest = epoch_.load();
+    for(int i = 0; i < kTriggerMaxSendingThreads; i++) {
+        uint64_t epoch = sendingThreads_[i].epoch.load();
+        if(epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
 }
 
 void TriggerSource::addTriggerDestination(TriggerDestination* dest) { 
@@ -56,14 +139,20 @@ void TriggerSource::addTriggerDestination(TriggerDestination* dest) {
 	if(dest == nullptr || (void*)dest == (void*)this)
 		return;
     juce::ScopedLock sl(triggerSourceMutex_);
+    DestinationList* current = triggerDestinations_.load();
+    int count = (current != nullptr ? current->count : 0);
+    
     // Make sure this trigger isn't already present
-    if(triggerDestinations_.count(dest) == 0) {
-        triggersToAdd_.insert(dest);
-        triggerDestinationsModified_ = true;
+    for(int i = 0; i < count; i++) {
+        if(current->destinations[i] == dest)
+            return;
     }
-    // If the trigger is also slated to be removed, cancel that request
-    if(triggersToRemove_.count(dest) != 0)
-        triggersToRemove_.erase(dest);
+    
+    DestinationList* list = createDestinationList(count + 1);
+    for(int i = 0; i < count; i++)
+        list->destinations[i] = current->destinations[i];
+    list->destinations[count] = dest;
+    publishDestinations(list);
 }
 
 void TriggerSource::removeTriggerDestination(TriggerDestination* dest) {
@@ -71,14 +160,26 @@ void TriggerSource::removeTriggerDestination(TriggerDestination* dest) {
     std::cerr << "removeTriggerDestination (" << this << "): " << dest << "\n";
 #endif
     juce::ScopedLock sl(triggerSourceMutex_);
+    DestinationList* current = triggerDestinations_.load();
+    if(current == nullptr)
+        return;
+    
     // Check whether this trigger is actually present
-    if(triggerDestinations_.count(dest) != 0) {
-        triggersToRemove_.insert(dest);
-        triggerDestinationsModified_ = true;
+    int index = 0;
+    while(index < current->count && current->destinations[index] != dest)
+        index++;
+    if(index == current->count)
+        return;
+    
+    DestinationList* list = nullptr;
+    if(current->count > 1) {
+        list = createDestinationList(current->count - 1);
+        for(int i = 0, j = 0; i < current->count; i++) {
+            if(i != index)
+                list->destinations[j++] = current->destinations[i];
+        }
     }
-    // If the trigger is also slated to be added, cancel that request
-    if(triggersToAdd_.count(dest) != 0)
-        triggersToAdd_.erase(dest);
+    publishDestinations(list);
 }	
 
 void TriggerSource::clearTriggerDestinations() {
@@ -86,32 +187,48 @@ void TriggerSource::clearTriggerDestinations() {
     std::cerr << "clearTriggerDestinations (" << this << ")\n";
 #endif
     juce::ScopedLock sl(triggerSourceMutex_);
-    processAddRemoveQueue();
-	for( auto it = triggerDestinations_.begin(); it != triggerDestinations_.end(); ++it)
-		(*it)->triggerSourceDeleted(this);		
-	triggerDestinations_.clear();
+    DestinationList* current = triggerDestinations_.load();
+    if(current == nullptr)
+        return;
+    
+	for(int i = 0; i < current->count; i++)
+		current->destinations[i]->triggerSourceDeleted(this);
+    publishDestinations(nullptr);
 }
 
-// Process everything in the add and remove groups and transfer them
-// into the main set of trigger destinations. Do this with mutex locked.
-void TriggerSource::processAddRemoveQueue() {
-#ifdef DEBUG_TRIGGERS
-    std::cerr << "processAddRemoveQueue (" << this << ")\n";
-#endif
+// Allocate a list with room for the given number of destinations
+TriggerSource::DestinationList* TriggerSource::createDestinationList(int count) {
+    size_t bytes = sizeof(DestinationList) + (count > 1 ? count - 1 : 0) * sizeof(TriggerDestination*);
+    DestinationList* list = static_cast<DestinationList*>(::operator new(bytes));
+    list->count = count;
+    return list;
+}
 
-    for( auto it = triggersToAdd_.begin(); it != triggersToAdd_.end(); ++it) {
-        triggerDestinations_.insert(*it);
-#ifdef DEBUG_TRIGGERS
-        std::cerr << " --> added " << *it << std::endl;
-#endif
+// The epoch advances after the swap, so a thread announcing the new epoch
+// has finished with the old list
+void TriggerSource::publishDestinations(DestinationList* list) {
+    DestinationList* old = triggerDestinations_.exchange(list);
+    if(old != nullptr) {
+        RetiredDestinations retired = { old, epoch_.fetch_add(1) + 1 };
+        retiredDestinations_.push_back(retired);
     }
-    for( auto it = triggersToRemove_.begin(); it != triggersToRemove_.end(); ++it) {
-        triggerDestinations_.erase(*it);
-#ifdef DEBUG_TRIGGERS
-        std::cerr << " --> removed " << *it << std::endl;
-#endif
+    freeRetiredDestinations();
+}
+
+// Free the replaced lists that no send can still be using: no counted send is in
+// progress, and every online sending thread has announced an epoch since the list
+// was replaced. Any send starting from now on will load the current list.
+void TriggerSource::freeRetiredDestinations() {
+    if(retiredDestinations_.empty() || sendersActive_.load() != 0)
+        return;
+
+    uint64_t oldest = oldestSendingThreadEpoch();
+    size_t kept = 0;
+    for(size_t i = 0; i < retiredDestinations_.size(); i++) {
+        if(retiredDestinations_[i].epoch <= oldest)
+            ::operator delete(retiredDestinations_[i].list);
+        else
+            retiredDestinations_[kept++] = retiredDestinations_[i];
     }
-    triggersToAdd_.clear();
-    triggersToRemove_.clear();
-    triggerDestinationsModified_ = false;
-}
\ No newline at end of file
+    retiredDestinations_.resize(kept);
+}
@@ -27,16 +27,32 @@
 
 #include "Types.h"
 #include <JuceHeader.h>
+#include <atomic>
 #include <iostream>
 #include <set>
+#include <vector>
 
 class TriggerDestination;
 
+const int kTriggerMaxSendingThreads = 16;      // Threads which can register to send without shared counters
+
 /*
  * TriggerSource
  *
  * Provides a set of routines for an object that sends triggers with an associated timestamp.  All Node
  * objects inherit from Trigger, but other objects may use these routines as well.
+ *
+ * The destinations are held in a contiguous array which is never changed once published.  Adding or
+ * removing a destination builds a new array under the mutex and swaps the pointer, so sendTrigger()
+ * takes no lock and always walks a consistent list.  A replaced array is kept until no send can
+ * still be using it, then freed by a later change or the destructor.
+ *
+ * Threads that send many triggers (device processing, mapping workers) register themselves as
+ * sending threads.  On those threads sendTrigger() writes nothing shared: instead the thread
+ * announces a quiescent state, when it holds no destination list, once per pass of its loop,
+ * and goes offline while it blocks.  A replaced list is freed once every online sending thread
+ * has passed a quiescent state since it was replaced.  Other threads count themselves in and
+ * out of sendTrigger() on a shared counter, and a list is also kept while that is nonzero.
  */
 
 class TriggerSource {
@@ -49,15 +65,31 @@ protected:
 public:
 	// ***** Constructor *****
 	
-	TriggerSource() {}	// No instantiating this class directly!
+	TriggerSource() : triggerDestinations_(nullptr), sendersActive_(0) {}	// No instantiating this class directly!
 	
 	// ***** Destructor *****
 	
-	~TriggerSource() { clearTriggerDestinations(); }	
+	~TriggerSource();
 	
 	// ***** Connection Management *****
 	
-	bool hasTriggerDestinations() { return triggerDestinations_.size() > 0; }
+	bool hasTriggerDestinations() { return triggerDestinations_.load() != nullptr; }
+
+    // ***** Sending Threads *****
+    //
+    // Call these from the thread itself. Registration fails quietly when every slot is in use,
+    // leaving the thread on the shared counter. A registered thread starts online.
+
+    static void registerSendingThread();
+    static void unregisterSendingThread();
+
+    // The calling thread holds no destination list: call between sends, once per loop
+    static void threadQuiescent();
+
+    // Bracket anything that may block for long, so the thread doesn't hold up freeing.
+    // Triggers sent while offline use the shared counter.
+    static void threadOffline();
+    static void threadOnline();
 
 private:
 	// For internal use or use by friend class NodeBase only
@@ -70,17 +102,44 @@ private:
 	void removeTriggerDestination(TriggerDestination* dest);
 	void clearTriggerDestinations();
     
-    // When sources are added or removed, they are first stored in separate locations to be updated
-    // prior to each new call of sendTrigger(). This way, destinations which are updated from functions
-    // called from sendTrigger() do not render the set inconsistent in the middle.
-    void processAddRemoveQueue();
-	
+    // An immutable list of destinations, allocated in one block with the pointers following the count
+    struct DestinationList {
+        int count;
+        TriggerDestination* destinations[1];
+    };
+    
+    static DestinationList* createDestinationList(int count);
+    
+    // Swap in a new list (which may be null for no destinations) and retire the old one.
+    // Call with triggerSourceMutex_ held.
+    void publishDestinations(DestinationList* list);
+    void freeRetiredDestinations();
+
+    // A replaced list and the epoch it was replaced in
+    struct RetiredDestinations {
+        DestinationList* list;
+        uint64_t epoch;
+    };
+
+    // The epoch each registered thread last announced (0 when offline), padded so
+    // that threads don't share cache lines
+    struct SendingThreadSlot {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> used;
+        char padding[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+    };
+
+    static uint64_t oldestSendingThreadEpoch();
+
 private:
-	std::set<TriggerDestination*> triggerDestinations_;
-    std::set<TriggerDestination*> triggersToAdd_;
-    std::set<TriggerDestination*> triggersToRemove_;
-    bool triggerDestinationsModified_;
-	juce::CriticalSection triggerSourceMutex_;
+	std::atomic<DestinationList*> triggerDestinations_;     // Current destinations, read without locking
+    std::atomic<int> sendersActive_;                        // Sends in progress from unregistered threads
+    std::vector<RetiredDestinations> retiredDestinations_;  // Replaced lists waiting to be freed
+	juce::CriticalSection triggerSourceMutex_;              // Serialises changes to the destinations
+
+    static std::atomic<uint64_t> epoch_;                    // Advanced each time a list is replaced
+    static SendingThreadSlot sendingThreads_[kTriggerMaxSendingThreads];
+    static thread_local SendingThreadSlot* currentSendingThread_;
 };
 
 /*